@@ -7,6 +7,9 @@
 #include <arpa/inet.h>
 #include <curses.h>
 #include <signal.h>
+#include <chrono>
+#include <climits>
+#include <thread>
 
 using namespace Aws;
 using namespace seal;
@@ -14,6 +17,9 @@ using namespace utility;
 
 // default server port
 #define PORT 8080
+#define MAX_RESUMABLE_SESSIONS 64        // interrupted sessions kept for a reconnection, the oldest is dropped first
+#define SESSION_ACK_TIMEOUT_SECONDS 300  // wait for the Destination Server to verify the last sets
+#define MAX_REQUEST_DATA_POINTS (INT_MAX / sizeof(double)) // the object buffers are sized in bytes with an int
 
 bool abortRequested = false;
 
@@ -23,26 +29,44 @@ typedef vector<bucket_data> buffer_data_vec;
 
 
 // constructor
-Auxiliary_Server::Auxiliary_Server(int data_points_num, bool read_keys_from_file, bool batched, string enc_init_params_file, std::ofstream *metrics_file_in)
+Auxiliary_Server::Auxiliary_Server(int data_points_num, bool read_keys_from_file, bool batched, string enc_init_params_file, std::ofstream *metrics_file_in, bool slot_packing, string dataset)
 {
     _data_points_num = data_points_num;
+    _dataset = dataset;
     _read_keys_from_file = read_keys_from_file;
     InitEncParams(&_enc_init_params, enc_init_params_file);
-    _batched_size = (batched) ? ceil((double)data_points_num / _enc_init_params.max_ct_entries) : 0;
+    _mod_arith = &Mod_Arith::For(_enc_init_params.prime);
+    _mac_scheme = MAC_Scheme::Create(batched);
+    _slot_packing = slot_packing;
     // create metrics file
     metrics_file = metrics_file_in;
 }
 
 
 std::ostream& operator<<(std::ostream& out, const AS_performance_metrics& asPerformanceMetrics) {
-    return out  << asPerformanceMetrics.load_stored_data/1000 << "," <<
+    out  << asPerformanceMetrics.load_stored_data/1000 << "," <<
                asPerformanceMetrics.encode_encrypt/1000 << "," <<  asPerformanceMetrics.serialize/1000 << ","
                << asPerformanceMetrics.send_data/1000 << "," << asPerformanceMetrics.sent_size_in_bytes << ","
-               << asPerformanceMetrics.end2end/1000;
+               << asPerformanceMetrics.end2end/1000 << "," << asPerformanceMetrics.send_hist;
+
+    if (Perf_Counters::IsEnabled())
+    {
+        long long ct_count = asPerformanceMetrics.send_hist.Count();
+        out << "," << Perf_Counters::Format(asPerformanceMetrics.encode_encrypt_perf, ct_count) << "," << Perf_Counters::Format(asPerformanceMetrics.serialize_perf, ct_count);
+    }
+
+    return out;
 }
 
 std::string AS_performance_metrics::getHeader(){
-    return "load stored data,encode and encrypt,serialize,send data, sent bytes, end2end_as";
+    std::string header = "load stored data,encode and encrypt,serialize,send data, sent bytes, end2end_as," + Latency_Histogram::getHeader("send ct");
+
+    if (Perf_Counters::IsEnabled())
+    {
+        header += "," + Perf_Counters::getHeader("encode and encrypt") + "," + Perf_Counters::getHeader("serialize");
+    }
+
+    return header;
 }
 
 
@@ -50,18 +74,22 @@ inline string Auxiliary_Server::EncodeEncryptSerialize(vector<double> &vec, cons
     Plaintext pt; Ciphertext ct;
     std::string serialized_str;
 
-    high_resolution_clock::time_point start_encode_encrypt = utility::timer_start();
+    Trace_Span encode_encrypt_span("encode_encrypt", &performanceMetrics->encode_encrypt);
+    Perf_Span encode_encrypt_perf_span(&performanceMetrics->encode_encrypt_perf);
 
     seal->encoder_ptr->encode(vec, _enc_init_params.scale, pt);
     seal->encryptor_ptr->encrypt(pt, ct);
 
-    performanceMetrics->encode_encrypt += utility::timer_end(start_encode_encrypt).count();
+    encode_encrypt_perf_span.End();
+    encode_encrypt_span.End();
 
-    high_resolution_clock::time_point start_serialize = utility::timer_start();
+    Trace_Span serialize_span("serialize", &performanceMetrics->serialize);
+    Perf_Span serialize_perf_span(&performanceMetrics->serialize_perf);
 
     serialized_str = utility::serialize_fhe(ct);
 
-    performanceMetrics->serialize += utility::timer_end(start_serialize).count();
+    serialize_perf_span.End();
+    serialize_span.End();
 
 
     return serialized_str;
@@ -132,11 +160,35 @@ void Auxiliary_Server::AcceptConnections(int server_socket)
             continue;
         }
 
-        cout << "Sending data" << endl;
-        EncryptAndSendData(client_socket);
-        cout << "Done sending data" << endl << endl;
+        // every connection has its own thread, so several datasets, or sessions of one dataset, are sent concurrently
+        _active_connections++;
+        std::thread([this, client_socket]() {
+            cout << "Sending data" << endl;
+            if (_metrics_endpoint)
+            {
+                _metrics_endpoint->ConnectionOpened();
+            }
 
-        close(client_socket);
+            AS_performance_metrics performanceMetrics;
+            try
+            {
+                performanceMetrics = EncryptAndSendData(client_socket);
+            }
+            catch (const std::exception& e)
+            {
+                // only this connection fails, the others keep going
+                std::cerr << "Sending data failed: " << e.what() << endl;
+            }
+
+            if (_metrics_endpoint)
+            {
+                _metrics_endpoint->ConnectionClosed(performanceMetrics);
+            }
+            cout << "Done sending data" << endl << endl;
+
+            close(client_socket);
+            _active_connections--;
+        }).detach();
     }
 
 }
@@ -191,97 +243,242 @@ void Auxiliary_Server::StartServer(void)
 
     close(server_socket);
 
+    // let the connections in progress finish
+    while (_active_connections > 0)
+    {
+        usleep(100000);
+    }
+
 }
 
-// extract the secret share values from the double read from the bucket
+// extract the secret share values from the doubles read from the bucket
 // s_q = double val / p
 // s_r = double val % p
-void Auxiliary_Server::parse_double_into_secret_share(double val, std::vector<std::vector<double>>& enc_vector_list, long index)
+static void parse_double_into_secret_share(const std::vector<double>& values, std::vector<std::vector<double>>& enc_vector_list, long index, const mod_arith_s& mod_arith)
 {
-    double s_q, s_r;
+    Mod_Arith::Dispatch(mod_arith, [&](auto arith) {
+        for (double val : values)
+        {
+            double s_q, s_r;
 
-    auto dv = lldiv(val, _enc_init_params.prime);
-    s_q = dv.quot;
-    s_r = dv.rem;
+            mod_divmod_s dv = arith.DivMod((ullong)val);
+            s_q = dv.quot;
+            s_r = dv.rem;
 
-    enc_vector_list[index].push_back(s_q);
-    enc_vector_list[index + 1].push_back(s_r);
+            enc_vector_list[index].push_back(s_q);
+            enc_vector_list[index + 1].push_back(s_r);
+        }
+    });
 }
 
-// extract the mac values from the double read from the bucket
-// z_q = double val / p^2
-// temp = double val % p^2
-// z_r = temp / p
-// y_r = temp % p
-void Auxiliary_Server::parse_double_into_mac(double val, std::vector<std::vector<double>>& enc_vector_list, long index)
+void Auxiliary_Server::AddDataset(shared_ptr<Auxiliary_Server> dataset_server)
 {
-    double z_q, z_r, y_r, temp;
-    ullong prime_square = pow(_enc_init_params.prime, 2);
-
-    auto dv = lldiv(val, prime_square);
-    z_q = dv.quot;
-    temp = dv.rem;
-    dv = lldiv(temp, _enc_init_params.prime);
-    z_r = dv.quot;
-    y_r = dv.rem;
-
-    enc_vector_list[index].push_back(z_r);
-    enc_vector_list[index + 1].push_back(y_r);
-    enc_vector_list[index + 2].push_back(z_q);
+    dataset_server->SetMetricsEndpoint(_metrics_endpoint);
+    _datasets[dataset_server->_dataset] = dataset_server;
 }
 
-void Auxiliary_Server::parse_double_into_mac_batched_part1(double val, std::vector<std::vector<double>>& enc_vector_list, long index)
+// tell the Destination Server why its hello can't be served, instead of closing the connection on it
+static void RejectSession(int the_socket, const session_hello_s& hello, uint32_t status, uint32_t mode)
 {
-    // No need for parsing here, as the restore is done on the same value.
-    enc_vector_list[index].push_back(val);
+    session_accept_s accept;
+    accept.status = status;
+    accept.mode = mode;
+    accept.session_id = hello.session_id;
+    Transfer_Session::SendAccept(the_socket, accept);
 }
 
-int the_counter = 0;
-void Auxiliary_Server::parse_double_into_mac_batched_part2(double val, std::vector<std::vector<double>>& enc_vector_list, long index)
+// encrypt the dataset the connected Destination Server asks for and send it
+AS_performance_metrics Auxiliary_Server::EncryptAndSendData(int the_socket)
 {
-    double alpha_int, beta_int;
-    double pSquare = pow(_enc_init_params.prime, 2);
-    double pTriple = pow(_enc_init_params.prime, 3);
+    // the Destination Server opens the connection with its session and the dataset it retrieves
+    session_hello_s hello;
+    if (!Transfer_Session::ReceiveHello(the_socket, hello))
+    {
+        std::cerr << "No session hello from the Destination Server" << endl;
+        return AS_performance_metrics();
+    }
+
+    // connections are served concurrently, every connection thread is a track of its own in the trace
+    Tracer::SetThreadName("Aux send session " + std::to_string(hello.session_id));
+
+    if (hello.dataset == _dataset)
+    {
+        return ServeSession(the_socket, hello);
+    }
+
+    auto dataset = _datasets.find(hello.dataset);
+    if (dataset == _datasets.end())
+    {
+        std::cerr << "Session " << hello.session_id << " asks for dataset '" << hello.dataset << "', which isn't in the catalog" << endl;
+        RejectSession(the_socket, hello, SESSION_UNKNOWN_DATASET, 0);
+        return AS_performance_metrics();
+    }
+
+    return dataset->second->ServeSession(the_socket, hello);
+}
+
+// send one session of this dataset, and record its metrics
+AS_performance_metrics Auxiliary_Server::ServeSession(int the_socket, const session_hello_s& hello)
+{
+    AS_performance_metrics performanceMetrics;
 
+    utility::WithStorage(_storage, awsparams::region, [&](Data_Storage& s3Utility) {
+        performanceMetrics = SendStoredData(the_socket, hello, s3Utility);
+    });
 
-    alpha_int = (((int)val >> 1) & 0x1) * pTriple;
-    beta_int = ((int)val & 0x1) * pSquare;
+    std::lock_guard<std::mutex> lock(_metrics_mutex);
 
-    enc_vector_list[index].push_back(alpha_int);
-    enc_vector_list[index + 1].push_back(beta_int);
+    if (metrics_file != nullptr)
+    {
+        // the send histogram of this connection and of all connections so far
+        string histogram_prefix = "AS_" + (_dataset.empty() ? "" : _dataset + "_") + std::to_string(hello.data_points_num);
+        _all_runs_send_hist.Merge(performanceMetrics.send_hist);
+        performanceMetrics.send_hist.Save(Latency_Histogram::DumpFileName(histogram_prefix, "send", _run));
+        _all_runs_send_hist.Save(Latency_Histogram::DumpFileName(histogram_prefix, "send", -1));
+
+        *metrics_file << performanceMetrics << endl;
+    }
+
+    if (!trace_file.empty())
+    {
+        // only this connection's spans, the connections still sending keep theirs. The datasets of the catalog count
+        // their runs separately, so their files are tagged with the dataset
+        Tracer::WriteThreadRun(trace_file, (_dataset.empty() ? "" : _dataset + "_") + std::to_string(_run));
+    }
+    _run++;
+
+    return performanceMetrics;
 }
 
+// the MAC scheme and slot packing the dataset is served with, as session_mode_flags
+uint32_t Auxiliary_Server::ServedMode()
+{
+    return _mac_scheme->SessionMode() | (_slot_packing ? SESSION_MODE_SLOT_PACKING : 0);
+}
 
-void Auxiliary_Server::EncryptAndSendData(int the_socket)
+// a request is served when it was made with the same encryption params. A dataset with a configured size only serves
+// that size, the others serve any size the int sized buffers can hold. Slot packing is configured, the MAC scheme is the one
+// the dataset was uploaded with and is named in the accept, so a request may name either
+uint32_t Auxiliary_Server::CheckRequest(const session_hello_s& hello)
 {
-    SDKOptions options;
-    Aws::InitAPI(options);
-    {
-        S3Utility s3Utility(awsparams::region);
-        shared_ptr<seal_struct> seal_ptr;
-        Servers_Protocol srvProtocol;
-        AS_performance_metrics performanceMetrics;
-        int remaining_data_points_num, num_of_ct, num_of_mac_ct;
-        int i, j, k;
-        int buffer_index = 0;
-        int sent = 0;
-        int sent_times = 0;
-        // number of doubles used for secret share and mac
-        int secret_share_encoded_doubles = 2;
-        int mac_encoded_doubles = 3;
-        char* buffer_tag_sr;
-        char* buffer_tag_sq;
-
-        size_t double_size = sizeof(double);
-
-        high_resolution_clock::time_point end2end = utility::timer_start();
-
-        EncryptionParameters parms;
-        seal::PublicKey pk_fhe;
-        string pk_object_name = string("pk-fhe-") + std::to_string(_enc_init_params.polyDegree);
-        string params_object_name  = string("seal-params-") + std::to_string(_enc_init_params.polyDegree);
-
-        if(_read_keys_from_file)
+    if (hello.params_hash != Transfer_Session::ParamsHash(_enc_init_params))
+    {
+        return SESSION_PARAMS_MISMATCH;
+    }
+
+    if ((hello.data_points_num == 0) || (hello.data_points_num > MAX_REQUEST_DATA_POINTS) ||
+        ((_data_points_num > 0) && (hello.data_points_num != (uint32_t)_data_points_num)))
+    {
+        return SESSION_SIZE_MISMATCH;
+    }
+
+    if ((hello.mode & SESSION_MODE_SLOT_PACKING) != (ServedMode() & SESSION_MODE_SLOT_PACKING))
+    {
+        return SESSION_MODE_MISMATCH;
+    }
+
+    return SESSION_ACCEPTED;
+}
+
+// the stored objects of the dataset must hold the requested data points: the secret shares exactly as many,
+// the tag objects at least the values the request reads from them
+uint32_t Auxiliary_Server::CheckStoredSize(const session_hello_s& hello, const MAC_Scheme& mac_scheme, Data_Storage& storage)
+{
+    string secret_object_name = utility::DatasetObjectName(_dataset, CIPHERTEXTS_X_INT_FRAC_DIR) + "/0";
+    size_t stored_size = 0;
+
+    if (!storage.object_size(secret_object_name.c_str(), awsparams::bucket_name, stored_size))
+    {
+        std::cerr << "Rejecting session " << hello.session_id << ", the dataset has no stored secret shares" << endl;
+        return SESSION_UNKNOWN_DATASET;
+    }
+
+    if (stored_size != (size_t)hello.data_points_num * sizeof(double))
+    {
+        std::cerr << "Rejecting session " << hello.session_id << " of " << hello.data_points_num << " data points, the Data Owner uploaded "
+                  << stored_size / sizeof(double) << endl;
+        return SESSION_SIZE_MISMATCH;
+    }
+
+    for (const mac_tag_object_s& tag_object : mac_scheme.TagObjects(_dataset, hello.data_points_num, _enc_init_params.max_ct_entries))
+    {
+        string tag_object_name = tag_object.object_name + "/0";
+        if (!storage.object_size(tag_object_name.c_str(), awsparams::bucket_name, stored_size) || (stored_size < (size_t)tag_object.buffer_size))
+        {
+            std::cerr << "Rejecting session " << hello.session_id << ", the tags in " << tag_object_name << " don't cover "
+                      << hello.data_points_num << " data points" << endl;
+            return SESSION_SIZE_MISMATCH;
+        }
+    }
+
+    return SESSION_ACCEPTED;
+}
+
+// the first ciphertext set to send for a session hello. A session this Aux served before resumes where the Destination
+// Server asks, it may be past the last acknowledgement that arrived. Anything else starts from the first set
+uint32_t Auxiliary_Server::StartSession(const session_hello_s& hello, uint32_t num_of_ct)
+{
+    std::lock_guard<std::mutex> lock(_sessions_mutex);
+
+    uint32_t start_index = 0;
+    auto session = _sessions.find(hello.session_id);
+    if (session != _sessions.end())
+    {
+        start_index = std::min(hello.resume_from, num_of_ct);
+        cout << "Resuming session " << hello.session_id << " at ciphertext set " << start_index << ", " << session->second << " were acknowledged" << endl;
+    }
+    else if (hello.resume_from > 0)
+    {
+        cout << "Unknown session " << hello.session_id << ", sending all ciphertext sets again" << endl;
+    }
+
+    // session ids start with their creation time, so the first one is the oldest
+    if (session == _sessions.end() && _sessions.size() >= MAX_RESUMABLE_SESSIONS)
+    {
+        _sessions.erase(_sessions.begin());
+    }
+    _sessions[hello.session_id] = start_index;
+
+    return start_index;
+}
+
+// a completed session can't be resumed anymore
+void Auxiliary_Server::UpdateSession(ullong session_id, uint32_t verified, uint32_t num_of_ct)
+{
+    std::lock_guard<std::mutex> lock(_sessions_mutex);
+
+    if (verified >= num_of_ct)
+    {
+        _sessions.erase(session_id);
+    }
+    else
+    {
+        _sessions[session_id] = verified;
+    }
+}
+
+// the encryption params and public key of the dataset. The SEAL context of the params is created once, the public key
+// is loaded for every connection as the Destination Server may have generated new keys. Returns nullptr if they
+// can't be loaded from the bucket
+shared_ptr<seal_struct> Auxiliary_Server::LoadSeal()
+{
+    Servers_Protocol srvProtocol;
+    EncryptionParameters parms;
+    seal::PublicKey pk_fhe;
+    shared_ptr<seal_struct> seal_context;
+    string pk_object_name = string("pk-fhe-") + std::to_string(_enc_init_params.polyDegree);
+    string params_object_name  = string("seal-params-") + std::to_string(_enc_init_params.polyDegree);
+
+    if (_seal)
+    {
+        // keys were handed over in process
+        return _seal;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(_seal_context_mutex);
+
+        if (!_seal_context && _read_keys_from_file)
         {
             std::fstream file_parms_fhe2(params_object_name, std::ios::in | std::ios::binary);
             if (file_parms_fhe2.is_open())
@@ -291,279 +488,345 @@ void Auxiliary_Server::EncryptAndSendData(int the_socket)
             }
             else throw std::runtime_error("Unable to open file seal-params");
 
-            seal_ptr = srvProtocol.gen_seal_params(parms.poly_modulus_degree(), parms.coeff_modulus(), _enc_init_params.scale);
-
-            //loading pk
-            std::fstream file_pk_fhe2(pk_object_name, std::ios::in | std::ios::binary);
-            if (file_pk_fhe2.is_open())
-            {
-                pk_fhe.load(seal_ptr->context_ptr, file_pk_fhe2);
-                file_pk_fhe2.close();
-            }
-            else throw std::runtime_error("Unable to open file pk-fhe");
-
-            seal_ptr->encryptor_ptr = make_shared<Encryptor>(seal_ptr->context_ptr, pk_fhe);
-
+            _seal_context = srvProtocol.gen_seal_context(parms.poly_modulus_degree(), parms.coeff_modulus(), _enc_init_params.scale);
         }
-        else
+        else if (!_seal_context)
         {
-
-            if (!utility::GetEncryptionParamsFromBucket(params_object_name, awsparams::bucket_name, awsparams::region,
+            if (!utility::GetEncryptionParamsFromBucket(utility::DatasetObjectName(_dataset, params_object_name), awsparams::bucket_name, awsparams::region,
                                                         parms)) {
                 std::cerr << "Failed to get public key";
-                return;
+                return nullptr;
             }
-            seal_ptr = srvProtocol.gen_seal_params(parms.poly_modulus_degree(), parms.coeff_modulus(), _enc_init_params.scale);
+            _seal_context = srvProtocol.gen_seal_context(parms.poly_modulus_degree(), parms.coeff_modulus(), _enc_init_params.scale);
             cout << " generated seal" << endl;
-            if (!utility::GetPublicKeyFromBucket(pk_object_name, awsparams::bucket_name, awsparams::region,
-                                                 seal_ptr->context_ptr, pk_fhe)) {
-                std::cerr << "Failed to get public key from bucket";
-                return;
-            }
-            seal_ptr->encryptor_ptr = make_shared<Encryptor>(seal_ptr->context_ptr, pk_fhe);
-
         }
 
-        // Get encrypted batch from bucket
-        int buffer_size = double_size * _data_points_num; // each buffer has a size that matches the amount of input data points
-        int mac_buff_size_sq = (_batched_size > 0) ? std::ceil(_data_points_num / _batched_size) * double_size : buffer_size;
-
-        // buffers for storing the data read from the bucket
-        char* buffer_ct_x_int_frac = new char[buffer_size];
-        buffer_tag_sq = new char[mac_buff_size_sq];
-
-        // list for holding the data info to be loaded from the bucket
-        buffer_data_vec load_from_bucket_list;
-
-        // file names
-        string secret_file_name(CIPHERTEXTS_X_INT_FRAC_DIR);
-        string tags_sq_file_name(TAGS_SQ_DIR);
-
-        // create list for info loaded from the bucket
-        // each item in the list includes a buffer pointer, the buffer size and the file to read from
-
-        // add secret share buffer to list
-        bucket_data secret_share_data;
-        secret_share_data.buffer = buffer_ct_x_int_frac;
-        secret_share_data.buffer_size = buffer_size;
-        secret_share_data.file_name = secret_file_name;
-        secret_share_data.parse_func = &Auxiliary_Server::parse_double_into_secret_share;
-        secret_share_data.num_of_parsed_items = 2;
-        secret_share_data.item_size = double_size;
-        load_from_bucket_list.push_back(secret_share_data);
-
-        // add mac buffers to the list
-        bucket_data sq_data;
-
-        sq_data.buffer = buffer_tag_sq;
-        sq_data.buffer_size = mac_buff_size_sq;
-        sq_data.file_name = tags_sq_file_name;
-        sq_data.parse_func = (_batched_size > 0) ? &Auxiliary_Server::parse_double_into_mac_batched_part1 : &Auxiliary_Server::parse_double_into_mac;
-        sq_data.num_of_parsed_items = (_batched_size > 0) ? 1 : 3;
-        sq_data.item_size = sizeof(double);
-
-        // add mac buffer to the list
-        load_from_bucket_list.push_back(sq_data);
-
-        // in batched there are additional mac parameters
-        // also, a different parsing function is needed for sq
-        if (_batched_size > 0)
+        seal_context = _seal_context;
+    }
+
+    // the context, evaluator and encoder are shared, the encryptor belongs to this connection
+    shared_ptr<seal_struct> seal_ptr = make_shared<seal_struct>(*seal_context);
+
+    if (_read_keys_from_file)
+    {
+        //loading pk
+        std::fstream file_pk_fhe2(pk_object_name, std::ios::in | std::ios::binary);
+        if (file_pk_fhe2.is_open())
         {
-            string tags_sr_file_name(TAGS_SR_DIR);
-            int mac_buff_size_sr = ceil(_data_points_num / _batched_size) * sizeof(char);
-            bucket_data sr_data;
-            buffer_tag_sr = new char[mac_buff_size_sr];
-            sr_data.buffer = buffer_tag_sr;
-            sr_data.buffer_size = mac_buff_size_sr;
-            sr_data.file_name = tags_sr_file_name;
-            sr_data.parse_func = &Auxiliary_Server::parse_double_into_mac_batched_part2;
-            sr_data.num_of_parsed_items = 2;
-            sr_data.item_size = sizeof(char);
-
-
-            load_from_bucket_list.push_back(sr_data);
+            pk_fhe.load(seal_ptr->context_ptr, file_pk_fhe2);
+            file_pk_fhe2.close();
         }
+        else throw std::runtime_error("Unable to open file pk-fhe");
+    }
+    else if (!utility::GetPublicKeyFromBucket(utility::DatasetObjectName(_dataset, pk_object_name), awsparams::bucket_name, awsparams::region,
+                                              seal_ptr->context_ptr, pk_fhe)) {
+        std::cerr << "Failed to get public key from bucket";
+        return nullptr;
+    }
+
+    srvProtocol.set_public_key(seal_ptr, pk_fhe);
+
+    return seal_ptr;
+}
+
+// load the shares and tags from the storage, then encrypt and send them ciphertext by ciphertext
+AS_performance_metrics Auxiliary_Server::SendStoredData(int the_socket, const session_hello_s& hello, Data_Storage& s3Utility)
+{
+    shared_ptr<seal_struct> seal_ptr;
+    AS_performance_metrics performanceMetrics;
+    int num_of_ct, num_of_mac_ct, num_of_sets;
+    int data_points_num;
+    int i, j, k;
+    int buffer_index = 0;
+    // number of doubles used for secret share and mac
+    int secret_share_encoded_doubles = 2;
+    int mac_encoded_doubles = 3;
+
+    size_t double_size = sizeof(double);
+
+    Trace_Span end2end_span("end2end", &performanceMetrics.end2end);
+
+    // the request sizes the transfer, one Aux serves datasets of any size without being restarted
+    uint32_t status = CheckRequest(hello);
+    if (status != SESSION_ACCEPTED)
+    {
+        std::cerr << "Rejecting session " << hello.session_id << " of " << hello.data_points_num << " data points: " << Transfer_Session::StatusText(status) << endl;
+        RejectSession(the_socket, hello, status, ServedMode());
+        return performanceMetrics;
+    }
+
+    // the MAC scheme the dataset was uploaded with, the accept names it for the Destination Server
+    shared_ptr<const MAC_Scheme> mac_scheme = _mac_scheme;
+
+    // the requested size must be the size the Data Owner uploaded, the stored objects tell it
+    status = CheckStoredSize(hello, *mac_scheme, s3Utility);
+    if (status != SESSION_ACCEPTED)
+    {
+        RejectSession(the_socket, hello, status, ServedMode());
+        return performanceMetrics;
+    }
+    data_points_num = hello.data_points_num;
+    num_of_ct = (data_points_num / _enc_init_params.max_ct_entries) + (((data_points_num % _enc_init_params.max_ct_entries) > 0)? 1 : 0);
+
+    // a resumed session skips the sets the Destination Server already verified
+    session_accept_s accept;
+
+    // the sets of the session are the selected blocks. Batched tags cover the whole dataset, so it is sent in full
+    vector<int> selected;
+    if (!Transfer_Session::SelectedBlocks(hello.blocks, num_of_ct, selected) || (!mac_scheme->SupportsBlockSelection() && !hello.blocks.empty()))
+    {
+        std::cerr << "Session " << hello.session_id << " selects blocks that can't be served, there are " << num_of_ct << " blocks"
+                  << (mac_scheme->SupportsBlockSelection() ? "" : string(" and ") + mac_scheme->Name() + " data is only sent in full") << endl;
+        RejectSession(the_socket, hello, SESSION_INVALID_BLOCKS, ServedMode());
+        return performanceMetrics;
+    }
+    num_of_sets = selected.size();
+
+    // data points loaded before each selected block
+    vector<int> set_offsets(num_of_sets + 1, 0);
+    for (i = 0; i < num_of_sets; i++)
+    {
+        set_offsets[i + 1] = set_offsets[i] + ct_data_points(selected[i], data_points_num, _enc_init_params.max_ct_entries);
+    }
+
+    accept.mode = ServedMode();
+    accept.session_id = hello.session_id;
+    accept.start_index = StartSession(hello, num_of_sets);
+    accept.num_of_ct = num_of_sets;
+    if (!Transfer_Session::SendAccept(the_socket, accept))
+    {
+        std::cerr << "Unable to accept session " << hello.session_id << endl;
+        return performanceMetrics;
+    }
+
+    uint32_t acked = accept.start_index;
+    bool connection_failed = false;
+
+    seal_ptr = LoadSeal();
+    if (!seal_ptr)
+    {
+        return performanceMetrics;
+    }
+
+    // Get encrypted batch from bucket
+    int buffer_size = double_size * data_points_num; // each object has a size that matches the amount of input data points
+
+    // list for holding the data info to be loaded from the bucket
+    buffer_data_vec load_from_bucket_list;
+
+    // file names
+    string secret_file_name = utility::DatasetObjectName(_dataset, CIPHERTEXTS_X_INT_FRAC_DIR);
+
+    // create list for info loaded from the bucket
+    // each item in the list includes a buffer pointer, the buffer size and the file to read from
+
+    // add secret share buffer to list
+    bucket_data secret_share_data;
+    secret_share_data.buffer_size = buffer_size;
+    secret_share_data.file_name = secret_file_name;
+    secret_share_data.parse_func = &parse_double_into_secret_share;
+    secret_share_data.num_of_parsed_items = 2;
+    secret_share_data.item_size = double_size;
+    load_from_bucket_list.push_back(secret_share_data);
+
+    // add the tag objects of the scheme to the list, the ones of a batched MAC are shorter
+    int num_of_tag_vectors = 0;
+    for (const mac_tag_object_s& tag_object : mac_scheme->TagObjects(_dataset, data_points_num, _enc_init_params.max_ct_entries))
+    {
+        bucket_data tag_data;
+        tag_data.buffer_size = tag_object.buffer_size;
+        tag_data.file_name = tag_object.object_name;
+        tag_data.parse_func = tag_object.parse_func;
+        tag_data.num_of_parsed_items = tag_object.num_of_parsed_items;
+        tag_data.item_size = tag_object.item_size;
+        load_from_bucket_list.push_back(tag_data);
+
+        num_of_tag_vectors += tag_object.num_of_parsed_items;
+    }
 
-        high_resolution_clock::time_point start_loading = utility::timer_start();
+    Trace_Span loading_span("load_stored_data", &performanceMetrics.load_stored_data);
 
-        for(i = 0; i < load_from_bucket_list.size(); i++)
+    for(i = 0; i < load_from_bucket_list.size(); i++)
+    {
+        // load only the byte ranges of the selected blocks, without the sets a resumed session already verified.
+        // A missing range ends the session rather than sending zeros in its place
+        if (!load_blocks_from_bucket(s3Utility, load_from_bucket_list[i], selected, set_offsets, accept.start_index))
         {
-            // load from buffer - get buffer pointer, buffer size and filename to read from
-            load_buffer_from_bucket(s3Utility, load_from_bucket_list[i].buffer, load_from_bucket_list[i].buffer_size, load_from_bucket_list[i].file_name);
+            std::cerr << "Session " << hello.session_id << " ends, its stored data couldn't be loaded" << endl;
+            return performanceMetrics;
         }
+    }
 
-        performanceMetrics.load_stored_data += utility::timer_end(start_loading).count();
+    loading_span.End();
 
-        num_of_ct = (_data_points_num / _enc_init_params.max_ct_entries) + (((_data_points_num % _enc_init_params.max_ct_entries) > 0)? 1 : 0);
-        num_of_mac_ct = (_batched_size > 0) ?  std::ceil(((double)_data_points_num / _batched_size) / _enc_init_params.max_ct_entries) : num_of_ct;
+    num_of_mac_ct = mac_scheme->MacCtNum(data_points_num, _enc_init_params.max_ct_entries);
 
 
-        remaining_data_points_num = _data_points_num;
+    // this connection's share of the queue gauge, removed when the connection ends, also on an exception
+    Queued_Sets queued_sets(_metrics_endpoint.get());
 
-        for (i = 0; i < num_of_ct; i++)
-        {
-            std::vector<std::vector<double>> enc_vector_list;
+    // sets verified by the Destination Server before the connection of a resumed session dropped are skipped
+    for (int set = accept.start_index; (set < num_of_sets) && !connection_failed; set++)
+    {
+        std::vector<std::vector<double>> enc_vector_list;
+        i = selected[set];
+        int ct_num_of_data_points = ct_data_points(i, data_points_num, _enc_init_params.max_ct_entries);
 
-            std::vector<double> x_int_vec;
-            std::vector<double> x_frac_vec;
-            std::vector<double> sq_vec1;
-            std::vector<double> sq_vec2;
-            std::vector<double> sq_vec3;
+        queued_sets.Set(num_of_sets - set);
 
-            enc_vector_list.push_back(x_int_vec);
-            enc_vector_list.push_back(x_frac_vec);
-            if (num_of_mac_ct > 0)
-            {
-                enc_vector_list.push_back(sq_vec1);
-                enc_vector_list.push_back(sq_vec2);
-                enc_vector_list.push_back(sq_vec3);
-                num_of_mac_ct--;
-            }
+        // x_int and x_frac, then the tag vectors of the sets that carry tags
+        enc_vector_list.resize(secret_share_data.num_of_parsed_items + ((i < num_of_mac_ct) ? num_of_tag_vectors : 0));
+
+        // at this point we have the secret share and tag buffers in the load_from_bucket_list vector
+        // we now need to split them into vectors to later be encrypted.
+        // Each vector contains the following set of sub-vectors:
+        // an int vector and frac vector for the secret share and zr, zy and zq for each of the macs
+        // These should be sufficient to reconstruct and verify an amount of number equal or lower than the maximum amount of packed values in the ciphertext
 
-            // at this point we have 2 buffers in the load_from_bucket_list vector
-            // we now need to split them into vectors to later be encrypted.
-            // Each vector contains the following set of sub-vectors:
-            // an int vector and frac vector for the secret share and zr, zy and zq for each of the macs
-            // These should be sufficient to reconstruct and verify an amount of number equal or lower than the maximum amount of packed values in the ciphertext
+        Trace_Span extract_double_span("parse_stored_data", &performanceMetrics.load_stored_data);
 
-            high_resolution_clock::time_point start_extract_double = utility::timer_start();
+        k = 0;
+        for(int list_iter = 0; list_iter < load_from_bucket_list.size(); list_iter++)
+        {
+            // verify the buffer index doesn't exceed the buffer size.
+            // this is useful for cases where not all buffers have the same length
+            // In batched mode, the mac buffers are shorter and should only be loaded once
+            int curr_buff_index = (i * _enc_init_params.max_ct_entries ) * load_from_bucket_list[list_iter].item_size;
 
-            k = 0;
-            for(int list_iter = 0; list_iter < load_from_bucket_list.size(); list_iter++)
+            if (curr_buff_index < load_from_bucket_list[list_iter].buffer_size)
             {
-                // verify the buffer index doesn't exceed the buffer size.
-                // this is useful for cases where not all buffers have the same length
-                // In batched mode, the mac buffers are shorter and should only be loaded once
-                int curr_buff_index = (i * _enc_init_params.max_ct_entries ) * load_from_bucket_list[list_iter].item_size;
+                std::vector<double> values(ct_num_of_data_points);
 
-                if (curr_buff_index < load_from_bucket_list[list_iter].buffer_size)
+                // load the items from the bucket as doubles
+                for (j = 0; j < ct_num_of_data_points; j++)
                 {
-                    // load the items from the bucket and parse them into doubles
-                    for (j = 0;j < std::min(remaining_data_points_num, _enc_init_params.max_ct_entries) ; j++)
-                    {
-                            char tempChar = 0;
-                            double tempDouble = 0;
-                            // calculate the index in the char buffer and extract the double value
-                            buffer_index = ((i * _enc_init_params.max_ct_entries + j)) * load_from_bucket_list[list_iter].item_size;
-
-                            // in batched mode we use one buffer with "double" values and one with "char" values.
-                            // unfortunately, memcpy from sizeof(char) to tempDouble resulted in bogus values
-                            // so in case we need to copy from sizeof(char), we place the value in a char variable and then convert to double
-                            if (load_from_bucket_list[list_iter].item_size == sizeof(char))
-                            {
-                                std::memcpy(&tempChar, load_from_bucket_list[list_iter].buffer + buffer_index, load_from_bucket_list[list_iter].item_size);
-                                tempDouble = double(tempChar);
-                            }
-                            else
-                            {
-                                std::memcpy(&tempDouble, load_from_bucket_list[list_iter].buffer + buffer_index, load_from_bucket_list[list_iter].item_size);
-                            }
-                            // parse the double into secret share/mac values
-                            auto fptr = load_from_bucket_list[list_iter].parse_func;
-                            (this->*fptr)(floor(tempDouble), enc_vector_list, k);
-                    }
-
-                    k += load_from_bucket_list[list_iter].num_of_parsed_items;
-
-                    performanceMetrics.load_stored_data += utility::timer_end(start_extract_double).count();
+                        char tempChar = 0;
+                        double tempDouble = 0;
+                        // calculate the index in the loaded blocks and extract the double value
+                        buffer_index = (set_offsets[set] - set_offsets[accept.start_index] + j) * load_from_bucket_list[list_iter].item_size;
+
+                        // in batched mode we use one buffer with "double" values and one with "char" values.
+                        // unfortunately, memcpy from sizeof(char) to tempDouble resulted in bogus values
+                        // so in case we need to copy from sizeof(char), we place the value in a char variable and then convert to double
+                        if (load_from_bucket_list[list_iter].item_size == sizeof(char))
+                        {
+                            std::memcpy(&tempChar, load_from_bucket_list[list_iter].buffer.data() + buffer_index, load_from_bucket_list[list_iter].item_size);
+                            tempDouble = double(tempChar);
+                        }
+                        else
+                        {
+                            std::memcpy(&tempDouble, load_from_bucket_list[list_iter].buffer.data() + buffer_index, load_from_bucket_list[list_iter].item_size);
+                        }
+                        values[j] = floor(tempDouble);
                 }
 
-            }
-            remaining_data_points_num -= j;
+                // parse the doubles into secret share/mac values
+                load_from_bucket_list[list_iter].parse_func(values, enc_vector_list, k, *_mod_arith);
 
-            // optimization for unbatched data
-            if (_batched_size == 0)
-            {
-                // calculate sq_tr and sr_tr values
-               std::vector<double> sq_tr_vec(enc_vector_list[ENC_VEC_SQ_ZR_IDX].size(), 0);
-               enc_vector_list.push_back(sq_tr_vec);
-               //enc_vector_list.push_back(sr_tr_vec);
-
-               // calc SQ_TR values
-               // this is zr*p:
-               std::transform(enc_vector_list[ENC_VEC_SQ_ZR_IDX].begin(), enc_vector_list[ENC_VEC_SQ_ZR_IDX].end(), enc_vector_list[ENC_VEC_SQ_TR_IDX].begin(), std::bind(std::multiplies<double>(), std::placeholders::_1, (double)_enc_init_params.prime));
-
-               // this is addition of yr
-               std::transform(enc_vector_list[ENC_VEC_SQ_TR_IDX].begin(), enc_vector_list[ENC_VEC_SQ_TR_IDX].end(), enc_vector_list[ENC_VEC_SQ_YR_IDX].begin(), enc_vector_list[ENC_VEC_SQ_TR_IDX].begin(), std::plus<double>());
-
-               // now remove the vectors we don't need to send: zr, yr
-               // note that the removal needs to be done from the last item to the first
-               // in order to use the indikces in the enum
-               //enc_vector_list.erase(enc_vector_list.begin()+ENC_VEC_SR_YR_IDX);
-               //enc_vector_list.erase(enc_vector_list.begin()+ENC_VEC_SR_ZR_IDX);
-               enc_vector_list.erase(enc_vector_list.begin()+ENC_VEC_SQ_YR_IDX);
-               enc_vector_list.erase(enc_vector_list.begin()+ENC_VEC_SQ_ZR_IDX);
+                k += load_from_bucket_list[list_iter].num_of_parsed_items;
             }
 
-            // now we encrypt and send the data
-            for (k=0; k < enc_vector_list.size(); k++)
-            {
-                // encode, encrypt and serialize
-                string serialized_str = EncodeEncryptSerialize(enc_vector_list[k], seal_ptr, &performanceMetrics);
+        }
+        extract_double_span.End();
 
-                high_resolution_clock::time_point send_data = utility::timer_start();
+        // e.g. the unbatched tag vectors are combined into t_r
+        mac_scheme->PrepareTagVectors(enc_vector_list, _enc_init_params.prime);
 
-                // send the length of the serialized str so the client will know the buffer size to expect
-                ullong ser_str_len = serialized_str.length();
-                std::ostringstream oss;
-                oss << ser_str_len;
-                char csize_arr[sizeof(ullong) + 1] = {0};
-                memcpy(csize_arr, oss.str().c_str(), oss.str().length());
+        // small ciphertexts carry pairs of vectors at different slot offsets
+        if (is_slot_packed(_slot_packing, ct_num_of_data_points, _enc_init_params.max_ct_entries))
+        {
+            mac_scheme->PackSlots(enc_vector_list);
+        }
 
-                // log sent size
-                performanceMetrics.sent_size_in_bytes += sizeof(ullong);
+        // now we encrypt and send the data
+        for (k=0; k < enc_vector_list.size(); k++)
+        {
+            // encode, encrypt and serialize
+            string serialized_str = EncodeEncryptSerialize(enc_vector_list[k], seal_ptr, &performanceMetrics);
 
-                sent = 0;
-                sent_times = 0;
-                while ((sent == 0) && (sent_times < MAX_SOCKET_SEND_RETRIES))
-                {
-                    sent = send(the_socket, csize_arr, sizeof(ullong), 0);
-                    sent_times++;
-                }
-                if (sent_times == MAX_SOCKET_SEND_RETRIES)
-                {
-                    perror("Failed sending size over socket\n");
-                    exit(1);
-                }
+            Trace_Span send_data_span("send_data", &performanceMetrics.send_data);
 
-                // now send the serialized string
-                sent = 0;
-                sent_times = 0;
-                // log sent size
-                performanceMetrics.sent_size_in_bytes += ser_str_len;
-                while ((sent == 0) && (sent_times < MAX_SOCKET_SEND_RETRIES))
-                {
-                    sent = send(the_socket, serialized_str.c_str(), ser_str_len, 0);
-                    sent_times++;
-                }
-                if (sent_times == MAX_SOCKET_SEND_RETRIES)
-                {
-                    perror("Failed sending data over socket\n");
-                    exit(1);
-                }
+            // send the length of the serialized str so the client will know the buffer size to expect
+            ullong ser_str_len = serialized_str.length();
+            std::ostringstream oss;
+            oss << ser_str_len;
+            char csize_arr[sizeof(ullong) + 1] = {0};
+            memcpy(csize_arr, oss.str().c_str(), oss.str().length());
 
-                performanceMetrics.send_data += utility::timer_end(send_data).count();
+            // log sent size
+            performanceMetrics.sent_size_in_bytes += sizeof(ullong) + ser_str_len;
+
+            if (!Transfer_Session::SendAll(the_socket, csize_arr, sizeof(ullong)) || !Transfer_Session::SendAll(the_socket, serialized_str.c_str(), ser_str_len))
+            {
+                // the Destination Server reconnects and resumes the session
+                std::cerr << "Connection to the Destination Server failed, session " << hello.session_id << " can resume after set " << acked << endl;
+                connection_failed = true;
+                break;
+            }
+
+            long long send_time = send_data_span.End();
+            performanceMetrics.send_hist.Record(send_time);
+            if (_metrics_endpoint)
+            {
+                _metrics_endpoint->CiphertextSent(send_time);
             }
         }
 
-        performanceMetrics.end2end = utility::timer_end(end2end).count();
-        // cleanup allocated buffers
-        delete buffer_ct_x_int_frac;
-        delete buffer_tag_sq;
+        // keep up with the acknowledgements, without waiting for them
+        if (!connection_failed && !Transfer_Session::ReceiveAcks(the_socket, acked, false, 0))
+        {
+            connection_failed = true;
+        }
+    }
 
-        *metrics_file << performanceMetrics << endl;
+    // the session is done once the Destination Server verified the last sets
+    auto ack_deadline = std::chrono::steady_clock::now() + std::chrono::seconds(SESSION_ACK_TIMEOUT_SECONDS);
+    while (!connection_failed && (acked < (uint32_t)num_of_sets) && (std::chrono::steady_clock::now() < ack_deadline))
+    {
+        connection_failed = !Transfer_Session::ReceiveAcks(the_socket, acked, true, 1);
     }
-    Aws::ShutdownAPI(options);
+    UpdateSession(hello.session_id, acked, num_of_sets);
+
+    queued_sets.Set(0);
 
+    end2end_span.End();
+
+    return performanceMetrics;
 }
 
 
-void Auxiliary_Server::load_buffer_from_bucket(S3Utility& s3_utility, char* buffer, int buffer_size, string file_name){
-    file_name.append("/");
-    file_name.append(std::to_string(0));
-    s3_utility.load_from_bucket(file_name.c_str(), awsparams::bucket_name,
-                                buffer_size, buffer);
-    cout << "Loading from bucket " << file_name<< endl;
+bool Auxiliary_Server::load_blocks_from_bucket(Data_Storage& s3_utility, bucket_data& data, const vector<int>& selected, const vector<int>& set_offsets, int first_set){
+    string file_name = data.file_name + "/" + std::to_string(0);
+    size_t block_size = (size_t)_enc_init_params.max_ct_entries * data.item_size;
+    size_t first_offset = set_offsets[first_set];
+
+    // room for every data point of the blocks, the batched tag objects are shorter and the rest stays zero
+    data.buffer.assign((size_t)(set_offsets.back() - first_offset) * data.item_size, 0);
+
+    size_t run_start = first_set;
+    while (run_start < selected.size())
+    {
+        size_t run_end = run_start + 1;
+        while ((run_end < selected.size()) && (selected[run_end] == selected[run_end - 1] + 1))
+        {
+            run_end++;
+        }
+
+        size_t offset = selected[run_start] * block_size;
+        size_t size = (size_t)(set_offsets[run_end] - set_offsets[run_start]) * data.item_size;
+        if ((offset < (size_t)data.buffer_size) &&
+            !s3_utility.load_range_from_bucket(file_name.c_str(), awsparams::bucket_name, offset,
+                                               std::min(size, data.buffer_size - offset), data.buffer.data() + (set_offsets[run_start] - first_offset) * data.item_size))
+        {
+            std::cerr << "Unable to load " << file_name << " at " << offset << endl;
+            return false;
+        }
+
+        run_start = run_end;
     }
+    cout << "Loading from bucket " << file_name << endl;
+
+    return true;
+}
 
 
@@ -3,6 +3,13 @@
 #include "../Servers_Protocol.h"
 #include "cpprest/http_listener.h"
 #include "../Utility.h"
+#include "../Latency_Histogram.h"
+#include "../Perf_Counters.h"
+#include "../Transfer_Session.h"
+#include "../Dataset_Catalog.h"
+#include "../MAC_Scheme.h"
+#include "Metrics_Endpoint.h"
+#include <atomic>
 
 using namespace utility;
 
@@ -22,69 +29,81 @@ public:
     long long serialize = 0;
     long long sent_size_in_bytes = 0;
     long long send_data = 0;
+    Latency_Histogram send_hist; // per ciphertext send latency
+    perf_sample_s encode_encrypt_perf;
+    perf_sample_s serialize_perf;
 
     static std::string getHeader();
 };
 
 std::ostream& operator<<(std::ostream&, const AS_performance_metrics& asPerformanceMetrics);
 
-// encrypted vector enum for unbatched operation
-enum enc_vec_list_index
-{
-    ENC_VEC_X_INT_IDX = 0,
-    ENC_VEC_X_FRAC_IDX,
-    ENC_VEC_SQ_ZR_IDX,
-    ENC_VEC_SQ_YR_IDX,
-    ENC_VEC_SQ_ZQ_IDX,
-    ENC_VEC_SQ_TR_IDX,
-};
-
-// encrypted vector enum for batched operation
-enum enc_vec_list_batched_index
-{
-    ENC_VEC_BATCHED_X_INT_IDX = 0,
-    ENC_VEC_BATCHED_X_FRAC_IDX,
-    ENC_VEC_BATCHED_SQ_TR_IDX,
-    ENC_VEC_BATCHED_SR_ALPHA_INT_IDX,
-    ENC_VEC_BATCHED_SR_BETA_INT_IDX,
-};
+struct bucket_data;
 
 class Auxiliary_Server : public Servers_Protocol //to inherit generating SEAL params
 {
 private:
-    int _data_points_num;
+    int _data_points_num;              // size of the dataset, 0 serves the size each request asks for
+    string _dataset;                   // prefix of the served objects, empty for the default dataset
     bool _read_keys_from_file;
     enc_init_params_s _enc_init_params;
-    int _batched_size;
+    const mod_arith_s* _mod_arith;     // reduction by the prime of _enc_init_params
+    shared_ptr<const MAC_Scheme> _mac_scheme; // the scheme the dataset's tags were uploaded with
+    bool _slot_packing;
+    shared_ptr<Data_Storage> _storage; // when not set, the data is loaded from the S3 bucket
+    shared_ptr<seal_struct> _seal;     // when not set, the keys are loaded from a file or the S3 bucket
+    shared_ptr<seal_struct> _seal_context; // the SEAL context of the encryption params, created by the first connection
+    std::mutex _seal_context_mutex;
+    int _run = 0;                      // connections served, numbers the trace and histogram files
+    Latency_Histogram _all_runs_send_hist;
+    std::mutex _metrics_mutex;         // connections are served concurrently, their metrics are recorded one at a time
+    shared_ptr<Metrics_Endpoint> _metrics_endpoint; // when set, live metrics are updated for every connection
+    std::map<ullong, uint32_t> _sessions;            // acknowledged ciphertext sets of the sessions that can resume
+    std::mutex _sessions_mutex;
+    std::map<string, shared_ptr<Auxiliary_Server>> _datasets; // the catalog datasets served next to the default one
+    std::atomic<int> _active_connections{0};
 
     tuple<const shared_ptr<vector<std::string>>, const shared_ptr<vector<std::string>>> ProcessAndEncrypt(S3Utility& s3_utility, const shared_ptr<seal_struct> seal, AS_performance_metrics *performanceMetrics);
     void SetupServerSocket(int &server_socket);
     void AcceptConnections(int server_socket);
     inline string EncodeEncryptSerialize(vector<double> &vec, const shared_ptr<seal_struct> seal, AS_performance_metrics *performanceMetrics);
-    void parse_double_into_secret_share(double val, std::vector<std::vector<double>>& enc_vector_list, long index);
-    void parse_double_into_mac(double val, std::vector<std::vector<double>>& enc_vector_list, long index);
-    void parse_double_into_mac_batched_part1(double val, std::vector<std::vector<double>>& enc_vector_list, long index);
-    void parse_double_into_mac_batched_part2(double val, std::vector<std::vector<double>>& enc_vector_list, long index);
+    uint32_t ServedMode();
+    uint32_t CheckRequest(const session_hello_s& hello);
+    uint32_t CheckStoredSize(const session_hello_s& hello, const MAC_Scheme& mac_scheme, Data_Storage& storage);
+    AS_performance_metrics SendStoredData(int the_socket, const session_hello_s& hello, Data_Storage& s3Utility);
+    AS_performance_metrics ServeSession(int the_socket, const session_hello_s& hello);
+    shared_ptr<seal_struct> LoadSeal();
+    uint32_t StartSession(const session_hello_s& hello, uint32_t num_of_ct);
+    void UpdateSession(ullong session_id, uint32_t verified, uint32_t num_of_ct);
 
 public:
     std::ofstream *metrics_file;
     std::ostringstream os;
+    string trace_file; // when set, a Chrome trace is written for every connection
 
-    Auxiliary_Server(int data_points_num, bool read_keys_from_file, bool batched, string enc_init_params_file, std::ofstream *metrics_file_in);
+    Auxiliary_Server(int data_points_num, bool read_keys_from_file, bool batched, string enc_init_params_file, std::ofstream *metrics_file_in, bool slot_packing = false, string dataset = "");
     ~Auxiliary_Server() {}
     Auxiliary_Server(const Auxiliary_Server& auxiliaryServer) {} //copy c'tor
     void StartServer(void);
-    void EncryptAndSendData(int the_socket);
-    void load_buffer_from_bucket(S3Utility& s3_utility,char* buffer, int buffer_size, string file_name);
+    AS_performance_metrics EncryptAndSendData(int the_socket);
+    // load the selected ciphertext blocks of an object from set first_set on, consecutive blocks with one ranged request.
+    // set_offsets holds the data points of the selected blocks before each one, the buffer starts at first_set's.
+    // Fails when a block can't be loaded in full
+    bool load_blocks_from_bucket(Data_Storage& s3_utility, bucket_data& data, const vector<int>& selected, const vector<int>& set_offsets, int first_set);
+    void SetStorage(shared_ptr<Data_Storage> storage) { _storage = storage; }
+    void SetSeal(shared_ptr<seal_struct> seal) { _seal = seal; }
+    void SetMetricsEndpoint(shared_ptr<Metrics_Endpoint> metrics_endpoint) { _metrics_endpoint = metrics_endpoint; }
+    // serve a catalog dataset from this server's port, Destination Servers select it by name
+    void AddDataset(shared_ptr<Auxiliary_Server> dataset_server);
 };
 
 
 // a struct for holding information about the data to be read from the bucket
 struct bucket_data {
-	char* buffer;  // the buffer to read data into
-	int buffer_size; // the size of the data to be read
+	vector<char> buffer;  // the buffer to read the selected blocks into
+	int buffer_size; // the size of the whole object
 	string file_name; // the file name to read from
-	void(Auxiliary_Server::* parse_func)(double, std::vector<std::vector<double> >&, long int);  // the function used to parse the data
+	mac_parse_func parse_func;  // the function used to parse the data
 	int num_of_parsed_items; // the number of doubles extracted by the parsing function
 	int item_size; // the size of each item in the buffer
 };
@@ -0,0 +1,141 @@
+#include "Metrics_Endpoint.h"
+#include "Auxiliary_Server.h"
+#include <sstream>
+
+using namespace web;
+using namespace web::http;
+using namespace web::http::experimental::listener;
+
+// S3 loads and whole requests take from milliseconds to minutes, a single ciphertext send from microseconds
+static const vector<double> LOAD_AND_REQUEST_BOUNDS = {0.01, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30, 60, 120};
+static const vector<double> SEND_BOUNDS = {0.0001, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.5};
+
+void prom_histogram_s::Observe(double seconds)
+{
+    for (size_t i = 0; i < upper_bounds.size(); i++)
+    {
+        if (seconds <= upper_bounds[i])
+        {
+            counts[i]++;
+        }
+    }
+    counts.back()++;
+    sum += seconds;
+    count++;
+}
+
+static void WriteMetric(std::ostringstream& out, const string& name, const string& type, const string& help, double value)
+{
+    out << "# HELP " << name << " " << help << "\n"
+        << "# TYPE " << name << " " << type << "\n"
+        << name << " " << value << "\n";
+}
+
+static void WriteHistogram(std::ostringstream& out, const string& name, const string& help, const prom_histogram_s& histogram)
+{
+    out << "# HELP " << name << " " << help << "\n"
+        << "# TYPE " << name << " histogram\n";
+
+    for (size_t i = 0; i < histogram.upper_bounds.size(); i++)
+    {
+        out << name << "_bucket{le=\"" << histogram.upper_bounds[i] << "\"} " << histogram.counts[i] << "\n";
+    }
+
+    out << name << "_bucket{le=\"+Inf\"} " << histogram.counts.back() << "\n"
+        << name << "_sum " << histogram.sum << "\n"
+        << name << "_count " << histogram.count << "\n";
+}
+
+Metrics_Endpoint::Metrics_Endpoint()
+    : _load_stored_data_seconds(LOAD_AND_REQUEST_BOUNDS),
+      _request_duration_seconds(LOAD_AND_REQUEST_BOUNDS),
+      _send_ciphertext_seconds(SEND_BOUNDS)
+{
+}
+
+void Metrics_Endpoint::Start(int port)
+{
+    string address = "http://0.0.0.0:" + std::to_string(port) + "/metrics";
+
+    _listener.reset(new http_listener(uri(address)));
+    _listener->support(methods::GET, [this](http_request request) { HandleGet(request); });
+    _listener->open().wait();
+
+    std::cout << "Serving metrics on " << address << std::endl;
+}
+
+void Metrics_Endpoint::Stop()
+{
+    if (_listener)
+    {
+        _listener->close().wait();
+        _listener.reset();
+    }
+}
+
+void Metrics_Endpoint::HandleGet(http_request request)
+{
+    // the listener is bound to /metrics, anything below it is unknown
+    string path = request.relative_uri().path();
+    if (path != "/" && !path.empty())
+    {
+        request.reply(status_codes::NotFound);
+        return;
+    }
+
+    request.reply(status_codes::OK, Render(), "text/plain; version=0.0.4");
+}
+
+// called once the connection's transfer ended, a transfer that sent nothing failed to load its keys or data
+void Metrics_Endpoint::ConnectionClosed(const AS_performance_metrics& performanceMetrics)
+{
+    _active_connections--;
+    _requests_total++;
+
+    if (performanceMetrics.sent_size_in_bytes == 0)
+    {
+        _failed_requests_total++;
+        return;
+    }
+
+    _bytes_sent_total += performanceMetrics.sent_size_in_bytes;
+    _encode_encrypt_ns_total += performanceMetrics.encode_encrypt;
+
+    if (performanceMetrics.encode_encrypt > 0)
+    {
+        _last_encrypt_throughput = performanceMetrics.send_hist.Count() / (performanceMetrics.encode_encrypt / 1e9);
+    }
+
+    std::lock_guard<std::mutex> lock(_histograms_mutex);
+    _load_stored_data_seconds.Observe(performanceMetrics.load_stored_data / 1e9);
+    _request_duration_seconds.Observe(performanceMetrics.end2end / 1e9);
+}
+
+void Metrics_Endpoint::CiphertextSent(long long send_ns)
+{
+    _ciphertexts_sent_total++;
+
+    std::lock_guard<std::mutex> lock(_histograms_mutex);
+    _send_ciphertext_seconds.Observe(send_ns / 1e9);
+}
+
+string Metrics_Endpoint::Render()
+{
+    std::ostringstream out;
+
+    WriteMetric(out, "aux_requests_total", "counter", "Transfers served to Destination Servers", _requests_total);
+    WriteMetric(out, "aux_failed_requests_total", "counter", "Transfers that ended before sending any data", _failed_requests_total);
+    WriteMetric(out, "aux_bytes_sent_total", "counter", "Bytes sent to Destination Servers, including size headers", _bytes_sent_total);
+    WriteMetric(out, "aux_ciphertexts_sent_total", "counter", "Ciphertexts encrypted and sent", _ciphertexts_sent_total);
+    WriteMetric(out, "aux_encode_encrypt_seconds_total", "counter", "Time spent encoding and encrypting", _encode_encrypt_ns_total / 1e9);
+    WriteMetric(out, "aux_encrypt_throughput_ciphertexts_per_second", "gauge", "Encode and encrypt throughput of the last transfer", _last_encrypt_throughput);
+    WriteMetric(out, "aux_active_connections", "gauge", "Destination Server connections being served", _active_connections);
+    WriteMetric(out, "aux_queued_ciphertext_sets", "gauge", "Ciphertext sets of the transfers in progress not yet encrypted and sent", _queued_ciphertext_sets);
+
+    std::lock_guard<std::mutex> lock(_histograms_mutex);
+    WriteHistogram(out, "aux_load_stored_data_seconds", "Time to load the shares and tags from the bucket", _load_stored_data_seconds);
+    WriteHistogram(out, "aux_request_duration_seconds", "Time to serve one transfer", _request_duration_seconds);
+    WriteHistogram(out, "aux_send_ciphertext_seconds", "Time to send one serialized ciphertext", _send_ciphertext_seconds);
+
+    return out.str();
+}
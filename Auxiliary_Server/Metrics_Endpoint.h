@@ -0,0 +1,92 @@
+#pragma once
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "cpprest/http_listener.h"
+
+using std::string;
+using std::vector;
+
+class AS_performance_metrics;
+
+// a cumulative Prometheus histogram of durations in seconds
+struct prom_histogram_s
+{
+    vector<double> upper_bounds;
+    vector<long long> counts; // counts[i] is the number of observations <= upper_bounds[i], the last entry is +Inf
+    double sum = 0;
+    long long count = 0;
+
+    explicit prom_histogram_s(const vector<double>& bounds) : upper_bounds(bounds), counts(bounds.size() + 1, 0) {}
+    void Observe(double seconds);
+};
+
+// Metrics_Endpoint - live counters of a long running Aux, served over HTTP in the Prometheus text format.
+// The accept loop updates the metrics per connection and the send loops update the queue depth per ciphertext set,
+// the listener threads only read them.
+class Metrics_Endpoint
+{
+private:
+    std::atomic<long long> _requests_total{0};
+    std::atomic<long long> _failed_requests_total{0};
+    std::atomic<long long> _bytes_sent_total{0};
+    std::atomic<long long> _ciphertexts_sent_total{0};
+    std::atomic<long long> _encode_encrypt_ns_total{0};
+    std::atomic<long long> _active_connections{0};
+    std::atomic<long long> _queued_ciphertext_sets{0};
+    std::atomic<double> _last_encrypt_throughput{0};
+
+    std::mutex _histograms_mutex;
+    prom_histogram_s _load_stored_data_seconds;
+    prom_histogram_s _request_duration_seconds;
+    prom_histogram_s _send_ciphertext_seconds;
+
+    std::unique_ptr<web::http::experimental::listener::http_listener> _listener;
+
+    void HandleGet(web::http::http_request request);
+
+public:
+    Metrics_Endpoint();
+    ~Metrics_Endpoint() { Stop(); }
+    Metrics_Endpoint(const Metrics_Endpoint&) = delete;
+    Metrics_Endpoint& operator=(const Metrics_Endpoint&) = delete;
+
+    // serve /metrics on all interfaces, throws if the port can't be bound
+    void Start(int port);
+    void Stop();
+
+    void ConnectionOpened() { _active_connections++; }
+    void ConnectionClosed(const AS_performance_metrics& performanceMetrics);
+    void CiphertextSent(long long send_ns);
+    // connections send concurrently, each adds the change of its own queue so the gauge is their sum
+    void AddQueuedCiphertextSets(long long delta) { _queued_ciphertext_sets.fetch_add(delta, std::memory_order_relaxed); }
+
+    // the exposition text returned by /metrics
+    string Render();
+};
+
+// Queued_Sets - the ciphertext sets one connection still has to send, published to the endpoint's queue gauge.
+// The endpoint may be null, then nothing is published
+class Queued_Sets
+{
+private:
+    Metrics_Endpoint* _endpoint;
+    long long _queued = 0;
+
+public:
+    explicit Queued_Sets(Metrics_Endpoint* endpoint) : _endpoint(endpoint) {}
+    ~Queued_Sets() { Set(0); }
+    Queued_Sets(const Queued_Sets&) = delete;
+    Queued_Sets& operator=(const Queued_Sets&) = delete;
+
+    void Set(long long queued)
+    {
+        if (_endpoint != nullptr)
+        {
+            _endpoint->AddQueuedCiphertextSets(queued - _queued);
+        }
+        _queued = queued;
+    }
+};
@@ -8,10 +8,16 @@ using namespace utility;
 void printHelp(void)
 {
     std::cout <<
-            "--input <n>                    Number of secret values to transfer\n"
+            "--input <n>                    Only serve requests for n secret values. Default serves the size each request asks for\n"
             "--read_keys_from_file          Read encryption keys from a local file instead of s3 bucket\n"
             "--enc_param_file <filename>    Read encryption params from a local file instead of defaults\n"
             "--batched                      Batched MAC\n"
+            "--slot_packing                 Send ciphertexts using at most half of the slots with x_int and x_frac packed together\n"
+            "--trace <filename>             Write a Chrome trace JSON of every connection (<filename>_<n>.json)\n"
+            "--metrics_port <port>          Serve live metrics in the Prometheus text format on http://<host>:<port>/metrics\n"
+            "--s3_max_connections <n>       Maximum number of pooled S3 connections. Default is 25\n"
+            "--perf_counters                Report IPC and cache/branch misses per ciphertext of the encode/encrypt and serialize stages\n"
+            "--catalog <filename>           Also serve the datasets listed in the catalog file, selected by name with the DS --dataset\n"
             "--help                         Display this help message\n";
     exit(1);
 
@@ -22,11 +28,15 @@ void printHelp(void)
 int main(int argc, char* argv[])
 {
     bool read_keys_from_file = false;
-    int data_points_num = constants::DEFAULT_INPUT_SIZE;
+    int data_points_num = 0;
     string params_file = "";
     bool batched = false;
+    bool slot_packing = false;
+    string trace_file = "";
+    int metrics_port = 0;
+    string catalog_file = "";
 
-    const char* const short_opts = "i:e:rnh";
+    const char* const short_opts = "i:e:x:p:c:g:rnPh";
     const option long_opts [] =
     {
             {"input", required_argument, nullptr, 'i'},
@@ -34,6 +44,12 @@ int main(int argc, char* argv[])
             {"read_keys_from_file", no_argument, nullptr, 'r'},
             {"no_mac", no_argument, nullptr, 'n'},
             {"batched", no_argument, nullptr, 'b'},
+            {"slot_packing", no_argument, nullptr, 'k'},
+            {"trace", required_argument, nullptr, 'x'},
+            {"metrics_port", required_argument, nullptr, 'p'},
+            {"s3_max_connections", required_argument, nullptr, 'c'},
+            {"perf_counters", no_argument, nullptr, 'P'},
+            {"catalog", required_argument, nullptr, 'g'},
             {"help", no_argument, nullptr, 'h'},
     };
 
@@ -61,6 +77,30 @@ int main(int argc, char* argv[])
             batched = true;
             break;
 
+        case 'k':
+            slot_packing = true;
+            break;
+
+        case 'x':
+            trace_file = optarg;
+            Tracer::Enable(true);
+            break;
+
+        case 'p':
+            metrics_port = std::stoi(optarg);
+            break;
+
+        case 'c':
+            utility::SetS3MaxConnections(std::stoi(optarg));
+            break;
+
+        case 'P':
+            Perf_Counters::Enable();
+            break;
+
+        case 'g':
+            catalog_file = optarg;
+            break;
 
         case 'h':
         case '?':
@@ -72,11 +112,56 @@ int main(int argc, char* argv[])
 
     }
 
+    // the S3 connections stay open across all Destination Server connections
+    Aws_API_Guard aws_api;
     std::ofstream  metrics_file = utility::openMetricsFile(data_points_num, "AS_");
     metrics_file << AS_performance_metrics::getHeader() << endl;
-    Auxiliary_Server Aux_Server(data_points_num, read_keys_from_file, batched, params_file, &metrics_file);
+    Auxiliary_Server Aux_Server(data_points_num, read_keys_from_file, batched, params_file, &metrics_file, slot_packing);
+    Aux_Server.trace_file = trace_file;
+
+    if (metrics_port > 0)
+    {
+        auto metrics_endpoint = make_shared<Metrics_Endpoint>();
+        metrics_endpoint->Start(metrics_port);
+        Aux_Server.SetMetricsEndpoint(metrics_endpoint);
+    }
+
+    // the default dataset comes from the command line, each catalog dataset has its own metrics and trace files
+    vector<std::unique_ptr<std::ofstream>> dataset_metrics_files;
+    if (!catalog_file.empty())
+    {
+        vector<dataset_s> datasets;
+        try
+        {
+            datasets = Dataset_Catalog::Load(catalog_file);
+        }
+        catch (const std::exception& e)
+        {
+            std::cout << e.what() << endl;
+            exit(1);
+        }
+
+        for (const dataset_s& dataset : datasets)
+        {
+            dataset_metrics_files.emplace_back(new std::ofstream(utility::openMetricsFile(dataset.data_points_num, "AS_" + dataset.name + "_")));
+            *dataset_metrics_files.back() << AS_performance_metrics::getHeader() << endl;
+
+            auto dataset_server = make_shared<Auxiliary_Server>(dataset.data_points_num, read_keys_from_file, dataset.batched, dataset.enc_param_file,
+                                                                dataset_metrics_files.back().get(), dataset.slot_packing, dataset.name);
+            // trace.json -> trace_<dataset>.json
+            dataset_server->trace_file = trace_file.empty() ? "" : trace_file.substr(0, trace_file.rfind(".json")) + "_" + dataset.name + ".json";
+            Aux_Server.AddDataset(dataset_server);
+        }
+
+        std::cout << "Serving " << datasets.size() << " datasets from " << catalog_file << endl;
+    }
+
     Aux_Server.StartServer();
     metrics_file.close();
+    for (auto& dataset_metrics_file : dataset_metrics_files)
+    {
+        dataset_metrics_file->close();
+    }
 
     return 0;
 }
@@ -10,6 +10,7 @@ typedef unsigned char byte;
 const int BLOCK_SIZE_BYTES { 16 };            // AES block size in bytes
 const int KEY_SIZE_BYTES { 32 };              // AES key size in bytes (256 bits)
 const int MAX_SOCKET_SEND_RETRIES { 15 };     // Max retries for socket send
+const int MAX_DATASET_NAME_LENGTH { 255 };    // Max length of a dataset name, the prefix of its bucket objects
 
 // Constants namespace
 namespace constants
@@ -29,6 +30,11 @@ namespace constants
 
     // Debug / validation constants
     const int max_reported_incorrect_items = 10; // Max number of incorrect MAC/secret share items to report
+    const double MAC_EPSILON = 1;                // A MAC diff at or above it is a forged value
+    // Bound on the MAC diff of an honest value, the CKKS noise its verification leaves at scale 2^60. The Destination
+    // Server checks the squared diffs of a transfer against it in test mode. The squared diffs of an honest transfer of
+    // n values sum to at most n * MAC_HONEST_DIFF_BOUND^2, about 0.25 for the 2^24 slots of a 16M data point transfer
+    const double MAC_HONEST_DIFF_BOUND = 1.0 / (1 << 13);
 
     // File names for keys
     inline std::string SECRET_SHARE_KEY_FILENAME("key_DS.txt"); // Secret share key file
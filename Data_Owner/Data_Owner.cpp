@@ -1,5 +1,6 @@
 #include "Data_Owner.h"
 #include "../Utility.h"
+#include "../MAC_Scheme.h"
 #include <aws/core/Aws.h>
 #include <aws/core/utils/logging/LogLevel.h>
 #include <aws/s3/S3Client.h>
@@ -19,7 +20,7 @@ std::string DO_performance_metrics::getHeader(){
 }
 
 // save the b/t generation key and the secret share/mac verify info to the bucket
-long long saveKeyAndDataToBucket(S3Utility s3Utility, string key_str,  string plain_data, string dir_name, string file_bucket)
+long long saveKeyAndDataToBucket(Data_Storage& s3Utility, string key_str,  string plain_data, string dir_name, string file_bucket)
 {
 
     s3Utility.save_to_bucket(file_bucket, awsparams::bucket_name, key_str);
@@ -28,12 +29,11 @@ long long saveKeyAndDataToBucket(S3Utility s3Utility, string key_str,  string pl
     file_name.append("/");
     file_name.append(std::to_string(0));
 
-    high_resolution_clock::time_point start_save = utility::timer_start();
+    Trace_Span save_span("upload");
 
     s3Utility.save_to_bucket(file_name.c_str(), awsparams::bucket_name, plain_data);
 
-    long long share_time = utility::timer_end(start_save).count();
-    return share_time;
+    return save_span.End();
 }
 
 // Constructor. Initialize encryption parameters
@@ -47,11 +47,7 @@ Data_Owner::Data_Owner(string enc_init_params_file)
 // secret reconstruction worked.
 void Data_Owner::SaveSecertToBucket()
 {
-    SDKOptions options;
-
-    Aws::InitAPI(options);
-    {
-        S3Utility s3Utility(awsparams::region);
+    utility::WithStorage(_storage, awsparams::region, [this](Data_Storage& s3Utility) {
         std::string str1 = "";
         for (int i = 0; i < _secret_num_vec.size(); i++) {
 
@@ -59,9 +55,8 @@ void Data_Owner::SaveSecertToBucket()
             std::string padded_num_str = (_enc_init_params.float_precision_for_test > num_str.length()) ? std::string(_enc_init_params.float_precision_for_test - num_str.length(), '0') + num_str : num_str;
             str1.append(padded_num_str);
             }
-        s3Utility.save_to_bucket("inputs", awsparams::bucket_name, str1);
-    }
-    Aws::ShutdownAPI(options);
+        s3Utility.save_to_bucket(utility::DatasetObjectName(dataset, "inputs"), awsparams::bucket_name, str1);
+    });
 
 }
 
@@ -75,12 +70,10 @@ void Data_Owner::GenSecret(ullong input_size)
 int Data_Owner::GenSecretShareAndCompactMAC(DO_performance_metrics& performanceMetrics, bool batched)
 {
     Secret_Sharing secret_sharing(_enc_init_params);
-    MAC mac(_enc_init_params);
+    shared_ptr<const MAC_Scheme> mac_scheme = MAC_Scheme::Create(batched);
     string plain_x_int_frac, plain_tag, plain_tag_beta;
     double calc_for_store;
-    double prime_square = pow(_enc_init_params.prime, 2);
 
-    mac_tag_batched_optimized optimized_mac;
     int prime_bits_to_bytes;
     int num_of_bits_prime = (std::log2(_enc_init_params.prime));
     int num_of_secret_shares = _secret_num_vec.size();
@@ -92,22 +85,15 @@ int Data_Owner::GenSecretShareAndCompactMAC(DO_performance_metrics& performanceM
     // generate secret share key
     rng.GenerateBlock(DS_key, KEY_SIZE_BYTES);
 
-    CryptoPP::HMAC<CryptoPP::SHA256> hmac(DS_key, KEY_SIZE_BYTES);
-
     // generate MAC keys
     byte MAC_key[KEY_SIZE_BYTES];
     rng.GenerateBlock(MAC_key, KEY_SIZE_BYTES);
-    CryptoPP::HMAC<CryptoPP::SHA256> hmac_tag(MAC_key, KEY_SIZE_BYTES);
 
     // generate secret shares and mac tags
-    nanoseconds share_time{0};
-    nanoseconds mac_time{0};
-    std::ostringstream os, os_tag, os_tag_beta;
-    vector<char> byteArr;
-
-    vector<int> cur_indexes;
-    int j=0;
-    int mac_len = std::min(num_of_secret_shares, _enc_init_params.max_ct_entries);
+    long long share_time = 0;
+    long long mac_time = 0;
+    std::ostringstream os;
+    vector<double> x_int_for_mac(num_of_secret_shares), x_frac_for_mac(num_of_secret_shares);
 
     // calc the number of bytes needed for the mac "a" value according to the number of bits in the prime number
     // as all "a" values are in Zp
@@ -120,146 +106,56 @@ int Data_Owner::GenSecretShareAndCompactMAC(DO_performance_metrics& performanceM
     int bytes_for_secret_share = num_of_secret_shares * (prime_bits_to_bytes + 1);
     SHARE_MAC_KEYS secret_share_keys(bytes_for_secret_share);
 
-    high_resolution_clock::time_point start_share = utility::timer_start();
+    Trace_Span gen_keys_span("gen_share_keys", &share_time);
     secret_share_keys.gen_keys(DS_key, KEY_SIZE_BYTES, constants::SECRET_SHARE_DERIVE_KEY);
-    share_time += utility::timer_end(start_share);
-
-    if(!batched)
-    {
-
-        for (int i = 0; i < num_of_secret_shares; i++)
-        {
-            start_share = utility::timer_start();
-            sharePT_struct sharePT1 = secret_sharing.gen_share(_secret_num_vec[i], &secret_share_keys, prime_bits_to_bytes);
-            share_time += utility::timer_end(start_share);
-
-            // next we prepare the secret share values for storage.
-            // In order to make the storage more compact, we group the secret share values
-            // into a single double and later the same for the MAC values.
-
-            // the secret share is stored as s_q*p +s_r
-            calc_for_store = sharePT1.x_int * _enc_init_params.prime + sharePT1.x_frac;
-            os.write(reinterpret_cast<const char*>(&calc_for_store), sizeof(double));
-
-            //cout << "going in to  single mac tag for i: " << i << endl;
-            high_resolution_clock::time_point start_mac = utility::timer_start();
-            //apply single kmac for each share couple
-            Key_Generator kmac(_enc_init_params.prime);
-            kmac.derive_abcd(hmac_tag, constants::MAC_DERIVE_KEY, i, 1); // derive secret share components
-            single_mac_tag tag = mac.single_compact_mac(kmac, 0, sharePT1.x_int, sharePT1.x_frac);
-            mac_time += utility::timer_end(start_mac);
-
-            // write the mac tag values
-            // the mac values are stored as: z_mskd*p^2 + z_r*p + y_r
-            calc_for_store = tag.z_qmskd *prime_square + tag.z_r * _enc_init_params.prime + tag.y_r;
-            os_tag.write(reinterpret_cast<const char*>(&calc_for_store), sizeof(double));
-        }
-    }
+    gen_keys_span.End();
 
-    else //batched mode
+    for (int i = 0; i < num_of_secret_shares; i++)
     {
-        vector<double> x_int_for_mac, x_frac_for_mac;
-        vector<double> result_vec(_enc_init_params.max_ct_entries, 0.0);
-
-        Batched_Key_Generator kmac(_enc_init_params.prime);
-
-        // calculate the amount of required bytes for all keys
-        // a_int, a_frac, c_alpha, c_beta and b required the same amount of bytes as the prime.
-        // d_alpha and d_beta each require 1 bit, so we can allocate 1 byte for both
-        // calculating by bytes maybe space consuming, but is easier for this implementation.
-        // future improvement and be to allocate according to number of bits
-        ullong num_of_mac_key_bytes = num_of_secret_shares * 2 * prime_bits_to_bytes +  _enc_init_params.max_ct_entries * (prime_bits_to_bytes * 3 + 1);
-        SHARE_MAC_KEYS kmac_keys(num_of_mac_key_bytes);
-
-        high_resolution_clock::time_point start_mac = utility::timer_start();
-
-        kmac_keys.gen_keys(MAC_key, KEY_SIZE_BYTES, constants::MAC_DERIVE_KEY);
-
-        mac_time += utility::timer_end(start_mac);
-
-        for (int i = 0; i < num_of_secret_shares; i++)
-        {
-            high_resolution_clock::time_point start_share = utility::timer_start();
-            sharePT_struct sharePT1 = secret_sharing.gen_share(_secret_num_vec[i], &secret_share_keys, prime_bits_to_bytes);
-            share_time += utility::timer_end(start_share);
+        Trace_Span share_span(nullptr, &share_time);
+        sharePT_struct sharePT1 = secret_sharing.gen_share(_secret_num_vec[i], &secret_share_keys, prime_bits_to_bytes);
+        share_span.End();
 
-            // next we prepare the secret share values for storage.
-            // In order to make the storage more compact, we group the secret share values
-            // into a single double and later the same for the MAC values.
+        // next we prepare the secret share values for storage.
+        // In order to make the storage more compact, we group the secret share values
+        // into a single double and the scheme does the same for the MAC values.
 
-            // the secret share is stored as s_q*p +s_r
-            calc_for_store = sharePT1.x_int * _enc_init_params.prime + sharePT1.x_frac;
-            os.write(reinterpret_cast<const char*>(&calc_for_store), sizeof(double));
+        // the secret share is stored as s_q*p +s_r
+        calc_for_store = sharePT1.x_int * _enc_init_params.prime + sharePT1.x_frac;
+        os.write(reinterpret_cast<const char*>(&calc_for_store), sizeof(double));
 
-            x_int_for_mac.push_back(sharePT1.x_int);
-            x_frac_for_mac.push_back(sharePT1.x_frac);
-
-            if ((((i + 1) % _enc_init_params.max_ct_entries) == 0) || ((i + 1) == num_of_secret_shares))
-            {
-                high_resolution_clock::time_point start_mac = utility::timer_start();
-                // calculate x_int * a_int + x_frac * a_frac and then add to the result vector
-                kmac.derive_a(&kmac_keys, i - x_int_for_mac.size() + 1, _enc_init_params.max_ct_entries, prime_bits_to_bytes);
-
-                std::transform(x_int_for_mac.begin(), x_int_for_mac.end(), kmac.a_int.begin(), x_int_for_mac.begin(), std::multiplies<double>());
-                std::transform(x_frac_for_mac.begin(), x_frac_for_mac.end(), kmac.a_frac.begin(), x_frac_for_mac.begin(), std::multiplies<double>());
-                std::transform(x_int_for_mac.begin(), x_int_for_mac.end(), x_frac_for_mac.begin(), x_int_for_mac.begin(), std::plus<double>());
-                std::transform(result_vec.begin(), result_vec.end(), x_int_for_mac.begin(), result_vec.begin(), std::plus<double>());
-
-                mac_time += utility::timer_end(start_mac);
-
-                kmac.a_int.clear();
-                kmac.a_frac.clear();
-                x_int_for_mac.clear();
-                x_frac_for_mac.clear();
-            }
-
-
-        }
-
-        start_mac = utility::timer_start();
-        kmac.derive_bcd(&kmac_keys, _enc_init_params.max_ct_entries, prime_bits_to_bytes, kmac_keys.keys_iter);
-        // add b to the sum of (x_int * a_int + x_frac * a_frac)
-        std::transform(result_vec.begin(), result_vec.end(), kmac.b.begin(), result_vec.begin(), std::plus<double>());
-
-        optimized_mac = mac.compact_mac_batched_optimized(kmac, result_vec);
-        for(j = 0; j < optimized_mac.mac_part1.size(); j++)
-        {
-            os_tag.write(reinterpret_cast<const char*>(&optimized_mac.mac_part1[j]), sizeof(double));
-        }
-        mac_time += utility::timer_end(start_mac);
+        x_int_for_mac[i] = sharePT1.x_int;
+        x_frac_for_mac[i] = sharePT1.x_frac;
     }
 
+    // the tags of the scheme the dataset is uploaded with, the Aux serves it with the same scheme
+    Trace_Span mac_span("mac_tag", &mac_time);
+    mac_scheme->GenerateTags(_enc_init_params, MAC_key, x_int_for_mac, x_frac_for_mac, plain_tag, plain_tag_beta);
+    mac_span.End();
 
-    performanceMetrics.share = share_time.count();
-    performanceMetrics.mac = mac_time.count();
+    performanceMetrics.share = share_time;
+    performanceMetrics.mac = mac_time;
 
     //converting stream to string
     plain_x_int_frac = os.str();
-    plain_tag = os_tag.str();
-
-    if(batched){
-            std::string str(optimized_mac.mac_part2.begin(), optimized_mac.mac_part2.end());
-            plain_tag_beta = str;
-    }
 
     // write key and secret share files to AWS bucket
-    SDKOptions options;
-    //options.loggingOptions.logLevel = Utils::Logging::LogLevel::Debug;
-    Aws::InitAPI(options);
-    {
-        S3Utility s3Utility(awsparams::region);
+    utility::WithStorage(_storage, awsparams::region, [&](Data_Storage& s3Utility) {
         std::string DS_key_str(reinterpret_cast<const char *>(DS_key), sizeof(DS_key));
         std::string MAC_key_str(reinterpret_cast<const char *>(MAC_key), sizeof(MAC_key));
 
 
-        performanceMetrics.upload_shared = saveKeyAndDataToBucket(s3Utility, DS_key_str, plain_x_int_frac, string(CIPHERTEXTS_X_INT_FRAC_DIR), constants::SECRET_SHARE_KEY_FILENAME);
-        performanceMetrics.upload_sq = saveKeyAndDataToBucket(s3Utility, MAC_key_str, plain_tag, string(TAGS_SQ_DIR), constants::TAG_SQ_KEY_FILENAME);
-        if(batched){
+        performanceMetrics.upload_shared = saveKeyAndDataToBucket(s3Utility, DS_key_str, plain_x_int_frac, utility::DatasetObjectName(dataset, CIPHERTEXTS_X_INT_FRAC_DIR),
+                                                                  utility::DatasetObjectName(dataset, constants::SECRET_SHARE_KEY_FILENAME));
+        performanceMetrics.upload_sq = saveKeyAndDataToBucket(s3Utility, MAC_key_str, plain_tag, utility::DatasetObjectName(dataset, TAGS_SQ_DIR),
+                                                              utility::DatasetObjectName(dataset, constants::TAG_SQ_KEY_FILENAME));
+        // the schemes without sr tags leave them empty
+        if (!plain_tag_beta.empty()) {
 
-            performanceMetrics.upload_sr = saveKeyAndDataToBucket(s3Utility, MAC_key_str, plain_tag_beta, string(TAGS_SR_DIR), constants::TAG_SR_KEY_FILENAME);
+            performanceMetrics.upload_sr = saveKeyAndDataToBucket(s3Utility, MAC_key_str, plain_tag_beta, utility::DatasetObjectName(dataset, TAGS_SR_DIR),
+                                                                  utility::DatasetObjectName(dataset, constants::TAG_SR_KEY_FILENAME));
         }
-    }
-    Aws::ShutdownAPI(options);
+    });
 
     return 1;
 }
@@ -27,7 +27,10 @@ class Data_Owner
 private:
     vector<double> _secret_num_vec;
     enc_init_params_s _enc_init_params;
+    shared_ptr<Data_Storage> _storage; // when not set, the data is saved to the S3 bucket
 public:
+    string dataset; // prefix of the uploaded objects, empty for the default dataset
+
     Data_Owner(string enc_params_file); // constructor
     ~Data_Owner() {} //class d'tor
     Data_Owner(const Data_Owner& data_owner) {} //copy c'tor
@@ -35,6 +38,7 @@ public:
     int GenSecretShare(DO_performance_metrics& performanceMetrics);
     void SaveSecertToBucket();
     int GenSecretShareAndCompactMAC(DO_performance_metrics& performanceMetrics, bool batched);
+    void SetStorage(shared_ptr<Data_Storage> storage) { _storage = storage; }
 
 };
 
@@ -3,6 +3,7 @@
 #include <iostream>
 #include "Data_Owner.h"
 #include "../Constants.h"
+#include "../Dataset_Catalog.h"
 
 using namespace seal;
 using namespace Aws;
@@ -15,6 +16,9 @@ void printHelp(void)
             "--enc_param_file <filename>  Read encryption params from a local file instead of defaults\n"
             "--no_test_mode               Do not validate output\n"
             "--batched                    Batched MAC\n"
+            "--trace <filename>           Write a Chrome trace JSON of every repetition (<filename>_<n>.json)\n"
+            "--s3_max_connections <n>     Maximum number of pooled S3 connections. Default is 25\n"
+            "--dataset <name>             Upload as the named dataset of an Aux catalog, its objects are <name>/... in the bucket\n"
             "--help                       Display this help message\n";
     exit(1);
 
@@ -32,8 +36,10 @@ int main(int argc, char* argv[])
     int repeat_times = 1;
     bool batched = false;
     string params_file = "";
+    string trace_file = "";
+    string dataset = "";
 
-    const char* const short_opts = "i:m:e:nbth";
+    const char* const short_opts = "i:m:e:x:c:S:nbth";
     const option long_opts [] =
     {
             {"input", required_argument, nullptr, 'i'},
@@ -41,6 +47,9 @@ int main(int argc, char* argv[])
             {"enc_param_file", required_argument, nullptr, 'e'},
             {"batched", no_argument, nullptr, 'b'},
             {"no_test_mode", no_argument, nullptr, 't'},
+            {"trace", required_argument, nullptr, 'x'},
+            {"s3_max_connections", required_argument, nullptr, 'c'},
+            {"dataset", required_argument, nullptr, 'S'},
             {"help", no_argument, nullptr, 'h'},
     };
 
@@ -72,6 +81,24 @@ int main(int argc, char* argv[])
             test_mode = false;
             break;
 
+        case 'x':
+            trace_file = optarg;
+            Tracer::Enable(true);
+            break;
+
+        case 'c':
+            utility::SetS3MaxConnections(std::stoi(optarg));
+            break;
+
+        case 'S':
+            dataset = optarg;
+            if (!Dataset_Catalog::IsValidName(dataset))
+            {
+                cout << "Dataset names may only hold letters, digits, '-', '_' and '.'" << endl;
+                exit(1);
+            }
+            break;
+
         case 'h':
         case '?':
         default:
@@ -82,7 +109,11 @@ int main(int argc, char* argv[])
 
     }
 
+    // the S3 connections stay open across all repetitions
+    Aws_API_Guard aws_api;
     Data_Owner data_owner(params_file);
+    data_owner.dataset = dataset;
+    Tracer::SetThreadName("Data Owner");
 
     // create metrics file
     std::ofstream metrics_file = utility::openMetricsFile(input_size, "DO_");
@@ -90,7 +121,7 @@ int main(int argc, char* argv[])
 
     for (int j=0; j< repeat_times; j++)
     {
-        high_resolution_clock::time_point end2end = utility::timer_start();
+        Trace_Span end2end_span("end2end");
         cout << "Preparing " << input_size << " data points" << endl;
 
         // generate random secret numbers
@@ -103,10 +134,15 @@ int main(int argc, char* argv[])
         }
 
 
-        performanceMetrics.end2end = utility::timer_end(end2end).count();
+        performanceMetrics.end2end = end2end_span.End();
 
         metrics_file << performanceMetrics << endl;
 
+        if (!trace_file.empty())
+        {
+            Tracer::WriteRun(trace_file, j);
+        }
+
         // For test mode write the original generated numbers in secret_num_vec to the bucket.
         // This is later used by the destination server for comparison and accuracy calculation.
         if (test_mode)
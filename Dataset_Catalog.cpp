@@ -0,0 +1,91 @@
+#include "Dataset_Catalog.h"
+#include <algorithm>
+#include <climits>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+std::vector<dataset_s> Dataset_Catalog::Load(const std::string& file_name)
+{
+    std::ifstream file(file_name);
+    if (!file.is_open())
+    {
+        throw std::runtime_error("Unable to open dataset catalog " + file_name);
+    }
+
+    std::vector<dataset_s> datasets;
+    std::string line;
+    int line_number = 0;
+
+    while (std::getline(file, line))
+    {
+        line_number++;
+        std::istringstream fields(line);
+        std::string size, mode, option;
+        dataset_s dataset;
+
+        if (!(fields >> dataset.name) || dataset.name[0] == '#')
+        {
+            continue;
+        }
+
+        auto fail = [&](const std::string& reason) {
+            return std::runtime_error(file_name + ":" + std::to_string(line_number) + ": " + reason);
+        };
+
+        if (!IsValidName(dataset.name))
+        {
+            throw fail("invalid dataset name " + dataset.name);
+        }
+
+        if (!(fields >> size >> mode) || (mode != "batched" && mode != "unbatched"))
+        {
+            throw fail("expected <name> <input size|any> <unbatched|batched> [<enc param file>|-] [slot_packing]");
+        }
+
+        if (size != "any")
+        {
+            char* end;
+            long data_points_num = strtol(size.c_str(), &end, 10);
+            if (*end != '\0' || data_points_num <= 0 || data_points_num > INT_MAX)
+            {
+                throw fail("invalid input size " + size);
+            }
+            dataset.data_points_num = data_points_num;
+        }
+        dataset.batched = (mode == "batched");
+
+        if ((fields >> option) && option != "-")
+        {
+            dataset.enc_param_file = option;
+        }
+
+        if (fields >> option)
+        {
+            if (option != "slot_packing")
+            {
+                throw fail("unknown option " + option);
+            }
+            dataset.slot_packing = true;
+        }
+
+        if (std::any_of(datasets.begin(), datasets.end(), [&](const dataset_s& other) { return other.name == dataset.name; }))
+        {
+            throw fail("dataset " + dataset.name + " is listed twice");
+        }
+
+        datasets.push_back(dataset);
+    }
+
+    return datasets;
+}
+
+bool Dataset_Catalog::IsValidName(const std::string& name)
+{
+    if (name.empty() || name.size() > MAX_DATASET_NAME_LENGTH || name == "." || name == "..")
+    {
+        return false;
+    }
+
+    return std::all_of(name.begin(), name.end(), [](char ch) { return isalnum((unsigned char)ch) || ch == '-' || ch == '_' || ch == '.'; });
+}
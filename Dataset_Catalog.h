@@ -0,0 +1,28 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include "Utility.h"
+
+// one dataset in the bucket, its objects are named <name>/<object name>
+struct dataset_s
+{
+    std::string name;
+    int data_points_num = 0; // 0 serves the size each request asks for
+    bool batched = false;
+    bool slot_packing = false;
+    std::string enc_param_file; // empty for the default encryption params
+};
+
+// Dataset_Catalog - the datasets one Aux serves, read from a text file with one dataset per line:
+//   <name> <input size|any> <unbatched|batched> [<enc param file>|-] [slot_packing]
+// Empty lines and lines starting with # are skipped. The name is the prefix of the dataset's objects in the bucket,
+// so it may only hold letters, digits, '-', '_' and '.'
+class Dataset_Catalog
+{
+public:
+    // throws a runtime_error naming the line that can't be parsed
+    static std::vector<dataset_s> Load(const std::string& file_name);
+
+    static bool IsValidName(const std::string& name);
+};
@@ -0,0 +1,212 @@
+#include "DS_Daemon.h"
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sstream>
+
+#define MAX_COMMAND_LENGTH 1024
+
+DS_Daemon::DS_Daemon(Destination_Server& server, string control_socket, string server_ip, bool test_mode, bool read_secret_from_file, bool read_keys_from_file)
+    : _server(server)
+{
+    _control_socket = control_socket;
+    _server_ip = server_ip;
+    _test_mode = test_mode;
+    _read_secret_from_file = read_secret_from_file;
+    _read_keys_from_file = read_keys_from_file;
+    _blocks = server.blocks;
+
+    // the derived keys stay valid until RELOAD_KEYS
+    _server.keep_derived_keys = true;
+}
+
+// read one command line, returns false when the client closed the connection
+static bool ReadLine(int the_socket, string& line)
+{
+    char ch;
+    line.clear();
+
+    while (read(the_socket, &ch, 1) == 1)
+    {
+        if (ch == '\n')
+        {
+            return true;
+        }
+        if ((ch != '\r') && (line.size() < MAX_COMMAND_LENGTH))
+        {
+            line.push_back(ch);
+        }
+    }
+
+    return !line.empty();
+}
+
+static void WriteLine(int the_socket, const string& line)
+{
+    string reply = line + "\n";
+    size_t sent = 0;
+
+    while (sent < reply.size())
+    {
+        ssize_t n = write(the_socket, reply.c_str() + sent, reply.size() - sent);
+        if (n <= 0)
+        {
+            // the client went away, the next accept serves someone else
+            return;
+        }
+        sent += n;
+    }
+}
+
+void DS_Daemon::Run()
+{
+    struct sockaddr_un addr;
+    int server_socket;
+
+    if (_control_socket.size() >= sizeof(addr.sun_path))
+    {
+        std::cout << "Control socket path is too long: " << _control_socket << endl;
+        exit(1);
+    }
+
+    // ignore sigpipe errors as the code will handle socket write errors
+    signal(SIGPIPE, SIG_IGN);
+
+    if ((server_socket = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+    {
+        perror("Control socket creation failed");
+        exit(1);
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, _control_socket.c_str(), sizeof(addr.sun_path) - 1);
+
+    // a socket file left by a previous daemon would fail the bind
+    unlink(_control_socket.c_str());
+
+    // only the owner may start retrievals. The socket file is created by bind, so the umask must already
+    // exclude the other users then, a chmod afterwards would leave it open in between
+    mode_t old_umask = umask(S_IXUSR | S_IRWXG | S_IRWXO);
+    int bind_result = bind(server_socket, (struct sockaddr*)&addr, sizeof(addr));
+    umask(old_umask);
+
+    if (bind_result < 0)
+    {
+        perror("Control socket bind failed");
+        exit(1);
+    }
+
+    if (listen(server_socket, 4) < 0)
+    {
+        perror("Control socket listen failed");
+        exit(1);
+    }
+
+    std::cout << "Destination Server daemon listening on " << _control_socket << endl;
+
+    while (!_shutdown)
+    {
+        int client_socket = accept(server_socket, nullptr, nullptr);
+        if (client_socket < 0)
+        {
+            if (errno != EINTR)
+            {
+                perror("Control socket accept failed");
+            }
+            continue;
+        }
+
+        ServeClient(client_socket);
+        close(client_socket);
+    }
+
+    close(server_socket);
+    unlink(_control_socket.c_str());
+    _server.SaveAllRunsHistograms();
+
+    std::cout << "Destination Server daemon stopped after " << _runs << " retrievals" << endl;
+}
+
+void DS_Daemon::ServeClient(int client_socket)
+{
+    string line;
+
+    while (!_shutdown && ReadLine(client_socket, line))
+    {
+        if (line.empty())
+        {
+            continue;
+        }
+
+        WriteLine(client_socket, HandleCommand(line));
+    }
+}
+
+string DS_Daemon::HandleCommand(const string& line)
+{
+    std::istringstream iss(line);
+    string command;
+    std::ostringstream reply;
+
+    iss >> command;
+
+    try
+    {
+        if (command == "RETRIEVE")
+        {
+            string server_ip = _server_ip;
+            string block_list;
+            iss >> server_ip >> block_list;
+
+            // every retrieval selects its own blocks, the ones given at startup when none are given
+            vector<block_range_s> blocks = _blocks;
+            if (!block_list.empty() && !Transfer_Session::ParseBlocks(block_list, blocks))
+            {
+                return "ERROR invalid block list " + block_list;
+            }
+            _server.blocks = blocks;
+
+            DS_performance_metrics performanceMetrics;
+            if (!_server.Retrieve(_runs, server_ip, _test_mode, _read_secret_from_file, performanceMetrics))
+            {
+                return "ERROR unable to connect to the Aux at " + server_ip;
+            }
+
+            _end2end_hist.Record(performanceMetrics.end2end);
+            const char* check = (performanceMetrics.verified < 0) ? "unchecked" : (performanceMetrics.verified ? "passed" : "failed");
+            reply << "OK " << _runs << " " << performanceMetrics.end2end / 1000 << " " << check;
+            _runs++;
+        }
+        else if (command == "STATS")
+        {
+            reply << "OK " << _runs << " " << _end2end_hist.Percentile(50) / 1000 << " " << _end2end_hist.Percentile(90) / 1000 << " "
+                  << _end2end_hist.Percentile(99) / 1000 << " " << _end2end_hist.Max() / 1000;
+        }
+        else if (command == "RELOAD_KEYS")
+        {
+            _server.ReloadTransferKeys(_read_keys_from_file);
+            reply << "OK";
+        }
+        else if (command == "SHUTDOWN")
+        {
+            _shutdown = true;
+            reply << "OK";
+        }
+        else
+        {
+            reply << "ERROR unknown command " << command;
+        }
+    }
+    catch (const std::exception& e)
+    {
+        reply.str("");
+        reply << "ERROR " << e.what();
+    }
+
+    return reply.str();
+}
@@ -0,0 +1,37 @@
+#pragma once
+#include "Destination_Server.h"
+
+// DS_Daemon - keeps one Destination_Server with its SEAL context, keys and derived transfer keys loaded, and runs
+// retrievals on request from a local control socket (AF_UNIX), so a retrieval doesn't pay the setup time.
+// One command per line, one reply line per command:
+//   RETRIEVE [<aux ip>] [<blocks>]
+//                         run one transfer, of the listed ciphertext blocks (e.g. 0-3,7) or the --blocks ones,
+//                         replies OK <run> <end2end us> <passed|failed|unchecked>
+//   STATS                 replies OK <runs> <end2end p50 us> <p90 us> <p99 us> <max us>
+//   RELOAD_KEYS           load the Data Owner's transfer keys again, after it uploaded new data
+//   SHUTDOWN              stop the daemon
+// Anything that fails is replied as ERROR <reason>. Clients are served one at a time.
+class DS_Daemon
+{
+private:
+    Destination_Server& _server;
+    string _control_socket;
+    string _server_ip;
+    bool _test_mode;
+    bool _read_secret_from_file;
+    bool _read_keys_from_file;
+    vector<block_range_s> _blocks; // the default block selection of a retrieval
+    int _runs = 0;
+    Latency_Histogram _end2end_hist;
+    bool _shutdown = false;
+
+    void ServeClient(int client_socket);
+    string HandleCommand(const string& line);
+
+public:
+    DS_Daemon(Destination_Server& server, string control_socket, string server_ip, bool test_mode, bool read_secret_from_file, bool read_keys_from_file);
+    ~DS_Daemon() {}
+
+    // serve the control socket until a SHUTDOWN command
+    void Run();
+};
@@ -1,20 +1,45 @@
 #pragma once
 
+#include <atomic>
+#include <string>
+#include "../Latency_Histogram.h"
+#include "../Perf_Counters.h"
+
+// the receive thread and the processing workers update the same metrics, so all totals are atomic.
+// Each worker records its histograms and hardware counters into its own metrics, merged once it is done
 class DS_performance_metrics
 {
 public:
-    long long push_to_queue = 0;
-    long long derive_b_t = 0;
-    long long deserialize = 0;
-    long long reconstruct = 0;
-    long long verify = 0;
-    long long square_diff = 0;
-    long long derive_kmacs = 0;
-    long long deserialize_macs = 0;
-    long long wait_for_auxiliary = 0;
-    long long total_receive_and_process = 0;
-    long long receive_from_aux = 0;
-    long long end2end = 0;
+    std::atomic<long long> push_to_queue{0};
+    std::atomic<long long> derive_b_t{0};
+    std::atomic<long long> deserialize{0};
+    std::atomic<long long> reconstruct{0};
+    std::atomic<long long> verify{0};
+    std::atomic<long long> square_diff{0};
+    std::atomic<long long> aggregate_mac{0};
+    std::atomic<long long> derive_kmacs{0};
+    std::atomic<long long> deserialize_macs{0};
+    std::atomic<long long> wait_for_auxiliary{0};
+    std::atomic<long long> total_receive_and_process{0};
+    std::atomic<long long> receive_from_aux{0};
+    std::atomic<long long> end2end{0};
+
+    // per ciphertext latencies, receive is recorded by the receive thread and the others by the processing workers
+    Latency_Histogram receive_hist;
+    Latency_Histogram deserialize_hist;
+    Latency_Histogram reconstruct_hist;
+    Latency_Histogram verify_hist;
+
+    // hardware counters of the processing workers' stages, with --perf_counters
+    perf_sample_s deserialize_perf;
+    perf_sample_s reconstruct_perf;
+    perf_sample_s verify_perf;
+
+    int verified = -1; // output check result in test mode: 1 passed, 0 failed, -1 not checked
+
+    void MergeHistograms(const DS_performance_metrics& other);
+    void MergeWorker(const DS_performance_metrics& worker);
+    void SaveHistograms(const std::string& prefix, int run) const;
 
     static std::string getHeader();
 };
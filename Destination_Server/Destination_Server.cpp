@@ -3,15 +3,21 @@
 #include <aws/core/Aws.h>
 #include <aws/core/utils/logging/LogLevel.h>
 #include <aws/s3/S3Client.h>
-#include <aws/s3/model/PutObjectRequest.h>
 #include <unistd.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <stdlib.h>
+#include <cstring>
 
 
 #define PORT 8080
+#define INPUTS_CHUNK_SIZE (1 << 20) // the secret inputs are parsed this many bytes at a time
+#define MAX_RECONNECTS 5              // reconnections to the Aux within one retrieval
+#define RECONNECT_DELAY_US 500000     // before the first reconnection, doubled for every further one
+
+static const char CHECKPOINT_MAGIC[4] = {'T', 'C', 'K', 'P'};
+static const uint32_t CHECKPOINT_VERSION = 2;
 
 using namespace utility;
 using namespace Aws;
@@ -24,18 +30,73 @@ using namespace Aws;
 
 // performance metrics setup
 std::ostream& operator<<(std::ostream& out, const DS_performance_metrics& dsPerformanceMetrics){
-    return out << dsPerformanceMetrics.wait_for_auxiliary/1000 << "," << dsPerformanceMetrics.receive_from_aux/1000 << "," << dsPerformanceMetrics.push_to_queue/1000
+    out << dsPerformanceMetrics.wait_for_auxiliary/1000 << "," << dsPerformanceMetrics.receive_from_aux/1000 << "," << dsPerformanceMetrics.push_to_queue/1000
     << "," << dsPerformanceMetrics.deserialize/1000 << "," << dsPerformanceMetrics.deserialize_macs/1000 << "," << dsPerformanceMetrics.derive_b_t/1000 << "," << dsPerformanceMetrics.reconstruct/1000
-    << "," << dsPerformanceMetrics.derive_kmacs/1000 << "," << dsPerformanceMetrics.verify/1000 << "," << dsPerformanceMetrics.square_diff/1000
-    << "," << dsPerformanceMetrics.total_receive_and_process/1000<< "," << dsPerformanceMetrics.end2end/1000 ;
+    << "," << dsPerformanceMetrics.derive_kmacs/1000 << "," << dsPerformanceMetrics.verify/1000 << "," << dsPerformanceMetrics.square_diff/1000 << "," << dsPerformanceMetrics.aggregate_mac/1000
+    << "," << dsPerformanceMetrics.total_receive_and_process/1000<< "," << dsPerformanceMetrics.end2end/1000
+    << "," << dsPerformanceMetrics.receive_hist << "," << dsPerformanceMetrics.deserialize_hist
+    << "," << dsPerformanceMetrics.reconstruct_hist << "," << dsPerformanceMetrics.verify_hist;
+
+    if (Perf_Counters::IsEnabled())
+    {
+        long long ct_count = dsPerformanceMetrics.deserialize_hist.Count();
+        out << "," << Perf_Counters::Format(dsPerformanceMetrics.deserialize_perf, ct_count) << "," << Perf_Counters::Format(dsPerformanceMetrics.reconstruct_perf, ct_count)
+            << "," << Perf_Counters::Format(dsPerformanceMetrics.verify_perf, ct_count);
+    }
+
+    return out;
 }
 
 std::string DS_performance_metrics::getHeader(){
-    return "wait for auxiliary,receive from aux, push to queue, deserialize, deserialize macs, derive b t,reconstruct, derive kmacs, verify, square diff, total receive and process, end2end_dest";
+    std::string header = "wait for auxiliary,receive from aux, push to queue, deserialize, deserialize macs, derive b t,reconstruct, derive kmacs, verify, square diff, aggregate mac, total receive and process, end2end_dest," +
+           Latency_Histogram::getHeader("receive ct") + "," + Latency_Histogram::getHeader("deserialize ct") + "," +
+           Latency_Histogram::getHeader("reconstruct ct") + "," + Latency_Histogram::getHeader("verify ct");
+
+    if (Perf_Counters::IsEnabled())
+    {
+        header += "," + Perf_Counters::getHeader("deserialize") + "," + Perf_Counters::getHeader("reconstruct") + "," + Perf_Counters::getHeader("verify");
+    }
+
+    return header;
+}
+
+void DS_performance_metrics::MergeHistograms(const DS_performance_metrics& other)
+{
+    receive_hist.Merge(other.receive_hist);
+    deserialize_hist.Merge(other.deserialize_hist);
+    reconstruct_hist.Merge(other.reconstruct_hist);
+    verify_hist.Merge(other.verify_hist);
+}
+
+// adds the stage totals, histograms and hardware counters a processing worker recorded
+void DS_performance_metrics::MergeWorker(const DS_performance_metrics& worker)
+{
+    derive_b_t += worker.derive_b_t;
+    deserialize += worker.deserialize;
+    reconstruct += worker.reconstruct;
+    verify += worker.verify;
+    square_diff += worker.square_diff;
+    derive_kmacs += worker.derive_kmacs;
+    deserialize_macs += worker.deserialize_macs;
+
+    MergeHistograms(worker);
+
+    deserialize_perf += worker.deserialize_perf;
+    reconstruct_perf += worker.reconstruct_perf;
+    verify_perf += worker.verify_perf;
+}
+
+// binary dumps of one run, or of all runs for a negative run
+void DS_performance_metrics::SaveHistograms(const std::string& prefix, int run) const
+{
+    receive_hist.Save(Latency_Histogram::DumpFileName(prefix, "receive", run));
+    deserialize_hist.Save(Latency_Histogram::DumpFileName(prefix, "deserialize", run));
+    reconstruct_hist.Save(Latency_Histogram::DumpFileName(prefix, "reconstruct", run));
+    verify_hist.Save(Latency_Histogram::DumpFileName(prefix, "verify", run));
 }
 
 // constructor
-Destination_Server::Destination_Server(int data_points_num_input, bool batched, string enc_init_params_file, bool squareDiff)
+Destination_Server::Destination_Server(int data_points_num_input, bool batched, string enc_init_params_file, bool squareDiff, bool deferredRescale, bool slotPacking)
 {
     InitEncParams(&_enc_init_params, enc_init_params_file);
     int num_of_bits_prime = (std::log2(_enc_init_params.prime));
@@ -43,11 +104,15 @@ Destination_Server::Destination_Server(int data_points_num_input, bool batched,
     // as all "a" values are in Zp
     prime_bits_to_bytes = std::ceil(num_of_bits_prime / 8.0);
     square_diff = squareDiff;
+    deferred_rescale = deferredRescale;
+    slot_packing = slotPacking;
     data_points_num = data_points_num_input;
-    _batched_size = (batched) ? ceil((double)data_points_num / _enc_init_params.max_ct_entries) : 0;
+    // the scheme of the first request, every transfer continues with the scheme the Aux serves the dataset with
+    _mac_scheme = MAC_Scheme::Create(batched);
     string DS_file_name = "DS_";
     DS_file_name += std::to_string(_enc_init_params.polyDegree);
     DS_file_name += "_";
+    _histogram_prefix = DS_file_name + std::to_string(data_points_num);
     metrics_file = utility::openMetricsFile(data_points_num, DS_file_name);
     metrics_file << DS_performance_metrics::getHeader() << endl;
 }
@@ -55,7 +120,11 @@ Destination_Server::Destination_Server(int data_points_num_input, bool batched,
 // reads the original secret numbers for validation purposes in test mode
 bool Destination_Server::ReadSecret(bool read_secret_from_file)
 {
-    SDKOptions options;
+    // the fields are parsed straight into the vector, chunk by chunk
+    int field_width = _enc_init_params.float_precision_for_test;
+    std::size_t inputs_size = (std::size_t)data_points_num * field_width;
+    _secret_vec.assign(data_points_num, 0);
+    Fixed_Width_Reader inputs_reader(field_width, _secret_vec);
 
     // can read the input from a file named "inputs" or from the bucket as saved by the data owner
     if (read_secret_from_file)
@@ -64,80 +133,91 @@ bool Destination_Server::ReadSecret(bool read_secret_from_file)
         std::fstream inputs_file("inputs", std::ios::in | std::ios::binary);
         if (inputs_file.is_open())
         {
-            for (int i=0; i<data_points_num; i++){
-                std::string str1;
-                char str2[_enc_init_params.float_precision_for_test+1];
-                inputs_file.read(str2, _enc_init_params.float_precision_for_test);
-                str2[_enc_init_params.float_precision_for_test] = '\0';
-                _secret_vec.push_back(std::atof(str2));
+            vector<char> chunk(std::min(inputs_size, (std::size_t)INPUTS_CHUNK_SIZE));
+            while (inputs_reader.Count() < (std::size_t)data_points_num)
+            {
+                inputs_file.read(chunk.data(), chunk.size());
+                if (inputs_file.gcount() <= 0)
+                {
+                    break;
+                }
+                inputs_reader.Consume(chunk.data(), inputs_file.gcount());
             }
         }
         else throw std::runtime_error("Unable to open file 'inputs'");
     }
     else
     {
-        cout << "reading secret values from s3 bucket" << endl;
-        InitAPI(options);
-        {
-            S3Utility s3_utility(awsparams::region);
-            char* buf = new char[data_points_num*_enc_init_params.float_precision_for_test];
-            if (buf == NULL){
-                std::cerr << "Error: Cannot allocate buffer" << endl;
-                return false;
+        cout << "reading secret values from " << (_storage ? "local storage" : "s3 bucket") << endl;
+        utility::WithStorage(_storage, awsparams::region, [&](Data_Storage& s3_utility) {
+            if (!s3_utility.load_chunks_from_bucket(utility::DatasetObjectName(dataset, "inputs"), awsparams::bucket_name, inputs_size,
+                                                    [&](const char* data, std::size_t size) { inputs_reader.Consume(data, size); })) {
+                throw std::runtime_error("Unable to get file 'inputs' from storage");
             }
+        });
+    }
 
-            if (s3_utility.load_from_bucket("inputs", awsparams::bucket_name, data_points_num*_enc_init_params.float_precision_for_test, buf)){
-                for (int i=0; i<data_points_num; i++){
-                    std::string str1;
-                    char str2[_enc_init_params.float_precision_for_test+1];
-                    str1.append(buf + i*_enc_init_params.float_precision_for_test, _enc_init_params.float_precision_for_test );
-                    //cout << "Input is "  << str1 << endl;
-                    _secret_vec.push_back(std::atof(str1.c_str())); //inserting to vector as double
-                }
-                delete buf;
-            }
-            else {
-                delete buf;
-                throw std::runtime_error("Unable to get file 'inputs' from S3");
-            }
-        }
-        ShutdownAPI(options);
+    if (inputs_reader.Count() < (std::size_t)data_points_num)
+    {
+        throw std::runtime_error("'inputs' holds " + std::to_string(inputs_reader.Count()) + " values, expected " + std::to_string(data_points_num));
     }
 
     return true;
 }
 
-// upload secret keys to AWS bucket
-bool uploadKeyToBucket(Aws::S3::Model::PutObjectRequest request, Aws::S3::S3Client s3_client, std::string key_str)
+// load the secret share and MAC base keys saved by the Data Owner
+void Destination_Server::LoadTransferKeys(Data_Storage& storage)
 {
-        std::shared_ptr <Aws::IOStream> input_data =
-                Aws::MakeShared<Aws::StringStream>("SampleAllocationTag", key_str,
-                                                   std::ios_base::in | std::ios_base::binary);
+    if (!storage.load_from_bucket(utility::DatasetObjectName(dataset, constants::SECRET_SHARE_KEY_FILENAME), awsparams::bucket_name, KEY_SIZE_BYTES, _DS_key_ch)) {
+        throw std::runtime_error("Unable to get DS key from bucket");
+    }
 
-        request.SetBody(input_data);
-        cout << "Uploading Public Key" << endl;
-        Aws::S3::Model::PutObjectOutcome outcome =
-                s3_client.PutObject(request);
+    if (!storage.load_from_bucket(utility::DatasetObjectName(dataset, constants::TAG_SQ_KEY_FILENAME), awsparams::bucket_name, KEY_SIZE_BYTES, _SQ_key_ch)) {
+        throw std::runtime_error("Unable to get sq key from bucket");
+    }
+}
+
+// the same keys, as saved locally by the Data Owner
+void Destination_Server::LoadTransferKeysFromFile()
+{
+    // Get the base value for derivation of b and t from the file
+    std::fstream ds_key_file("key_DS.txt", std::ios::in | std::ios::binary);
+    if (ds_key_file.is_open()){
+        ds_key_file.read(_DS_key_ch, KEY_SIZE_BYTES);
+    }
+    else{
+        throw std::runtime_error("Unable to open file 'key_DS.txt'");
+    }
 
-        if (outcome.IsSuccess()) {
+    std::fstream sq_key_file("key_sq.txt", std::ios::in | std::ios::binary);
+    if (sq_key_file.is_open()){
+        sq_key_file.read(_SQ_key_ch, KEY_SIZE_BYTES);
+    }
+    else{
+        throw std::runtime_error("Unable to open file 'key_sq.txt'");
+    }
+}
 
-            std::cout << "Added key to bucket '"
-                      << awsparams::bucket_name << "'." << endl;
-            //return true;
-        } else {
-            std::cout << "Error: PutObject: " <<
-                      outcome.GetError().GetMessage() << std::endl;
+// load the Data Owner's transfer keys again, after it uploaded new data, without touching the encryption keys
+void Destination_Server::ReloadTransferKeys(bool read_keys_from_file)
+{
+    if (read_keys_from_file)
+    {
+        LoadTransferKeysFromFile();
+    }
+    else
+    {
+        utility::WithStorage(_storage, awsparams::region, [this](Data_Storage& storage) { LoadTransferKeys(storage); });
+    }
 
-            return false;
-        }
+    hmac_sq = CryptoPP::HMAC<CryptoPP::SHA256>((const unsigned char*)_SQ_key_ch, KEY_SIZE_BYTES);
 
-        return true;
+    _derived_keys_ready = false;
 }
 
 // read or generate homomorphic encryption keys and base key for secret share reconstruction
 bool Destination_Server::GetEncryptionParams(bool read_keys_from_file, bool read_keys_from_s3)
 {
-    SDKOptions options;
     Servers_Protocol srvProtocol;
     EncryptionParameters parms;
     seal::PublicKey pk_fhe;
@@ -149,33 +229,33 @@ bool Destination_Server::GetEncryptionParams(bool read_keys_from_file, bool read
     string sk_object_name = string("sk-fhe-") + std::to_string(_enc_init_params.polyDegree);
     string parms_object_name  = string("seal-params-") + std::to_string(_enc_init_params.polyDegree);
 
-    if(read_keys_from_file)
-    {
-        // Get the base value for derivation of b and t from the file
-        std::fstream ds_key_file("key_DS.txt", std::ios::in | std::ios::binary);
-        if (ds_key_file.is_open()){
-            ds_key_file.read(_DS_key_ch, KEY_SIZE_BYTES);
-        }
-        else{
-            throw std::runtime_error("Unable to open file 'key_DS.txt'");
-        }
+    // the bucket objects of the keys belong to the dataset, so every dataset can have its own encryption params
+    string pk_bucket_object_name = utility::DatasetObjectName(dataset, pk_object_name);
+    string sk_bucket_object_name = utility::DatasetObjectName(dataset, sk_object_name);
+    string parms_bucket_object_name = utility::DatasetObjectName(dataset, parms_object_name);
 
-        std::fstream sq_key_file("key_sq.txt", std::ios::in | std::ios::binary);
-        if (sq_key_file.is_open()){
-            sq_key_file.read(_SQ_key_ch, KEY_SIZE_BYTES);
-        }
-        else{
-            throw std::runtime_error("Unable to open file 'key_sq.txt'");
-        }
+    // a valid snapshot replaces loading or generating the encryption keys, the transfer keys are still loaded
+    bool from_snapshot = false;
+    if (!key_snapshot_file.empty())
+    {
+        _seal = Key_Snapshot::Load(key_snapshot_file, _enc_init_params);
+        from_snapshot = (_seal != nullptr);
+    }
 
-        std::fstream sr_key_file("key_sr.txt", std::ios::in | std::ios::binary);
-        if (sr_key_file.is_open()){
-            sr_key_file.read(_SR_key_ch, KEY_SIZE_BYTES);
+    if (from_snapshot)
+    {
+        if (read_keys_from_file)
+        {
+            LoadTransferKeysFromFile();
         }
-        else{
-            throw std::runtime_error("Unable to open file 'key_sr.txt'");
+        else
+        {
+            utility::WithStorage(_storage, awsparams::region, [this](Data_Storage& storage) { LoadTransferKeys(storage); });
         }
-
+    }
+    else if(read_keys_from_file)
+    {
+        LoadTransferKeysFromFile();
 
         std::fstream file_parms_fhe2(parms_object_name, std::ios::in | std::ios::binary);
         if (file_parms_fhe2.is_open())
@@ -185,7 +265,7 @@ bool Destination_Server::GetEncryptionParams(bool read_keys_from_file, bool read
         }
         else throw std::runtime_error("Unable to open file seal-params");
 
-        _seal = srvProtocol.gen_seal_params(parms.poly_modulus_degree(), parms.coeff_modulus(), _enc_init_params.scale);
+        _seal = srvProtocol.gen_seal_context(parms.poly_modulus_degree(), parms.coeff_modulus(), _enc_init_params.scale);
         cout << " generated seal params" << endl;
 
         //loading sk
@@ -197,7 +277,7 @@ bool Destination_Server::GetEncryptionParams(bool read_keys_from_file, bool read
         }
         else throw std::runtime_error("Unable to open file sk-fhe");
 
-        _seal->decryptor_ptr = make_shared<Decryptor>(_seal->context_ptr, sk_fhe);
+        srvProtocol.set_secret_key(_seal, sk_fhe);
 
         //loading pk
         std::fstream file_pk_fhe2(pk_object_name, std::ios::in | std::ios::binary);
@@ -208,108 +288,144 @@ bool Destination_Server::GetEncryptionParams(bool read_keys_from_file, bool read
         }
         else throw std::runtime_error("Unable to open file pk-fhe");
 
-        _seal->encryptor_ptr = make_shared<Encryptor>(_seal->context_ptr, pk_fhe);
+        srvProtocol.set_public_key(_seal, pk_fhe);
+    }
+    else if (_storage)
+    {
+        // all parties run in one process: the keys stay in memory and are handed to the Aux directly
+        LoadTransferKeys(*_storage);
+        _seal = srvProtocol.gen_seal_params(polyDegree, bit_sizes, _enc_init_params.scale);
     }
     else
     {
-        InitAPI(options);
-        {
-            S3Utility s3_utility(awsparams::region);
-            Aws::Client::ClientConfiguration config;
-            config.region = awsparams::region;
-            Aws::S3::S3Client s3_client(config);
+        Aws_API_Guard aws_api;
+        S3Utility s3_utility(awsparams::region);
 
+        // Get the base value for derivation of b and t from the bucket
+        LoadTransferKeys(s3_utility);
 
-            // Get the base value for derivation of b and t from the bucket
-            if (!s3_utility.load_from_bucket("key_DS.txt", awsparams::bucket_name, KEY_SIZE_BYTES, _DS_key_ch)) {
-                throw std::runtime_error("Unable to get DS key from bucket");
-            }
-
-            if (!s3_utility.load_from_bucket("key_sq.txt", awsparams::bucket_name, KEY_SIZE_BYTES, _SQ_key_ch)) {
-                throw std::runtime_error("Unable to get sq key from bucket");
-            }
-             if (!s3_utility.load_from_bucket("key_sr.txt", awsparams::bucket_name, KEY_SIZE_BYTES, _SR_key_ch)) {
-                throw std::runtime_error("Unable to get sr key from bucket");
+        // generate new security keys
+        if (gen_new_keys)
+        {
+            _seal = srvProtocol.gen_seal_params(polyDegree,
+                                               bit_sizes, _enc_init_params.scale); //initialize SEAL parameters - derived from parent class
+
+            // Save Public Key
+            std::stringstream pk_str;
+            _seal->pk_ptr->save(pk_str);
+            s3_utility.save_to_bucket(pk_bucket_object_name, awsparams::bucket_name, pk_str.str());
+
+            // Save Secret Key
+            std::stringstream sk_str;
+            _seal->sk_ptr->save(sk_str);
+            s3_utility.save_to_bucket(sk_bucket_object_name, awsparams::bucket_name, sk_str.str());
+
+            // Save Encryption Parameters
+            parms = _seal->context_ptr.key_context_data()->parms();
+            std::stringstream parms_str;
+            parms.save(parms_str);
+            s3_utility.save_to_bucket(parms_bucket_object_name, awsparams::bucket_name, parms_str.str());
+        }
+        else if (read_keys_from_s3)
+        {
+            if (!utility::GetEncryptionParamsFromBucket(parms_bucket_object_name, awsparams::bucket_name,
+                                                        awsparams::region, parms)) {
+                std::cerr << "Failed to get Encryption Params";
+                return false;
             }
-
-            // generate new security keys
-            if (gen_new_keys)
-            {
-                _seal = srvProtocol.gen_seal_params(polyDegree,
-                                                   bit_sizes, _enc_init_params.scale); //initialize SEAL parameters - derived from parent class
-                Aws::S3::Model::PutObjectRequest request;
-                request.SetBucket(awsparams::bucket_name);
-
-                // Save Public Key
-                request.SetKey(pk_object_name);
-                std::stringstream pk_str;
-                _seal->pk_ptr->save(pk_str);
-                uploadKeyToBucket(request, s3_client, pk_str.str());
-
-                // Save Secret Key
-                request.SetKey(sk_object_name);
-                std::stringstream sk_str;
-                _seal->sk_ptr->save(sk_str);
-                uploadKeyToBucket(request, s3_client, sk_str.str());
-
-                // Save Encryption Parameters
-                parms = _seal->context_ptr.key_context_data()->parms();
-                request.SetKey(parms_object_name);
-                std::stringstream parms_str;
-                parms.save(parms_str);
-                uploadKeyToBucket(request, s3_client, parms_str.str());
+            _seal = srvProtocol.gen_seal_context(parms.poly_modulus_degree(), parms.coeff_modulus(), _enc_init_params.scale);
+            cout << " generated seal params" << endl;
+            if (!utility::GetPublicKeyFromBucket(pk_bucket_object_name, awsparams::bucket_name, awsparams::region,
+                                                 _seal->context_ptr, pk_fhe)) {
+                std::cerr << "Failed to get public key";
+                return false;
             }
-            else if (read_keys_from_s3)
-            {
-                if (!utility::GetEncryptionParamsFromBucket(parms_object_name, awsparams::bucket_name,
-                                                            awsparams::region, parms)) {
-                    std::cerr << "Failed to get Encryption Params";
-                    return false;
-                }
-                _seal = srvProtocol.gen_seal_params(parms.poly_modulus_degree(), parms.coeff_modulus(), _enc_init_params.scale);
-                cout << " generated seal params" << endl;
-                if (!utility::GetPublicKeyFromBucket(pk_object_name, awsparams::bucket_name, awsparams::region,
-                                                     _seal->context_ptr, pk_fhe)) {
-                    std::cerr << "Failed to get public key";
-                    return false;
-                }
-                _seal->encryptor_ptr = make_shared<Encryptor>(_seal->context_ptr, pk_fhe);
+            srvProtocol.set_public_key(_seal, pk_fhe);
 
-                if (!utility::GetSecretKeyFromBucket(sk_object_name, awsparams::bucket_name, awsparams::region,
-                                                     _seal->context_ptr, sk_fhe)) {
-                    std::cerr << "Failed to get secret key";
-                    return false;
-                }
-                _seal->decryptor_ptr = make_shared<Decryptor>(_seal->context_ptr, sk_fhe);
+            if (!utility::GetSecretKeyFromBucket(sk_bucket_object_name, awsparams::bucket_name, awsparams::region,
+                                                 _seal->context_ptr, sk_fhe)) {
+                std::cerr << "Failed to get secret key";
+                return false;
             }
+            srvProtocol.set_secret_key(_seal, sk_fhe);
         }
-        ShutdownAPI(options);
+    }
+
+    if (!from_snapshot && !key_snapshot_file.empty())
+    {
+        // a failed save only costs the next start the full key load
+        Key_Snapshot::Save(key_snapshot_file, *_seal, _enc_init_params);
     }
 
     // generate hmac for secret share and mac
     //hmac = CryptoPP::HMAC<CryptoPP::SHA256>((const unsigned char*)_DS_key, KEY_SIZE_BYTES);
 
-    if (_batched_size == 0)
+    // both MAC schemes derive their keys from the sq key, the sr key the Data Owner saves for the batched tags is the same key
+    hmac_sq = CryptoPP::HMAC<CryptoPP::SHA256>((const unsigned char*)_SQ_key_ch, KEY_SIZE_BYTES);
+
+    CreateGaloisKeys();
+
+    return true;
+}
+
+// the number of ciphertexts the Aux sends for the set at ct_index
+int Destination_Server::ExpectedCtCount(int ct_index)
+{
+    int ct_num_of_data_points = ct_data_points(ct_index, data_points_num, _enc_init_params.max_ct_entries);
+    bool packed = is_slot_packed(slot_packing, ct_num_of_data_points, _enc_init_params.max_ct_entries);
+
+    // in batched mac, only the first sets of ciphertexts include the mac details
+    bool has_tags = ct_index < _mac_scheme->MacCtNum(data_points_num, _enc_init_params.max_ct_entries);
+
+    return _mac_scheme->SetCtCount(has_tags, packed);
+}
+
+// Only the last (or only) ciphertext can use at most half of the slots, so a single rotation step is needed for packing.
+// The rotation by n moves the second half of a packed ciphertext to the first n slots.
+// The MAC diff aggregation sums the slots with power of two rotations.
+void Destination_Server::CreateGaloisKeys()
+{
+    int num_of_ct = (data_points_num + _enc_init_params.max_ct_entries - 1) / _enc_init_params.max_ct_entries;
+    int last_ct_num_of_data_points = ct_data_points(num_of_ct - 1, data_points_num, _enc_init_params.max_ct_entries);
+    vector<int> steps;
+
+    if (is_slot_packed(slot_packing, last_ct_num_of_data_points, _enc_init_params.max_ct_entries))
     {
-        hmac_sq = CryptoPP::HMAC<CryptoPP::SHA256>((const unsigned char*)_SQ_key_ch, KEY_SIZE_BYTES);
-        hmac_sr = CryptoPP::HMAC<CryptoPP::SHA256>((const unsigned char*)_SR_key_ch, KEY_SIZE_BYTES);
+        steps.push_back(last_ct_num_of_data_points);
     }
-    return true;
+
+    if (aggregate_mac)
+    {
+        for (int step : MAC::aggregateRotationSteps(_seal->encoder_ptr->slot_count()))
+        {
+            if (std::find(steps.begin(), steps.end(), step) == steps.end())
+            {
+                steps.push_back(step);
+            }
+        }
+    }
+
+    if (steps.empty())
+    {
+        return;
+    }
+
+    _seal->galois_ptr = make_shared<GaloisKeys>();
+    _seal->keygen_ptr->create_galois_keys(steps, *_seal->galois_ptr);
 }
 
 // run secret share reconstruction and MAC verification
-void Destination_Server::VerifyAndReconstruct(vector<std::string> str_vec, DS_performance_metrics *performanceMetrics)
+// all temporaries are allocated from the worker's memory pool, the received ciphertexts are never copied.
+// The keys are read from the ciphertext's own windows and the outputs go to its set's slots, so the ciphertexts
+// can be processed in any order by any worker. In batched mode the y term is added to the worker's accumulator
+void Destination_Server::VerifyAndReconstruct(const vector<std::string>& str_vec, MemoryPoolHandle pool, Ciphertext& batched_y_acc, DS_performance_metrics *performanceMetrics)
 {
     Secret_Sharing secret_sharing(_enc_init_params);
     MAC mac(_enc_init_params);
-    Key_Generator kmac_sq(_enc_init_params.prime);
-
-    Batched_Key_Generator kmac_batched(_enc_init_params.prime);
     int total_if_ct_full, total_before_curr_ct, ct_num_of_data_points;
-    int ct_index = std::stoi(str_vec[CT_IDX]);
-    key_mac kmac_sq_vec, kmac_sr_vec;
-    Ciphertext ct_int, ct_frac, ct_int_const, ct_frac_const, ct_t_r, ct_zqmskd, ct_alpha_int, ct_beta_int;//, ct_t_sr, ct_zqmskd_sr;
-    vector<double> kmac_sq_a_int_vec, kmac_sq_a_frac_vec, kmac_sq_b_vec, kmac_sq_c_vec, kmac_sq_d_vec;
+    int set_index = std::stoi(str_vec[CT_IDX]);
+    int ct_index = _selected_ct[set_index];
+    Ciphertext ct_int(pool), ct_frac(pool);
 
     vector<double> cleartext_vec;
     vector<double> cleartext_for_cipher_vec;
@@ -328,16 +444,21 @@ void Destination_Server::VerifyAndReconstruct(vector<std::string> str_vec, DS_pe
     // this will be the current CT amount of datapoints
     ct_num_of_data_points = (total_if_ct_full > data_points_num) ? data_points_num - total_before_curr_ct : _enc_init_params.max_ct_entries;
 
+    bool packed = is_slot_packed(slot_packing, ct_num_of_data_points, _enc_init_params.max_ct_entries);
+
+    // every data point takes prime_bits_to_bytes bytes for t and one byte for b
+    Key_Window share_window(_secret_share_keys, total_before_curr_ct * (prime_bits_to_bytes + 1));
+
     for (int i = 0; i < ct_num_of_data_points; i++)
     {
         // calculate the location of the current ciphertext index inside the full datapoint list
         int index_base = ct_index * _enc_init_params.max_ct_entries + i;
 
-        high_resolution_clock::time_point start_derive = utility::timer_start();
-        sharePT_struct shared_struct = secret_sharing.Derive_b_t(&_secret_share_keys, prime_bits_to_bytes);
-        performanceMetrics->derive_b_t += utility::timer_end(start_derive).count();
+        Trace_Span derive_span(nullptr, &performanceMetrics->derive_b_t);
+        sharePT_struct shared_struct = secret_sharing.Derive_b_t(share_window, prime_bits_to_bytes);
+        derive_span.End();
 
-        high_resolution_clock::time_point start_prepare_vector = utility::timer_start();
+        Trace_Span prepare_vector_span(nullptr, &performanceMetrics->reconstruct);
         // this is: (-1)^b * (-b)
         // note that the outcome of this calculation will be the same as the value of b
         double cleartext_pt1  = shared_struct.b;
@@ -349,320 +470,861 @@ void Destination_Server::VerifyAndReconstruct(vector<std::string> str_vec, DS_pe
         double minus_one_to_the_b = (shared_struct.b == 1) ? -1 : 1;
         cleartext_for_cipher_vec.push_back(_enc_init_params.prime * minus_one_to_the_b);
 
-        performanceMetrics->reconstruct += utility::timer_end(start_prepare_vector).count();
+        prepare_vector_span.End();
 
     }
 
-    int index_base = ct_index * _enc_init_params.max_ct_entries;
+    // de-serialize and reconstruct the secret share values
+    Trace_Span deserialize_span("deserialize", &performanceMetrics->deserialize);
+    Perf_Span deserialize_perf_span(&performanceMetrics->deserialize_perf);
 
-    high_resolution_clock::time_point start_derive_kmac = utility::timer_start();
-    if (_batched_size == 0)
+    if (packed)
     {
-        kmac_sq = mac.Derive_compact_kmac_unbatched_single(hmac_sq, index_base, ct_num_of_data_points);
+        // [x_int | x_frac]: x_int already sits in the first slots, one rotation brings x_frac there.
+        // The rotated x_frac carries x_int into its last slots, the zero padded plaintexts Rec_CT and the MAC
+        // multiply by clear them, so the packed outputs hold zeros after the data points like the others
+        utility::deserialize_fhe(str_vec[PACKED_X_IDX].c_str(), std::stol(str_vec[PACKED_X_SIZE]), ct_int, _seal->context_ptr);
+        _seal->evaluator_ptr->rotate_vector(ct_int, ct_num_of_data_points, *_seal->galois_ptr, ct_frac, pool);
     }
     else
     {
-        // for batched mac, derive the "a" values for x_int and x_frac
-        kmac_batched.derive_a(&_kmac_keys, index_base, ct_num_of_data_points, prime_bits_to_bytes);
+        utility::deserialize_fhe(str_vec[X_INT_IDX].c_str(), std::stol(str_vec[X_INT_SIZE]), ct_int, _seal->context_ptr);
+        utility::deserialize_fhe(str_vec[X_FRAC_IDX].c_str(), std::stol(str_vec[X_FRAC_SIZE]), ct_frac, _seal->context_ptr);
     }
 
-    performanceMetrics->derive_kmacs += utility::timer_end(start_derive_kmac).count();
+    deserialize_perf_span.End();
+    performanceMetrics->deserialize_hist.Record(deserialize_span.End());
+
+    // Rec_CT and the MAC verification read ct_int and ct_frac without modifying them, so no static copies are needed
+    Trace_Span reconstruct_span("reconstruct", &performanceMetrics->reconstruct);
+    Perf_Span reconstruct_perf_span(&performanceMetrics->reconstruct_perf);
+    Ciphertext x_final_CT(pool);
+    secret_sharing.Rec_CT(cleartext_vec, cleartext_for_cipher_vec, ct_int, ct_frac, x_final_CT, _seal, pool, deferred_rescale);
+    reconstruct_perf_span.End();
+    performanceMetrics->reconstruct_hist.Record(reconstruct_span.End());
+
+    reconstructed_FHE_CT[set_index] = std::move(x_final_CT);
+
+    // the tags are checked against the same ciphertexts, the keys of the MAC are derived by the scheme
+    mac_verify_set_s set;
+    set.str_vec = &str_vec;
+    set.set_index = set_index;
+    set.ct_index = ct_index;
+    set.ct_num_of_data_points = ct_num_of_data_points;
+    set.packed = packed;
+    set.ct_int = &ct_int;
+    set.ct_frac = &ct_frac;
+    set.y_acc = &batched_y_acc;
+    _mac_scheme->VerifySet(MacTransfer(), mac, set, pool, performanceMetrics);
+}
 
-    // de-serialize and reconstruct the secret share values
-    high_resolution_clock::time_point start_deserialize = utility::timer_start();
 
-    utility::deserialize_fhe(str_vec[X_INT_IDX].c_str(), std::stol(str_vec[X_INT_SIZE]), ct_int, _seal->context_ptr);
-    utility::deserialize_fhe(str_vec[X_FRAC_IDX].c_str(), std::stol(str_vec[X_FRAC_SIZE]), ct_frac, _seal->context_ptr);
+// the thread function of a processing worker, takes cipher text vectors from the queue until all have been taken
+void Destination_Server::ProcessCt(DS_performance_metrics* performanceMetrics, Ciphertext* batched_y_acc)
+{
+    // a private pool per worker keeps the ciphertext temporaries off the global pool's lock
+    MemoryPoolHandle pool = MemoryPoolHandle::New();
+    Tracer::SetThreadName("DS process");
 
-    performanceMetrics->deserialize += utility::timer_end(start_deserialize).count();
+    while (true)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
 
-    ct_int_const = ct_int; //static copy since x_int is to be edited during reconstruct
-    ct_frac_const = ct_frac; //static copy since x_frac is to be edited during reconstruct
+        if (this->total_num_of_unprocessed_ct == 0)
+        {
+            break;
+        }
 
-    high_resolution_clock::time_point start_actual_reconstruct = utility::timer_start();
-    const Ciphertext x_final_CT = secret_sharing.Rec_CT(cleartext_vec, cleartext_for_cipher_vec, ct_int, ct_frac, _seal);
-    nanoseconds reconstruct_time = utility::timer_end(start_actual_reconstruct);
-    performanceMetrics->reconstruct += reconstruct_time.count();
+        // another worker may have taken the last queued vector
+        if (this->_ct_queue.empty())
+        {
+            lock.unlock();
+            usleep(50);
+            continue;
+        }
 
-    reconstructed_FHE_CT.push_back(x_final_CT);
+        vector<string> ct_vec = std::move(_ct_queue.front());
+        _ct_queue.pop();
+        //cout << "Remaining unprocessed: " << total_num_of_unprocessed_ct << endl;
+        this->total_num_of_unprocessed_ct--;
+        lock.unlock();
 
-    if (_batched_size == 0) //unbatched mac verification
-    {
-        mac_tag_ct macTagCT_sr, macTagCT_sq;
+        // a resumed session is sent again from the first set not verified in order, sets after it may already be done
+        int set_index = std::stoi(ct_vec[CT_IDX]);
+        if (_ct_verified[set_index])
+        {
+            continue;
+        }
 
-        high_resolution_clock::time_point start_deserialize_mac = utility::timer_start();
-        utility::deserialize_fhe(str_vec[SQ_TR_IDX].c_str(), std::stol(str_vec[SQ_TR_SIZE]), ct_t_r, _seal->context_ptr);
-        utility::deserialize_fhe(str_vec[SQ_ZQMSKD_IDX].c_str(), std::stol(str_vec[SQ_ZQMSKD_SIZE]), ct_zqmskd, _seal->context_ptr);
-        performanceMetrics->deserialize_macs += utility::timer_end(start_deserialize_mac).count();
+        VerifyAndReconstruct(ct_vec, pool, *batched_y_acc, performanceMetrics);
+        MarkVerified(set_index);
+    }
 
-        macTagCT_sq.t_r_ct = make_shared<Ciphertext>(ct_t_r);
-        macTagCT_sq.z_qmskd_ct = make_shared<Ciphertext>(ct_zqmskd);
+}
 
-        const Ciphertext diff_SQ_CT = mac.compact_unbatched_VerifyHE(_seal, kmac_sq, ct_int_const, ct_frac_const, macTagCT_sq, square_diff, ct_num_of_data_points, performanceMetrics);
+// derive the secret share keys, and the mac keys in batched mode, for one transfer
+void Destination_Server::DeriveTransferKeys(DS_performance_metrics *performanceMetrics)
+{
+    SelectBlocks();
 
-        diff_SQ_FHE_CT.push_back(diff_SQ_CT);
-    }
-    else // batched mac
+    // the keys only change when the transfer keys are reloaded, and are read through per ciphertext windows,
+    // so a long running server reuses them as they are for the same blocks
+    if (keep_derived_keys && _derived_keys_ready && (_derived_ct == _selected_ct))
     {
-        Ciphertext ax_ct = mac.verifyHE_batched_y(_seal, kmac_batched, ct_int_const, ct_frac_const, performanceMetrics);
-        // this is adds a_int*x_int + a_frac*x_frac values calculated earlier to all the same values from the previous ciphertexts
-        high_resolution_clock::time_point start_verify = utility::timer_start();
-        _seal->evaluator_ptr->mod_switch_to_inplace(batched_y_ct, ax_ct.parms_id());
-        _seal->evaluator_ptr->add_inplace(batched_y_ct, ax_ct);
-        performanceMetrics->verify += utility::timer_end(start_verify).count();
+        return;
+    }
 
-        // if the queue also contains the y_tag data, extract that too
-        if (str_vec.size() - 1 > X_FRAC_IDX)
+    int bytes_for_secret_share = data_points_num * (prime_bits_to_bytes + 1);
+    _secret_share_keys = SHARE_MAC_KEYS(bytes_for_secret_share);
+
+    // initialize secret share keys using hkdf
+    Trace_Span derive_span("derive_b_t", &performanceMetrics->derive_b_t);
+    if (blocks.empty())
+    {
+        _secret_share_keys.gen_keys((byte*)_DS_key_ch, KEY_SIZE_BYTES, constants::SECRET_SHARE_DERIVE_KEY);
+    }
+    else
+    {
+        // only the key windows of the selected blocks, consecutive blocks are derived as one range
+        int block_key_bytes = _enc_init_params.max_ct_entries * (prime_bits_to_bytes + 1);
+        size_t run_start = 0;
+        while (run_start < _selected_ct.size())
         {
-            int bcd_key_index = data_points_num * 2 * prime_bits_to_bytes;
-            high_resolution_clock::time_point start_derive_kmac = utility::timer_start();
-            kmac_batched.derive_bcd(&_kmac_keys, ct_num_of_data_points, prime_bits_to_bytes, bcd_key_index);
-            performanceMetrics->derive_kmacs += utility::timer_end(start_derive_kmac).count();
+            size_t run_end = run_start + 1;
+            while ((run_end < _selected_ct.size()) && (_selected_ct[run_end] == _selected_ct[run_end - 1] + 1))
+            {
+                run_end++;
+            }
 
-            high_resolution_clock::time_point start_deserialize_mac = utility::timer_start();
-            utility::deserialize_fhe(str_vec[BATCHED_TR_IDX].c_str(), std::stol(str_vec[BATCHED_TR_SIZE]), ct_t_r, _seal->context_ptr);
-            utility::deserialize_fhe(str_vec[BATCHED_ALPHA_INT_IDX].c_str(), std::stol(str_vec[BATCHED_ALPHA_INT_SIZE]), ct_alpha_int, _seal->context_ptr);
-            utility::deserialize_fhe(str_vec[BATCHED_BETA_INT_IDX].c_str(), std::stol(str_vec[BATCHED_BETA_INT_SIZE]), ct_beta_int, _seal->context_ptr);
-            performanceMetrics->deserialize_macs += utility::timer_end(start_deserialize_mac).count();
+            int offset = _selected_ct[run_start] * block_key_bytes;
+            int size = std::min((_selected_ct[run_end - 1] + 1) * block_key_bytes, bytes_for_secret_share) - offset;
+            _secret_share_keys.gen_keys_range((byte*)_DS_key_ch, KEY_SIZE_BYTES, constants::SECRET_SHARE_DERIVE_KEY, offset, size);
 
-            batched_y_tag_ct = mac.verifyHE_batched_y_tag(_seal, ct_num_of_data_points, kmac_batched, ct_t_r, ct_alpha_int, ct_beta_int, performanceMetrics);
+            run_start = run_end;
         }
-
     }
+    derive_span.End();
+
+    DeriveMacKeys(performanceMetrics);
+
+    _derived_ct = _selected_ct;
+    _derived_keys_ready = true;
+}
+
+// the MAC keys of the transfer's scheme that don't depend on the set, derived again when the Aux serves another scheme
+void Destination_Server::DeriveMacKeys(DS_performance_metrics *performanceMetrics)
+{
+    Trace_Span derive_kmac_span("derive_kmacs", &performanceMetrics->derive_kmacs);
+    _mac_scheme->DeriveKeys(_kmac_keys, (const byte*)_SQ_key_ch, data_points_num, _enc_init_params.max_ct_entries, prime_bits_to_bytes);
+    derive_kmac_span.End();
 }
 
+// the keys and outputs of the current transfer, for the MAC scheme
+mac_transfer_s Destination_Server::MacTransfer()
+{
+    mac_transfer_s transfer;
+    transfer.seal = _seal;
+    transfer.enc_init_params = &_enc_init_params;
+    transfer.data_points_num = data_points_num;
+    transfer.prime_bits_to_bytes = prime_bits_to_bytes;
+    transfer.square_diff = square_diff;
+    transfer.deferred_rescale = deferred_rescale;
+    transfer.hmac_sq = &hmac_sq;
+    transfer.kmac_keys = &_kmac_keys;
+    transfer.diffs = &diff_SQ_FHE_CT;
+    transfer.y_tag = &batched_y_tag_ct;
+
+    return transfer;
+}
 
-// the thread function for processing a vector of cipher texts
-void Destination_Server::ProcessCt(DS_performance_metrics* performanceMetrics)
+// open a TCP connection to the Aux server, returns -1 if it can't be reached
+int Destination_Server::ConnectToAux(string server_ip, DS_performance_metrics *performanceMetrics)
 {
-    while (this->total_num_of_unprocessed_ct > 0)
+    int sock = 0;
+    struct sockaddr_in serv_addr;
+
+    if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0)
     {
-        if (!this->_ct_queue.empty())
-        {
-            std::unique_lock<std::mutex> lock(_mutex);
+        perror("Socket creation error");
+        exit(1);
+    }
 
-            vector<string> ct_vec = _ct_queue.front();
-            _ct_queue.pop();
-            //cout << "Remaining unprocessed: " << total_num_of_unprocessed_ct << endl;
-            this->total_num_of_unprocessed_ct--;
-            lock.unlock();
-            VerifyAndReconstruct(ct_vec, performanceMetrics);
-        }
+    serv_addr.sin_family = AF_INET;
+    serv_addr.sin_port = htons(PORT);
+
+    // Convert IPv4 address from text to binary form
+    if (inet_pton(AF_INET, server_ip.c_str(), &serv_addr.sin_addr) <= 0)
+    {
+        perror("Invalid IP address\n");
+        close(sock);
+        return -1;
+    }
+
+    Trace_Span send_request_span("wait_for_auxiliary", &performanceMetrics->wait_for_auxiliary);
 
-        usleep(50);
+    if (connect(sock, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0)
+    {
+        perror("Connection Failed\n");
+        close(sock);
+        return -1;
     }
 
+    send_request_span.End();
+
+    return sock;
 }
 
-// Connect to AUX server, receive and parse secret share and mac data
-void Destination_Server::RequestAndParseDataFromAux(int repeatTimes, string server_ip, bool test_mode, bool read_secret_from_file)
+// the ciphertext index of each set of the transfer, all of them unless blocks are selected
+void Destination_Server::SelectBlocks()
+{
+    int num_of_blocks = (data_points_num / _enc_init_params.max_ct_entries) + (((data_points_num % _enc_init_params.max_ct_entries) > 0) ? 1 : 0);
+
+    if (!Transfer_Session::SelectedBlocks(blocks, num_of_blocks, _selected_ct))
+    {
+        throw std::runtime_error("The selected blocks must be ascending, disjoint and below " + std::to_string(num_of_blocks));
+    }
+
+    // the batched tags cover the whole dataset
+    if (!_mac_scheme->SupportsBlockSelection() && !blocks.empty())
+    {
+        throw std::runtime_error(string("Blocks can't be selected with a ") + _mac_scheme->Name() + " MAC");
+    }
+}
+
+// start a session: one empty slot per ciphertext set, nothing verified yet
+void Destination_Server::BeginTransfer(ullong session_id)
+{
+    SelectBlocks();
+
+    _session_id = session_id;
+    _num_of_ct = _selected_ct.size();
+    _ct_verified.assign(_num_of_ct, 0);
+    _verified_prefix = 0;
+
+    // the outputs only hold the current transfer, with one slot per ciphertext set so the workers can fill them in any order.
+    // In batched mode there is a single diff, computed once all ciphertexts are verified
+    reconstructed_FHE_CT.assign(_num_of_ct, Ciphertext());
+    diff_SQ_FHE_CT.assign(_mac_scheme->IsBatched() ? 0 : _num_of_ct, Ciphertext());
+    batched_y_ct = Ciphertext();
+    batched_y_tag_ct = Ciphertext();
+}
+
+// record a verified ciphertext set, and acknowledge the number of sets verified so far counting from set 0
+void Destination_Server::MarkVerified(int ct_index)
+{
+    std::lock_guard<std::mutex> lock(_session_mutex);
+
+    _ct_verified[ct_index] = 1;
+
+    int verified_prefix = _verified_prefix;
+    while ((verified_prefix < _num_of_ct) && _ct_verified[verified_prefix])
+    {
+        verified_prefix++;
+    }
+
+    if (verified_prefix == _verified_prefix)
+    {
+        return;
+    }
+    _verified_prefix = verified_prefix;
+
+    // a failed acknowledgement shows up in the receive loop as a dropped connection
+    if (_ack_socket >= 0)
+    {
+        Transfer_Session::SendAck(_ack_socket, _verified_prefix);
+    }
+}
+
+// one connection of the session: receive the ciphertexts the Aux sends from the first set not verified yet,
+// reconstruct and verify them. Returns true once all sets of the transfer are verified, false if the connection
+// dropped before, the sets verified so far are kept for the next connection
+bool Destination_Server::ReceiveSession(int sock, DS_performance_metrics *performanceMetrics)
 {
-    int sock = 0, valread;
-    struct sockaddr_in serv_addr;
     int buffer_size = sizeof(ullong);
     char str_size_buffer[buffer_size + 1] = {0};
     vector<string> ct_vec;
 
-    // initialize mac ciphertexts for batched verification
-    if (_batched_size > 0)
+    session_hello_s hello;
+    session_accept_s accept;
+    hello.session_id = _session_id;
+    hello.resume_from = _verified_prefix;
+    hello.data_points_num = data_points_num;
+    hello.mode = _mac_scheme->SessionMode() | (slot_packing ? SESSION_MODE_SLOT_PACKING : 0);
+    hello.params_hash = Transfer_Session::ParamsHash(_enc_init_params);
+    hello.blocks = blocks;
+    hello.dataset = dataset;
+
+    if (!Transfer_Session::SendHello(sock, hello) || !Transfer_Session::ReceiveAccept(sock, accept))
     {
-        vector<double> zero_vec(_enc_init_params.max_ct_entries, 0);
-        Plaintext zero_pt;
-        _seal->encoder_ptr->encode(zero_vec, _enc_init_params.scale, zero_pt);
-        _seal->encryptor_ptr->encrypt(zero_pt, batched_y_ct);
-        _seal->encryptor_ptr->encrypt(zero_pt, batched_y_tag_ct);
+        std::cout << "The Aux didn't accept session " << _session_id << endl;
+        return false;
     }
 
-    for (int i = 0; i < repeatTimes; i++)
+    // a request the Aux can't serve fails the retrieval, connecting again wouldn't change the answer
+    if (accept.status == SESSION_MODE_MISMATCH)
     {
-        int index = 0;
-        long ct_count = 0;
-        total_num_of_unprocessed_ct = (data_points_num / _enc_init_params.max_ct_entries) + (((data_points_num % _enc_init_params.max_ct_entries) > 0) ? 1 : 0);
-        DS_performance_metrics performanceMetrics;
-        std::thread processingThread(&Destination_Server::ProcessCt, this, &performanceMetrics);
+        throw std::runtime_error(string("The Aux rejected the request: the dataset is served") + ((accept.mode & SESSION_MODE_SLOT_PACKING) ? " with" : " without") +
+                                 " slot packing, this request is" + (slot_packing ? " with" : " without") + " slot packing");
+    }
+    if (accept.status != SESSION_ACCEPTED)
+    {
+        throw std::runtime_error("The Aux rejected the request for " + std::to_string(data_points_num) + " data points" +
+                                 (dataset.empty() ? "" : " of dataset " + dataset) + ": " + Transfer_Session::StatusText(accept.status));
+    }
 
-        high_resolution_clock::time_point end2end = utility::timer_start();
-        int bytes_for_secret_share = data_points_num * (prime_bits_to_bytes + 1);
-        _secret_share_keys = SHARE_MAC_KEYS(bytes_for_secret_share);
+    // the dataset's tags were uploaded with the scheme the Aux serves, a transfer started with another one starts over
+    shared_ptr<const MAC_Scheme> served_scheme = MAC_Scheme::FromSessionMode(accept.mode);
+    if (served_scheme->SessionMode() != _mac_scheme->SessionMode())
+    {
+        std::cout << "The Aux serves the dataset with the " << served_scheme->Name() << " MAC, this transfer started " << _mac_scheme->Name() << endl;
+        _mac_scheme = served_scheme;
+        BeginTransfer(_session_id);
+        DeriveMacKeys(performanceMetrics);
+    }
 
-        // initialize secret share keys using hkdf
-        high_resolution_clock::time_point start_derive = utility::timer_start();
-        _secret_share_keys.gen_keys((byte*)_DS_key_ch, KEY_SIZE_BYTES, constants::SECRET_SHARE_DERIVE_KEY);
-        long long the_time = utility::timer_end(start_derive).count();
-        performanceMetrics.derive_b_t += utility::timer_end(start_derive).count();
+    if ((int)accept.num_of_ct != _num_of_ct)
+    {
+        throw std::runtime_error("The Aux sends " + std::to_string(accept.num_of_ct) + " ciphertext sets instead of " + std::to_string(_num_of_ct));
+    }
 
-        if (_batched_size > 0) // initialize mac keys for batched mode using hkdf
+    // an Aux that doesn't know the session, e.g. after a restart, sends everything again
+    if ((int)accept.start_index != _verified_prefix)
+    {
+        if (accept.start_index != 0)
         {
-            high_resolution_clock::time_point start_derive_kmac = utility::timer_start();
-            // calculate the amount of required bytes for all keys
-            // a_int, a_frac, c_alpha, c_beta and b required the same amount of bytes as the prime.
-            // d_alpha and d_beta each require 1 bit, so we can allocate 1 byte for both
-            // calculating by bytes maybe space consuming, but is easier for this implementation.
-            // future improvement and be to allocate according to number of bits
-            int num_of_mac_key_bytes = data_points_num * 2 * prime_bits_to_bytes +  _enc_init_params.max_ct_entries * (prime_bits_to_bytes * 3 + 1);
-            _kmac_keys = SHARE_MAC_KEYS(num_of_mac_key_bytes);
+            throw std::runtime_error("The Aux resumes session " + std::to_string(_session_id) + " at ciphertext set " + std::to_string(accept.start_index) +
+                                     ", which isn't the first unverified set " + std::to_string(_verified_prefix));
+        }
+
+        std::cout << "The Aux doesn't know session " << _session_id << ", starting it over" << endl;
+        BeginTransfer(_session_id);
+    }
+    else if (_verified_prefix > 0)
+    {
+        std::cout << "Resuming session " << _session_id << " at ciphertext set " << _verified_prefix << " of " << _num_of_ct << endl;
+    }
+
+    int index = accept.start_index;
+    long ct_count = 0;
+    bool connection_dropped = false;
+    total_num_of_unprocessed_ct = _num_of_ct - accept.start_index;
+
+    {
+        std::lock_guard<std::mutex> lock(_session_mutex);
+        _ack_socket = sock;
+    }
 
-            _kmac_keys.gen_keys((byte*)_SQ_key_ch, KEY_SIZE_BYTES, constants::MAC_DERIVE_KEY);
-            performanceMetrics.derive_kmacs += utility::timer_end(start_derive_kmac).count();
+    // each worker has its own batched mac accumulator and its own histograms, they are added up after the join
+    int num_of_workers = std::max(1, std::min(processing_threads, total_num_of_unprocessed_ct));
+    vector<Ciphertext> batched_y_accs(num_of_workers);
+    vector<std::unique_ptr<DS_performance_metrics>> workers_metrics;
+    vector<std::thread> processingThreads;
+    for (int i = 0; i < num_of_workers; i++)
+    {
+        workers_metrics.emplace_back(new DS_performance_metrics());
+        processingThreads.emplace_back(&Destination_Server::ProcessCt, this, workers_metrics[i].get(), &batched_y_accs[i]);
+    }
+
+    std::cout << "Started receiving data from Aux" << endl;
+
+    // calculate the amount of expected num of ciphertexts to form a set of secret share + mac
+    // in case of unbatched mac, there will be mac+secret share number of ciphertexts
+    // in case of batched mac, the number of mac ciphertexts is expected to be less than the amount of secret share at some point
+    // with slot packing, small ciphertexts carry two vectors each and fewer ciphertexts are expected
+    int expected_num_of_ct = (index < _num_of_ct) ? ExpectedCtCount(_selected_ct[index]) : 0;
+    int curr_ct_count = 0;
+
+    // the Aux sends a known number of sets, a connection that ends before the last one dropped
+    while (index < _num_of_ct)
+    {
+        // read the size of the serialized string from the server
+        if (!Transfer_Session::ReceiveAll(sock, str_size_buffer, buffer_size))
+        {
+            connection_dropped = true;
+            break;
         }
 
-        if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+        Trace_Span receive_from_aux_span("receive_from_aux", &performanceMetrics->receive_from_aux);
+        // prepare a buffer according to the read size
+        ullong ser_str_size = atoll(str_size_buffer);
+
+        // read straight into the string that is queued, instead of a stack buffer that is copied afterwards
+        string ser_str(ser_str_size, '\0');
+
+        // here we build a queue of string vectors
+        // the format of each vector is as following:
+        // ciphertext set index (according to the order in which it's received from the Aux
+        // secret share int serialized string size
+        // secret share int serialized string
+        // secret share frac serialized string size
+        // secret share frac serialized string
+        // and in the same way, the mac serialized ciphertexts
+        // in total we should expect 4 ciphertexts in unbatched mode
+        // in batched mode we expect 5 ciphertexts while transmitting mac data and 2 ciphertexts once all mac ciphertexts have been sent
+
+        if (!Transfer_Session::ReceiveAll(sock, &ser_str[0], ser_str_size))
         {
-            perror("Socket creation error");
-            exit(1);
+            connection_dropped = true;
+            break;
         }
 
-        serv_addr.sin_family = AF_INET;
-        serv_addr.sin_port = htons(PORT);
+        performanceMetrics->receive_hist.Record(receive_from_aux_span.End());
+        // insert the vector size
+        ct_vec.emplace_back((const char*)str_size_buffer);
+        ct_vec.push_back(std::move(ser_str));
 
-        // Convert IPv4 address from text to binary form
-        if (inet_pton(AF_INET, server_ip.c_str(), &serv_addr.sin_addr) <= 0)
+        ct_count++;
+        curr_ct_count++;
+
+        if (curr_ct_count ==  expected_num_of_ct)
         {
-            perror("Invalid IP address\n");
-            exit(1);
+            Trace_Span push_to_queue_span("push_to_queue", &performanceMetrics->push_to_queue);
+            // insert the ciphertext index
+            ct_vec.insert(ct_vec.begin(), std::to_string(index));
+            // acquire a lock
+            std::unique_lock<std::mutex> lock(_mutex);
+            // update the queue
+            _ct_queue.push(std::move(ct_vec));
+            // unlock the mutex
+            lock.unlock();
+            // clear the vector for the next entry
+            ct_vec.clear();
+            curr_ct_count = 0;
+            index++;
+            expected_num_of_ct = (index < _num_of_ct) ? ExpectedCtCount(_selected_ct[index]) : 0;
+
+            push_to_queue_span.End();
+
         }
 
-        high_resolution_clock::time_point start_send_request = utility::timer_start();
+        bzero(str_size_buffer, buffer_size);
+    }
+
+    if (connection_dropped)
+    {
+        // the workers still verify the queued sets, a partially received set is sent again by the next connection
+        std::lock_guard<std::mutex> lock(_mutex);
+        total_num_of_unprocessed_ct = _ct_queue.size();
+    }
+
+    for (int i = 0; i < num_of_workers; i++)
+    {
+        processingThreads[i].join();
+        performanceMetrics->MergeWorker(*workers_metrics[i]);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(_session_mutex);
+        _ack_socket = -1;
+    }
 
-        if (connect(sock, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0)
+    // the accumulators are sums of products at the same level and scale, so adding them in worker order gives
+    // the same ciphertext whichever worker, or connection, processed which ciphertext.
+    // They stay empty with the schemes that don't accumulate
+    Trace_Span add_accs_span("verify", &performanceMetrics->verify);
+    for (Ciphertext& acc : batched_y_accs)
+    {
+        if (acc.size() == 0)
         {
-            perror("Connection Failed\n");
-            exit(1);
+            continue;
         }
 
-        performanceMetrics.wait_for_auxiliary = utility::timer_end(start_send_request).count();
+        if (batched_y_ct.size() == 0)
+        {
+            batched_y_ct = std::move(acc);
+        }
+        else
+        {
+            _seal->evaluator_ptr->add_inplace(batched_y_ct, acc);
+        }
+    }
+    add_accs_span.End();
 
-        std::cout << "Started receiving data from Aux" << endl;
-        high_resolution_clock::time_point total_receive_and_process = utility::timer_start();
+    std::cout << "Done receiving data from Aux, " << _verified_prefix << " of " << _num_of_ct << " ciphertext sets verified" << endl << endl;
 
+    return _verified_prefix == _num_of_ct;
+}
 
-        // calculate the amount of expected num of ciphertexts to form a set of secret share + mac
-        // in case of unbatched mac, there will be mac+secret share number of ciphertexts
-        // in case of batched mac, the number of mac ciphertexts is expected to be less than the amount of secret share at some point
-        int expected_num_of_ct = (_batched_size > 0) ? MAX_IDX_WITH_BATCHED_MAC : MAX_IDX_WITH_UNBATCHED_MAC;
+// once all ciphertext sets are verified: the diffs the scheme computes for the whole transfer, and their aggregation
+void Destination_Server::FinishTransfer(DS_performance_metrics *performanceMetrics)
+{
+    // the batched mac diff needs the accumulators of all threads
+    MAC finish_mac(_enc_init_params);
+    _mac_scheme->FinishVerify(MacTransfer(), finish_mac, batched_y_ct, MemoryManager::GetPool(), performanceMetrics);
 
-        // read the size of the serialized string from the server
-        while ((valread = read(sock, str_size_buffer, buffer_size)) > 0)
-        {
-            int curr_ct_count;
-            high_resolution_clock::time_point receive_from_aux = utility::timer_start();
-            // prepare a buffer according to the read size
-            ullong ser_str_size = atoll(str_size_buffer);
-
-            char ser_buffer[ser_str_size + 1] = {0};
-            char *pSerBuffer = ser_buffer;
-            bzero(ser_buffer, ser_str_size + 1);
-
-            // here we build a queue of string vectors
-            // the format of each vector is as following:
-            // ciphertext index (according to the order in which it's received from the Aux
-            // secret share int serialized string size
-            // secret share int serialized string
-            // secret share frac serialized string size
-            // secret share frac serialized string
-            // and in the same way, the mac serialized ciphertexts
-            // in total we should expect 4 ciphertexts in unbatched mode
-            // in batched mode we expect 5 ciphertexts while transmitting mac data and 2 ciphertexts once all mac ciphertexts have been sent
-
-            ullong remaining = ser_str_size;
-             // cout << "Receiving size of: " << remaining << endl;
-            valread = 0;
-
-            int retries = 20;
-            while (remaining > 0)
-            {
-                if ((valread = read(sock, pSerBuffer, ser_str_size)) <= 0)
-                {
-                    if (retries == 0)
-                    {
-                              perror("Failed to read serialized string\n");
-                              exit(1);
-                    }
-                    cout << "Failed to read serealized string, but don't worry, we're retrying. valread is: " << valread << " remaining retries: " << retries << endl;
-                    retries--;
-                }
-                remaining -= valread;
-                pSerBuffer += valread;
-            }
+    // only squared diffs can be summed without a forged value cancelling another, the batched diff isn't squared
+    _diffs_aggregated = aggregate_mac && _mac_scheme->SquaresDiffs(square_diff);
+    _aggregated_diff_values = diff_SQ_FHE_CT.size() * (ullong)_seal->encoder_ptr->slot_count();
 
-            performanceMetrics.receive_from_aux += utility::timer_end(receive_from_aux).count();
-            // insert the vector size
-            string size_of_ct(str_size_buffer);
-            ct_vec.push_back(size_of_ct);
-            string ser_str(ser_buffer, ser_str_size);
+    // the honest noise of that many values may reach the square of a forged value, which the sum can't tell apart
+    if (_diffs_aggregated && !test_correctness::can_aggregate_MAC(_aggregated_diff_values))
+    {
+        std::cout << "The squared MAC diffs of " << _aggregated_diff_values << " values are too many to aggregate, they are checked value by value" << endl;
+        _diffs_aggregated = false;
+    }
 
-            ct_vec.push_back(ser_str);
+    if (_diffs_aggregated)
+    {
+        // one ciphertext, and one value to decrypt, for the whole transfer
+        Trace_Span aggregate_mac_span("aggregate_mac", &performanceMetrics->aggregate_mac);
+        MAC mac(_enc_init_params);
+        Ciphertext aggregated;
+        mac.aggregateHE_diffs(_seal, diff_SQ_FHE_CT, aggregated);
+        diff_SQ_FHE_CT.push_back(std::move(aggregated));
+        aggregate_mac_span.End();
+    }
+}
 
-            ct_count++;
-            curr_ct_count++;
+// receive all ciphertexts of one transfer over a single connection, reconstruct and verify them.
+// The socket can be a TCP connection to the Aux or one end of a socketpair in a single process run.
+void Destination_Server::ReceiveAndProcess(int sock, DS_performance_metrics *performanceMetrics)
+{
+    Trace_Span total_receive_and_process_span("total_receive_and_process", &performanceMetrics->total_receive_and_process);
 
-            if (curr_ct_count ==  expected_num_of_ct)
-            {
-                high_resolution_clock::time_point push_to_queue = utility::timer_start();
-                // insert the ciphertext index
-                ct_vec.insert(ct_vec.begin(), std::to_string(index));
-                // acquire a lock
-                std::unique_lock<std::mutex> lock(_mutex);
-                // update the queue
-                _ct_queue.push(ct_vec);
-                // unlock the mutex
-                lock.unlock();
-                // clear the vector for the next entry
-                ct_vec.clear();
-                curr_ct_count = 0;
-                index++;
-                // in batched mac, the first set of ciphertexts include the mac details. the rest don't.
-                if (_batched_size > 0)
-                {
-                    expected_num_of_ct = MAX_IDX_WITHOUT_MAC;
-                }
+    BeginTransfer(Transfer_Session::NewSessionId());
+    if (!ReceiveSession(sock, performanceMetrics))
+    {
+        throw std::runtime_error("The connection to the Aux ended before all ciphertexts were verified");
+    }
+    FinishTransfer(performanceMetrics);
 
-                performanceMetrics.push_to_queue += utility::timer_end(push_to_queue).count();
+    total_receive_and_process_span.End();
+}
 
-            }
+static void AppendCheckpointSection(string& out, const string& section)
+{
+    uint64_t length = section.size();
+    out.append((const char*)&length, sizeof(length));
+    out.append(section);
+}
+
+// a fingerprint of the transfer keys and the selected blocks, a checkpoint of another upload or selection must not be resumed
+static uint64_t TransferKeysFingerprint(const char* ds_key, const char* sq_key, const vector<int>& selected_ct)
+{
+    CryptoPP::SHA256 hash;
+    CryptoPP::byte digest[CryptoPP::SHA256::DIGESTSIZE];
+    hash.Update((const CryptoPP::byte*)ds_key, KEY_SIZE_BYTES);
+    hash.Update((const CryptoPP::byte*)sq_key, KEY_SIZE_BYTES);
+    hash.Update((const CryptoPP::byte*)selected_ct.data(), selected_ct.size() * sizeof(int));
+    hash.Final(digest);
+
+    uint64_t fingerprint;
+    memcpy(&fingerprint, digest, sizeof(fingerprint));
+    return fingerprint;
+}
+
+// the transfer settings that change the content of the checkpointed ciphertexts
+uint32_t Destination_Server::CheckpointMode()
+{
+    return (_mac_scheme->IsBatched() ? 1 : 0) | (square_diff ? 2 : 0) | (deferred_rescale ? 4 : 0) | (slot_packing ? 8 : 0);
+}
 
-            bzero(str_size_buffer, buffer_size);
+// write the verified ciphertext sets and the partial batched mac sum to the checkpoint file.
+// Layout: magic, version, poly degree, data points, ciphertext sets, mode, keys and blocks fingerprint, session id, one verified
+// flag per set, then 64 bit length prefixed ciphertexts: batched y sum and y tag, and the reconstructed ciphertext
+// and diff of every verified set, and a SHA256 of everything before it
+bool Destination_Server::SaveCheckpoint()
+{
+    if (std::find(_ct_verified.begin(), _ct_verified.end(), 1) == _ct_verified.end())
+    {
+        return true;
+    }
+
+    auto serialize = [](const Ciphertext& ct) { return (ct.size() == 0) ? string() : utility::serialize_fhe(ct); };
+
+    uint32_t header[5] = {CHECKPOINT_VERSION, (uint32_t)_enc_init_params.polyDegree, (uint32_t)data_points_num, (uint32_t)_num_of_ct, CheckpointMode()};
+    uint64_t fingerprint = TransferKeysFingerprint(_DS_key_ch, _SQ_key_ch, _selected_ct);
+    string out(CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC));
+    out.append((const char*)header, sizeof(header));
+    out.append((const char*)&fingerprint, sizeof(fingerprint));
+    out.append((const char*)&_session_id, sizeof(_session_id));
+    out.append(_ct_verified.data(), _ct_verified.size());
+
+    AppendCheckpointSection(out, serialize(batched_y_ct));
+    AppendCheckpointSection(out, serialize(batched_y_tag_ct));
+    for (int i = 0; i < _num_of_ct; i++)
+    {
+        if (!_ct_verified[i])
+        {
+            continue;
+        }
+
+        AppendCheckpointSection(out, serialize(reconstructed_FHE_CT[i]));
+        if (!_mac_scheme->IsBatched())
+        {
+            AppendCheckpointSection(out, serialize(diff_SQ_FHE_CT[i]));
         }
+    }
+
+    CryptoPP::byte digest[CryptoPP::SHA256::DIGESTSIZE];
+    CryptoPP::SHA256().CalculateDigest(digest, (const CryptoPP::byte*)out.data(), out.size());
+    out.append((const char*)digest, sizeof(digest));
+
+    // write a temporary file and rename it, a crash while saving leaves the previous checkpoint
+    string temp_file_name = checkpoint_file + ".tmp";
+    std::ofstream file(temp_file_name, std::ios::out | std::ios::binary | std::ios::trunc);
+    file.write(out.data(), out.size());
+    file.close();
+
+    if (!file || (rename(temp_file_name.c_str(), checkpoint_file.c_str()) < 0))
+    {
+        perror("Unable to save the transfer checkpoint");
+        unlink(temp_file_name.c_str());
+        return false;
+    }
 
+    cout << "Saved checkpoint of session " << _session_id << " with " << _verified_prefix << " of " << _num_of_ct << " ciphertext sets verified in order" << endl;
+    return true;
+}
+
+// continue the session of a checkpoint, returns false if there is none or it doesn't match this transfer
+bool Destination_Server::LoadCheckpoint()
+{
+    std::ifstream file(checkpoint_file, std::ios::in | std::ios::binary);
+    if (!file.is_open())
+    {
+        return false;
+    }
+    string in((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
 
-        processingThread.join();
+    uint32_t header[5];
+    uint64_t fingerprint;
+    ullong session_id;
+    size_t pos = sizeof(CHECKPOINT_MAGIC) + sizeof(header) + sizeof(fingerprint) + sizeof(session_id);
 
-        // for batched mac, need to perform the diff after completion of all threads
-        if (_batched_size > 0)
+    if (in.size() < pos + CryptoPP::SHA256::DIGESTSIZE || memcmp(in.data(), CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC)) != 0)
+    {
+        std::cerr << "Ignoring checkpoint " << checkpoint_file << ", it is truncated or not a checkpoint" << endl;
+        return false;
+    }
+
+    size_t hashed_size = in.size() - CryptoPP::SHA256::DIGESTSIZE;
+    if (!CryptoPP::SHA256().VerifyDigest((const CryptoPP::byte*)in.data() + hashed_size, (const CryptoPP::byte*)in.data(), hashed_size))
+    {
+        std::cerr << "Ignoring checkpoint " << checkpoint_file << ", its hash doesn't match its content" << endl;
+        return false;
+    }
+
+    memcpy(header, in.data() + sizeof(CHECKPOINT_MAGIC), sizeof(header));
+    memcpy(&fingerprint, in.data() + sizeof(CHECKPOINT_MAGIC) + sizeof(header), sizeof(fingerprint));
+    memcpy(&session_id, in.data() + sizeof(CHECKPOINT_MAGIC) + sizeof(header) + sizeof(fingerprint), sizeof(session_id));
+
+    BeginTransfer(session_id);
+
+    uint32_t expected_header[5] = {CHECKPOINT_VERSION, (uint32_t)_enc_init_params.polyDegree, (uint32_t)data_points_num, (uint32_t)_num_of_ct, CheckpointMode()};
+    if (memcmp(header, expected_header, sizeof(header)) != 0 || fingerprint != TransferKeysFingerprint(_DS_key_ch, _SQ_key_ch, _selected_ct) ||
+        pos + _num_of_ct > hashed_size)
+    {
+        std::cerr << "Ignoring checkpoint " << checkpoint_file << ", it was saved by another version, transfer settings or upload" << endl;
+        return false;
+    }
+
+    _ct_verified.assign(in.data() + pos, in.data() + pos + _num_of_ct);
+    pos += _num_of_ct;
+
+    auto next_section = [&](Ciphertext& ct) {
+        uint64_t length;
+        if (pos + sizeof(length) > hashed_size)
         {
-            Ciphertext diff_ct;
+            throw std::runtime_error("Checkpoint " + checkpoint_file + " is missing ciphertexts");
+        }
+        memcpy(&length, in.data() + pos, sizeof(length));
+        pos += sizeof(length);
+        if (length > hashed_size - pos)
+        {
+            throw std::runtime_error("Checkpoint " + checkpoint_file + " is missing ciphertexts");
+        }
+        if (length > 0)
+        {
+            utility::deserialize_fhe(in.data() + pos, length, ct, _seal->context_ptr);
+        }
+        pos += length;
+    };
+
+    try
+    {
+        next_section(batched_y_ct);
+        next_section(batched_y_tag_ct);
+        for (int i = 0; i < _num_of_ct; i++)
+        {
+            if (!_ct_verified[i])
+            {
+                continue;
+            }
 
-            high_resolution_clock::time_point start_verify = utility::timer_start();
-            _seal->evaluator_ptr->sub(batched_y_ct, batched_y_tag_ct, diff_ct);
-            diff_SQ_FHE_CT.push_back(diff_ct);
-            performanceMetrics.verify += utility::timer_end(start_verify).count();
+            next_section(reconstructed_FHE_CT[i]);
+            if (!_mac_scheme->IsBatched())
+            {
+                next_section(diff_SQ_FHE_CT[i]);
+            }
         }
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << "Ignoring checkpoint: " << e.what() << endl;
+        return false;
+    }
+
+    while ((_verified_prefix < _num_of_ct) && _ct_verified[_verified_prefix])
+    {
+        _verified_prefix++;
+    }
 
-        performanceMetrics.total_receive_and_process = utility::timer_end(total_receive_and_process).count();
-        performanceMetrics.end2end = utility::timer_end(end2end).count();
+    cout << "Loaded checkpoint of session " << _session_id << ", resuming at ciphertext set " << _verified_prefix << " of " << _num_of_ct << endl;
+    return true;
+}
 
-        std::cout << "Done receiving data from Aux" << endl << endl;
+// Connect to AUX server, receive and parse secret share and mac data
+void Destination_Server::RequestAndParseDataFromAux(int repeatTimes, string server_ip, bool test_mode, bool read_secret_from_file)
+{
+    Tracer::SetThreadName("DS receive");
 
-        metrics_file << performanceMetrics << endl;
+    for (int i = 0; i < repeatTimes; i++)
+    {
+        DS_performance_metrics performanceMetrics;
 
-        if (test_mode)
+        if (!Retrieve(i, server_ip, test_mode, read_secret_from_file, performanceMetrics))
         {
-            VerifyOutput(read_secret_from_file);
+            exit(1);
         }
     }
 
+    _all_runs_metrics.SaveHistograms(_histogram_prefix, -1);
     metrics_file.close();
 }
 
-void Destination_Server::VerifyOutput(bool read_secret_from_file)
+// one transfer from the Aux: receive, reconstruct and verify, then record its metrics.
+// A dropped connection is opened again and the session resumes after the sets verified so far, the derived keys
+// and the verified sets are kept. Returns false if the Aux could not be reached, or the transfer couldn't be completed
+// within MAX_RECONNECTS reconnections; with a checkpoint file the next retrieval continues from there
+bool Destination_Server::Retrieve(int run, string server_ip, bool test_mode, bool read_secret_from_file, DS_performance_metrics& performanceMetrics)
+{
+    Trace_Span end2end_span("end2end", &performanceMetrics.end2end);
+
+    DeriveTransferKeys(&performanceMetrics);
+
+    // the checkpoint of an interrupted retrieval continues its session
+    if (checkpoint_file.empty() || !LoadCheckpoint())
+    {
+        BeginTransfer(Transfer_Session::NewSessionId());
+    }
+
+    Trace_Span total_receive_and_process_span("total_receive_and_process", &performanceMetrics.total_receive_and_process);
+    bool completed = false;
+
+    for (int attempt = 0; !completed && attempt <= MAX_RECONNECTS; attempt++)
+    {
+        if (attempt > 0)
+        {
+            cout << "Connection to the Aux dropped with " << _verified_prefix << " of " << _num_of_ct << " ciphertext sets verified in order, reconnecting" << endl;
+            if (!checkpoint_file.empty())
+            {
+                SaveCheckpoint();
+            }
+            usleep(RECONNECT_DELAY_US << (attempt - 1));
+        }
+
+        int sock = ConnectToAux(server_ip, &performanceMetrics);
+        if (sock < 0)
+        {
+            continue;
+        }
+
+        completed = ReceiveSession(sock, &performanceMetrics);
+        close(sock);
+    }
+
+    if (!completed)
+    {
+        if (!checkpoint_file.empty())
+        {
+            SaveCheckpoint();
+        }
+        return false;
+    }
+
+    FinishTransfer(&performanceMetrics);
+    total_receive_and_process_span.End();
+
+    if (!checkpoint_file.empty())
+    {
+        unlink(checkpoint_file.c_str());
+    }
+
+    end2end_span.End();
+
+    metrics_file << performanceMetrics << endl;
+    performanceMetrics.SaveHistograms(_histogram_prefix, run);
+    _all_runs_metrics.MergeHistograms(performanceMetrics);
+
+    if (!trace_file.empty())
+    {
+        Tracer::WriteRun(trace_file, run);
+    }
+
+    if (test_mode)
+    {
+        performanceMetrics.verified = VerifyOutput(read_secret_from_file) ? 1 : 0;
+    }
+
+    return true;
+}
+
+// the aggregated histogram dumps of all transfers so far
+void Destination_Server::SaveAllRunsHistograms()
+{
+    _all_runs_metrics.SaveHistograms(_histogram_prefix, -1);
+}
+
+// returns whether both the secret share and the MAC checks passed
+bool Destination_Server::VerifyOutput(bool read_secret_from_file)
 {
     ReadSecret(read_secret_from_file);
 
+    // the outputs of selected blocks are compared with their inputs. Only the last block can be partial,
+    // so the selected inputs line up with the outputs like a smaller dataset
+    int checked_data_points = data_points_num;
+    if (!blocks.empty())
+    {
+        vector<double> selected_secret;
+        for (int ct_index : _selected_ct)
+        {
+            auto first = _secret_vec.begin() + ct_index * _enc_init_params.max_ct_entries;
+            selected_secret.insert(selected_secret.end(), first, first + ct_data_points(ct_index, data_points_num, _enc_init_params.max_ct_entries));
+        }
+        _secret_vec = std::move(selected_secret);
+        checked_data_points = _secret_vec.size();
+    }
+
     // test secret share correctness
-    test_correctness::is_correct_secret_sharing(make_shared<vector<Ciphertext>>(reconstructed_FHE_CT), _seal, _secret_vec, data_points_num, _enc_init_params.max_ct_entries);
+    int secret_share_valid = test_correctness::is_correct_secret_sharing(reconstructed_FHE_CT, _seal, _secret_vec, checked_data_points, _enc_init_params.max_ct_entries);
 
     // test MAC correctness
-    test_correctness::is_MAC_HE_valid(_seal, make_shared<vector<Ciphertext>>(diff_SQ_FHE_CT), data_points_num, _enc_init_params.max_ct_entries, "SQ", true); //test for sq
+    bool mac_valid;
+    if (_diffs_aggregated)
+    {
+        mac_valid = test_correctness::is_aggregated_MAC_HE_valid(_seal, diff_SQ_FHE_CT[0], _aggregated_diff_values, "SQ");
+    }
+    else
+    {
+        // a single diff ciphertext is the batched mac, otherwise there is one per secret share ciphertext
+        test_correctness::check_result_s mac_check;
+        mac_valid = test_correctness::is_MAC_HE_valid(_seal, diff_SQ_FHE_CT, checked_data_points, _enc_init_params.max_ct_entries, "SQ", diff_SQ_FHE_CT.size() == 1, &mac_check); //test for sq
+
+        // the aggregated check relies on the squared diffs of an honest transfer staying within the honest bound
+        if (mac_valid && _mac_scheme->SquaresDiffs(square_diff))
+        {
+            double bound = constants::MAC_HONEST_DIFF_BOUND * constants::MAC_HONEST_DIFF_BOUND;
+            cout << "Squared MAC diffs of " << mac_check.checked << " values sum to " << mac_check.sum_abs_error
+                 << ", the aggregated tolerance is " << test_correctness::aggregated_MAC_tolerance(mac_check.checked) << endl;
+            if (mac_check.max_abs_error > bound)
+            {
+                cout << "Squared MAC diff " << mac_check.max_abs_error << " is above the honest bound " << bound << " of the aggregated check" << endl;
+                mac_valid = false;
+            }
+        }
+    }
 
+    return secret_share_valid && mac_valid;
 }
 
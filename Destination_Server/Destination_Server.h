@@ -1,6 +1,9 @@
 #pragma once
 #include "seal/seal.h"
 #include "../Servers_Protocol.h"
+#include "../Key_Snapshot.h"
+#include "../Transfer_Session.h"
+#include "../MAC_Scheme.h"
 #include <queue>
 #include <thread>
 #include <mutex>
@@ -16,63 +19,71 @@ using namespace utility;
 std::ostream& operator<<(std::ostream&, const DS_performance_metrics& dsPerformanceMetrics);
 
 
-enum CT_Index
-{
-    CT_IDX = 0,
-    X_INT_SIZE,
-    X_INT_IDX,
-    X_FRAC_SIZE,
-    X_FRAC_IDX,
-    SQ_ZQMSKD_SIZE,
-    SQ_ZQMSKD_IDX,
-    SQ_TR_SIZE,
-    SQ_TR_IDX,
-
-};
-
-enum CT_BATCHED_Index
-{
-    BATCHED_TR_SIZE = X_FRAC_IDX + 1 ,
-    BATCHED_TR_IDX,
-    BATCHED_ALPHA_INT_SIZE,
-    BATCHED_ALPHA_INT_IDX,
-    BATCHED_BETA_INT_SIZE,
-    BATCHED_BETA_INT_IDX,
-};
-
-enum CT_Max_Index
-{
-    MAX_IDX_WITHOUT_MAC = 2,
-    MAX_IDX_WITH_UNBATCHED_MAC = 4,
-    MAX_IDX_WITH_BATCHED_MAC = 5
-};
-
-
 class Destination_Server : public Servers_Protocol //to inherit generating SEAL params
 {
 private:
     std::vector<double> _secret_vec;
     shared_ptr<seal_struct> _seal;
     enc_init_params_s _enc_init_params;
-    int _batched_size;
+    shared_ptr<const MAC_Scheme> _mac_scheme; // of the current transfer, as the Aux serves the dataset
     std::queue<vector<string>> _ct_queue;
     std::mutex _mutex;
     std::mutex _log_mutex;
 
     char _DS_key_ch[KEY_SIZE_BYTES];
     char _SQ_key_ch[KEY_SIZE_BYTES];
-    char _SR_key_ch[KEY_SIZE_BYTES];
 
     bool square_diff;
+    bool deferred_rescale; // keep reconstruction and square diff outputs unrescaled, they are only decrypted
+    bool slot_packing;
     SHARE_MAC_KEYS _secret_share_keys;
     SHARE_MAC_KEYS _kmac_keys;
-
-    void ProcessCt(DS_performance_metrics* performanceMetrics);
+    shared_ptr<Data_Storage> _storage; // when not set, the keys and inputs are loaded from the S3 bucket
+    string _histogram_prefix; // latency histogram dumps go to /tmp/out/<prefix>_<stage>_<run>.hist
+    DS_performance_metrics _all_runs_metrics; // only the histograms are merged, for the aggregated dumps
+    bool _derived_keys_ready = false;
+    bool _diffs_aggregated = false; // the diffs of the last transfer were summed into one ciphertext
+    ullong _aggregated_diff_values = 0; // the number of squared diff values summed into it
+
+    // the resumable session of the current transfer
+    ullong _session_id = 0;
+    int _num_of_ct = 0;
+    vector<int> _selected_ct;  // ciphertext index of each set
+    vector<int> _derived_ct;   // ciphertext indices the derived keys cover
+    vector<char> _ct_verified; // per ciphertext set
+    int _verified_prefix = 0;  // sets verified counting from set 0, acknowledged to the Aux
+    int _ack_socket = -1;      // connection the workers acknowledge on, -1 between connections
+    std::mutex _session_mutex;
+
+    void ProcessCt(DS_performance_metrics* performanceMetrics, Ciphertext* batched_y_acc);
+    void SelectBlocks();
+    void BeginTransfer(ullong session_id);
+    void MarkVerified(int ct_index);
+    bool ReceiveSession(int sock, DS_performance_metrics *performanceMetrics);
+    void FinishTransfer(DS_performance_metrics *performanceMetrics);
+    uint32_t CheckpointMode();
+    bool SaveCheckpoint();
+    bool LoadCheckpoint();
     bool ReadSecret(bool read_secret_from_file);
-    void VerifyAndReconstruct(vector<std::string> str_vec, DS_performance_metrics *performanceMetrics);
+    int ExpectedCtCount(int ct_index);
+    void CreateGaloisKeys();
+    void VerifyAndReconstruct(const vector<std::string>& str_vec, MemoryPoolHandle pool, Ciphertext& batched_y_acc, DS_performance_metrics *performanceMetrics);
+    void DeriveMacKeys(DS_performance_metrics *performanceMetrics);
+    mac_transfer_s MacTransfer();
+    void LoadTransferKeys(Data_Storage& storage);
+    void LoadTransferKeysFromFile();
+    int ConnectToAux(string server_ip, DS_performance_metrics *performanceMetrics);
 
 public:
     std::ofstream metrics_file;
+    string trace_file; // when set, a Chrome trace is written for every repetition
+    bool keep_derived_keys = false; // reuse the derived keys between transfers until the transfer keys are reloaded
+    bool aggregate_mac = false; // sum the squared MAC diffs into one ciphertext, set before GetEncryptionParams as it needs Galois keys
+    string key_snapshot_file; // when set, the encryption keys are loaded from and saved to this local snapshot
+    int processing_threads = 1; // workers reconstructing and verifying the received ciphertexts, in any order
+    string checkpoint_file; // when set, an interrupted transfer is saved to this file and resumed by the next retrieval
+    vector<block_range_s> blocks; // when set, only these ciphertext blocks are retrieved, the outputs hold them in order
+    string dataset; // the dataset to retrieve and the prefix of its bucket objects, empty for the default dataset. Set before GetEncryptionParams
     int data_points_num;
     int total_num_of_unprocessed_ct;
     int prime_bits_to_bytes;
@@ -83,11 +94,17 @@ public:
 
     CryptoPP::HMAC<CryptoPP::SHA256> hmac;
     CryptoPP::HMAC<CryptoPP::SHA256> hmac_sq;
-    CryptoPP::HMAC<CryptoPP::SHA256> hmac_sr;
 
-    Destination_Server(int data_points_num_input, bool batched, string enc_init_params_file, bool squareDiff);//class c'tor
+    Destination_Server(int data_points_num_input, bool batched, string enc_init_params_file, bool squareDiff, bool deferredRescale = false, bool slotPacking = false);//class c'tor
     ~Destination_Server() {} //class d'tor
     bool GetEncryptionParams(bool read_keys_from_file, bool read_keys_from_s3);
     void RequestAndParseDataFromAux(int repeatTimes, string server_ip, bool test_mode, bool read_secret_from_file);
-    void VerifyOutput(bool read_secret_from_file);
+    bool Retrieve(int run, string server_ip, bool test_mode, bool read_secret_from_file, DS_performance_metrics& performanceMetrics);
+    void ReloadTransferKeys(bool read_keys_from_file);
+    void SaveAllRunsHistograms();
+    void DeriveTransferKeys(DS_performance_metrics *performanceMetrics);
+    void ReceiveAndProcess(int sock, DS_performance_metrics *performanceMetrics);
+    void SetStorage(shared_ptr<Data_Storage> storage) { _storage = storage; }
+    shared_ptr<seal_struct> GetSeal() { return _seal; }
+    bool VerifyOutput(bool read_secret_from_file);
 };
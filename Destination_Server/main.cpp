@@ -1,5 +1,7 @@
 #include <getopt.h>
 #include "Destination_Server.h"
+#include "DS_Daemon.h"
+#include "../Dataset_Catalog.h"
 
 void printHelp(void)
 {
@@ -9,11 +11,25 @@ void printHelp(void)
             "--enc_param_file <filename>          Read encryption params from a local file instead of defaults\n"
             "--read_keys_from_file                Read encryption keys from a local file instead of s3 bucket\n"
             "--read_keys_from_s3                  Read keys from amazon s3 bucket\n"
-            "--batched                            Batched MAC\n"
+            "--batched                            Expect the batched MAC, the transfer uses the MAC the Aux serves the dataset with\n"
             "--repeat_times <n>                   Number of times to repeat the reading. Default is 1\n"
             "--no_test_mode                       Do not validate output\n"
             "--read_secret_from_file              In test mode, read the secret numbers from a file. Default is to read from the bucket\n"
             "--square_diff                        Perform square diff on the MAC verification out\n"
+            "--deferred_rescale                   Skip the rescale of the reconstruction, which costs an extra plaintext multiply of x_frac,\n"
+            "                                     and the relinearization and rescale of the unbatched square diff. The batched MAC still uses its level\n"
+            "--slot_packing                       Expect ciphertexts using at most half of the slots to be packed (must match the Aux server)\n"
+            "--aggregate_mac                      Sum the squared MAC diffs into one ciphertext and check a single value (needs --square_diff)\n"
+            "--trace <filename>                   Write a Chrome trace JSON of every repetition (<filename>_<n>.json)\n"
+            "--daemon                             Keep the keys loaded and run a retrieval for every RETRIEVE command on the control socket\n"
+            "--control_socket <path>              Control socket of the daemon. Default is /tmp/ds_control.sock\n"
+            "--key_snapshot <filename>            Load the encryption keys from a local snapshot, created on the first start\n"
+            "--s3_max_connections <n>             Maximum number of pooled S3 connections. Default is 25\n"
+            "--checkpoint <filename>              Save the verified part of an interrupted transfer, and resume it on the next retrieval\n"
+            "--threads <n>                        Number of workers reconstructing and verifying the ciphertexts. Default is 1\n"
+            "--dataset <name>                     Retrieve the named dataset of the Aux catalog, its objects are <name>/... in the bucket\n"
+            "--blocks <list>                      Only retrieve these ciphertext blocks, e.g. 0-3,7 (unbatched MAC only). Default is all\n"
+            "--perf_counters                      Report IPC and cache/branch misses per ciphertext of the deserialize, reconstruct and verify stages\n"
             "--help                               Display this help message\n";
     exit(1);
 
@@ -32,12 +48,23 @@ int main(int argc, char* argv[])
     bool test_mode = true;
     bool square_diff = false;
     bool batched = false;
+    bool deferred_rescale = false;
+    bool slot_packing = false;
+    bool aggregate_mac = false;
     string server_ip = "127.0.0.1";
     string params_file = "";
+    string trace_file = "";
+    string control_socket = "/tmp/ds_control.sock";
+    string key_snapshot_file = "";
+    bool daemon_mode = false;
     int data_points_num = constants::DEFAULT_INPUT_SIZE;
     int repeatTimes = 1;
+    int processing_threads = 1;
+    string checkpoint_file = "";
+    vector<block_range_s> blocks;
+    string dataset = "";
 
-    const char* const short_opts = "i:p:e:m:rsntfh";
+    const char* const short_opts = "i:p:e:m:x:C:K:c:T:R:B:S:rsntfaDPh";
     const option long_opts [] =
     {
             {"input", required_argument, nullptr, 'i'},
@@ -50,6 +77,19 @@ int main(int argc, char* argv[])
             {"no_test_mode", no_argument, nullptr, 't'},
             {"read_secret_from_file", no_argument, nullptr, 'f'},
             {"square_diff", no_argument, nullptr, 'q'},
+            {"deferred_rescale", no_argument, nullptr, 'd'},
+            {"slot_packing", no_argument, nullptr, 'k'},
+            {"aggregate_mac", no_argument, nullptr, 'a'},
+            {"trace", required_argument, nullptr, 'x'},
+            {"daemon", no_argument, nullptr, 'D'},
+            {"control_socket", required_argument, nullptr, 'C'},
+            {"key_snapshot", required_argument, nullptr, 'K'},
+            {"s3_max_connections", required_argument, nullptr, 'c'},
+            {"checkpoint", required_argument, nullptr, 'R'},
+            {"threads", required_argument, nullptr, 'T'},
+            {"blocks", required_argument, nullptr, 'B'},
+            {"dataset", required_argument, nullptr, 'S'},
+            {"perf_counters", no_argument, nullptr, 'P'},
             {"help", no_argument, nullptr, 'h'},
     };
 
@@ -111,6 +151,73 @@ int main(int argc, char* argv[])
             square_diff = true;
             break;
 
+        case 'd':
+            deferred_rescale = true;
+            break;
+
+        case 'k':
+            slot_packing = true;
+            break;
+
+        case 'a':
+            aggregate_mac = true;
+            break;
+
+        case 'x':
+            trace_file = optarg;
+            Tracer::Enable(true);
+            break;
+
+        case 'D':
+            daemon_mode = true;
+            break;
+
+        case 'C':
+            control_socket = optarg;
+            break;
+
+        case 'K':
+            key_snapshot_file = optarg;
+            break;
+
+        case 'c':
+            utility::SetS3MaxConnections(std::stoi(optarg));
+            break;
+
+        case 'R':
+            checkpoint_file = optarg;
+            break;
+
+        case 'T':
+            processing_threads = std::stoi(optarg);
+            if (processing_threads < 1)
+            {
+                cout << "--threads must be at least 1" << endl;
+                exit(1);
+            }
+            break;
+
+        case 'B':
+            if (!Transfer_Session::ParseBlocks(optarg, blocks))
+            {
+                cout << "--blocks expects a comma separated list of block indices and ranges, e.g. 0-3,7" << endl;
+                exit(1);
+            }
+            break;
+
+        case 'S':
+            dataset = optarg;
+            if (!Dataset_Catalog::IsValidName(dataset))
+            {
+                cout << "Dataset names may only hold letters, digits, '-', '_' and '.'" << endl;
+                exit(1);
+            }
+            break;
+
+        case 'P':
+            Perf_Counters::Enable();
+            break;
+
         case 'h':
         case '?':
         default:
@@ -121,8 +228,39 @@ int main(int argc, char* argv[])
 
     }
 
-    Destination_Server dest_server(data_points_num, batched, params_file, square_diff);
+    // signed diffs could cancel each other in the sum, only squared ones can't
+    if (aggregate_mac && !square_diff)
+    {
+        std::cout << "--aggregate_mac needs --square_diff" << endl;
+        exit(1);
+    }
+
+    // the batched tags cover the whole dataset and are checked once for all of it
+    if (batched && !blocks.empty())
+    {
+        std::cout << "--blocks can't be combined with --batched" << endl;
+        exit(1);
+    }
 
+    // the S3 connections stay open across all retrievals
+    Aws_API_Guard aws_api;
+    Destination_Server dest_server(data_points_num, batched, params_file, square_diff, deferred_rescale, slot_packing);
+
+    dest_server.trace_file = trace_file;
+    dest_server.key_snapshot_file = key_snapshot_file;
+    dest_server.aggregate_mac = aggregate_mac;
+    dest_server.processing_threads = processing_threads;
+    dest_server.checkpoint_file = checkpoint_file;
+    dest_server.blocks = blocks;
+    dest_server.dataset = dataset;
     dest_server.GetEncryptionParams(read_keys_from_file, read_keys_from_s3);
+
+    if (daemon_mode)
+    {
+        DS_Daemon daemon(dest_server, control_socket, server_ip, test_mode, read_secret_from_file, read_keys_from_file);
+        daemon.Run();
+        return 0;
+    }
+
     dest_server.RequestAndParseDataFromAux(repeatTimes, server_ip, test_mode, read_secret_from_file);
 }
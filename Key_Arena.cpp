@@ -0,0 +1,30 @@
+#include "Key_Arena.h"
+#include <memory>
+
+void Key_Arena::Reserve(std::size_t bytes)
+{
+    if (bytes <= _left)
+    {
+        return;
+    }
+
+    // the pool doesn't align its allocations, take room to align the start of the block
+    std::size_t block_bytes = bytes + KEY_LANE_ALIGN;
+    _blocks.push_back(seal::util::allocate<seal::seal_byte>(block_bytes, _pool));
+
+    void* start = _blocks.back().get();
+    std::align(KEY_LANE_ALIGN, bytes, start, block_bytes);
+    _next = static_cast<seal::seal_byte*>(start);
+    _left = block_bytes;
+}
+
+void* Key_Arena::Alloc(std::size_t bytes)
+{
+    Reserve(bytes);
+
+    void* lane = _next;
+    _next += bytes;
+    _left -= bytes;
+
+    return lane;
+}
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+#include "seal/seal.h"
+#include "seal/util/pointer.h"
+
+class Key_Arena;
+
+// key_lane - one key vector, a view of KEY_LANE_ALIGN aligned values placed in a Key_Arena.
+// It is not copied, as a copy would alias the place of its values. A moved lane leaves an empty one behind
+template <typename T>
+class key_lane
+{
+private:
+    friend class Key_Arena;
+
+    T* _data = nullptr;
+    std::size_t _size = 0;
+    std::size_t _capacity = 0;
+
+public:
+    key_lane() = default;
+    key_lane(const key_lane&) = delete;
+    key_lane& operator=(const key_lane&) = delete;
+
+    key_lane(key_lane&& other) noexcept { *this = std::move(other); }
+
+    key_lane& operator=(key_lane&& other) noexcept
+    {
+        _data = std::exchange(other._data, nullptr);
+        _size = std::exchange(other._size, 0);
+        _capacity = std::exchange(other._capacity, 0);
+        return *this;
+    }
+
+    T* data() { return _data; }
+    const T* data() const { return _data; }
+    std::size_t size() const { return _size; }
+    bool empty() const { return _size == 0; }
+
+    T& operator[](std::size_t i) { return _data[i]; }
+    const T& operator[](std::size_t i) const { return _data[i]; }
+
+    T* begin() { return _data; }
+    T* end() { return _data + _size; }
+    const T* begin() const { return _data; }
+    const T* end() const { return _data + _size; }
+
+    // the values as the CKKS encoder takes them, converted to doubles in a buffer of the calling worker thread.
+    // The buffer keeps its capacity across ciphertexts, and is valid until the thread's next encode_view
+    const std::vector<double>& encode_view() const
+    {
+        thread_local std::vector<double> values;
+        values.assign(begin(), end());
+        return values;
+    }
+};
+
+// Key_Arena - bump allocator for the key lanes of a key generator. The blocks come from a SEAL memory pool, so the
+// keys of a ciphertext derived on a worker reuse the memory of its previous ciphertext's keys.
+// A lane keeps its place while it is re-derived with at most as many values, only a larger one takes a new place
+class Key_Arena
+{
+private:
+    seal::MemoryPoolHandle _pool;
+    std::vector<seal::util::Pointer<seal::seal_byte>> _blocks;
+    seal::seal_byte* _next = nullptr;
+    std::size_t _left = 0;
+
+    void* Alloc(std::size_t bytes);
+
+public:
+    static const std::size_t KEY_LANE_ALIGN = 64;
+
+    explicit Key_Arena(seal::MemoryPoolHandle pool) : _pool(std::move(pool)) {}
+    Key_Arena(const Key_Arena&) = delete;
+    Key_Arena& operator=(const Key_Arena&) = delete;
+
+    // the bytes a lane of count values takes
+    template <typename T>
+    static std::size_t LaneBytes(std::size_t count)
+    {
+        return (count * sizeof(T) + KEY_LANE_ALIGN - 1) / KEY_LANE_ALIGN * KEY_LANE_ALIGN;
+    }
+
+    // make sure the next bytes of lanes are placed in one block
+    void Reserve(std::size_t bytes);
+
+    // place count values in the lane, their value is not set
+    template <typename T>
+    void Place(key_lane<T>& lane, std::size_t count)
+    {
+        if (count > lane._capacity)
+        {
+            lane._data = static_cast<T*>(Alloc(LaneBytes<T>(count)));
+            lane._capacity = count;
+        }
+        lane._size = count;
+    }
+};
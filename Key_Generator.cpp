@@ -1,9 +1,44 @@
 #include "Key_Generator.h"
 
 // Constructor
-Key_Generator::Key_Generator(ullong prime)
+Key_Generator::Key_Generator(ullong prime, MemoryPoolHandle pool)
 {
+    // the keys are reduced by the prime into 32 bit lanes
+    if (prime > UINT32_MAX)
+    {
+        throw std::runtime_error("The prime " + std::to_string(prime) + " doesn't fit the 32 bit key lanes");
+    }
+
     _prime = prime;
+    _mod_arith = &Mod_Arith::For(prime);
+    _pool = pool;
+}
+
+// Copy constructor, the copy gets its own arena
+Key_Generator::Key_Generator(const Key_Generator& other) : _prime(other._prime), _mod_arith(other._mod_arith), _pool(other._pool)
+{
+    copy_lane(a_int, other.a_int);
+    copy_lane(a_frac, other.a_frac);
+    copy_lane(b, other.b);
+    copy_lane(c_alpha, other.c_alpha);
+    copy_lane(d_alpha, other.d_alpha);
+}
+
+// Copy assignment, the keys are copied into the lanes of this generator's arena
+Key_Generator& Key_Generator::operator=(const Key_Generator& other)
+{
+    if (this != &other)
+    {
+        _prime = other._prime;
+        _mod_arith = other._mod_arith;
+        copy_lane(a_int, other.a_int);
+        copy_lane(a_frac, other.a_frac);
+        copy_lane(b, other.b);
+        copy_lane(c_alpha, other.c_alpha);
+        copy_lane(d_alpha, other.d_alpha);
+    }
+
+    return *this;
 }
 
 // Destructor
@@ -12,38 +47,58 @@ Key_Generator::~Key_Generator()
     // dtor
 }
 
+// The arena of the key lanes
+Key_Arena& Key_Generator::arena()
+{
+    if (!_arena)
+    {
+        _arena = std::make_unique<Key_Arena>(_pool);
+    }
+
+    return *_arena;
+}
+
 // Derive vectors a, b, c_alpha, d_alpha using HMAC and derived keys
 void Key_Generator::derive_abcd(CryptoPP::HMAC<SHA256>& hmac, std::string key, ullong start_index, ullong amount)
 {
-    for (int i = 0; i < amount; i++)
-    {
-        std::string derivation_data = key + std::to_string(start_index);
-        std::string derived_key = derive_rand_key(hmac, derivation_data);
+    arena().Reserve(Key_Arena::LaneBytes<uint32_t>(amount) * 5);
+    place(a_int, amount);
+    place(a_frac, amount);
+    place(b, amount);
+    place(c_alpha, amount);
+    place(d_alpha, amount);
+
+    Mod_Arith::Dispatch(*_mod_arith, [&](auto arith) {
+        for (int i = 0; i < amount; i++)
+        {
+            std::string derivation_data = key + std::to_string(start_index);
+            std::string derived_key = derive_rand_key(hmac, derivation_data);
 
-        ullong a1_int = (((ullong)derived_key[0]  << 48) | ((ullong)derived_key[1]  << 40) | ((ullong)derived_key[2]  << 32) |
-                         ((ullong)derived_key[3]  << 24) | ((ullong)derived_key[4]  << 16) | ((ullong)derived_key[5]  << 8)  |
-                         (ullong)(derived_key[6]));
+            ullong a1_int = (((ullong)derived_key[0]  << 48) | ((ullong)derived_key[1]  << 40) | ((ullong)derived_key[2]  << 32) |
+                             ((ullong)derived_key[3]  << 24) | ((ullong)derived_key[4]  << 16) | ((ullong)derived_key[5]  << 8)  |
+                             (ullong)(derived_key[6]));
 
-        ullong a1_frac = (((ullong)derived_key[7]  << 48) | ((ullong)derived_key[8]  << 40) | ((ullong)derived_key[9]  << 32) |
-                          ((ullong)derived_key[10] << 24) | ((ullong)derived_key[11] << 16) | ((ullong)derived_key[12] << 8)  |
-                          (ullong)(derived_key[13]));
+            ullong a1_frac = (((ullong)derived_key[7]  << 48) | ((ullong)derived_key[8]  << 40) | ((ullong)derived_key[9]  << 32) |
+                              ((ullong)derived_key[10] << 24) | ((ullong)derived_key[11] << 16) | ((ullong)derived_key[12] << 8)  |
+                              (ullong)(derived_key[13]));
 
-        ullong b1 = (((ullong)derived_key[24] << 48) | ((ullong)derived_key[25] << 40) | ((ullong)derived_key[26] << 32) |
-                     ((ullong)derived_key[27] << 24) | ((ullong)derived_key[28] << 16) | ((ullong)derived_key[29] << 8)  |
-                     (ullong)(derived_key[30]));
+            ullong b1 = (((ullong)derived_key[24] << 48) | ((ullong)derived_key[25] << 40) | ((ullong)derived_key[26] << 32) |
+                         ((ullong)derived_key[27] << 24) | ((ullong)derived_key[28] << 16) | ((ullong)derived_key[29] << 8)  |
+                         (ullong)(derived_key[30]));
 
-        ullong c1 = (((ullong)derived_key[14] << 48) | ((ullong)derived_key[15] << 40) | ((ullong)derived_key[16] << 32) |
-                     ((ullong)derived_key[17] << 24) | ((ullong)derived_key[18] << 16) | ((ullong)derived_key[19] << 8)  |
-                     (ullong)(derived_key[20]));
+            ullong c1 = (((ullong)derived_key[14] << 48) | ((ullong)derived_key[15] << 40) | ((ullong)derived_key[16] << 32) |
+                         ((ullong)derived_key[17] << 24) | ((ullong)derived_key[18] << 16) | ((ullong)derived_key[19] << 8)  |
+                         (ullong)(derived_key[20]));
 
-        a_int.push_back(fmod(a1_int, _prime));
-        a_frac.push_back(fmod(a1_frac, _prime));
-        b.push_back(fmod(b1, _prime));
-        c_alpha.push_back(fmod(c1, _prime));
-        d_alpha.push_back(((unsigned int)(derived_key[31]) % 2));
+            a_int[i] = (uint32_t)arith.ModDouble(a1_int);
+            a_frac[i] = (uint32_t)arith.ModDouble(a1_frac);
+            b[i] = (uint32_t)arith.ModDouble(b1);
+            c_alpha[i] = (uint32_t)arith.ModDouble(c1);
+            d_alpha[i] = ((unsigned int)(derived_key[31]) % 2);
 
-        start_index++;
-    }
+            start_index++;
+        }
+    });
 }
 
 // Derive a random key using HMAC
@@ -79,19 +134,67 @@ void Key_Generator::derive_rand_key_hkdf(byte* key_tag, int key_tag_len, std::st
         std::copy(&derivedKey[0], &derivedKey[max_derived_key_len], std::back_inserter(keys));
     }
 
+    // the remainder is the first bytes of one more block, derived like the full ones
     if (remainder)
     {
         std::string cur_derivation_data = info + std::to_string(i);
-        hkdf.DeriveKey(derivedKey, sizeof(derivedKey), key_tag, key_tag_len, NULL, 0, derivedKey, max_derived_key_len);
+        hkdf.DeriveKey(derivedKey, max_derived_key_len, key_tag, key_tag_len, NULL, 0, (byte*)cur_derivation_data.c_str(), cur_derivation_data.length());
         std::copy(derivedKey, derivedKey + remainder, std::back_inserter(keys));
     }
 }
 
+// Derive the HKDF blocks covering a byte range of the keys, in place
+void Key_Generator::derive_rand_key_hkdf_range(byte* key_tag, int key_tag_len, std::string info, std::vector<byte>& keys, int key_len, int offset, int size)
+{
+    CryptoPP::HKDF<SHA512> hkdf;
+    int max_derived_key_len = hkdf.MaxDerivedKeyLength();
+    byte derivedKey[max_derived_key_len];
+
+    int num_of_derivations = key_len / max_derived_key_len;
+    int remainder = key_len % max_derived_key_len;
+    int num_of_blocks = num_of_derivations + (remainder ? 1 : 0);
+
+    if (size <= 0)
+    {
+        return;
+    }
+
+    // every block, also the remainder one, is derived from its own index only
+    int first_block = offset / max_derived_key_len;
+    int last_block = std::min((offset + size - 1) / max_derived_key_len, num_of_blocks - 1);
+
+    for (int i = first_block; i <= last_block; i++)
+    {
+        std::string cur_derivation_data = info + std::to_string(i);
+        int block_len = (i < num_of_derivations) ? max_derived_key_len : remainder;
+        hkdf.DeriveKey(derivedKey, max_derived_key_len, key_tag, key_tag_len, NULL, 0, (byte*)cur_derivation_data.c_str(), cur_derivation_data.length());
+        std::copy(derivedKey, derivedKey + block_len, keys.begin() + i * max_derived_key_len);
+    }
+}
+
 
 // Batched_Key_Generator constructor (inherits Key_Generator)
-Batched_Key_Generator::Batched_Key_Generator(ullong prime) : Key_Generator(prime)
+Batched_Key_Generator::Batched_Key_Generator(ullong prime, MemoryPoolHandle pool) : Key_Generator(prime, pool)
 {}
 
+Batched_Key_Generator::Batched_Key_Generator(const Batched_Key_Generator& other) : Key_Generator(other)
+{
+    copy_lane(c_beta, other.c_beta);
+    copy_lane(d_beta, other.d_beta);
+}
+
+Batched_Key_Generator& Batched_Key_Generator::operator=(const Batched_Key_Generator& other)
+{
+    if (this != &other)
+    {
+        Key_Generator::operator=(other);
+        copy_lane(c_beta, other.c_beta);
+        copy_lane(d_beta, other.d_beta);
+    }
+
+    return *this;
+}
+
 
 // SHARE_MAC_KEYS constructor
 SHARE_MAC_KEYS::SHARE_MAC_KEYS(int key_length)
@@ -112,6 +215,14 @@ void SHARE_MAC_KEYS::gen_keys(byte* key_tag, int key_tag_len, std::string info)
     k_mac.derive_rand_key_hkdf(key_tag, key_tag_len, info, keys, key_len);
 }
 
+// Generate the keys of a byte range, the other bytes stay zero
+void SHARE_MAC_KEYS::gen_keys_range(byte* key_tag, int key_tag_len, std::string info, int offset, int size)
+{
+    Key_Generator k_mac; // default prime not used here
+    keys.resize(key_len);
+    k_mac.derive_rand_key_hkdf_range(key_tag, key_tag_len, info, keys, key_len, offset, size);
+}
+
 // Return next byte from keys vector; exit if exceeded
 byte SHARE_MAC_KEYS::get_next_byte(void)
 {
@@ -125,53 +236,86 @@ byte SHARE_MAC_KEYS::get_next_byte(void)
     exit(1);
 }
 
-// Derive a_int and a_frac values for a batch
-void Batched_Key_Generator::derive_a(SHARE_MAC_KEYS* kmac_keys, ullong start_index, ullong ct_max_index, int bytes_per_a)
+// Return next byte of the window; exit if exceeded
+byte Key_Window::get_next_byte(void)
 {
-    for (int i = start_index; i < start_index + ct_max_index; i++)
+    if (_iter < _keys.key_len)
     {
-        ullong a1_int = 0;
-        ullong a1_frac = 0;
-
-        for (int j = 0; j < bytes_per_a; j++)
-        {
-            a1_int |= ((ullong)kmac_keys->get_next_byte() << 8 * j);
-            a1_frac |= ((ullong)kmac_keys->get_next_byte() << 8 * j);
-        }
-
-        a_int.push_back(fmod(a1_int, _prime));
-        a_frac.push_back(fmod(a1_frac, _prime));
+        return _keys.keys[_iter++];
     }
+
+    perror("Key window exceeded key array size");
+    cout << "key length: " << _keys.key_len << " window position: " << _iter << endl;
+    exit(1);
 }
 
-// Derive b, c_alpha, c_beta, d_alpha, d_beta values for a batch
-void Batched_Key_Generator::derive_bcd(SHARE_MAC_KEYS* kmac_keys, int amount, int bytes_per_bc, int start_iter_index)
+// Derive a_int and a_frac values for a batch, advancing keys_iter
+void Batched_Key_Generator::derive_a(SHARE_MAC_KEYS* kmac_keys, ullong ct_max_index, int bytes_per_a)
 {
-    int curr_iter = kmac_keys->keys_iter;
-    kmac_keys->keys_iter = start_iter_index;
+    Key_Window kmac_window(*kmac_keys, kmac_keys->keys_iter);
+    derive_a(kmac_window, ct_max_index, bytes_per_a);
+    kmac_keys->keys_iter = kmac_window.position();
+}
 
-    for (int i = 0; i < amount; i++)
-    {
-        ullong b1 = 0;
-        ullong c1_alpha = 0;
-        ullong c1_beta = 0;
-        byte d1;
+// Derive a_int and a_frac values for a batch from a window
+void Batched_Key_Generator::derive_a(Key_Window& kmac_window, ullong ct_max_index, int bytes_per_a)
+{
+    arena().Reserve(Key_Arena::LaneBytes<uint32_t>(ct_max_index) * 2);
+    place(a_int, ct_max_index);
+    place(a_frac, ct_max_index);
 
-        for (int j = 0; j < bytes_per_bc; j++)
+    Mod_Arith::Dispatch(*_mod_arith, [&](auto arith) {
+        for (int i = 0; i < ct_max_index; i++)
         {
-            b1 |= ((ullong)kmac_keys->get_next_byte() << 8 * j);
-            c1_alpha |= ((ullong)kmac_keys->get_next_byte() << 8 * j);
-            c1_beta |= ((ullong)kmac_keys->get_next_byte() << 8 * j);
+            ullong a1_int = 0;
+            ullong a1_frac = 0;
+
+            for (int j = 0; j < bytes_per_a; j++)
+            {
+                a1_int |= ((ullong)kmac_window.get_next_byte() << 8 * j);
+                a1_frac |= ((ullong)kmac_window.get_next_byte() << 8 * j);
+            }
+
+            a_int[i] = (uint32_t)arith.ModDouble(a1_int);
+            a_frac[i] = (uint32_t)arith.ModDouble(a1_frac);
         }
+    });
+}
 
-        d1 = kmac_keys->get_next_byte();
+// Derive b, c_alpha, c_beta, d_alpha, d_beta values for a batch
+void Batched_Key_Generator::derive_bcd(const SHARE_MAC_KEYS* kmac_keys, int amount, int bytes_per_bc, int start_iter_index)
+{
+    Key_Window kmac_window(*kmac_keys, start_iter_index);
 
-        b.push_back(fmod(b1, _prime));
-        c_alpha.push_back(fmod(c1_alpha, _prime));
-        c_beta.push_back(fmod(c1_beta, _prime));
-        d_alpha.push_back(d1 & 0x1);
-        d_beta.push_back(d1 & 0x2);
-    }
+    arena().Reserve(Key_Arena::LaneBytes<uint32_t>(amount) * 5);
+    place(b, amount);
+    place(c_alpha, amount);
+    place(c_beta, amount);
+    place(d_alpha, amount);
+    place(d_beta, amount);
 
-    kmac_keys->keys_iter = curr_iter;
+    Mod_Arith::Dispatch(*_mod_arith, [&](auto arith) {
+        for (int i = 0; i < amount; i++)
+        {
+            ullong b1 = 0;
+            ullong c1_alpha = 0;
+            ullong c1_beta = 0;
+            byte d1;
+
+            for (int j = 0; j < bytes_per_bc; j++)
+            {
+                b1 |= ((ullong)kmac_window.get_next_byte() << 8 * j);
+                c1_alpha |= ((ullong)kmac_window.get_next_byte() << 8 * j);
+                c1_beta |= ((ullong)kmac_window.get_next_byte() << 8 * j);
+            }
+
+            d1 = kmac_window.get_next_byte();
+
+            b[i] = (uint32_t)arith.ModDouble(b1);
+            c_alpha[i] = (uint32_t)arith.ModDouble(c1_alpha);
+            c_beta[i] = (uint32_t)arith.ModDouble(c1_beta);
+            d_alpha[i] = d1 & 0x1;
+            d_beta[i] = d1 & 0x2;
+        }
+    });
 }
@@ -1,26 +1,47 @@
 #ifndef Key_Generator_H
 #define Key_Generator_H
 
+#include <algorithm>
+#include <memory>
 #include "Utility.h"
+#include "Mod_Arith.h"
+#include "Key_Arena.h"
 
 
 /**
  * @class Key_Generator
  * Base class for generating secret sharing keys (a, b, c_alpha, d_alpha) from HMAC or HKDF.
+ * The key vectors are lanes of the generator's Key_Arena, each derivation places its lanes once for the amount it
+ * derives. The keys are below the prime, so they are held in 32 bit lanes.
+ * A copy gets its own arena with a copy of the keys, a move takes the arena along.
  */
 class Key_Generator {
 public:
-    // Public key vectors
-    vector<double> a_int;
-    vector<double> a_frac;
-    vector<double> b;
-    vector<double> c_alpha;
-    vector<double> d_alpha;
-
-    // Constructor / Destructor
-    Key_Generator(ullong prime = constants::prime);
+    // Public key vectors, d_alpha holds one bit
+    key_lane<uint32_t> a_int;
+    key_lane<uint32_t> a_frac;
+    key_lane<uint32_t> b;
+    key_lane<uint32_t> c_alpha;
+    key_lane<uint32_t> d_alpha;
+
+    // Constructor / Destructor, the keys are allocated from pool
+    Key_Generator(ullong prime = constants::prime, MemoryPoolHandle pool = MemoryManager::GetPool());
     virtual ~Key_Generator();
 
+    // A copy places the keys in its own arena, from the pool of the copied generator
+    Key_Generator(const Key_Generator& other);
+    Key_Generator& operator=(const Key_Generator& other);
+    Key_Generator(Key_Generator&&) = default;
+    Key_Generator& operator=(Key_Generator&&) = default;
+
+    // Set a key vector to given values, instead of deriving it
+    template <typename T>
+    void assign(key_lane<T>& lane, const vector<double>& values)
+    {
+        place(lane, values.size());
+        std::transform(values.begin(), values.end(), lane.begin(), [](double value) { return (T)value; });
+    }
+
     // Derive vectors a, b, c_alpha, d_alpha using HMAC and derived key
     virtual void derive_abcd(CryptoPP::HMAC<SHA256>& hmac, std::string derived_key, ullong start_index, ullong amount);
 
@@ -30,8 +51,29 @@ public:
     // Derive random key using HKDF
     void derive_rand_key_hkdf(byte* key_tag, int key_tag_len, std::string cur_derivation_data, std::vector<byte>& keys, int key_len);
 
+    // Derive only the HKDF blocks of the same keys that cover keys[offset, offset + size), keys already holds key_len bytes
+    void derive_rand_key_hkdf_range(byte* key_tag, int key_tag_len, std::string info, std::vector<byte>& keys, int key_len, int offset, int size);
+
 protected:
     ullong _prime;
+    const mod_arith_s* _mod_arith; // reduction by _prime, resolved once in the constructor
+    MemoryPoolHandle _pool;
+    std::unique_ptr<Key_Arena> _arena;   // created by the first derivation
+
+    template <typename T>
+    void place(key_lane<T>& lane, size_t count)
+    {
+        arena().Place(lane, count);
+    }
+
+    template <typename T>
+    void copy_lane(key_lane<T>& lane, const key_lane<T>& other)
+    {
+        place(lane, other.size());
+        std::copy(other.begin(), other.end(), lane.begin());
+    }
+
+    Key_Arena& arena();
 };
 
 
@@ -54,28 +96,58 @@ public:
     // Generate keys using HKDF
     void gen_keys(byte* key_tag, int key_tag_len, std::string info);
 
+    // Generate the keys of a byte range only, the same bytes gen_keys generates there. Can be called for several ranges
+    void gen_keys_range(byte* key_tag, int key_tag_len, std::string info, int offset, int size);
+
     // Return next byte from keys vector
     byte get_next_byte(void);
 };
 
 
+/**
+ * @class Key_Window
+ * Reads the keys of one ciphertext from a SHARE_MAC_KEYS starting at a byte offset, with its own position,
+ * so ciphertexts can take their keys in any order and from several threads without moving keys_iter.
+ */
+class Key_Window {
+public:
+    Key_Window(const SHARE_MAC_KEYS& keys, int start_iter_index) : _keys(keys), _iter(start_iter_index) {}
+
+    // Return next byte of the window
+    byte get_next_byte(void);
+
+    // Offset of the next byte in the keys vector
+    int position() const { return _iter; }
+
+private:
+    const SHARE_MAC_KEYS& _keys;
+    int _iter;
+};
+
+
 /**
  * @class Batched_Key_Generator
  * Derived class from Key_Generator for generating batch keys (adds c_beta and d_beta).
  */
 class Batched_Key_Generator : public Key_Generator {
 public:
-    vector<double> c_beta;
-    vector<double> d_beta;
+    key_lane<uint32_t> c_beta;
+    key_lane<uint32_t> d_beta;
 
     // Constructor
-    Batched_Key_Generator(ullong prime);
+    Batched_Key_Generator(ullong prime, MemoryPoolHandle pool = MemoryManager::GetPool());
+
+    Batched_Key_Generator(const Batched_Key_Generator& other);
+    Batched_Key_Generator& operator=(const Batched_Key_Generator& other);
+    Batched_Key_Generator(Batched_Key_Generator&&) = default;
+    Batched_Key_Generator& operator=(Batched_Key_Generator&&) = default;
 
-    // Derive vector a for batching
-    void derive_a(SHARE_MAC_KEYS *kmac_keys, ullong start_index, ullong ct_max_index, int bytes_per_a);
+    // Derive vector a for batching, from the current keys_iter or from a window
+    void derive_a(SHARE_MAC_KEYS *kmac_keys, ullong ct_max_index, int bytes_per_a);
+    void derive_a(Key_Window& kmac_window, ullong ct_max_index, int bytes_per_a);
 
-    // Derive vectors b, c_beta, d_beta for batching
-    void derive_bcd(SHARE_MAC_KEYS *kmac_keys, int amount, int bytes_per_cd, int start_iter_index);
+    // Derive vectors b, c_beta, d_beta for batching, keys_iter is left untouched
+    void derive_bcd(const SHARE_MAC_KEYS *kmac_keys, int amount, int bytes_per_cd, int start_iter_index);
 };
 
 
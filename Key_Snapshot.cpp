@@ -0,0 +1,232 @@
+#include "Key_Snapshot.h"
+#include <cstring>
+#include <sstream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const char SNAPSHOT_MAGIC[4] = {'K', 'S', 'N', 'P'};
+static const uint32_t SNAPSHOT_VERSION = 2;
+static const size_t SNAPSHOT_HEADER_SIZE = sizeof(SNAPSHOT_MAGIC) + 2 * sizeof(uint32_t) + sizeof(ullong);
+
+enum snapshot_section
+{
+    SNAPSHOT_PARMS = 0,
+    SNAPSHOT_PK,
+    SNAPSHOT_SK,
+    SNAPSHOT_RELIN_KEYS,
+    SNAPSHOT_NUM_SECTIONS,
+};
+
+static void AppendSection(string& out, const string& section)
+{
+    uint64_t length = section.size();
+    out.append((const char*)&length, sizeof(length));
+    out.append(section);
+}
+
+bool Key_Snapshot::Save(const string& file_name, const seal_struct& seal, const utility::enc_init_params_s& enc_init_params)
+{
+    if (!seal.pk_ptr || !seal.sk_ptr || !seal.relink_ptr)
+    {
+        std::cerr << "Key snapshot needs the public, secret and relinearization keys" << std::endl;
+        return false;
+    }
+
+    std::stringstream parms_str, pk_str, sk_str, relin_str;
+    seal.context_ptr.key_context_data()->parms().save(parms_str);
+    seal.pk_ptr->save(pk_str);
+    seal.sk_ptr->save(sk_str);
+    seal.relink_ptr->save(relin_str);
+
+    uint32_t poly_degree = seal.poly_modulus_degree;
+    ullong params_hash = Transfer_Session::ParamsHash(enc_init_params);
+    string out(SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    out.append((const char*)&SNAPSHOT_VERSION, sizeof(SNAPSHOT_VERSION));
+    out.append((const char*)&poly_degree, sizeof(poly_degree));
+    out.append((const char*)&params_hash, sizeof(params_hash));
+    AppendSection(out, parms_str.str());
+    AppendSection(out, pk_str.str());
+    AppendSection(out, sk_str.str());
+    AppendSection(out, relin_str.str());
+
+    CryptoPP::byte digest[CryptoPP::SHA256::DIGESTSIZE];
+    CryptoPP::SHA256().CalculateDigest(digest, (const CryptoPP::byte*)out.data(), out.size());
+    out.append((const char*)digest, sizeof(digest));
+
+    // the snapshot holds the secret key, only the owner may read it
+    string temp_file_name = file_name + ".tmp";
+    int fd = open(temp_file_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (fd < 0)
+    {
+        perror("Unable to create key snapshot");
+        return false;
+    }
+
+    size_t written = 0;
+    while (written < out.size())
+    {
+        ssize_t n = write(fd, out.data() + written, out.size() - written);
+        if (n <= 0)
+        {
+            perror("Unable to write key snapshot");
+            close(fd);
+            unlink(temp_file_name.c_str());
+            return false;
+        }
+        written += n;
+    }
+
+    if ((fsync(fd) < 0) || (close(fd) < 0) || (rename(temp_file_name.c_str(), file_name.c_str()) < 0))
+    {
+        perror("Unable to save key snapshot");
+        unlink(temp_file_name.c_str());
+        return false;
+    }
+
+    cout << "Saved key snapshot " << file_name << endl;
+    return true;
+}
+
+// parse and validate the mapped snapshot, each section points into the mapping
+static bool ParseSnapshot(const char* data, size_t size, const utility::enc_init_params_s& enc_init_params,
+                          const char* sections[SNAPSHOT_NUM_SECTIONS], size_t lengths[SNAPSHOT_NUM_SECTIONS])
+{
+    if (size < SNAPSHOT_HEADER_SIZE + CryptoPP::SHA256::DIGESTSIZE)
+    {
+        std::cerr << "Key snapshot is truncated" << std::endl;
+        return false;
+    }
+
+    uint32_t version, poly_degree;
+    ullong params_hash;
+    memcpy(&version, data + sizeof(SNAPSHOT_MAGIC), sizeof(version));
+    memcpy(&poly_degree, data + sizeof(SNAPSHOT_MAGIC) + sizeof(version), sizeof(poly_degree));
+    memcpy(&params_hash, data + sizeof(SNAPSHOT_MAGIC) + sizeof(version) + sizeof(poly_degree), sizeof(params_hash));
+
+    if (memcmp(data, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0 || version != SNAPSHOT_VERSION)
+    {
+        std::cerr << "Key snapshot has an unknown format or version" << std::endl;
+        return false;
+    }
+
+    if ((int)poly_degree != enc_init_params.polyDegree)
+    {
+        std::cerr << "Key snapshot is for poly modulus degree " << poly_degree << ", not " << enc_init_params.polyDegree << std::endl;
+        return false;
+    }
+
+    // the coefficient modulus bit sizes and the scale have to match as well, not only the number of moduli
+    if (params_hash != Transfer_Session::ParamsHash(enc_init_params))
+    {
+        std::cerr << "Key snapshot was saved with other encryption params" << std::endl;
+        return false;
+    }
+
+    size_t hashed_size = size - CryptoPP::SHA256::DIGESTSIZE;
+    if (!CryptoPP::SHA256().VerifyDigest((const CryptoPP::byte*)data + hashed_size, (const CryptoPP::byte*)data, hashed_size))
+    {
+        std::cerr << "Key snapshot hash doesn't match its content" << std::endl;
+        return false;
+    }
+
+    size_t offset = SNAPSHOT_HEADER_SIZE;
+    for (int i = 0; i < SNAPSHOT_NUM_SECTIONS; i++)
+    {
+        uint64_t length;
+        if (offset + sizeof(length) > hashed_size)
+        {
+            std::cerr << "Key snapshot is truncated" << std::endl;
+            return false;
+        }
+        memcpy(&length, data + offset, sizeof(length));
+        offset += sizeof(length);
+
+        if (length > hashed_size - offset)
+        {
+            std::cerr << "Key snapshot is truncated" << std::endl;
+            return false;
+        }
+        sections[i] = data + offset;
+        lengths[i] = length;
+        offset += length;
+    }
+
+    return true;
+}
+
+shared_ptr<seal_struct> Key_Snapshot::Load(const string& file_name, const utility::enc_init_params_s& enc_init_params)
+{
+    int fd = open(file_name.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        // no snapshot yet, the first start creates it
+        return nullptr;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size == 0)
+    {
+        close(fd);
+        return nullptr;
+    }
+
+    size_t size = st.st_size;
+    void* mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+    {
+        perror("Unable to map key snapshot");
+        return nullptr;
+    }
+
+    shared_ptr<seal_struct> seal;
+    const char* sections[SNAPSHOT_NUM_SECTIONS];
+    size_t lengths[SNAPSHOT_NUM_SECTIONS];
+
+    try
+    {
+        if (ParseSnapshot((const char*)mapping, size, enc_init_params, sections, lengths))
+        {
+            EncryptionParameters parms;
+            parms.load((const seal_byte*)sections[SNAPSHOT_PARMS], lengths[SNAPSHOT_PARMS]);
+
+            if (parms.coeff_modulus().size() != enc_init_params.bit_sizes.size())
+            {
+                std::cerr << "Key snapshot has " << parms.coeff_modulus().size() << " coefficient moduli, expected "
+                          << enc_init_params.bit_sizes.size() << std::endl;
+            }
+            else
+            {
+                Servers_Protocol srvProtocol;
+                shared_ptr<seal_struct> loaded = srvProtocol.gen_seal_context(parms.poly_modulus_degree(), parms.coeff_modulus(), enc_init_params.scale);
+
+                seal::PublicKey pk;
+                SecretKey sk;
+                RelinKeys relin_keys;
+                pk.load(loaded->context_ptr, (const seal_byte*)sections[SNAPSHOT_PK], lengths[SNAPSHOT_PK]);
+                sk.load(loaded->context_ptr, (const seal_byte*)sections[SNAPSHOT_SK], lengths[SNAPSHOT_SK]);
+                relin_keys.load(loaded->context_ptr, (const seal_byte*)sections[SNAPSHOT_RELIN_KEYS], lengths[SNAPSHOT_RELIN_KEYS]);
+
+                srvProtocol.set_public_key(loaded, pk);
+                srvProtocol.set_secret_key(loaded, sk, &relin_keys);
+                seal = loaded;
+            }
+        }
+    }
+    catch (const std::exception& e)
+    {
+        // SEAL checks the keys against the context while loading
+        std::cerr << "Key snapshot is invalid: " << e.what() << std::endl;
+        seal = nullptr;
+    }
+
+    munmap(mapping, size);
+
+    if (seal)
+    {
+        cout << "Loaded key snapshot " << file_name << endl;
+    }
+    return seal;
+}
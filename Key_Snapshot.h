@@ -0,0 +1,21 @@
+#pragma once
+
+#include "Servers_Protocol.h"
+#include "Transfer_Session.h"
+
+// Key_Snapshot - local binary copy of a server's SEAL state: encryption parameters, public key, secret key and
+// relinearization keys, so a restart maps one file instead of downloading the keys and generating new ones.
+// File layout: magic, version, poly modulus degree, the Transfer_Session::ParamsHash of the encryption params it was
+// saved with, then the four sections, each as a 64 bit length followed by
+// the SEAL serialization, and a SHA256 of everything before it.
+// A snapshot that is truncated, of another version, fails its hash or doesn't match the configured encryption
+// parameters is rejected, and the caller loads the keys the usual way.
+class Key_Snapshot
+{
+public:
+    // write the snapshot to a temporary file and rename it, so a reader never sees a partial snapshot
+    static bool Save(const string& file_name, const seal_struct& seal, const utility::enc_init_params_s& enc_init_params);
+
+    // map and validate the snapshot, returns nullptr if it can't be used
+    static shared_ptr<seal_struct> Load(const string& file_name, const utility::enc_init_params_s& enc_init_params);
+};
@@ -0,0 +1,152 @@
+#include "Latency_Histogram.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+
+// dump file layout: magic, version, sub bucket bits, total, max, then NUM_BUCKETS counts
+static const char HIST_MAGIC[4] = {'L', 'H', 'S', 'T'};
+static const uint32_t HIST_VERSION = 1;
+
+int Latency_Histogram::BucketIndex(long long value)
+{
+    if (value < SUB_BUCKETS)
+    {
+        return (value < 0) ? 0 : (int)value;
+    }
+
+    int msb = 63 - __builtin_clzll((unsigned long long)value);
+    int shift = msb - SUB_BUCKET_BITS;
+    int sub_bucket = (int)(value >> shift); // in [SUB_BUCKETS, 2 * SUB_BUCKETS)
+
+    return (shift + 1) * SUB_BUCKETS + (sub_bucket - SUB_BUCKETS);
+}
+
+long long Latency_Histogram::BucketUpperBound(int index)
+{
+    if (index < SUB_BUCKETS)
+    {
+        return index;
+    }
+
+    int shift = index / SUB_BUCKETS - 1;
+    long long sub_bucket = index % SUB_BUCKETS + SUB_BUCKETS;
+
+    return ((sub_bucket + 1) << shift) - 1;
+}
+
+void Latency_Histogram::Record(long long value_ns)
+{
+    _counts[BucketIndex(value_ns)]++;
+    _total++;
+    _max = std::max(_max, value_ns);
+}
+
+void Latency_Histogram::Merge(const Latency_Histogram& other)
+{
+    for (int i = 0; i < NUM_BUCKETS; i++)
+    {
+        _counts[i] += other._counts[i];
+    }
+    _total += other._total;
+    _max = std::max(_max, other._max);
+}
+
+void Latency_Histogram::Clear()
+{
+    std::fill(_counts.begin(), _counts.end(), 0);
+    _total = 0;
+    _max = 0;
+}
+
+long long Latency_Histogram::Percentile(double p) const
+{
+    if (_total == 0)
+    {
+        return 0;
+    }
+
+    uint64_t rank = std::max((uint64_t)1, (uint64_t)std::ceil(p / 100.0 * _total));
+    uint64_t seen = 0;
+
+    for (int i = 0; i < NUM_BUCKETS; i++)
+    {
+        seen += _counts[i];
+        if (seen >= rank)
+        {
+            return std::min(BucketUpperBound(i), _max);
+        }
+    }
+
+    return _max;
+}
+
+bool Latency_Histogram::Save(const string& fileName) const
+{
+    std::ofstream out_file(fileName, std::ios::out | std::ios::binary);
+    if (!out_file)
+    {
+        return false;
+    }
+
+    uint32_t sub_bucket_bits = SUB_BUCKET_BITS;
+    out_file.write(HIST_MAGIC, sizeof(HIST_MAGIC));
+    out_file.write(reinterpret_cast<const char*>(&HIST_VERSION), sizeof(HIST_VERSION));
+    out_file.write(reinterpret_cast<const char*>(&sub_bucket_bits), sizeof(sub_bucket_bits));
+    out_file.write(reinterpret_cast<const char*>(&_total), sizeof(_total));
+    out_file.write(reinterpret_cast<const char*>(&_max), sizeof(_max));
+    out_file.write(reinterpret_cast<const char*>(_counts.data()), NUM_BUCKETS * sizeof(uint64_t));
+
+    return out_file.good();
+}
+
+bool Latency_Histogram::Load(const string& fileName)
+{
+    std::ifstream in_file(fileName, std::ios::in | std::ios::binary);
+    if (!in_file)
+    {
+        return false;
+    }
+
+    char magic[sizeof(HIST_MAGIC)];
+    uint32_t version, sub_bucket_bits;
+    in_file.read(magic, sizeof(magic));
+    in_file.read(reinterpret_cast<char*>(&version), sizeof(version));
+    in_file.read(reinterpret_cast<char*>(&sub_bucket_bits), sizeof(sub_bucket_bits));
+
+    if (!in_file || std::memcmp(magic, HIST_MAGIC, sizeof(HIST_MAGIC)) != 0 || version != HIST_VERSION || sub_bucket_bits != SUB_BUCKET_BITS)
+    {
+        std::cout << "Error: " << fileName << " is not a compatible histogram dump" << std::endl;
+        return false;
+    }
+
+    Latency_Histogram loaded;
+    in_file.read(reinterpret_cast<char*>(&loaded._total), sizeof(loaded._total));
+    in_file.read(reinterpret_cast<char*>(&loaded._max), sizeof(loaded._max));
+    in_file.read(reinterpret_cast<char*>(loaded._counts.data()), NUM_BUCKETS * sizeof(uint64_t));
+
+    if (!in_file)
+    {
+        std::cout << "Error: " << fileName << " is truncated" << std::endl;
+        return false;
+    }
+
+    Merge(loaded);
+    return true;
+}
+
+std::string Latency_Histogram::getHeader(const string& stage)
+{
+    return stage + " p50," + stage + " p90," + stage + " p99," + stage + " max";
+}
+
+std::string Latency_Histogram::DumpFileName(const string& prefix, const string& stage, int run)
+{
+    return "/tmp/out/" + prefix + "_" + stage + "_" + ((run < 0) ? string("all") : std::to_string(run)) + ".hist";
+}
+
+std::ostream& operator<<(std::ostream& out, const Latency_Histogram& latencyHistogram)
+{
+    return out << latencyHistogram.Percentile(50) / 1000 << "," << latencyHistogram.Percentile(90) / 1000 << ","
+               << latencyHistogram.Percentile(99) / 1000 << "," << latencyHistogram.Max() / 1000;
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using std::string;
+using std::vector;
+
+// Latency_Histogram - HDR style histogram of durations in nanoseconds.
+// Values below SUB_BUCKETS are counted exactly. Above that every power of two range is split into SUB_BUCKETS
+// linear sub-buckets, so a reported percentile is within 1/SUB_BUCKETS (about 3%) of the recorded value.
+// Histograms of the same layout can be merged, in memory or through their binary dump files.
+// A histogram is not thread safe, each one is recorded by a single thread.
+class Latency_Histogram
+{
+private:
+    static const int SUB_BUCKET_BITS = 5;
+    static const int SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+    static const int NUM_BUCKETS = (64 - SUB_BUCKET_BITS) * SUB_BUCKETS;
+
+    vector<uint64_t> _counts;
+    uint64_t _total = 0;
+    long long _max = 0;
+
+    static int BucketIndex(long long value);
+    static long long BucketUpperBound(int index);
+
+public:
+    Latency_Histogram() : _counts(NUM_BUCKETS, 0) {}
+
+    void Record(long long value_ns);
+    void Merge(const Latency_Histogram& other);
+    void Clear();
+
+    uint64_t Count() const { return _total; }
+    long long Max() const { return _max; }
+
+    // value at or below which p percent of the recorded values are, 0 if nothing was recorded
+    long long Percentile(double p) const;
+
+    // binary dump, Load merges the file into this histogram so dumps of several runs can be aggregated
+    bool Save(const string& fileName) const;
+    bool Load(const string& fileName);
+
+    // csv columns for the percentiles of a stage
+    static std::string getHeader(const string& stage);
+
+    // /tmp/out/<prefix>_<stage>_<run>.hist, or <prefix>_<stage>_all.hist for a negative run
+    static std::string DumpFileName(const string& prefix, const string& stage, int run);
+};
+
+// p50, p90, p99 and max in microseconds, like the other metrics columns
+std::ostream& operator<<(std::ostream&, const Latency_Histogram& latencyHistogram);
@@ -0,0 +1,129 @@
+#include "Loopback_Bench.h"
+#include <unistd.h>
+#include <sys/socket.h>
+#include <signal.h>
+#include <thread>
+
+// constructor. Opens the combined report in the metrics folder
+Loopback_Bench::Loopback_Bench(string enc_init_params_file, bool test_mode, string report_name)
+{
+    _enc_init_params_file = enc_init_params_file;
+    _test_mode = test_mode;
+
+    // ignore sigpipe errors as the code will handle socket write errors
+    signal(SIGPIPE, SIG_IGN);
+
+    struct stat sb;
+    if (stat("/tmp/out", &sb))
+    {
+        mkdir("/tmp/out", S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
+    }
+
+    string report_path = "/tmp/out/" + report_name + ".csv";
+    _report_file.open(report_path);
+    if (!_report_file.is_open())
+    {
+        std::cout << "Unable to open file " << report_path << std::endl;
+        exit(1);
+    }
+
+    _report_file << getHeader() << endl;
+}
+
+// all stage times are in microseconds, the throughput is in data points per second
+std::string Loopback_Bench::getHeader()
+{
+    return "data points,mode,repetition," + DO_performance_metrics::getHeader() + "," + AS_performance_metrics::getHeader() + "," +
+           DS_performance_metrics::getHeader() + ",end2end_loopback,throughput";
+}
+
+static string ModeName(const loopback_mode_s& mode)
+{
+    string name = mode.batched ? "batched" : "unbatched";
+    if (mode.square_diff)
+        name += "+square_diff";
+    if (mode.deferred_rescale)
+        name += "+deferred_rescale";
+    if (mode.slot_packing)
+        name += "+slot_packing";
+
+    return name;
+}
+
+void Loopback_Bench::Run(const loopback_mode_s& mode, int repetition)
+{
+    auto storage = make_shared<Local_Storage>();
+    DO_performance_metrics doPerformanceMetrics;
+    AS_performance_metrics asPerformanceMetrics;
+    DS_performance_metrics dsPerformanceMetrics;
+    int sockets[2];
+
+    cout << "Loopback run: " << mode.data_points_num << " data points, " << ModeName(mode) << endl;
+
+    // the Destination Server generates the keys first, as it does when run with new keys
+    Destination_Server destination_server(mode.data_points_num, mode.batched, _enc_init_params_file, mode.square_diff, mode.deferred_rescale, mode.slot_packing);
+    Auxiliary_Server auxiliary_server(mode.data_points_num, false, mode.batched, _enc_init_params_file, nullptr, mode.slot_packing);
+    Data_Owner data_owner(_enc_init_params_file);
+
+    data_owner.SetStorage(storage);
+    auxiliary_server.SetStorage(storage);
+    destination_server.SetStorage(storage);
+
+    Trace_Span end2end_span("end2end_loopback");
+    Tracer::SetThreadName("Data Owner / DS receive");
+
+    // Data Owner: secret share, MAC and save to the storage
+    Trace_Span do_end2end_span("end2end_do");
+    data_owner.GenSecret(mode.data_points_num);
+    if (data_owner.GenSecretShareAndCompactMAC(doPerformanceMetrics, mode.batched) == 0)
+    {
+        throw std::runtime_error("Error generating secret shares and MAC");
+    }
+    doPerformanceMetrics.end2end = do_end2end_span.End();
+
+    if (_test_mode)
+    {
+        data_owner.SaveSecertToBucket();
+    }
+
+    // Destination Server keys, published to the Aux in process instead of through the bucket
+    destination_server.GetEncryptionParams(false, false);
+    auxiliary_server.SetSeal(destination_server.GetSeal());
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) < 0)
+    {
+        perror("Socketpair creation failed");
+        exit(1);
+    }
+
+    // Aux sends from its own thread, and returns once the Destination Server acknowledged the last ciphertext set
+    std::thread auxThread([&]() {
+        asPerformanceMetrics = auxiliary_server.EncryptAndSendData(sockets[0]);
+        close(sockets[0]);
+    });
+
+    Trace_Span ds_end2end_span("end2end_dest", &dsPerformanceMetrics.end2end);
+    destination_server.DeriveTransferKeys(&dsPerformanceMetrics);
+    destination_server.ReceiveAndProcess(sockets[1], &dsPerformanceMetrics);
+    ds_end2end_span.End();
+
+    auxThread.join();
+    close(sockets[1]);
+
+    long long end2end_time = end2end_span.End();
+    double throughput = mode.data_points_num / (end2end_time / 1e9);
+
+    _report_file << mode.data_points_num << "," << ModeName(mode) << "," << repetition << "," << doPerformanceMetrics << ","
+                 << asPerformanceMetrics << "," << dsPerformanceMetrics << "," << end2end_time / 1000 << "," << (ullong)throughput << endl;
+
+    if (!trace_file.empty())
+    {
+        Tracer::WriteRun(trace_file, _run);
+    }
+    _run++;
+
+    if (_test_mode)
+    {
+        destination_server.VerifyOutput(false);
+    }
+}
@@ -0,0 +1,43 @@
+#pragma once
+#include "seal/seal.h"
+#include "../Data_Owner/Data_Owner.h"
+#include "../Auxiliary_Server/Auxiliary_Server.h"
+#include "../Destination_Server/Destination_Server.h"
+
+using std::cout;  using std::endl;
+using std::string;
+
+// Protocol configuration of one loopback run
+struct loopback_mode_s
+{
+    int data_points_num;
+    bool batched;
+    bool square_diff;
+    bool deferred_rescale;
+    bool slot_packing;
+};
+
+// Loopback_Bench - runs the Data Owner, Auxiliary Server and Destination Server in one process.
+// The Data Owner saves to a Local_Storage instead of the S3 bucket, the Aux loads from it, and the
+// ciphertexts travel from the Aux to the Destination Server over a socketpair.
+// Each run adds a row with the per-stage metrics of all three parties to one combined report.
+class Loopback_Bench
+{
+private:
+    string _enc_init_params_file;
+    bool _test_mode;
+    std::ofstream _report_file;
+    int _run = 0;
+
+public:
+    Loopback_Bench(string enc_init_params_file, bool test_mode, string report_name);
+    ~Loopback_Bench() { _report_file.close(); }
+    Loopback_Bench(const Loopback_Bench& loopbackBench) {} //copy c'tor
+
+    string trace_file; // when set, a Chrome trace with all three parties is written for every run
+
+    // run the full protocol for the mode and add its metrics to the report
+    void Run(const loopback_mode_s& mode, int repetition);
+
+    static std::string getHeader();
+};
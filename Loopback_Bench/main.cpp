@@ -0,0 +1,166 @@
+#include <getopt.h>
+#include <sstream>
+#include "Loopback_Bench.h"
+
+void printHelp(void)
+{
+    std::cout <<
+            "--sizes <n1,n2,...>                  Numbers of secret values to transfer. Default is 16,4096,32768\n"
+            "--modes <m1,m2>                      MAC modes to run: unbatched, batched. Default is both\n"
+            "--enc_param_file <filename>          Read encryption params from a local file instead of defaults\n"
+            "--repeat_times <n>                   Number of times to repeat every run. Default is 1\n"
+            "--square_diff                        Destination Server performs square diff on the MAC verification output\n"
+            "--deferred_rescale                   Destination Server skips the reconstruction rescale and the unbatched square diff relin and rescale\n"
+            "--slot_packing                       Pack ciphertexts using at most half of the slots\n"
+            "--no_test_mode                       Do not validate output\n"
+            "--out <name>                         Report file name under /tmp/out, without extension. Default is loopback\n"
+            "--trace <filename>                   Write a Chrome trace JSON of every run (<filename>_<n>.json)\n"
+            "--perf_counters                      Report IPC and cache/branch misses per ciphertext of the Aux and Destination Server stages\n"
+            "--help                               Display this help message\n";
+    exit(1);
+
+}
+
+static vector<string> SplitList(const string& list)
+{
+    vector<string> items;
+    std::istringstream iss(list);
+    string item;
+
+    while (getline(iss, item, ','))
+    {
+        items.push_back(item);
+    }
+
+    return items;
+}
+
+
+// main function for the loopback benchmark
+// runs the Data Owner, Auxiliary Server and Destination Server in one process for every size and mode
+int main(int argc, char* argv[])
+{
+    // default command line argument values
+    vector<string> sizes = {"16", "4096", "32768"};
+    vector<string> modes = {"unbatched", "batched"};
+    string params_file = "";
+    string report_name = "loopback";
+    string trace_file = "";
+    int repeatTimes = 1;
+    bool test_mode = true;
+    bool square_diff = false;
+    bool deferred_rescale = false;
+    bool slot_packing = false;
+
+    const char* const short_opts = "z:c:e:m:o:x:qdktPh";
+    const option long_opts [] =
+    {
+            {"sizes", required_argument, nullptr, 'z'},
+            {"modes", required_argument, nullptr, 'c'},
+            {"enc_param_file", required_argument, nullptr, 'e'},
+            {"repeat_times", required_argument, nullptr, 'm'},
+            {"out", required_argument, nullptr, 'o'},
+            {"square_diff", no_argument, nullptr, 'q'},
+            {"deferred_rescale", no_argument, nullptr, 'd'},
+            {"slot_packing", no_argument, nullptr, 'k'},
+            {"no_test_mode", no_argument, nullptr, 't'},
+            {"trace", required_argument, nullptr, 'x'},
+            {"perf_counters", no_argument, nullptr, 'P'},
+            {"help", no_argument, nullptr, 'h'},
+            {nullptr, 0, nullptr, 0}
+    };
+
+    while (true)
+    {
+        const auto opt = getopt_long(argc, argv, short_opts, long_opts, nullptr);
+        if (-1 == opt)
+            break;
+
+        switch(opt)
+        {
+        case 'z':
+            sizes = SplitList(optarg);
+            break;
+
+        case 'c':
+            modes = SplitList(optarg);
+            break;
+
+        case 'e':
+            params_file = optarg;
+            break;
+
+        case 'm':
+            repeatTimes = std::stoi(optarg);
+            break;
+
+        case 'o':
+            report_name = optarg;
+            break;
+
+        case 'q':
+            square_diff = true;
+            break;
+
+        case 'd':
+            deferred_rescale = true;
+            break;
+
+        case 'k':
+            slot_packing = true;
+            break;
+
+        case 't':
+            test_mode = false;
+            break;
+
+        case 'x':
+            trace_file = optarg;
+            Tracer::Enable(true);
+            break;
+
+        case 'P':
+            Perf_Counters::Enable();
+            break;
+
+        case 'h':
+        case '?':
+        default:
+            printHelp();
+            break;
+
+        }
+
+    }
+
+    Loopback_Bench loopback_bench(params_file, test_mode, report_name);
+    loopback_bench.trace_file = trace_file;
+
+    for (const string& mode_name : modes)
+    {
+        if (mode_name != "unbatched" && mode_name != "batched")
+        {
+            std::cout << "Unknown mode " << mode_name << endl;
+            printHelp();
+        }
+
+        for (const string& size : sizes)
+        {
+            loopback_mode_s mode;
+            mode.data_points_num = std::stoi(size);
+            mode.batched = (mode_name == "batched");
+            mode.square_diff = square_diff;
+            mode.deferred_rescale = deferred_rescale;
+            mode.slot_packing = slot_packing;
+
+            for (int i = 0; i < repeatTimes; i++)
+            {
+                loopback_bench.Run(mode, i);
+            }
+        }
+    }
+
+    std::cout << "Report written to /tmp/out/" << report_name << ".csv" << endl;
+
+    return 0;
+}
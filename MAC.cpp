@@ -10,15 +10,16 @@ using namespace utility;
 MAC::MAC(enc_init_params_s enc_init_params)
 {
     _enc_init_params = enc_init_params;
+    _mod_arith = &Mod_Arith::For(enc_init_params.prime);
 }
 
 /**
  * Multiply Ciphertext by Plaintext in-place with rescaling and setting scale.
  */
-Ciphertext& MAC::mult_ct_pt_inplace(const shared_ptr<seal_struct> seal_struct, Ciphertext& ct, const Plaintext& pt)
+Ciphertext& MAC::mult_ct_pt_inplace(const shared_ptr<seal_struct>& seal_struct, Ciphertext& ct, const Plaintext& pt, MemoryPoolHandle pool)
 {
-    seal_struct->evaluator_ptr->multiply_plain_inplace(ct, pt);
-    seal_struct->evaluator_ptr->rescale_to_next_inplace(ct);
+    seal_struct->evaluator_ptr->multiply_plain_inplace(ct, pt, pool);
+    seal_struct->evaluator_ptr->rescale_to_next_inplace(ct, pool);
     ct.scale() = _enc_init_params.scale;
     return ct;
 }
@@ -26,11 +27,11 @@ Ciphertext& MAC::mult_ct_pt_inplace(const shared_ptr<seal_struct> seal_struct, C
 /**
  * Derive Key_Generator for compact MAC (unbatched) using HMAC.
  */
-Key_Generator MAC::Derive_compact_kmac_unbatched_single(CryptoPP::HMAC<SHA256>& hmac, ullong start_index, ullong amount)
+Key_Generator MAC::Derive_compact_kmac_unbatched_single(CryptoPP::HMAC<SHA256>& hmac, ullong start_index, ullong amount, MemoryPoolHandle pool)
 {
     std::string derivation_data("storage_test_MAC_");
 
-    Key_Generator kmac(_enc_init_params.prime);
+    Key_Generator kmac(_enc_init_params.prime, pool);
     kmac.derive_abcd(hmac, derivation_data, start_index, amount);
 
     return kmac;
@@ -39,16 +40,16 @@ Key_Generator MAC::Derive_compact_kmac_unbatched_single(CryptoPP::HMAC<SHA256>&
 /**
  * Compute single compact MAC for (x_int, x_frac).
  */
-single_mac_tag MAC::single_compact_mac(Key_Generator kmac, int index, double x_int, double x_frac)
+single_mac_tag MAC::single_compact_mac(const Key_Generator& kmac, int index, double x_int, double x_frac)
 {
     // y_r = sum(a_i * x_i) + b mod p
     double sum_dvY = kmac.a_int[index] * x_int + kmac.a_frac[index] * x_frac + kmac.b[index];
 
-    auto dvY = lldiv(sum_dvY, _enc_init_params.prime);
+    auto dvY = Mod_Arith::DivMod(*_mod_arith, (ullong)(sum_dvY));
     double y_r = double(dvY.rem);
     double y_q = double(dvY.quot);
 
-    auto dvYalpha = lldiv(y_q + kmac.c_alpha[index], _enc_init_params.prime);
+    auto dvYalpha = Mod_Arith::DivMod(*_mod_arith, (ullong)(y_q + kmac.c_alpha[index]));
     double y_alpha_frac = dvYalpha.rem;
     double y_alpha_int = fmod((dvYalpha.quot + kmac.d_alpha[index]), 2);
 
@@ -58,35 +59,37 @@ single_mac_tag MAC::single_compact_mac(Key_Generator kmac, int index, double x_i
 /**
  * Compute optimized batched compact MAC over a vector of inputs.
  */
-mac_tag_batched_optimized MAC::compact_mac_batched_optimized(Batched_Key_Generator kmac, vector<double> y_vec)
+mac_tag_batched_optimized MAC::compact_mac_batched_optimized(const Batched_Key_Generator& kmac, const vector<double>& y_vec)
 {
     double prime_square = std::pow(_enc_init_params.prime, 2);
 
     mac_tag_batched_optimized mac_optimized;
 
-    for (int i = 0; i < y_vec.size(); i++)
-    {
-        double sum_dvY = y_vec[i];
+    Mod_Arith::Dispatch(*_mod_arith, [&](auto arith) {
+        for (int i = 0; i < y_vec.size(); i++)
+        {
+            double sum_dvY = y_vec[i];
 
-        auto dvY = lldiv(sum_dvY, _enc_init_params.prime);
-        double y_r = double(dvY.rem);
-        double y_q = double(dvY.quot);
+            auto dvY = arith.DivMod((ullong)(sum_dvY));
+            double y_r = double(dvY.rem);
+            double y_q = double(dvY.quot);
 
-        auto alpha_beta = lldiv(y_q, _enc_init_params.prime);
-        double alpha = alpha_beta.quot;
-        double beta = alpha_beta.rem;
+            auto alpha_beta = arith.DivMod((ullong)(y_q));
+            double alpha = alpha_beta.quot;
+            double beta = alpha_beta.rem;
 
-        auto dvYalpha = lldiv(alpha + kmac.c_alpha[i], _enc_init_params.prime);
-        double y_alpha_frac = dvYalpha.rem;
-        double y_alpha_int = fmod((dvYalpha.quot + kmac.d_alpha[i]), 2);
+            auto dvYalpha = arith.DivMod((ullong)(alpha + kmac.c_alpha[i]));
+            double y_alpha_frac = dvYalpha.rem;
+            double y_alpha_int = fmod((dvYalpha.quot + kmac.d_alpha[i]), 2);
 
-        auto dvYbeta = lldiv(beta + kmac.c_beta[i], _enc_init_params.prime);
-        double y_beta_frac = dvYbeta.rem;
-        double y_beta_int = fmod((dvYbeta.quot + kmac.d_beta[i]), 2);
+            auto dvYbeta = arith.DivMod((ullong)(beta + kmac.c_beta[i]));
+            double y_beta_frac = dvYbeta.rem;
+            double y_beta_int = fmod((dvYbeta.quot + kmac.d_beta[i]), 2);
 
-        mac_optimized.mac_part1.push_back(y_alpha_frac * prime_square + y_beta_frac * _enc_init_params.prime + y_r);
-        mac_optimized.mac_part2.push_back((int(y_alpha_int) << 1) | int(y_beta_int));
-    }
+            mac_optimized.mac_part1.push_back(y_alpha_frac * prime_square + y_beta_frac * _enc_init_params.prime + y_r);
+            mac_optimized.mac_part2.push_back((int(y_alpha_int) << 1) | int(y_beta_int));
+        }
+    });
 
     return mac_optimized;
 }
@@ -132,25 +135,27 @@ compact_mac_tag MAC::compact_mac(vector<Batched_Key_Generator>& kmac_vec, vector
 
     cur_vec_size = vec_size;
 
-    for (int i = 0; i < cur_vec_size; i++)
-    {
-        auto dvY = lldiv(sum_dvY[i], _enc_init_params.prime);
-        y_r_vec[i] = double(dvY.rem);
-        double y_q = double(dvY.quot);
+    Mod_Arith::Dispatch(*_mod_arith, [&](auto arith) {
+        for (int i = 0; i < cur_vec_size; i++)
+        {
+            auto dvY = arith.DivMod((ullong)(sum_dvY[i]));
+            y_r_vec[i] = double(dvY.rem);
+            double y_q = double(dvY.quot);
 
-        auto alpha_beta = lldiv(y_q, _enc_init_params.prime);
+            auto alpha_beta = arith.DivMod((ullong)(y_q));
 
-        double alpha = alpha_beta.quot;
-        double beta = alpha_beta.rem;
+            double alpha = alpha_beta.quot;
+            double beta = alpha_beta.rem;
 
-        auto dvYalpha = lldiv(alpha + kmac_vec[i].c_alpha[0], _enc_init_params.prime);
-        y_alpha_frac_vec[i] = dvYalpha.rem;
-        y_alpha_int_vec[i] = fmod((dvYalpha.quot + kmac_vec[i].d_alpha[0]), 2);
+            auto dvYalpha = arith.DivMod((ullong)(alpha + kmac_vec[i].c_alpha[0]));
+            y_alpha_frac_vec[i] = dvYalpha.rem;
+            y_alpha_int_vec[i] = fmod((dvYalpha.quot + kmac_vec[i].d_alpha[0]), 2);
 
-        auto dvYbeta = lldiv(beta + kmac_vec[i].c_beta[0], _enc_init_params.prime);
-        y_beta_frac_vec[i] = dvYbeta.rem;
-        y_beta_int_vec[i] = fmod((dvYbeta.quot + kmac_vec[i].d_beta[0]), 2);
-    }
+            auto dvYbeta = arith.DivMod((ullong)(beta + kmac_vec[i].c_beta[0]));
+            y_beta_frac_vec[i] = dvYbeta.rem;
+            y_beta_int_vec[i] = fmod((dvYbeta.quot + kmac_vec[i].d_beta[0]), 2);
+        }
+    });
 
     compact_mac_tag tag;
     tag.y_r = make_shared<vector<double>>(y_r_vec);
@@ -165,30 +170,80 @@ compact_mac_tag MAC::compact_mac(vector<Batched_Key_Generator>& kmac_vec, vector
 /**
  * Verify y = a * x + b (batched, homomorphic)
  */
-Ciphertext MAC::verifyHE_batched_y(const shared_ptr<seal_struct> seal_struct, Batched_Key_Generator kmac, Ciphertext ct_x_int, Ciphertext ct_x_frac, DS_performance_metrics* performanceMetrics)
+void MAC::verifyHE_batched_y(const shared_ptr<seal_struct>& seal_struct, const Batched_Key_Generator& kmac, const Ciphertext& ct_x_int, const Ciphertext& ct_x_frac,
+    Ciphertext& ct_result, MemoryPoolHandle pool, DS_performance_metrics* performanceMetrics)
 {
-    Ciphertext ct_result;
-    Plaintext pt_a_int, pt_a_frac;
+    Plaintext pt_a_int(pool), pt_a_frac(pool);
+    Ciphertext ct_a_frac_x_frac(pool);
 
-    auto start_verify = utility::timer_start();
+    Trace_Span verify_span("verify", &performanceMetrics->verify);
 
-    seal_struct->encoder_ptr->encode(kmac.a_int, _enc_init_params.scale, pt_a_int);
-    seal_struct->encoder_ptr->encode(kmac.a_frac, _enc_init_params.scale, pt_a_frac);
+    seal_struct->encoder_ptr->encode(kmac.a_int.encode_view(), ct_x_int.parms_id(), _enc_init_params.scale, pt_a_int, pool);
+    seal_struct->encoder_ptr->encode(kmac.a_frac.encode_view(), ct_x_frac.parms_id(), _enc_init_params.scale, pt_a_frac, pool);
 
-    mult_ct_pt_inplace(seal_struct, ct_x_int, pt_a_int);
-    mult_ct_pt_inplace(seal_struct, ct_x_frac, pt_a_frac);
+    // multiply out-of-place so the secret share ciphertexts stay intact for reconstruction
+    seal_struct->evaluator_ptr->multiply_plain(ct_x_int, pt_a_int, ct_result, pool);
+    seal_struct->evaluator_ptr->rescale_to_next_inplace(ct_result, pool);
+    ct_result.scale() = _enc_init_params.scale;
 
-    seal_struct->evaluator_ptr->add(ct_x_int, ct_x_frac, ct_result);
+    seal_struct->evaluator_ptr->multiply_plain(ct_x_frac, pt_a_frac, ct_a_frac_x_frac, pool);
+    seal_struct->evaluator_ptr->rescale_to_next_inplace(ct_a_frac_x_frac, pool);
+    ct_a_frac_x_frac.scale() = _enc_init_params.scale;
 
-    performanceMetrics->verify += utility::timer_end(start_verify).count();
+    seal_struct->evaluator_ptr->add_inplace(ct_result, ct_a_frac_x_frac);
 
-    return ct_result;
+    verify_span.End();
+}
+
+/**
+ * Fused multiply-accumulate of the batched y term (homomorphic, no rescale)
+ */
+void MAC::accumulateHE_batched_y(const shared_ptr<seal_struct>& seal_struct, const Batched_Key_Generator& kmac, const Ciphertext& ct_x_int, const Ciphertext& ct_x_frac,
+    Ciphertext& acc, MemoryPoolHandle pool, DS_performance_metrics* performanceMetrics)
+{
+    Plaintext pt_a_int(pool), pt_a_frac(pool);
+    Ciphertext ct_product(pool);
+
+    Trace_Span verify_span("verify", &performanceMetrics->verify);
+
+    seal_struct->encoder_ptr->encode(kmac.a_int.encode_view(), ct_x_int.parms_id(), _enc_init_params.scale, pt_a_int, pool);
+    seal_struct->encoder_ptr->encode(kmac.a_frac.encode_view(), ct_x_frac.parms_id(), _enc_init_params.scale, pt_a_frac, pool);
+
+    // both products stay at the top level with scale^2, so they can be summed without any rescale
+    if (acc.size() == 0)
+    {
+        seal_struct->evaluator_ptr->multiply_plain(ct_x_int, pt_a_int, acc, pool);
+    }
+    else
+    {
+        seal_struct->evaluator_ptr->multiply_plain(ct_x_int, pt_a_int, ct_product, pool);
+        seal_struct->evaluator_ptr->add_inplace(acc, ct_product);
+    }
+
+    seal_struct->evaluator_ptr->multiply_plain(ct_x_frac, pt_a_frac, ct_product, pool);
+    seal_struct->evaluator_ptr->add_inplace(acc, ct_product);
+
+    verify_span.End();
+}
+
+/**
+ * Rescale the accumulated batched y term once
+ */
+void MAC::finalizeHE_batched_y(const shared_ptr<seal_struct>& seal_struct, Ciphertext& acc, MemoryPoolHandle pool, DS_performance_metrics* performanceMetrics)
+{
+    Trace_Span verify_span("verify", &performanceMetrics->verify);
+
+    seal_struct->evaluator_ptr->rescale_to_next_inplace(acc, pool);
+    acc.scale() = _enc_init_params.scale;
+
+    verify_span.End();
 }
 
 /**
  * Verify batched y_tag (homomorphic)
  */
-Ciphertext MAC::verifyHE_batched_y_tag(const shared_ptr<seal_struct> seal_struct, int len_vec, Batched_Key_Generator kmac, Ciphertext ct_tr, Ciphertext ct_alpha_int, Ciphertext ct_beta_int, DS_performance_metrics* performanceMetrics)
+void MAC::verifyHE_batched_y_tag(const shared_ptr<seal_struct>& seal_struct, int len_vec, const Batched_Key_Generator& kmac, Ciphertext& ct_tr, Ciphertext& ct_alpha_int, Ciphertext& ct_beta_int,
+    Ciphertext& y_comp, MemoryPoolHandle pool, DS_performance_metrics* performanceMetrics)
 {
     double p_square = _enc_init_params.prime * _enc_init_params.prime;
     double p_triple = p_square * _enc_init_params.prime;
@@ -197,7 +252,7 @@ Ciphertext MAC::verifyHE_batched_y_tag(const shared_ptr<seal_struct> seal_struct
     vector<double> signPSquare(len_vec, 1);
     vector<double> cleartext_calc(len_vec, 0);
 
-    auto start_verify = utility::timer_start();
+    Trace_Span verify_span("verify", &performanceMetrics->verify);
 
     for (int i = 0; i < len_vec; i++)
     {
@@ -208,7 +263,7 @@ Ciphertext MAC::verifyHE_batched_y_tag(const shared_ptr<seal_struct> seal_struct
         }
         else
         {
-            cleartext_calc[i] += -kmac.c_alpha[i] * p_square;
+            cleartext_calc[i] -= kmac.c_alpha[i] * p_square;
         }
 
         if (kmac.d_beta[i] == 1)
@@ -218,45 +273,45 @@ Ciphertext MAC::verifyHE_batched_y_tag(const shared_ptr<seal_struct> seal_struct
         }
         else
         {
-            cleartext_calc[i] += -kmac.c_beta[i] * _enc_init_params.prime;
+            cleartext_calc[i] -= (double)kmac.c_beta[i] * _enc_init_params.prime;
         }
 
         cleartext_calc[i] -= kmac.b[i];
     }
 
-    Plaintext pt_signPTriple, pt_signPSquare, cleartext_calc_pt;
-
-    seal_struct->encoder_ptr->encode(signPTriple, _enc_init_params.scale, pt_signPTriple);
-    seal_struct->encoder_ptr->encode(signPSquare, _enc_init_params.scale, pt_signPSquare);
+    Plaintext pt_signPTriple(pool), pt_signPSquare(pool), cleartext_calc_pt(pool);
 
-    Ciphertext y_comp;
+    seal_struct->encoder_ptr->encode(signPTriple, ct_alpha_int.parms_id(), _enc_init_params.scale, pt_signPTriple, pool);
+    seal_struct->encoder_ptr->encode(signPSquare, ct_beta_int.parms_id(), _enc_init_params.scale, pt_signPSquare, pool);
 
-    mult_ct_pt_inplace(seal_struct, ct_alpha_int, pt_signPTriple);
-    mult_ct_pt_inplace(seal_struct, ct_beta_int, pt_signPSquare);
+    mult_ct_pt_inplace(seal_struct, ct_alpha_int, pt_signPTriple, pool);
+    mult_ct_pt_inplace(seal_struct, ct_beta_int, pt_signPSquare, pool);
 
-    seal_struct->evaluator_ptr->add(ct_alpha_int, ct_beta_int, y_comp);
+    seal_struct->evaluator_ptr->add_inplace(ct_alpha_int, ct_beta_int);
 
-    seal_struct->evaluator_ptr->mod_switch_to_inplace(ct_tr, y_comp.parms_id());
-    seal_struct->evaluator_ptr->add_inplace(y_comp, ct_tr);
+    seal_struct->evaluator_ptr->mod_switch_to_inplace(ct_tr, ct_alpha_int.parms_id(), pool);
+    seal_struct->evaluator_ptr->add_inplace(ct_alpha_int, ct_tr);
 
-    seal_struct->encoder_ptr->encode(cleartext_calc, y_comp.parms_id(), _enc_init_params.scale, cleartext_calc_pt);
-    seal_struct->evaluator_ptr->add_plain_inplace(y_comp, cleartext_calc_pt);
+    seal_struct->encoder_ptr->encode(cleartext_calc, ct_alpha_int.parms_id(), _enc_init_params.scale, cleartext_calc_pt, pool);
+    seal_struct->evaluator_ptr->add_plain_inplace(ct_alpha_int, cleartext_calc_pt, pool);
 
-    performanceMetrics->verify += utility::timer_end(start_verify).count();
+    // the alpha ciphertext now holds the full y_tag value, hand its buffers over instead of copying
+    y_comp = std::move(ct_alpha_int);
 
-    return y_comp;
+    verify_span.End();
 }
 
 /**
  * Verify compact MAC (unbatched, homomorphic)
  */
-const Ciphertext& MAC::compact_unbatched_VerifyHE(const shared_ptr<seal_struct> seal_struct, Key_Generator kmac, Ciphertext& x_int, Ciphertext& x_frac, mac_tag_ct& tag_he, bool squareDiff, int len, DS_performance_metrics* performanceMetrics)
+void MAC::compact_unbatched_VerifyHE(const shared_ptr<seal_struct>& seal_struct, const Key_Generator& kmac, const Ciphertext& x_int, const Ciphertext& x_frac, mac_tag_ct& tag_he,
+    bool squareDiff, bool lazyRelin, int len, Ciphertext& diff_out, MemoryPoolHandle pool, DS_performance_metrics* performanceMetrics)
 {
     double p_square = _enc_init_params.prime * _enc_init_params.prime;
     vector<double> signPSquare(len, p_square);
     vector<double> cleartext_calc(len, 0);
 
-    auto start_verify = utility::timer_start();
+    Trace_Span verify_span("verify", &performanceMetrics->verify);
 
     for (int i = 0; i < len; i++)
     {
@@ -267,47 +322,114 @@ const Ciphertext& MAC::compact_unbatched_VerifyHE(const shared_ptr<seal_struct>
         }
         else
         {
-            cleartext_calc[i] = -kmac.c_alpha[i] * _enc_init_params.prime - kmac.b[i];
+            cleartext_calc[i] = -(double)kmac.c_alpha[i] * _enc_init_params.prime - kmac.b[i];
         }
     }
 
-    Plaintext pt_signPSquare, cleartext_calc_pt;
+    Plaintext pt_signPSquare(pool), pt_ones(pool), cleartext_calc_pt(pool);
 
-    seal_struct->encoder_ptr->encode(signPSquare, _enc_init_params.scale, pt_signPSquare);
+    // z_q * (-1)^d * p^2 and t_r times a plaintext of ones are summed at scale^2 and rescaled once. Both plaintexts are
+    // zero after the data points, so the slots after them are zero in the diff, also when a slot packed t_r holds z_q there
+    seal_struct->evaluator_ptr->mod_switch_to_inplace(*tag_he.t_r_ct, tag_he.z_qmskd_ct->parms_id(), pool);
 
-    mult_ct_pt_inplace(seal_struct, *tag_he.z_qmskd_ct, pt_signPSquare);
+    seal_struct->encoder_ptr->encode(signPSquare, tag_he.z_qmskd_ct->parms_id(), _enc_init_params.scale, pt_signPSquare, pool);
+    seal_struct->evaluator_ptr->multiply_plain_inplace(*tag_he.z_qmskd_ct, pt_signPSquare, pool);
 
-    Ciphertext y_comp;
-    seal_struct->evaluator_ptr->mod_switch_to_inplace(*tag_he.t_r_ct, tag_he.z_qmskd_ct->parms_id());
-    seal_struct->evaluator_ptr->add(*tag_he.t_r_ct, *tag_he.z_qmskd_ct, y_comp);
+    seal_struct->encoder_ptr->encode(vector<double>(len, 1), tag_he.t_r_ct->parms_id(), _enc_init_params.scale, pt_ones, pool);
+    seal_struct->evaluator_ptr->multiply_plain_inplace(*tag_he.t_r_ct, pt_ones, pool);
 
-    seal_struct->encoder_ptr->encode(cleartext_calc, y_comp.parms_id(), _enc_init_params.scale, cleartext_calc_pt);
-    seal_struct->evaluator_ptr->add_plain_inplace(y_comp, cleartext_calc_pt);
+    seal_struct->evaluator_ptr->add_inplace(*tag_he.z_qmskd_ct, *tag_he.t_r_ct);
+    seal_struct->evaluator_ptr->rescale_to_next_inplace(*tag_he.z_qmskd_ct, pool);
+    tag_he.z_qmskd_ct->scale() = _enc_init_params.scale;
 
-    Plaintext a_int_pt, a_frac_pt;
-    seal_struct->encoder_ptr->encode(kmac.a_int, x_int.parms_id(), _enc_init_params.scale, a_int_pt);
-    seal_struct->encoder_ptr->encode(kmac.a_frac, x_frac.parms_id(), _enc_init_params.scale, a_frac_pt);
+    // the tag ciphertext is consumed here, move it into the output rather than copying
+    diff_out = std::move(*tag_he.z_qmskd_ct);
 
-    mult_ct_pt_inplace(seal_struct, x_int, a_int_pt);
-    mult_ct_pt_inplace(seal_struct, x_frac, a_frac_pt);
+    seal_struct->encoder_ptr->encode(cleartext_calc, diff_out.parms_id(), _enc_init_params.scale, cleartext_calc_pt, pool);
+    seal_struct->evaluator_ptr->add_plain_inplace(diff_out, cleartext_calc_pt, pool);
 
-    seal_struct->evaluator_ptr->add_inplace(x_int, x_frac);
-    seal_struct->evaluator_ptr->sub(y_comp, x_int, x_int);
+    Plaintext a_int_pt(pool), a_frac_pt(pool);
+    Ciphertext ax_int(pool), ax_frac(pool);
+    seal_struct->encoder_ptr->encode(kmac.a_int.encode_view(), x_int.parms_id(), _enc_init_params.scale, a_int_pt, pool);
+    seal_struct->encoder_ptr->encode(kmac.a_frac.encode_view(), x_frac.parms_id(), _enc_init_params.scale, a_frac_pt, pool);
 
-    performanceMetrics->verify += utility::timer_end(start_verify).count();
+    // multiply out-of-place so the secret share ciphertexts stay intact for reconstruction
+    seal_struct->evaluator_ptr->multiply_plain(x_int, a_int_pt, ax_int, pool);
+    seal_struct->evaluator_ptr->rescale_to_next_inplace(ax_int, pool);
+    ax_int.scale() = _enc_init_params.scale;
+
+    seal_struct->evaluator_ptr->multiply_plain(x_frac, a_frac_pt, ax_frac, pool);
+    seal_struct->evaluator_ptr->rescale_to_next_inplace(ax_frac, pool);
+    ax_frac.scale() = _enc_init_params.scale;
+
+    seal_struct->evaluator_ptr->add_inplace(ax_int, ax_frac);
+    seal_struct->evaluator_ptr->sub_inplace(diff_out, ax_int);
+
+    verify_span.End();
 
     // Optionally compute squared difference for tighter validation
     if (squareDiff)
     {
-        auto start_square_diff = utility::timer_start();
+        Trace_Span square_diff_span("square_diff", &performanceMetrics->square_diff);
+
+        seal_struct->evaluator_ptr->square_inplace(diff_out, pool);
+
+        // the squared difference is only decrypted, and the decryptor handles size 3 ciphertexts at any scale
+        if (!lazyRelin)
+        {
+            seal_struct->evaluator_ptr->relinearize_inplace(diff_out, *seal_struct->relink_ptr, pool);
+            seal_struct->evaluator_ptr->rescale_to_next_inplace(diff_out, pool);
+            diff_out.scale() = _enc_init_params.scale;
+        }
+
+        square_diff_span.End();
+    }
+}
+
+/**
+ * Random linear combination of the MAC diffs, summed over all slots
+ */
+void MAC::aggregateHE_diffs(const shared_ptr<seal_struct>& seal_struct, vector<Ciphertext>& diffs, Ciphertext& aggregated, MemoryPoolHandle pool)
+{
+    int slot_count = seal_struct->encoder_ptr->slot_count();
+
+    // the squared diffs are nonnegative, so a forged slot can't be cancelled by another one and no weights are needed
+    for (size_t i = 0; i < diffs.size(); i++)
+    {
+        Ciphertext& diff = diffs[i];
 
-        seal_struct->evaluator_ptr->square_inplace(x_int);
-        seal_struct->evaluator_ptr->relinearize_inplace(x_int, *seal_struct->relink_ptr);
-        seal_struct->evaluator_ptr->rescale_to_next_inplace(x_int);
-        x_int.scale() = _enc_init_params.scale;
+        // an unrelinearized squared diff can't be rotated
+        if (diff.size() > 2)
+        {
+            seal_struct->evaluator_ptr->relinearize_inplace(diff, *seal_struct->relink_ptr, pool);
+        }
 
-        performanceMetrics->square_diff += utility::timer_end(start_square_diff).count();
+        if (i == 0)
+        {
+            aggregated = std::move(diff);
+        }
+        else
+        {
+            seal_struct->evaluator_ptr->add_inplace(aggregated, diff);
+        }
     }
+    diffs.clear();
 
-    return x_int;
+    // after the rotation by s, every slot holds the sum of 2s slots
+    Ciphertext rotated(pool);
+    for (int step : aggregateRotationSteps(slot_count))
+    {
+        seal_struct->evaluator_ptr->rotate_vector(aggregated, step, *seal_struct->galois_ptr, rotated, pool);
+        seal_struct->evaluator_ptr->add_inplace(aggregated, rotated);
+    }
+}
+
+vector<int> MAC::aggregateRotationSteps(int slot_count)
+{
+    vector<int> steps;
+    for (int step = 1; step < slot_count; step *= 2)
+    {
+        steps.push_back(step);
+    }
+    return steps;
 }
@@ -11,6 +11,7 @@
 #include "Utility.h"
 #include "Secret_Sharing.h"
 #include "Key_Generator.h"
+#include "Mod_Arith.h"
 #include "Destination_Server/DS_Performance_metrics.h"
 
 using std::shared_ptr, std::make_shared;
@@ -80,6 +81,9 @@ private:
     // Encryption parameters used in HE operations
     enc_init_params_s _enc_init_params;
 
+    // Reduction by the prime, resolved once from the encryption parameters
+    const mod_arith_s* _mod_arith;
+
     // Buffers for intermediate results in batched MAC accumulation
     std::vector<Ciphertext> a_int_times_x_int;
     std::vector<Ciphertext> a_frac_times_x_frac;
@@ -103,9 +107,10 @@ public:
      * @param seal_struct SEAL context and keys
      * @param ct Ciphertext to multiply (in-place)
      * @param pt Plaintext multiplier
+     * @param pool Memory pool used for temporary allocations
      * @return Reference to modified ciphertext
      */
-    Ciphertext& mult_ct_pt_inplace(const shared_ptr<seal_struct> seal_struct, Ciphertext& ct, const Plaintext& pt);
+    Ciphertext& mult_ct_pt_inplace(const shared_ptr<seal_struct>& seal_struct, Ciphertext& ct, const Plaintext& pt, MemoryPoolHandle pool = MemoryManager::GetPool());
 
     // --------------------------------------------------------------------
     // Batched MAC Functions
@@ -117,7 +122,7 @@ public:
      * @param y_vec Vector of input values
      * @return Optimized batched MAC tag
      */
-    mac_tag_batched_optimized compact_mac_batched_optimized(Batched_Key_Generator kmac, std::vector<double> y_vec);
+    mac_tag_batched_optimized compact_mac_batched_optimized(const Batched_Key_Generator& kmac, const std::vector<double>& y_vec);
 
     /**
      * Generate compact batched MAC tag.
@@ -131,27 +136,58 @@ public:
 
     /**
      * Verify batched MAC (compute y term).
+     * The input ciphertexts are left untouched, so the caller can reuse them for reconstruction.
      * @param seal_struct SEAL context and keys
      * @param kmac Batched key generator
      * @param ct_x_int Ciphertext of integer part
      * @param ct_x_frac Ciphertext of fractional part
+     * @param ct_result Output ciphertext of verification result
+     * @param pool Memory pool used for temporary allocations
+     * @param performanceMetrics Metrics for performance evaluation
+     */
+    void verifyHE_batched_y(const shared_ptr<seal_struct>& seal_struct, const Batched_Key_Generator& kmac, const Ciphertext& ct_x_int, const Ciphertext& ct_x_frac,
+        Ciphertext& ct_result, MemoryPoolHandle pool, DS_performance_metrics* performanceMetrics);
+
+    /**
+     * Fused multiply-accumulate of the batched y term: acc += a_int * x_int + a_frac * x_frac.
+     * The products are kept at the top level with scale^2 and summed in NTT form without rescaling,
+     * so a whole aggregation pays a single rescale in finalizeHE_batched_y instead of two per ciphertext.
+     * An empty accumulator (size 0) is initialized by the first call.
+     * @param seal_struct SEAL context and keys
+     * @param kmac Batched key generator
+     * @param ct_x_int Ciphertext of integer part (left untouched)
+     * @param ct_x_frac Ciphertext of fractional part (left untouched)
+     * @param acc Accumulator ciphertext
+     * @param pool Memory pool used for temporary allocations
+     * @param performanceMetrics Metrics for performance evaluation
+     */
+    void accumulateHE_batched_y(const shared_ptr<seal_struct>& seal_struct, const Batched_Key_Generator& kmac, const Ciphertext& ct_x_int, const Ciphertext& ct_x_frac,
+        Ciphertext& acc, MemoryPoolHandle pool, DS_performance_metrics* performanceMetrics);
+
+    /**
+     * Finish an accumulation started by accumulateHE_batched_y: one rescale and reset of the scale.
+     * @param seal_struct SEAL context and keys
+     * @param acc Accumulator ciphertext (modified in place)
+     * @param pool Memory pool used for temporary allocations
      * @param performanceMetrics Metrics for performance evaluation
-     * @return Ciphertext of verification result
      */
-    Ciphertext verifyHE_batched_y(const shared_ptr<seal_struct> seal_struct, Batched_Key_Generator kmac, Ciphertext ct_x_int, Ciphertext ct_x_frac, DS_performance_metrics* performanceMetrics);
+    void finalizeHE_batched_y(const shared_ptr<seal_struct>& seal_struct, Ciphertext& acc, MemoryPoolHandle pool, DS_performance_metrics* performanceMetrics);
 
     /**
      * Verify batched MAC tag (compute y_tag term).
+     * The tag ciphertexts are consumed: they are modified in place and the result is moved out of them.
      * @param seal_struct SEAL context and keys
      * @param len_vec Length of vector
      * @param kmac Batched key generator
-     * @param ct_tr Ciphertext of tag
-     * @param ct_alpha_int Ciphertext of alpha integer part
-     * @param ct_beta_int Ciphertext of beta integer part
+     * @param ct_tr Ciphertext of tag (modified in place)
+     * @param ct_alpha_int Ciphertext of alpha integer part (modified in place)
+     * @param ct_beta_int Ciphertext of beta integer part (modified in place)
+     * @param y_comp Output ciphertext of verification result
+     * @param pool Memory pool used for temporary allocations
      * @param performanceMetrics Metrics for performance evaluation
-     * @return Ciphertext of verification result
      */
-    Ciphertext verifyHE_batched_y_tag(const shared_ptr<seal_struct> seal_struct, int len_vec, Batched_Key_Generator kmac, Ciphertext ct_tr, Ciphertext ct_alpha_int, Ciphertext ct_beta_int, DS_performance_metrics* performanceMetrics);
+    void verifyHE_batched_y_tag(const shared_ptr<seal_struct>& seal_struct, int len_vec, const Batched_Key_Generator& kmac, Ciphertext& ct_tr, Ciphertext& ct_alpha_int, Ciphertext& ct_beta_int,
+        Ciphertext& y_comp, MemoryPoolHandle pool, DS_performance_metrics* performanceMetrics);
 
     // --------------------------------------------------------------------
     // Unbatched MAC Functions
@@ -162,9 +198,10 @@ public:
      * @param hmac HMAC object for key derivation
      * @param start_index Starting index for key derivation
      * @param amount Number of keys to derive
+     * @param pool Memory pool the keys are allocated from
      * @return Derived key generator
      */
-    Key_Generator Derive_compact_kmac_unbatched_single(CryptoPP::HMAC<SHA256>& hmac, ullong start_index, ullong amount);
+    Key_Generator Derive_compact_kmac_unbatched_single(CryptoPP::HMAC<SHA256>& hmac, ullong start_index, ullong amount, MemoryPoolHandle pool = MemoryManager::GetPool());
 
     /**
      * Generate a compact MAC tag for a single input.
@@ -174,21 +211,44 @@ public:
      * @param x_frac Fractional part of input
      * @return Single MAC tag
      */
-    single_mac_tag single_compact_mac(Key_Generator kmac, int index, double x_int, double x_frac);
+    single_mac_tag single_compact_mac(const Key_Generator& kmac, int index, double x_int, double x_frac);
 
     /**
      * Verify compact MAC for unbatched input (HE version).
+     * The secret share ciphertexts are left untouched, the tag ciphertexts are consumed.
      * @param seal_struct SEAL context and keys
      * @param kmac Key generator
      * @param x_int Ciphertext of integer part
      * @param x_frac Ciphertext of fractional part
-     * @param tag_he MAC tag (HE)
+     * @param tag_he MAC tag (HE), modified in place
      * @param squareDiff If true, compute squared difference; otherwise linear
+     * @param lazyRelin If true, the squared difference is left unrelinearized and unrescaled (size 3, scale^2),
+     *        which is enough for decryption and saves the relinearization and a level
      * @param len Input length
+     * @param diff_out Output ciphertext of verification result
+     * @param pool Memory pool used for temporary allocations
      * @param performanceMetrics Metrics for performance evaluation
-     * @return Ciphertext of verification result
      */
-    const Ciphertext& compact_unbatched_VerifyHE(const shared_ptr<seal_struct> seal_struct, Key_Generator kmac, Ciphertext& x_int,
-        Ciphertext& x_frac, mac_tag_ct& tag_he, bool squareDiff, int len, DS_performance_metrics* performanceMetrics);
+    void compact_unbatched_VerifyHE(const shared_ptr<seal_struct>& seal_struct, const Key_Generator& kmac, const Ciphertext& x_int,
+        const Ciphertext& x_frac, mac_tag_ct& tag_he, bool squareDiff, bool lazyRelin, int len, Ciphertext& diff_out, MemoryPoolHandle pool, DS_performance_metrics* performanceMetrics);
+
+    // --------------------------------------------------------------------
+    // MAC diff aggregation
+    // --------------------------------------------------------------------
+
+    /**
+     * Combine all squared MAC diff ciphertexts into one, whose first slot holds the sum of every diff value.
+     * The ciphertexts are added, then the slots are summed with log2(slots) rotations. The diffs must be squared:
+     * as every value is nonnegative, a value at or above the per value epsilon keeps the sum there too, while
+     * signed diffs of a forgery could cancel each other. The Galois keys must hold the steps of aggregateRotationSteps.
+     * @param seal_struct SEAL context and keys
+     * @param diffs Squared diff ciphertexts, consumed
+     * @param aggregated Output ciphertext
+     * @param pool Memory pool used for temporary allocations
+     */
+    void aggregateHE_diffs(const shared_ptr<seal_struct>& seal_struct, vector<Ciphertext>& diffs, Ciphertext& aggregated, MemoryPoolHandle pool = MemoryManager::GetPool());
+
+    // Rotation steps needed by aggregateHE_diffs: 1, 2, 4, ... up to half the slots
+    static vector<int> aggregateRotationSteps(int slot_count);
 
 };
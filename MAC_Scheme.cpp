@@ -0,0 +1,383 @@
+#include "MAC_Scheme.h"
+#include "Servers_Protocol.h"
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <sstream>
+
+static std::vector<double> concat(std::vector<double>& first, const std::vector<double>& second)
+{
+    first.insert(first.end(), second.begin(), second.end());
+    return std::move(first);
+}
+
+// extract the mac values from the doubles read from the bucket, val = z_q * p^2 + z_r * p + y_r
+// temp = double val / p
+// y_r = double val % p
+// z_q = temp / p
+// z_r = temp % p
+static void parse_double_into_mac(const std::vector<double>& values, std::vector<std::vector<double>>& enc_vector_list, long index, const mod_arith_s& mod_arith)
+{
+    Mod_Arith::Dispatch(mod_arith, [&](auto arith) {
+        for (double val : values)
+        {
+            double z_q, z_r, y_r;
+
+            mod_divmod_s dv = arith.DivMod((ullong)val);
+            y_r = dv.rem;
+            dv = arith.DivMod(dv.quot);
+            z_q = dv.quot;
+            z_r = dv.rem;
+
+            enc_vector_list[index].push_back(z_r);
+            enc_vector_list[index + 1].push_back(y_r);
+            enc_vector_list[index + 2].push_back(z_q);
+        }
+    });
+}
+
+static void parse_double_into_mac_batched_part1(const std::vector<double>& values, std::vector<std::vector<double>>& enc_vector_list, long index, const mod_arith_s& mod_arith)
+{
+    // No need for parsing here, as the restore is done on the same value.
+    enc_vector_list[index].insert(enc_vector_list[index].end(), values.begin(), values.end());
+}
+
+static void parse_double_into_mac_batched_part2(const std::vector<double>& values, std::vector<std::vector<double>>& enc_vector_list, long index, const mod_arith_s& mod_arith)
+{
+    double pSquare = pow(mod_arith.prime(), 2);
+    double pTriple = pow(mod_arith.prime(), 3);
+
+    for (double val : values)
+    {
+        double alpha_int, beta_int;
+
+        alpha_int = (((int)val >> 1) & 0x1) * pTriple;
+        beta_int = ((int)val & 0x1) * pSquare;
+
+        enc_vector_list[index].push_back(alpha_int);
+        enc_vector_list[index + 1].push_back(beta_int);
+    }
+}
+
+void MAC_Scheme::PackSlots(std::vector<std::vector<double>>& enc_vector_list) const
+{
+    std::vector<std::vector<double>> packed_list;
+
+    packed_list.push_back(concat(enc_vector_list[ENC_VEC_SENT_X_INT_IDX], enc_vector_list[ENC_VEC_SENT_X_FRAC_IDX]));
+    PackTagVectors(enc_vector_list, packed_list);
+
+    enc_vector_list = std::move(packed_list);
+}
+
+std::shared_ptr<const MAC_Scheme> MAC_Scheme::Create(bool batched)
+{
+    if (batched)
+    {
+        return std::make_shared<Batched_MAC_Scheme>();
+    }
+
+    return std::make_shared<Unbatched_MAC_Scheme>();
+}
+
+std::shared_ptr<const MAC_Scheme> MAC_Scheme::FromSessionMode(uint32_t mode)
+{
+    return Create((mode & SESSION_MODE_BATCHED) != 0);
+}
+
+// one tag per data point, with its own keys derived from the hmac of the mac key
+void Unbatched_MAC_Scheme::GenerateTags(const enc_init_params_s& enc_init_params, const byte* mac_key, const std::vector<double>& x_int, const std::vector<double>& x_frac,
+                                        std::string& tags_sq, std::string& tags_sr) const
+{
+    MAC mac(enc_init_params);
+    CryptoPP::HMAC<CryptoPP::SHA256> hmac_tag(mac_key, KEY_SIZE_BYTES);
+    double prime_square = pow(enc_init_params.prime, 2);
+    std::ostringstream os_tag;
+
+    // the keys of every data point are derived into the same lanes
+    Key_Generator kmac(enc_init_params.prime);
+
+    for (size_t i = 0; i < x_int.size(); i++)
+    {
+        kmac.derive_abcd(hmac_tag, constants::MAC_DERIVE_KEY, i, 1);
+        single_mac_tag tag = mac.single_compact_mac(kmac, 0, x_int[i], x_frac[i]);
+
+        // the mac values are stored as: z_mskd*p^2 + z_r*p + y_r
+        double calc_for_store = tag.z_qmskd * prime_square + tag.z_r * enc_init_params.prime + tag.y_r;
+        os_tag.write(reinterpret_cast<const char*>(&calc_for_store), sizeof(double));
+    }
+
+    tags_sq = os_tag.str();
+    tags_sr.clear();
+}
+
+// every set has its own keys and its own diff
+void Unbatched_MAC_Scheme::VerifySet(const mac_transfer_s& transfer, MAC& mac, const mac_verify_set_s& set, MemoryPoolHandle pool, DS_performance_metrics* performanceMetrics) const
+{
+    const std::vector<std::string>& str_vec = *set.str_vec;
+    const shared_ptr<seal_struct>& seal = transfer.seal;
+    int index_base = set.ct_index * transfer.enc_init_params->max_ct_entries;
+
+    Trace_Span derive_kmac_span("derive_kmacs", &performanceMetrics->derive_kmacs);
+    // the keys of the ciphertext are placed in memory of the worker's pool, reused by its next ciphertext
+    Key_Generator kmac_sq = mac.Derive_compact_kmac_unbatched_single(*transfer.hmac_sq, index_base, set.ct_num_of_data_points, pool);
+    derive_kmac_span.End();
+
+    mac_tag_ct macTagCT_sq;
+
+    // deserialize the tags straight into the shared ciphertexts used by the verification
+    macTagCT_sq.t_r_ct = make_shared<Ciphertext>(pool);
+    macTagCT_sq.z_qmskd_ct = make_shared<Ciphertext>(pool);
+
+    Trace_Span deserialize_mac_span("deserialize_macs", &performanceMetrics->deserialize_macs);
+    if (set.packed)
+    {
+        // [z_q | t_r], the rotated t_r carries z_q into its last slots, the MAC clears them like Rec_CT clears x_frac's
+        utility::deserialize_fhe(str_vec[PACKED_TAG_IDX].c_str(), std::stol(str_vec[PACKED_TAG_SIZE]), *macTagCT_sq.z_qmskd_ct, seal->context_ptr);
+        seal->evaluator_ptr->rotate_vector(*macTagCT_sq.z_qmskd_ct, set.ct_num_of_data_points, *seal->galois_ptr, *macTagCT_sq.t_r_ct, pool);
+    }
+    else
+    {
+        utility::deserialize_fhe(str_vec[SQ_TR_IDX].c_str(), std::stol(str_vec[SQ_TR_SIZE]), *macTagCT_sq.t_r_ct, seal->context_ptr);
+        utility::deserialize_fhe(str_vec[SQ_ZQMSKD_IDX].c_str(), std::stol(str_vec[SQ_ZQMSKD_SIZE]), *macTagCT_sq.z_qmskd_ct, seal->context_ptr);
+    }
+    deserialize_mac_span.End();
+
+    Ciphertext diff_SQ_CT(pool);
+    Trace_Span verify_ct_span(nullptr);
+    Perf_Span verify_perf_span(&performanceMetrics->verify_perf);
+    mac.compact_unbatched_VerifyHE(seal, kmac_sq, *set.ct_int, *set.ct_frac, macTagCT_sq, transfer.square_diff, transfer.deferred_rescale, set.ct_num_of_data_points, diff_SQ_CT, pool, performanceMetrics);
+    verify_perf_span.End();
+    performanceMetrics->verify_hist.Record(verify_ct_span.End());
+
+    (*transfer.diffs)[set.set_index] = std::move(diff_SQ_CT);
+}
+
+int Unbatched_MAC_Scheme::MacCtNum(int data_points_num, int max_ct_entries) const
+{
+    return (data_points_num + max_ct_entries - 1) / max_ct_entries;
+}
+
+int Unbatched_MAC_Scheme::SetCtCount(bool has_tags, bool packed) const
+{
+    return packed ? PACKED_MAX_IDX_WITH_UNBATCHED_MAC : MAX_IDX_WITH_UNBATCHED_MAC;
+}
+
+std::vector<mac_tag_object_s> Unbatched_MAC_Scheme::TagObjects(const std::string& dataset, int data_points_num, int max_ct_entries) const
+{
+    mac_tag_object_s sq_data;
+    sq_data.object_name = utility::DatasetObjectName(dataset, TAGS_SQ_DIR);
+    sq_data.buffer_size = sizeof(double) * data_points_num;
+    sq_data.item_size = sizeof(double);
+    sq_data.parse_func = &parse_double_into_mac;
+    sq_data.num_of_parsed_items = 3;
+
+    return {sq_data};
+}
+
+void Unbatched_MAC_Scheme::PrepareTagVectors(std::vector<std::vector<double>>& enc_vector_list, ullong prime) const
+{
+    if (enc_vector_list.size() <= ENC_VEC_SQ_ZQ_IDX)
+    {
+        return;
+    }
+
+    // calculate sq_tr values
+    std::vector<double> sq_tr_vec(enc_vector_list[ENC_VEC_SQ_ZR_IDX].size(), 0);
+    enc_vector_list.push_back(sq_tr_vec);
+
+    // calc SQ_TR values
+    // this is zr*p:
+    std::transform(enc_vector_list[ENC_VEC_SQ_ZR_IDX].begin(), enc_vector_list[ENC_VEC_SQ_ZR_IDX].end(), enc_vector_list[ENC_VEC_SQ_TR_IDX].begin(), std::bind(std::multiplies<double>(), std::placeholders::_1, (double)prime));
+
+    // this is addition of yr
+    std::transform(enc_vector_list[ENC_VEC_SQ_TR_IDX].begin(), enc_vector_list[ENC_VEC_SQ_TR_IDX].end(), enc_vector_list[ENC_VEC_SQ_YR_IDX].begin(), enc_vector_list[ENC_VEC_SQ_TR_IDX].begin(), std::plus<double>());
+
+    // now remove the vectors we don't need to send: zr, yr
+    // note that the removal needs to be done from the last item to the first
+    // in order to use the indices in the enum
+    enc_vector_list.erase(enc_vector_list.begin()+ENC_VEC_SQ_YR_IDX);
+    enc_vector_list.erase(enc_vector_list.begin()+ENC_VEC_SQ_ZR_IDX);
+}
+
+// [z_q | t_r]
+void Unbatched_MAC_Scheme::PackTagVectors(std::vector<std::vector<double>>& enc_vector_list, std::vector<std::vector<double>>& packed_list) const
+{
+    if (enc_vector_list.size() > ENC_VEC_SENT_SQ_TR_IDX)
+    {
+        packed_list.push_back(concat(enc_vector_list[ENC_VEC_SENT_SQ_ZQ_IDX], enc_vector_list[ENC_VEC_SENT_SQ_TR_IDX]));
+    }
+}
+
+int Batched_MAC_Scheme::BatchedSize(int data_points_num, int max_ct_entries) const
+{
+    return ceil((double)data_points_num / max_ct_entries);
+}
+
+int Batched_MAC_Scheme::MacCtNum(int data_points_num, int max_ct_entries) const
+{
+    return std::ceil(((double)data_points_num / BatchedSize(data_points_num, max_ct_entries)) / max_ct_entries);
+}
+
+int Batched_MAC_Scheme::SetCtCount(bool has_tags, bool packed) const
+{
+    if (has_tags)
+    {
+        return packed ? PACKED_MAX_IDX_WITH_BATCHED_MAC : MAX_IDX_WITH_BATCHED_MAC;
+    }
+
+    return packed ? PACKED_MAX_IDX_WITHOUT_MAC : MAX_IDX_WITHOUT_MAC;
+}
+
+// one tag over the sums of x_int * a_int + x_frac * a_frac of all ciphertexts, slot by slot
+void Batched_MAC_Scheme::GenerateTags(const enc_init_params_s& enc_init_params, const byte* mac_key, const std::vector<double>& x_int, const std::vector<double>& x_frac,
+                                      std::string& tags_sq, std::string& tags_sr) const
+{
+    MAC mac(enc_init_params);
+    int data_points_num = x_int.size();
+    int max_ct_entries = enc_init_params.max_ct_entries;
+    int prime_bits_to_bytes = std::ceil((int)std::log2(enc_init_params.prime) / 8.0);
+    std::vector<double> result_vec(max_ct_entries, 0.0);
+    SHARE_MAC_KEYS kmac_keys;
+
+    DeriveKeys(kmac_keys, mac_key, data_points_num, max_ct_entries, prime_bits_to_bytes);
+
+    Batched_Key_Generator kmac(enc_init_params.prime);
+
+    // the keys are read where the Destination Server reads them: two "a" values per data point, then b, c and d
+    for (int index_base = 0; index_base < data_points_num; index_base += max_ct_entries)
+    {
+        int ct_num_of_data_points = std::min(max_ct_entries, data_points_num - index_base);
+        Key_Window kmac_window(kmac_keys, index_base * 2 * prime_bits_to_bytes);
+        kmac.derive_a(kmac_window, ct_num_of_data_points, prime_bits_to_bytes);
+
+        for (int i = 0; i < ct_num_of_data_points; i++)
+        {
+            result_vec[i] += (x_int[index_base + i] * kmac.a_int[i]) + (x_frac[index_base + i] * kmac.a_frac[i]);
+        }
+    }
+
+    // add b to the sum of (x_int * a_int + x_frac * a_frac)
+    kmac.derive_bcd(&kmac_keys, max_ct_entries, prime_bits_to_bytes, data_points_num * 2 * prime_bits_to_bytes);
+    std::transform(result_vec.begin(), result_vec.end(), kmac.b.begin(), result_vec.begin(), std::plus<double>());
+
+    mac_tag_batched_optimized optimized_mac = mac.compact_mac_batched_optimized(kmac, result_vec);
+    tags_sq.assign(reinterpret_cast<const char*>(optimized_mac.mac_part1.data()), optimized_mac.mac_part1.size() * sizeof(double));
+    tags_sr.assign(optimized_mac.mac_part2.begin(), optimized_mac.mac_part2.end());
+}
+
+// the keys of all sets are derived at once, the sets read them through their own windows
+void Batched_MAC_Scheme::DeriveKeys(SHARE_MAC_KEYS& kmac_keys, const byte* mac_key, int data_points_num, int max_ct_entries, int prime_bits_to_bytes) const
+{
+    // a_int and a_frac for every data point, then b, c_alpha and c_beta for every slot, each taking the bytes of the prime.
+    // d_alpha and d_beta take one bit each, they share one byte
+    int num_of_mac_key_bytes = data_points_num * 2 * prime_bits_to_bytes + max_ct_entries * (prime_bits_to_bytes * 3 + 1);
+    kmac_keys = SHARE_MAC_KEYS(num_of_mac_key_bytes);
+
+    kmac_keys.gen_keys((byte*)mac_key, KEY_SIZE_BYTES, constants::MAC_DERIVE_KEY);
+}
+
+// a_int*x_int + a_frac*x_frac is added to the worker's accumulator, the first set also carries the tag
+void Batched_MAC_Scheme::VerifySet(const mac_transfer_s& transfer, MAC& mac, const mac_verify_set_s& set, MemoryPoolHandle pool, DS_performance_metrics* performanceMetrics) const
+{
+    const std::vector<std::string>& str_vec = *set.str_vec;
+    const shared_ptr<seal_struct>& seal = transfer.seal;
+    int prime_bits_to_bytes = transfer.prime_bits_to_bytes;
+    int index_base = set.ct_index * transfer.enc_init_params->max_ct_entries;
+    Batched_Key_Generator kmac_batched(transfer.enc_init_params->prime, pool);
+    Ciphertext ct_alpha_int(pool), ct_beta_int(pool), ct_t_r(pool);
+
+    // the "a" values for x_int and x_frac, each data point takes two "a" values
+    Trace_Span derive_kmac_span("derive_kmacs", &performanceMetrics->derive_kmacs);
+    Key_Window kmac_window(*transfer.kmac_keys, index_base * 2 * prime_bits_to_bytes);
+    kmac_batched.derive_a(kmac_window, set.ct_num_of_data_points, prime_bits_to_bytes);
+    derive_kmac_span.End();
+
+    // this adds a_int*x_int + a_frac*x_frac to the same values from the worker's previous ciphertexts,
+    // the rescale of the sum is deferred until all workers' sums have been added
+    Trace_Span verify_ct_span(nullptr);
+    Perf_Span verify_perf_span(&performanceMetrics->verify_perf);
+    mac.accumulateHE_batched_y(seal, kmac_batched, *set.ct_int, *set.ct_frac, *set.y_acc, pool, performanceMetrics);
+    verify_perf_span.End();
+    long long verify_ct_time = verify_ct_span.End();
+
+    // the first set also carries the y_tag data
+    if (set.ct_index == 0)
+    {
+        int bcd_key_index = transfer.data_points_num * 2 * prime_bits_to_bytes;
+        Trace_Span derive_bcd_span("derive_kmacs", &performanceMetrics->derive_kmacs);
+        kmac_batched.derive_bcd(transfer.kmac_keys, set.ct_num_of_data_points, prime_bits_to_bytes, bcd_key_index);
+        derive_bcd_span.End();
+
+        Trace_Span deserialize_mac_span("deserialize_macs", &performanceMetrics->deserialize_macs);
+        if (set.packed)
+        {
+            // t_r, [alpha_int | beta_int]
+            utility::deserialize_fhe(str_vec[PACKED_TAG_IDX].c_str(), std::stol(str_vec[PACKED_TAG_SIZE]), ct_t_r, seal->context_ptr);
+            utility::deserialize_fhe(str_vec[PACKED_ALPHA_BETA_IDX].c_str(), std::stol(str_vec[PACKED_ALPHA_BETA_SIZE]), ct_alpha_int, seal->context_ptr);
+            seal->evaluator_ptr->rotate_vector(ct_alpha_int, set.ct_num_of_data_points, *seal->galois_ptr, ct_beta_int, pool);
+        }
+        else
+        {
+            utility::deserialize_fhe(str_vec[BATCHED_TR_IDX].c_str(), std::stol(str_vec[BATCHED_TR_SIZE]), ct_t_r, seal->context_ptr);
+            utility::deserialize_fhe(str_vec[BATCHED_ALPHA_INT_IDX].c_str(), std::stol(str_vec[BATCHED_ALPHA_INT_SIZE]), ct_alpha_int, seal->context_ptr);
+            utility::deserialize_fhe(str_vec[BATCHED_BETA_INT_IDX].c_str(), std::stol(str_vec[BATCHED_BETA_INT_SIZE]), ct_beta_int, seal->context_ptr);
+        }
+        deserialize_mac_span.End();
+
+        Trace_Span verify_tag_span(nullptr);
+        Perf_Span verify_tag_perf_span(&performanceMetrics->verify_perf);
+        mac.verifyHE_batched_y_tag(seal, set.ct_num_of_data_points, kmac_batched, ct_t_r, ct_alpha_int, ct_beta_int, *transfer.y_tag, pool, performanceMetrics);
+        verify_tag_perf_span.End();
+        verify_ct_time += verify_tag_span.End();
+    }
+
+    performanceMetrics->verify_hist.Record(verify_ct_time);
+}
+
+// the single diff of the transfer, y of all sets against the tag
+void Batched_MAC_Scheme::FinishVerify(const mac_transfer_s& transfer, MAC& mac, Ciphertext& y_sum, MemoryPoolHandle pool, DS_performance_metrics* performanceMetrics) const
+{
+    const shared_ptr<seal_struct>& seal = transfer.seal;
+    Ciphertext diff_ct;
+
+    mac.finalizeHE_batched_y(seal, y_sum, pool, performanceMetrics);
+
+    Trace_Span verify_span("verify", &performanceMetrics->verify);
+    seal->evaluator_ptr->mod_switch_to_inplace(y_sum, transfer.y_tag->parms_id());
+    seal->evaluator_ptr->sub(y_sum, *transfer.y_tag, diff_ct);
+    transfer.diffs->push_back(diff_ct);
+    verify_span.End();
+}
+
+std::vector<mac_tag_object_s> Batched_MAC_Scheme::TagObjects(const std::string& dataset, int data_points_num, int max_ct_entries) const
+{
+    int batched_size = BatchedSize(data_points_num, max_ct_entries);
+
+    // t_r, restored from the stored value as is
+    mac_tag_object_s sq_data;
+    sq_data.object_name = utility::DatasetObjectName(dataset, TAGS_SQ_DIR);
+    sq_data.buffer_size = std::ceil(data_points_num / batched_size) * sizeof(double);
+    sq_data.item_size = sizeof(double);
+    sq_data.parse_func = &parse_double_into_mac_batched_part1;
+    sq_data.num_of_parsed_items = 1;
+
+    // the alpha and beta bits
+    mac_tag_object_s sr_data;
+    sr_data.object_name = utility::DatasetObjectName(dataset, TAGS_SR_DIR);
+    sr_data.buffer_size = std::ceil(data_points_num / batched_size) * sizeof(char);
+    sr_data.item_size = sizeof(char);
+    sr_data.parse_func = &parse_double_into_mac_batched_part2;
+    sr_data.num_of_parsed_items = 2;
+
+    return {sq_data, sr_data};
+}
+
+// t_r, [alpha_int | beta_int] (the tag vectors only travel with the first ciphertext)
+void Batched_MAC_Scheme::PackTagVectors(std::vector<std::vector<double>>& enc_vector_list, std::vector<std::vector<double>>& packed_list) const
+{
+    if (enc_vector_list.size() > ENC_VEC_BATCHED_SQ_TR_IDX)
+    {
+        packed_list.push_back(std::move(enc_vector_list[ENC_VEC_BATCHED_SQ_TR_IDX]));
+        packed_list.push_back(concat(enc_vector_list[ENC_VEC_BATCHED_SR_ALPHA_INT_IDX], enc_vector_list[ENC_VEC_BATCHED_SR_BETA_INT_IDX]));
+    }
+}
@@ -0,0 +1,239 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+#include "Utility.h"
+#include "Transfer_Session.h"
+#include "Mod_Arith.h"
+#include "MAC.h"
+
+// the vectors the Aux parses from the stored values of one ciphertext set, unbatched
+enum enc_vec_list_index
+{
+    ENC_VEC_X_INT_IDX = 0,
+    ENC_VEC_X_FRAC_IDX,
+    ENC_VEC_SQ_ZR_IDX,
+    ENC_VEC_SQ_YR_IDX,
+    ENC_VEC_SQ_ZQ_IDX,
+    ENC_VEC_SQ_TR_IDX,
+};
+
+// the vectors the Aux sends unbatched, after the tag vectors were combined into t_r
+enum enc_vec_list_sent_index
+{
+    ENC_VEC_SENT_X_INT_IDX = 0,
+    ENC_VEC_SENT_X_FRAC_IDX,
+    ENC_VEC_SENT_SQ_ZQ_IDX,
+    ENC_VEC_SENT_SQ_TR_IDX,
+};
+
+// the vectors the Aux parses and sends batched
+enum enc_vec_list_batched_index
+{
+    ENC_VEC_BATCHED_X_INT_IDX = 0,
+    ENC_VEC_BATCHED_X_FRAC_IDX,
+    ENC_VEC_BATCHED_SQ_TR_IDX,
+    ENC_VEC_BATCHED_SR_ALPHA_INT_IDX,
+    ENC_VEC_BATCHED_SR_BETA_INT_IDX,
+};
+
+// the number of ciphertexts of one set
+enum CT_Max_Index
+{
+    MAX_IDX_WITHOUT_MAC = 2,
+    MAX_IDX_WITH_UNBATCHED_MAC = 4,
+    MAX_IDX_WITH_BATCHED_MAC = 5,
+    PACKED_MAX_IDX_WITHOUT_MAC = 1,
+    PACKED_MAX_IDX_WITH_UNBATCHED_MAC = 2,
+    PACKED_MAX_IDX_WITH_BATCHED_MAC = 3
+};
+
+// the ciphertexts of one set as the Destination Server receives them: the set index, then size and serialized ciphertext pairs
+enum CT_Index
+{
+    CT_IDX = 0,
+    X_INT_SIZE,
+    X_INT_IDX,
+    X_FRAC_SIZE,
+    X_FRAC_IDX,
+    SQ_ZQMSKD_SIZE,
+    SQ_ZQMSKD_IDX,
+    SQ_TR_SIZE,
+    SQ_TR_IDX,
+
+};
+
+enum CT_BATCHED_Index
+{
+    BATCHED_TR_SIZE = X_FRAC_IDX + 1 ,
+    BATCHED_TR_IDX,
+    BATCHED_ALPHA_INT_SIZE,
+    BATCHED_ALPHA_INT_IDX,
+    BATCHED_BETA_INT_SIZE,
+    BATCHED_BETA_INT_IDX,
+};
+
+// slot packed ciphertexts: [x_int | x_frac], then [z_q | t_r] (unbatched) or t_r, [alpha_int | beta_int] (batched)
+enum CT_Packed_Index
+{
+    PACKED_X_SIZE = CT_IDX + 1,
+    PACKED_X_IDX,
+    PACKED_TAG_SIZE,
+    PACKED_TAG_IDX,
+    PACKED_ALPHA_BETA_SIZE,
+    PACKED_ALPHA_BETA_IDX,
+};
+
+// parse the stored values of a ciphertext into the vectors starting at index
+typedef void (*mac_parse_func)(const std::vector<double>& values, std::vector<std::vector<double>>& enc_vector_list, long index, const mod_arith_s& mod_arith);
+
+// a tag object of a dataset, loaded by the Aux next to the secret shares
+struct mac_tag_object_s
+{
+    std::string object_name;
+    int buffer_size;           // the size of the whole object
+    int item_size;             // the size of each stored value
+    mac_parse_func parse_func;
+    int num_of_parsed_items;   // the number of vectors each value is parsed into
+};
+
+// the Destination Server's state of one transfer, shared by the workers verifying its sets
+struct mac_transfer_s
+{
+    shared_ptr<seal_struct> seal;
+    const enc_init_params_s* enc_init_params;
+    int data_points_num;
+    int prime_bits_to_bytes;
+    bool square_diff;
+    bool deferred_rescale;
+    CryptoPP::HMAC<CryptoPP::SHA256>* hmac_sq; // the unbatched keys are derived from it per set
+    const SHARE_MAC_KEYS* kmac_keys;           // the batched keys, derived once per transfer
+    std::vector<Ciphertext>* diffs;            // one diff per set, or the batched one once the transfer is finished
+    Ciphertext* y_tag;                         // the batched y tag, computed with the first set
+};
+
+// one received ciphertext set, its secret shares already deserialized
+struct mac_verify_set_s
+{
+    const std::vector<std::string>* str_vec; // laid out as CT_Index, CT_BATCHED_Index or CT_Packed_Index
+    int set_index;
+    int ct_index;
+    int ct_num_of_data_points;
+    bool packed;
+    const Ciphertext* ct_int;                // not modified, the reconstruction reads them too
+    const Ciphertext* ct_frac;
+    Ciphertext* y_acc;                       // the worker's batched y accumulator
+};
+
+// MAC_Scheme - how the tags of a dataset are generated, stored, sent and verified. The Data Owner picks the scheme when it
+// uploads a dataset, the Aux serves the dataset with it and names it in the accept of every session, and the Destination
+// Server verifies the transfer with the scheme the accept names.
+// Unbatched tags hold one tag per data point and travel with every ciphertext set, for a low latency on small datasets.
+// Batched tags cover the whole dataset and only travel with the first sets, for throughput on large ones
+class MAC_Scheme
+{
+protected:
+    // append the tag vectors of a slot packed set, paired as they share ciphertexts
+    virtual void PackTagVectors(std::vector<std::vector<double>>& enc_vector_list, std::vector<std::vector<double>>& packed_list) const = 0;
+
+public:
+    virtual ~MAC_Scheme() {}
+
+    virtual const char* Name() const = 0;
+    virtual bool IsBatched() const = 0;
+
+    // the session_mode_flags bit of the scheme
+    virtual uint32_t SessionMode() const = 0;
+
+    // data points whose tags are summed into one batched tag value, 0 when every data point has its own tag
+    virtual int BatchedSize(int data_points_num, int max_ct_entries) const = 0;
+
+    // the ciphertext sets, counted from set 0, that also carry tag ciphertexts
+    virtual int MacCtNum(int data_points_num, int max_ct_entries) const = 0;
+
+    // the number of ciphertexts of one set
+    virtual int SetCtCount(bool has_tags, bool packed) const = 0;
+
+    // whether the diffs of a transfer are squared, only those can be summed into one value to check
+    virtual bool SquaresDiffs(bool square_diff) const = 0;
+
+    // whether a transfer may select ciphertext blocks, the tags must then cover each block on its own
+    virtual bool SupportsBlockSelection() const = 0;
+
+    // the tag objects of a dataset
+    virtual std::vector<mac_tag_object_s> TagObjects(const std::string& dataset, int data_points_num, int max_ct_entries) const = 0;
+
+    // turn the parsed tag vectors of a set into the ones that are sent
+    virtual void PrepareTagVectors(std::vector<std::vector<double>>& enc_vector_list, ullong prime) const = 0;
+
+    // the Data Owner's tags of a dataset: the tag object of TAGS_SQ_DIR, and of TAGS_SR_DIR for the schemes that have one
+    virtual void GenerateTags(const enc_init_params_s& enc_init_params, const byte* mac_key, const std::vector<double>& x_int, const std::vector<double>& x_frac,
+                              std::string& tags_sq, std::string& tags_sr) const = 0;
+
+    // derive the keys of a transfer that don't depend on the set, from the key the Data Owner saved as TAG_SQ_KEY_FILENAME
+    virtual void DeriveKeys(SHARE_MAC_KEYS& kmac_keys, const byte* mac_key, int data_points_num, int max_ct_entries, int prime_bits_to_bytes) const = 0;
+
+    // verify the tags of one set against its secret shares, a worker may verify any set of the transfer
+    virtual void VerifySet(const mac_transfer_s& transfer, MAC& mac, const mac_verify_set_s& set, MemoryPoolHandle pool, DS_performance_metrics* performanceMetrics) const = 0;
+
+    // once all sets are verified, with the sum of the workers' y accumulators
+    virtual void FinishVerify(const mac_transfer_s& transfer, MAC& mac, Ciphertext& y_sum, MemoryPoolHandle pool, DS_performance_metrics* performanceMetrics) const = 0;
+
+    // place the vectors of a ciphertext that uses at most half of the slots side by side, so they travel in one ciphertext:
+    // [x_int | x_frac], then the tag vectors of the scheme
+    void PackSlots(std::vector<std::vector<double>>& enc_vector_list) const;
+
+    static std::shared_ptr<const MAC_Scheme> Create(bool batched);
+
+    // the scheme a session names in its session_mode_flags
+    static std::shared_ptr<const MAC_Scheme> FromSessionMode(uint32_t mode);
+};
+
+// one tag per data point: z_q, z_r and y_r stored as one double, sent as z_q and t_r = z_r * p + y_r
+class Unbatched_MAC_Scheme : public MAC_Scheme
+{
+protected:
+    void PackTagVectors(std::vector<std::vector<double>>& enc_vector_list, std::vector<std::vector<double>>& packed_list) const override;
+
+public:
+    const char* Name() const override { return "unbatched"; }
+    bool IsBatched() const override { return false; }
+    uint32_t SessionMode() const override { return 0; }
+    int BatchedSize(int data_points_num, int max_ct_entries) const override { return 0; }
+    int MacCtNum(int data_points_num, int max_ct_entries) const override;
+    int SetCtCount(bool has_tags, bool packed) const override;
+    bool SquaresDiffs(bool square_diff) const override { return square_diff; }
+    bool SupportsBlockSelection() const override { return true; }
+    std::vector<mac_tag_object_s> TagObjects(const std::string& dataset, int data_points_num, int max_ct_entries) const override;
+    void PrepareTagVectors(std::vector<std::vector<double>>& enc_vector_list, ullong prime) const override;
+    void GenerateTags(const enc_init_params_s& enc_init_params, const byte* mac_key, const std::vector<double>& x_int, const std::vector<double>& x_frac,
+                      std::string& tags_sq, std::string& tags_sr) const override;
+    void DeriveKeys(SHARE_MAC_KEYS& kmac_keys, const byte* mac_key, int data_points_num, int max_ct_entries, int prime_bits_to_bytes) const override {}
+    void VerifySet(const mac_transfer_s& transfer, MAC& mac, const mac_verify_set_s& set, MemoryPoolHandle pool, DS_performance_metrics* performanceMetrics) const override;
+    void FinishVerify(const mac_transfer_s& transfer, MAC& mac, Ciphertext& y_sum, MemoryPoolHandle pool, DS_performance_metrics* performanceMetrics) const override {}
+};
+
+// tags over sums of batched_size data points: t_r stored as doubles and the alpha and beta bits stored as chars
+class Batched_MAC_Scheme : public MAC_Scheme
+{
+protected:
+    void PackTagVectors(std::vector<std::vector<double>>& enc_vector_list, std::vector<std::vector<double>>& packed_list) const override;
+
+public:
+    const char* Name() const override { return "batched"; }
+    bool IsBatched() const override { return true; }
+    uint32_t SessionMode() const override { return SESSION_MODE_BATCHED; }
+    int BatchedSize(int data_points_num, int max_ct_entries) const override;
+    int MacCtNum(int data_points_num, int max_ct_entries) const override;
+    int SetCtCount(bool has_tags, bool packed) const override;
+    bool SquaresDiffs(bool square_diff) const override { return false; }
+    bool SupportsBlockSelection() const override { return false; }
+    std::vector<mac_tag_object_s> TagObjects(const std::string& dataset, int data_points_num, int max_ct_entries) const override;
+    void PrepareTagVectors(std::vector<std::vector<double>>& enc_vector_list, ullong prime) const override {}
+    void GenerateTags(const enc_init_params_s& enc_init_params, const byte* mac_key, const std::vector<double>& x_int, const std::vector<double>& x_frac,
+                      std::string& tags_sq, std::string& tags_sr) const override;
+    void DeriveKeys(SHARE_MAC_KEYS& kmac_keys, const byte* mac_key, int data_points_num, int max_ct_entries, int prime_bits_to_bytes) const override;
+    void VerifySet(const mac_transfer_s& transfer, MAC& mac, const mac_verify_set_s& set, MemoryPoolHandle pool, DS_performance_metrics* performanceMetrics) const override;
+    void FinishVerify(const mac_transfer_s& transfer, MAC& mac, Ciphertext& y_sum, MemoryPoolHandle pool, DS_performance_metrics* performanceMetrics) const override;
+};
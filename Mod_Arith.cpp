@@ -0,0 +1,42 @@
+#include "Mod_Arith.h"
+#include <map>
+#include <mutex>
+
+static mod_arith_s runtime_arith(ullong prime)
+{
+    ullong barrett = ~0ULL / prime;
+    return mod_arith_s{prime, barrett, (barrett_divmod(~0ULL, prime, barrett).rem + 1) % prime};
+}
+
+const mod_arith_s& Mod_Arith::For(ullong prime)
+{
+    // the primes Dispatch has a ModArith specialization for
+    static const mod_arith_s fixed[] = {
+        runtime_arith(constants::prime),
+        runtime_arith(2999),
+        runtime_arith(16411),
+        runtime_arith(248231),
+        runtime_arith(524309),
+    };
+
+    for (const mod_arith_s& arith : fixed)
+    {
+        if (arith.prime() == prime)
+        {
+            return arith;
+        }
+    }
+
+    // other primes are created once and kept for the process
+    static std::map<ullong, mod_arith_s> runtime;
+    static std::mutex runtime_mutex;
+
+    std::lock_guard<std::mutex> lock(runtime_mutex);
+    auto it = runtime.find(prime);
+    if (it == runtime.end())
+    {
+        it = runtime.emplace(prime, runtime_arith(prime)).first;
+    }
+
+    return it->second;
+}
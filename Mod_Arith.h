@@ -0,0 +1,101 @@
+#pragma once
+
+#include "Utility.h"
+
+// quotient and remainder of a division by the prime
+struct mod_divmod_s
+{
+    ullong quot;
+    ullong rem;
+};
+
+// Barrett reduction of a 64 bit value: with m = floor((2^64 - 1) / p) the estimate mulhi(x, m) is at most one below x / p,
+// so a single correction replaces the hardware division
+inline mod_divmod_s barrett_divmod(ullong x, ullong p, ullong m)
+{
+    ullong quot = (ullong)(((unsigned __int128)x * m) >> 64);
+    ullong rem = x - quot * p;
+
+    if (rem >= p)
+    {
+        rem -= p;
+        quot++;
+    }
+
+    return mod_divmod_s{quot, rem};
+}
+
+// fmod(x, prime) of a non negative integer valued double, as the key derivation rounds its 64 bit values to doubles.
+// Doubles from 2^53 on are integers, only a value rounded up to 2^64 doesn't fit a ullong
+template <typename Arith>
+inline double mod_double(const Arith& arith, double x)
+{
+    if (x >= 18446744073709551616.0)
+    {
+        return (double)arith.two_64_mod();
+    }
+    return (double)arith.Mod((ullong)x);
+}
+
+// ModArith<P> - arithmetic modulo a prime known at compile time, the Barrett constant is folded into the code
+template <ullong P>
+struct ModArith
+{
+    static_assert(P > 2 && (P & 1), "the prime must be odd");
+
+    static constexpr ullong PRIME = P;
+    static constexpr ullong BARRETT = ~0ULL / P;
+    static constexpr ullong TWO_64_MOD = (~0ULL % P + 1) % P;
+
+    static constexpr ullong prime() { return P; }
+    static constexpr ullong two_64_mod() { return TWO_64_MOD; }
+
+    static mod_divmod_s DivMod(ullong x) { return barrett_divmod(x, P, BARRETT); }
+    static ullong Mod(ullong x) { return DivMod(x).rem; }
+    static double ModDouble(double x) { return mod_double(ModArith(), x); }
+};
+
+// mod_arith_s - arithmetic modulo a prime known at runtime, with the interface of ModArith<P>.
+// Resolved once by Mod_Arith::For, the loops over values are run by Mod_Arith::Dispatch
+struct mod_arith_s
+{
+    ullong _prime;
+    ullong _barrett;      // floor((2^64 - 1) / prime)
+    ullong _two_64_mod;   // 2^64 mod prime
+
+    ullong prime() const { return _prime; }
+    ullong two_64_mod() const { return _two_64_mod; }
+
+    mod_divmod_s DivMod(ullong x) const { return barrett_divmod(x, _prime, _barrett); }
+    ullong Mod(ullong x) const { return DivMod(x).rem; }
+    double ModDouble(double x) const { return mod_double(*this, x); }
+};
+
+// Mod_Arith - picks the arithmetic of the configured prime: a ModArith specialization for the primes of
+// tests_enc_params and the default prime, and the runtime Barrett reduction of mod_arith_s for any other prime
+class Mod_Arith
+{
+public:
+    static const mod_arith_s& For(ullong prime);
+
+    // run f on the arithmetic of the prime, a ModArith<P> when the prime has one. Call it once around a loop over
+    // values, so the loop body is compiled per prime with its constants and without a call per value
+    template <typename F>
+    static auto Dispatch(const mod_arith_s& arith, F&& f) -> decltype(f(arith))
+    {
+        switch (arith.prime())
+        {
+            case constants::prime: return f(ModArith<constants::prime>());
+            case 2999:             return f(ModArith<2999>());
+            case 16411:            return f(ModArith<16411>());
+            case 248231:           return f(ModArith<248231>());
+            case 524309:           return f(ModArith<524309>());
+            default:               return f(arith);
+        }
+    }
+
+    // single values, outside of the loops
+    static mod_divmod_s DivMod(const mod_arith_s& arith, ullong x) { return arith.DivMod(x); }
+    static ullong Mod(const mod_arith_s& arith, ullong x) { return arith.Mod(x); }
+    static double ModDouble(const mod_arith_s& arith, double x) { return arith.ModDouble(x); }
+};
@@ -0,0 +1,262 @@
+#include "Param_Planner.h"
+#include <algorithm>
+#include <numeric>
+#include <stdexcept>
+
+using std::cout;
+using std::endl;
+
+// supported CKKS ring sizes, from smallest to largest
+static const int POLY_DEGREES[] = {4096, 8192, 16384, 32768};
+
+// SEAL limit on the size of a single coefficient modulus prime
+static const int MAX_PRIME_BITS = 60;
+
+// fractional bits kept above the CKKS encoding and encryption noise, which grows with log2(polyDegree)
+static const int NOISE_PRECISION_BITS = 20;
+
+// absolute error allowed on a decrypted result, the same threshold test_correctness uses
+static const double ERROR_TOLERANCE = 1.0;
+
+
+// constructor
+Param_Planner::Param_Planner(planner_mode_s mode, int margin_bits)
+{
+    _mode = mode;
+    _margin_bits = margin_bits;
+}
+
+// batched: alpha * p^3 and the sum of N_agg products a * x of two values in Zp
+// unbatched: z * p^2 and a * x
+double Param_Planner::MacValueBits(int num_of_ct)
+{
+    double log_p = std::log2((double)_mode.prime);
+
+    if (_mode.batched)
+    {
+        return std::max(3 * log_p + 1, std::log2((double)std::max(num_of_ct, 1)) + 2 * log_p + 1);
+    }
+
+    return 2 * log_p + 1;
+}
+
+// x_int * p * (-1)^b plus the x_frac and cleartext terms
+double Param_Planner::RecValueBits()
+{
+    return 2 * std::log2((double)_mode.prime) + 1;
+}
+
+// Each requirement is a (level, bits) pair: after "level" rescales the remaining modulus must hold "bits".
+// The remaining modulus after l rescales is base + (depth - l) * scale, so the base primes are sized to the
+// tightest requirement. The special prime is as large as the largest data prime.
+vector<int> Param_Planner::BuildBitSizes(int scale_bits, double mac_bits, double rec_bits, int* depth)
+{
+    vector<std::pair<int, double>> requirements;
+
+    requirements.push_back({1, scale_bits + mac_bits + 1 + _margin_bits});
+
+    if (_mode.deferred_rescale)
+    {
+        requirements.push_back({0, 2 * scale_bits + rec_bits + 1 + _margin_bits});
+    }
+    else
+    {
+        requirements.push_back({1, scale_bits + rec_bits + 1 + _margin_bits});
+    }
+
+    // a valid MAC leaves a difference below 1, so the squared difference needs no value bits of its own
+    if (!_mode.batched && _mode.square_diff)
+    {
+        if (_mode.deferred_rescale)
+        {
+            requirements.push_back({1, 2 * scale_bits + 1 + _margin_bits});
+        }
+        else
+        {
+            requirements.push_back({2, scale_bits + 1 + _margin_bits});
+        }
+    }
+
+    *depth = 0;
+    for (const auto& req : requirements)
+    {
+        *depth = std::max(*depth, req.first);
+    }
+
+    double base_bits = 0;
+    for (const auto& req : requirements)
+    {
+        base_bits = std::max(base_bits, req.second - (*depth - req.first) * scale_bits);
+    }
+
+    int total_base_bits = (int)std::ceil(base_bits);
+    int num_of_base_primes = (int)std::ceil((double)total_base_bits / MAX_PRIME_BITS);
+    int base_prime_bits = (int)std::ceil((double)total_base_bits / num_of_base_primes);
+
+    vector<int> bit_sizes(num_of_base_primes, base_prime_bits);
+    for (int i = 0; i < *depth; i++)
+    {
+        bit_sizes.push_back(scale_bits);
+    }
+    bit_sizes.push_back(std::max(base_prime_bits, scale_bits));
+
+    return bit_sizes;
+}
+
+// The protocol resets the scale to 2^scale_bits after every rescale, so a value v divided by a prime q
+// instead of 2^scale_bits is off by v * |q - 2^scale_bits| / 2^scale_bits.
+double Param_Planner::RescaleError(int poly_degree, const vector<int>& bit_sizes, int depth, int scale_bits, double value_bits)
+{
+    vector<Modulus> primes = CoeffModulus::Create(poly_degree, bit_sizes);
+    int first_rescale_prime = (int)bit_sizes.size() - depth - 1;
+    double scale = std::pow(2.0, scale_bits);
+    double max_rel_error = 0;
+
+    for (int i = first_rescale_prime; i < first_rescale_prime + depth; i++)
+    {
+        double rel_error = std::fabs((double)primes[i].value() - scale) / scale;
+        max_rel_error = std::max(max_rel_error, rel_error);
+    }
+
+    return std::pow(2.0, value_bits) * max_rel_error;
+}
+
+// Scale bits start from the smallest value that keeps the expected rescale error below the tolerance and
+// grow until the actual primes meet it. If no scale up to 60 bits does, the largest fitting one is kept
+// and the estimated error is reported.
+bool Param_Planner::PlanForDegree(int poly_degree, planned_params_s* params)
+{
+    int slots = poly_degree / 2;
+    int num_of_ct = (int)((_mode.data_points_num + slots - 1) / slots);
+    int max_bits = CoeffModulus::MaxBitCount(poly_degree, sec_level_type::tc128);
+
+    double mac_bits = MacValueBits(num_of_ct);
+    double rec_bits = RecValueBits();
+    double rescaled_value_bits = _mode.deferred_rescale ? mac_bits : std::max(mac_bits, rec_bits);
+
+    // SEAL picks primes congruent to 1 mod 2N below 2^scale_bits, so they differ from the scale by roughly 2N
+    int log_degree = (int)std::log2((double)poly_degree);
+    int scale_bits = (int)std::ceil(rescaled_value_bits + log_degree + 1 + _margin_bits);
+    scale_bits = std::max(scale_bits, log_degree + NOISE_PRECISION_BITS);
+    scale_bits = std::min(scale_bits, MAX_PRIME_BITS);
+
+    bool found = false;
+    for (; scale_bits <= MAX_PRIME_BITS; scale_bits++)
+    {
+        int depth;
+        vector<int> bit_sizes = BuildBitSizes(scale_bits, mac_bits, rec_bits, &depth);
+        int total_bits = std::accumulate(bit_sizes.begin(), bit_sizes.end(), 0);
+
+        // a larger scale only adds bits
+        if (total_bits > max_bits)
+        {
+            break;
+        }
+
+        double rescale_error;
+        try
+        {
+            rescale_error = RescaleError(poly_degree, bit_sizes, depth, scale_bits, rescaled_value_bits);
+        }
+        catch (const std::exception& e)
+        {
+            // not enough NTT friendly primes of this size for the ring
+            continue;
+        }
+
+        params->polyDegree = poly_degree;
+        params->scale_bits = scale_bits;
+        params->bit_sizes = bit_sizes;
+        params->depth = depth;
+        params->total_bits = total_bits;
+        params->max_bits = max_bits;
+        params->num_of_ct = num_of_ct;
+        params->rescale_error = rescale_error;
+        params->meets_error_margin = (rescale_error * std::pow(2.0, _margin_bits) <= ERROR_TOLERANCE);
+        found = true;
+
+        if (params->meets_error_margin)
+        {
+            break;
+        }
+    }
+
+    return found;
+}
+
+// pick the cheapest fitting ring: HE operation and transfer cost scale with
+// number of ciphertexts * polyDegree * log(polyDegree) * number of data primes.
+// Rings that meet the rescale error margin always win over rings that don't.
+bool Param_Planner::Plan(planned_params_s* params)
+{
+    bool found = false;
+    double best_cost = 0;
+
+    for (int poly_degree : POLY_DEGREES)
+    {
+        planned_params_s candidate;
+        if (!PlanForDegree(poly_degree, &candidate))
+        {
+            continue;
+        }
+
+        double cost = (double)candidate.num_of_ct * poly_degree * std::log2((double)poly_degree) * (candidate.bit_sizes.size() - 1);
+        bool better_margin = candidate.meets_error_margin && !params->meets_error_margin;
+        bool same_margin = candidate.meets_error_margin == params->meets_error_margin;
+        if (!found || better_margin || (same_margin && cost < best_cost))
+        {
+            *params = candidate;
+            best_cost = cost;
+            found = true;
+        }
+    }
+
+    return found;
+}
+
+// writes the parameters in the tests_enc_params format
+void Param_Planner::SaveParams(const planned_params_s& params, const string& fileName)
+{
+    std::ofstream out_file(fileName);
+    if (!out_file)
+    {
+        throw std::runtime_error("Error: Unable to open file " + fileName);
+    }
+
+    out_file << "#generated by Param_Planner for " << _mode.data_points_num << " inputs, "
+             << (_mode.batched ? "batched" : "unbatched")
+             << (_mode.square_diff ? ", square diff" : "")
+             << (_mode.deferred_rescale ? ", deferred rescale" : "") << endl;
+    out_file << "#prime" << endl << _mode.prime << endl;
+    out_file << "#poly degree" << endl << params.polyDegree << endl;
+    out_file << "#scale" << endl << params.scale_bits << endl;
+    out_file << "#bit sizes" << endl;
+    for (int i = 0; i < params.bit_sizes.size(); i++)
+    {
+        out_file << params.bit_sizes[i] << ((i + 1 < params.bit_sizes.size()) ? " " : "");
+    }
+    out_file << endl;
+
+    out_file.close();
+}
+
+void Param_Planner::PrintParams(const planned_params_s& params)
+{
+    cout << "prime: " << _mode.prime << " polyDegree: " << params.polyDegree << " scale: 2^" << params.scale_bits
+         << " depth: " << params.depth << " bit sizes:";
+    for (int bits : params.bit_sizes)
+    {
+        cout << " " << bits;
+    }
+    cout << endl;
+
+    cout << "total modulus bits: " << params.total_bits << " (128-bit security bound: " << params.max_bits << ")"
+         << " ciphertexts per share: " << params.num_of_ct << endl;
+    cout << "estimated rescale error: " << params.rescale_error << endl;
+
+    if (!params.meets_error_margin)
+    {
+        cout << "Warning: the rescale error margin of " << _margin_bits << " bits is not met with scale bits up to "
+             << MAX_PRIME_BITS << ", verification may report false mismatches" << endl;
+    }
+}
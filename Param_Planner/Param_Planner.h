@@ -0,0 +1,81 @@
+#pragma once
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <cmath>
+#include "seal/seal.h"
+#include "../Constants.h"
+
+using namespace seal;
+using std::string;
+using std::vector;
+
+// Protocol configuration the CKKS parameters are planned for
+struct planner_mode_s
+{
+    ullong prime;               // secret sharing / MAC prime
+    ullong data_points_num;     // number of secret values transferred
+    bool batched;               // batched MAC
+    bool square_diff;           // square diff on the unbatched MAC output
+    bool deferred_rescale;      // Destination Server runs with --deferred_rescale
+};
+
+// Planned CKKS parameters, in the same terms as the tests_enc_params files
+struct planned_params_s
+{
+    int polyDegree = 0;
+    int scale_bits = 0;
+    vector<int> bit_sizes;      // base primes, rescale primes, special prime
+    int depth = 0;              // number of rescale primes
+    int total_bits = 0;         // sum of bit_sizes
+    int max_bits = 0;           // 128-bit security bound for polyDegree
+    int num_of_ct = 0;          // ciphertexts per share for the planned data size
+    double rescale_error = 0;   // estimated absolute error caused by rescale primes differing from the scale
+    bool meets_error_margin = false;
+};
+
+// Param_Planner - computes the smallest CKKS parameters that fit the protocol's depth and value bounds
+//
+// Value bounds (in bits, log p = log2(prime)):
+//   unbatched MAC verification works on values up to p^2 (z * p^2, a * x)
+//   batched MAC verification works on values up to p^3 (alpha * p^3) and N_agg * p^2 (the accumulated a * x)
+//   reconstruction works on values up to p^2 (x_int * p)
+// Depth: one rescale for the MAC products and the reconstruction, plus one for the unbatched square diff.
+// With deferred rescale the reconstruction and the square diff consume no level, but their scale^2
+// outputs must fit in the modulus of the level they stay on.
+class Param_Planner
+{
+private:
+    planner_mode_s _mode;
+    int _margin_bits;
+
+    // bits the value bound of the MAC verification needs
+    double MacValueBits(int num_of_ct);
+
+    // bits the value bound of the reconstruction needs
+    double RecValueBits();
+
+    // try to fit the parameters for one poly degree, returns false if the 128-bit bound is exceeded
+    bool PlanForDegree(int poly_degree, planned_params_s* params);
+
+    // build the bit sizes list for the given scale and value bounds
+    vector<int> BuildBitSizes(int scale_bits, double mac_bits, double rec_bits, int* depth);
+
+    // estimated absolute error caused by the actual rescale primes differing from 2^scale_bits
+    double RescaleError(int poly_degree, const vector<int>& bit_sizes, int depth, int scale_bits, double value_bits);
+
+public:
+    Param_Planner(planner_mode_s mode, int margin_bits);
+    ~Param_Planner() {}
+
+    // plan minimal parameters over all supported poly degrees, returns false if none fits
+    bool Plan(planned_params_s* params);
+
+    // write the parameters in the format read by utility::InitEncParams
+    void SaveParams(const planned_params_s& params, const string& fileName);
+
+    // print the planned parameters and the bounds behind them
+    void PrintParams(const planned_params_s& params);
+};
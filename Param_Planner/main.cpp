@@ -0,0 +1,111 @@
+#include <getopt.h>
+#include "Param_Planner.h"
+
+void printHelp(void)
+{
+    std::cout <<
+            "--prime <p>                          Secret sharing and MAC prime. Default is " << constants::prime << "\n"
+            "--input <n>                          Number of secret values to transfer. Default is " << constants::DEFAULT_INPUT_SIZE << "\n"
+            "--batched                            Batched MAC\n"
+            "--square_diff                        Destination Server performs square diff on the MAC verification output\n"
+            "--deferred_rescale                   Destination Server runs with --deferred_rescale\n"
+            "--margin_bits <n>                    Extra bits kept on every bound. Default is 2\n"
+            "--out <filename>                     Write the parameters to a file in the tests_enc_params format\n"
+            "--help                               Display this help message\n";
+    exit(1);
+
+}
+
+
+// main function for the parameter planner
+// computes the smallest CKKS parameters for the requested protocol mode and optionally saves them
+int main(int argc, char* argv[])
+{
+    planner_mode_s mode;
+    mode.prime = constants::prime;
+    mode.data_points_num = constants::DEFAULT_INPUT_SIZE;
+    mode.batched = false;
+    mode.square_diff = false;
+    mode.deferred_rescale = false;
+    int margin_bits = 2;
+    string out_file = "";
+
+    const char* const short_opts = "p:i:g:o:bqdh";
+    const option long_opts [] =
+    {
+            {"prime", required_argument, nullptr, 'p'},
+            {"input", required_argument, nullptr, 'i'},
+            {"margin_bits", required_argument, nullptr, 'g'},
+            {"out", required_argument, nullptr, 'o'},
+            {"batched", no_argument, nullptr, 'b'},
+            {"square_diff", no_argument, nullptr, 'q'},
+            {"deferred_rescale", no_argument, nullptr, 'd'},
+            {"help", no_argument, nullptr, 'h'},
+            {nullptr, 0, nullptr, 0}
+    };
+
+    while (true)
+    {
+        const auto opt = getopt_long(argc, argv, short_opts, long_opts, nullptr);
+        if (-1 == opt)
+            break;
+
+        switch(opt)
+        {
+        case 'p':
+            mode.prime = std::stoull(optarg);
+            break;
+
+        case 'i':
+            mode.data_points_num = std::stoull(optarg);
+            break;
+
+        case 'g':
+            margin_bits = std::stoi(optarg);
+            break;
+
+        case 'o':
+            out_file = optarg;
+            break;
+
+        case 'b':
+            mode.batched = true;
+            break;
+
+        case 'q':
+            mode.square_diff = true;
+            break;
+
+        case 'd':
+            mode.deferred_rescale = true;
+            break;
+
+        case 'h':
+        case '?':
+        default:
+            printHelp();
+            break;
+
+        }
+
+    }
+
+    Param_Planner planner(mode, margin_bits);
+    planned_params_s params;
+
+    if (!planner.Plan(&params))
+    {
+        std::cout << "No polyDegree up to 32768 fits these bounds at 128-bit security" << std::endl;
+        return 1;
+    }
+
+    planner.PrintParams(params);
+
+    if (!out_file.empty())
+    {
+        planner.SaveParams(params, out_file);
+        std::cout << "Parameters written to " << out_file << std::endl;
+    }
+
+    return 0;
+}
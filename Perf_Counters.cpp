@@ -0,0 +1,213 @@
+#include "Perf_Counters.h"
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+std::atomic<bool> Perf_Counters::_enabled{false};
+
+// the order of the events in a counter group, cycles is the group leader
+enum perf_event_index
+{
+    PERF_CYCLES_IDX = 0,
+    PERF_INSTRUCTIONS_IDX,
+    PERF_LLC_MISSES_IDX,
+    PERF_BRANCH_MISSES_IDX,
+    PERF_NUM_EVENTS,
+};
+
+static const unsigned long long PERF_EVENT_CONFIGS[PERF_NUM_EVENTS] = {
+    PERF_COUNT_HW_CPU_CYCLES,
+    PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_CACHE_MISSES,
+    PERF_COUNT_HW_BRANCH_MISSES,
+};
+
+// the counter group of one thread, closed when the thread exits
+struct perf_group_s
+{
+    int fds[PERF_NUM_EVENTS] = {-1, -1, -1, -1};
+    int read_index[PERF_NUM_EVENTS] = {-1, -1, -1, -1}; // position of each event in the group read, -1 if it didn't open
+    int num_opened = 0;
+    bool initialized = false;
+    int open_errno = 0;
+
+    void Open();
+    ~perf_group_s();
+};
+
+static int PerfEventOpen(perf_event_attr* attr, int group_fd)
+{
+    // pid 0 and cpu -1 count the calling thread on any cpu
+    return (int)syscall(__NR_perf_event_open, attr, 0, -1, group_fd, 0);
+}
+
+void perf_group_s::Open()
+{
+    initialized = true;
+
+    for (int i = 0; i < PERF_NUM_EVENTS; i++)
+    {
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = PERF_EVENT_CONFIGS[i];
+        attr.disabled = (i == PERF_CYCLES_IDX) ? 1 : 0;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+        fds[i] = PerfEventOpen(&attr, (i == PERF_CYCLES_IDX) ? -1 : fds[PERF_CYCLES_IDX]);
+        if (fds[i] < 0)
+        {
+            if (i == PERF_CYCLES_IDX)
+            {
+                // without the leader there is no group
+                open_errno = errno;
+                return;
+            }
+            continue;
+        }
+
+        read_index[i] = num_opened++;
+    }
+
+    ioctl(fds[PERF_CYCLES_IDX], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(fds[PERF_CYCLES_IDX], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+}
+
+perf_group_s::~perf_group_s()
+{
+    for (int fd : fds)
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+    }
+}
+
+static thread_local perf_group_s perf_group;
+
+perf_sample_s& perf_sample_s::operator+=(const perf_sample_s& other)
+{
+    // a counter missing in one run makes the total meaningless
+    auto add = [](long long& total, long long value) { total = (total < 0 || value < 0) ? -1 : total + value; };
+
+    add(cycles, other.cycles);
+    add(instructions, other.instructions);
+    add(llc_misses, other.llc_misses);
+    add(branch_misses, other.branch_misses);
+
+    return *this;
+}
+
+bool Perf_Counters::Enable()
+{
+    perf_sample_s sample;
+    if (!Read(sample))
+    {
+        std::cerr << "Hardware performance counters are not available (" << strerror(perf_group.open_errno)
+                  << "), check /proc/sys/kernel/perf_event_paranoid and that the machine exposes a PMU. Continuing without them" << std::endl;
+        return false;
+    }
+
+    _enabled.store(true, std::memory_order_relaxed);
+    return true;
+}
+
+bool Perf_Counters::Read(perf_sample_s& sample)
+{
+    if (!perf_group.initialized)
+    {
+        perf_group.Open();
+    }
+
+    if (perf_group.fds[PERF_CYCLES_IDX] < 0)
+    {
+        return false;
+    }
+
+    // nr, time enabled, time running, then one value per opened event
+    unsigned long long values[3 + PERF_NUM_EVENTS];
+    if (read(perf_group.fds[PERF_CYCLES_IDX], values, sizeof(values)) < (ssize_t)(3 * sizeof(unsigned long long)))
+    {
+        return false;
+    }
+
+    // scale up when the group shared the PMU with other groups
+    double scale = (values[2] > 0 && values[2] < values[1]) ? (double)values[1] / values[2] : 1.0;
+    long long counts[PERF_NUM_EVENTS];
+    for (int i = 0; i < PERF_NUM_EVENTS; i++)
+    {
+        counts[i] = (perf_group.read_index[i] < 0) ? -1 : (long long)(values[3 + perf_group.read_index[i]] * scale);
+    }
+
+    sample.cycles = counts[PERF_CYCLES_IDX];
+    sample.instructions = counts[PERF_INSTRUCTIONS_IDX];
+    sample.llc_misses = counts[PERF_LLC_MISSES_IDX];
+    sample.branch_misses = counts[PERF_BRANCH_MISSES_IDX];
+
+    return true;
+}
+
+string Perf_Counters::getHeader(const string& stage)
+{
+    return stage + " ipc," + stage + " cycles per ct," + stage + " llc misses per ct," + stage + " branch misses per ct";
+}
+
+string Perf_Counters::Format(const perf_sample_s& sample, long long ct_count)
+{
+    std::ostringstream out;
+
+    auto per_ct = [&](long long value) {
+        if (value < 0 || ct_count == 0)
+            out << "NA";
+        else
+            out << value / ct_count;
+    };
+
+    if (sample.cycles > 0 && sample.instructions >= 0)
+        out << (double)sample.instructions / sample.cycles;
+    else
+        out << "NA";
+
+    out << ",";
+    per_ct(sample.cycles);
+    out << ",";
+    per_ct(sample.llc_misses);
+    out << ",";
+    per_ct(sample.branch_misses);
+
+    return out.str();
+}
+
+void Perf_Span::End()
+{
+    if (!_active)
+    {
+        return;
+    }
+    _active = false;
+
+    perf_sample_s end;
+    if (!Perf_Counters::Read(end))
+    {
+        return;
+    }
+
+    auto delta = [](long long end_value, long long start_value) { return (end_value < 0 || start_value < 0) ? -1 : end_value - start_value; };
+
+    perf_sample_s diff;
+    diff.cycles = delta(end.cycles, _start.cycles);
+    diff.instructions = delta(end.instructions, _start.instructions);
+    diff.llc_misses = delta(end.llc_misses, _start.llc_misses);
+    diff.branch_misses = delta(end.branch_misses, _start.branch_misses);
+
+    *_total += diff;
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <atomic>
+#include <string>
+
+using std::string;
+
+// hardware counter values of a stage, summed over all its runs. A negative value means the counter is not available
+struct perf_sample_s
+{
+    long long cycles = 0;
+    long long instructions = 0;
+    long long llc_misses = 0;
+    long long branch_misses = 0;
+
+    perf_sample_s& operator+=(const perf_sample_s& other);
+};
+
+// Perf_Counters - per thread hardware counters read with perf_event_open: cycles, instructions, last level cache misses
+// and branch misses. Each thread opens its own counter group on first use, counting user space only.
+// The counters are disabled by default. Enable() checks that the kernel allows them (perf_event_paranoid, container
+// seccomp profile, virtual machine PMU) and otherwise reports why and leaves them disabled, so every caller can keep
+// its Perf_Spans in place. Counters the CPU doesn't support are reported as NA.
+class Perf_Counters
+{
+private:
+    static std::atomic<bool> _enabled;
+
+public:
+    // returns whether the counters could be enabled
+    static bool Enable();
+    static bool IsEnabled() { return _enabled.load(std::memory_order_relaxed); }
+
+    // the calling thread's counters since it first read them, returns false if they are not available
+    static bool Read(perf_sample_s& sample);
+
+    // csv columns of a stage, only written while the counters are enabled
+    static string getHeader(const string& stage);
+
+    // IPC, then cycles, LLC misses and branch misses per ciphertext
+    static string Format(const perf_sample_s& sample, long long ct_count);
+};
+
+// Perf_Span - adds the counter deltas of its scope to a stage total, does nothing when the counters are disabled.
+// The total must only be updated by one thread, as the counters are per thread.
+class Perf_Span
+{
+private:
+    perf_sample_s* _total;
+    perf_sample_s _start;
+    bool _active;
+
+public:
+    explicit Perf_Span(perf_sample_s* total) : _total(total), _active(Perf_Counters::IsEnabled() && Perf_Counters::Read(_start)) {}
+    ~Perf_Span() { End(); }
+
+    Perf_Span(const Perf_Span&) = delete;
+    Perf_Span& operator=(const Perf_Span&) = delete;
+
+    void End();
+};
@@ -0,0 +1,461 @@
+// Protocol_Bench.cpp
+// Microbenchmarks for the protocol's hot kernels, swept over every encryption params file and data size.
+// Results are written as JSON (by default to /tmp/out/protocol_bench.json) for regression tracking.
+
+#include <benchmark/benchmark.h>
+#include <dirent.h>
+#include <algorithm>
+#include <sys/stat.h>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include "../Servers_Protocol.h"
+
+using namespace utility;
+
+// everything a benchmark needs for one params file, created on first use since key generation is slow
+struct bench_setup
+{
+    string name;
+    enc_init_params_s enc_init_params;
+    shared_ptr<seal_struct> seal;
+};
+
+// the batched MAC inputs of one data size: HKDF keys, per ciphertext shares and their encryptions
+struct batched_inputs
+{
+    vector<Batched_Key_Generator> kmac_vec;   // a values per ciphertext
+    Batched_Key_Generator kmac_tag;           // b, c, d values used for the tag
+    vector<vector<double>> x_int_vec, x_frac_vec;
+    vector<Ciphertext> ct_x_int, ct_x_frac;
+    Ciphertext ct_t_r, ct_alpha_int, ct_beta_int;
+
+    batched_inputs(ullong prime) : kmac_tag(prime) {}
+};
+
+static byte bench_key[KEY_SIZE_BYTES] = {0};
+
+static shared_ptr<bench_setup> GetSetup(const string& params_file)
+{
+    static std::map<string, shared_ptr<bench_setup>> setups;
+    static std::mutex setups_mutex;
+
+    std::lock_guard<std::mutex> lock(setups_mutex);
+    auto it = setups.find(params_file);
+    if (it != setups.end())
+    {
+        return it->second;
+    }
+
+    auto setup = make_shared<bench_setup>();
+    setup->name = params_file.substr(params_file.find_last_of('/') + 1);
+    enc_init_params_s enc_init_params;
+    InitEncParams(&enc_init_params, params_file);
+    setup->enc_init_params = enc_init_params; // the assignment derives num_of_bits_prime and prime_bits_to_bytes
+
+    Servers_Protocol srvProtocol;
+    setup->seal = srvProtocol.gen_seal_params(setup->enc_init_params.polyDegree, setup->enc_init_params.bit_sizes, setup->enc_init_params.scale);
+
+    setups[params_file] = setup;
+    return setup;
+}
+
+static int NumOfCt(const enc_init_params_s& params, int data_points_num)
+{
+    return (data_points_num + params.max_ct_entries - 1) / params.max_ct_entries;
+}
+
+static Ciphertext EncryptVec(const shared_ptr<seal_struct>& seal, const vector<double>& vec, double scale)
+{
+    Plaintext pt;
+    Ciphertext ct;
+    seal->encoder_ptr->encode(vec, scale, pt);
+    seal->encryptor_ptr->encrypt(pt, ct);
+    return ct;
+}
+
+// builds keys, shares and tag ciphertexts the same way the Data Owner and Aux server do for batched mode
+static shared_ptr<batched_inputs> MakeBatchedInputs(const shared_ptr<bench_setup>& setup, int data_points_num)
+{
+    const enc_init_params_s& params = setup->enc_init_params;
+    auto inputs = make_shared<batched_inputs>(params.prime);
+    int num_of_ct = NumOfCt(params, data_points_num);
+
+    int num_of_mac_key_bytes = data_points_num * 2 * params.prime_bits_to_bytes + params.max_ct_entries * (params.prime_bits_to_bytes * 3 + 1);
+    SHARE_MAC_KEYS kmac_keys(num_of_mac_key_bytes);
+    kmac_keys.gen_keys(bench_key, KEY_SIZE_BYTES, constants::MAC_DERIVE_KEY);
+
+    for (int i = 0; i < num_of_ct; i++)
+    {
+        Servers_Protocol srvProtocol;
+        int ct_num_of_data_points = srvProtocol.ct_data_points(i, data_points_num, params.max_ct_entries);
+
+        Batched_Key_Generator kmac(params.prime);
+        kmac.derive_a(&kmac_keys, ct_num_of_data_points, params.prime_bits_to_bytes);
+        inputs->kmac_vec.push_back(kmac);
+
+        inputs->x_int_vec.push_back(utility::x_gen_int(0, 1, ct_num_of_data_points));
+        inputs->x_frac_vec.push_back(utility::x_gen_int(0, params.prime_minus_1, ct_num_of_data_points));
+        inputs->ct_x_int.push_back(EncryptVec(setup->seal, inputs->x_int_vec.back(), params.scale));
+        inputs->ct_x_frac.push_back(EncryptVec(setup->seal, inputs->x_frac_vec.back(), params.scale));
+    }
+
+    int tag_len = std::min(data_points_num, params.max_ct_entries);
+    inputs->kmac_tag.derive_bcd(&kmac_keys, tag_len, params.prime_bits_to_bytes, data_points_num * 2 * params.prime_bits_to_bytes);
+
+    double p_square = std::pow(params.prime, 2);
+    double p_triple = p_square * params.prime;
+    vector<double> t_r_vec = utility::x_gen_int(0, params.prime_minus_1, tag_len);
+    vector<double> alpha_vec = utility::x_gen_int(0, 1, tag_len);
+    vector<double> beta_vec = utility::x_gen_int(0, 1, tag_len);
+    std::transform(alpha_vec.begin(), alpha_vec.end(), alpha_vec.begin(), [p_triple](double v) { return v * p_triple; });
+    std::transform(beta_vec.begin(), beta_vec.end(), beta_vec.begin(), [p_square](double v) { return v * p_square; });
+
+    inputs->ct_t_r = EncryptVec(setup->seal, t_r_vec, params.scale);
+    inputs->ct_alpha_int = EncryptVec(setup->seal, alpha_vec, params.scale);
+    inputs->ct_beta_int = EncryptVec(setup->seal, beta_vec, params.scale);
+
+    return inputs;
+}
+
+// -----------------------------------------------------------------------------
+// Cleartext kernels
+// -----------------------------------------------------------------------------
+
+static void BM_gen_keys(benchmark::State& state, string params_file, int data_points_num)
+{
+    auto setup = GetSetup(params_file);
+    int bytes_for_secret_share = data_points_num * (setup->enc_init_params.prime_bits_to_bytes + 1);
+
+    for (auto _ : state)
+    {
+        SHARE_MAC_KEYS keys(bytes_for_secret_share);
+        keys.gen_keys(bench_key, KEY_SIZE_BYTES, constants::SECRET_SHARE_DERIVE_KEY);
+        benchmark::DoNotOptimize(keys.keys.data());
+    }
+
+    state.SetItemsProcessed(state.iterations() * data_points_num);
+    state.SetBytesProcessed(state.iterations() * bytes_for_secret_share);
+}
+
+static void BM_Derive_b_t(benchmark::State& state, string params_file, int data_points_num)
+{
+    auto setup = GetSetup(params_file);
+    int prime_bits_to_bytes = setup->enc_init_params.prime_bits_to_bytes;
+    Secret_Sharing secret_sharing(setup->enc_init_params);
+    SHARE_MAC_KEYS keys(data_points_num * (prime_bits_to_bytes + 1));
+    keys.gen_keys(bench_key, KEY_SIZE_BYTES, constants::SECRET_SHARE_DERIVE_KEY);
+
+    for (auto _ : state)
+    {
+        keys.keys_iter = 0;
+        for (int i = 0; i < data_points_num; i++)
+        {
+            benchmark::DoNotOptimize(secret_sharing.Derive_b_t(&keys, prime_bits_to_bytes));
+        }
+    }
+
+    state.SetItemsProcessed(state.iterations() * data_points_num);
+}
+
+static void BM_gen_share(benchmark::State& state, string params_file, int data_points_num)
+{
+    auto setup = GetSetup(params_file);
+    int prime_bits_to_bytes = setup->enc_init_params.prime_bits_to_bytes;
+    Secret_Sharing secret_sharing(setup->enc_init_params);
+    SHARE_MAC_KEYS keys(data_points_num * (prime_bits_to_bytes + 1));
+    keys.gen_keys(bench_key, KEY_SIZE_BYTES, constants::SECRET_SHARE_DERIVE_KEY);
+    vector<double> secret_vec = utility::x_gen_int(0, setup->enc_init_params.prime_minus_1, data_points_num);
+
+    for (auto _ : state)
+    {
+        keys.keys_iter = 0;
+        for (int i = 0; i < data_points_num; i++)
+        {
+            benchmark::DoNotOptimize(secret_sharing.gen_share(secret_vec[i], &keys, prime_bits_to_bytes));
+        }
+    }
+
+    state.SetItemsProcessed(state.iterations() * data_points_num);
+}
+
+static void BM_compact_mac_batched_optimized(benchmark::State& state, string params_file, int data_points_num)
+{
+    auto setup = GetSetup(params_file);
+    const enc_init_params_s& params = setup->enc_init_params;
+    MAC mac(params);
+    Batched_Key_Generator kmac(params.prime);
+
+    int num_of_mac_key_bytes = params.max_ct_entries * (params.prime_bits_to_bytes * 3 + 1);
+    SHARE_MAC_KEYS kmac_keys(num_of_mac_key_bytes);
+    kmac_keys.gen_keys(bench_key, KEY_SIZE_BYTES, constants::MAC_DERIVE_KEY);
+    kmac.derive_bcd(&kmac_keys, params.max_ct_entries, params.prime_bits_to_bytes, 0);
+
+    // y = sum over the aggregated ciphertexts of a_int * x_int + a_frac * x_frac, plus b
+    ullong max_y = (ullong)NumOfCt(params, data_points_num) * 2 * params.prime * params.prime;
+    vector<double> y_vec = utility::x_gen_int(0, max_y, params.max_ct_entries);
+
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(mac.compact_mac_batched_optimized(kmac, y_vec));
+    }
+
+    state.SetItemsProcessed(state.iterations() * params.max_ct_entries);
+}
+
+// -----------------------------------------------------------------------------
+// Homomorphic kernels, one call per ciphertext of the data size
+// -----------------------------------------------------------------------------
+
+// the batched y term as the Destination Server computes it: accumulated over the ciphertexts, then rescaled once
+static void BM_accumulateHE_batched_y(benchmark::State& state, string params_file, int data_points_num)
+{
+    auto setup = GetSetup(params_file);
+    auto inputs = MakeBatchedInputs(setup, data_points_num);
+    MAC mac(setup->enc_init_params);
+    DS_performance_metrics performanceMetrics;
+    MemoryPoolHandle pool = MemoryPoolHandle::New();
+
+    for (auto _ : state)
+    {
+        Ciphertext acc(pool);
+        for (int i = 0; i < inputs->ct_x_int.size(); i++)
+        {
+            mac.accumulateHE_batched_y(setup->seal, inputs->kmac_vec[i], inputs->ct_x_int[i], inputs->ct_x_frac[i], acc, pool, &performanceMetrics);
+        }
+        mac.finalizeHE_batched_y(setup->seal, acc, pool, &performanceMetrics);
+    }
+
+    state.SetItemsProcessed(state.iterations() * data_points_num);
+}
+
+static void BM_verifyHE_batched_y_tag(benchmark::State& state, string params_file, int data_points_num)
+{
+    auto setup = GetSetup(params_file);
+    auto inputs = MakeBatchedInputs(setup, data_points_num);
+    MAC mac(setup->enc_init_params);
+    DS_performance_metrics performanceMetrics;
+    MemoryPoolHandle pool = MemoryPoolHandle::New();
+    int tag_len = std::min(data_points_num, setup->enc_init_params.max_ct_entries);
+    Ciphertext ct_t_r(pool), ct_alpha_int(pool), ct_beta_int(pool), y_comp(pool);
+
+    for (auto _ : state)
+    {
+        // the tag ciphertexts are consumed by the verification
+        state.PauseTiming();
+        ct_t_r = inputs->ct_t_r;
+        ct_alpha_int = inputs->ct_alpha_int;
+        ct_beta_int = inputs->ct_beta_int;
+        state.ResumeTiming();
+
+        mac.verifyHE_batched_y_tag(setup->seal, tag_len, inputs->kmac_tag, ct_t_r, ct_alpha_int, ct_beta_int, y_comp, pool, &performanceMetrics);
+    }
+
+    state.SetItemsProcessed(state.iterations() * tag_len);
+}
+
+static void BM_Rec_CT(benchmark::State& state, string params_file, int data_points_num)
+{
+    auto setup = GetSetup(params_file);
+    auto inputs = MakeBatchedInputs(setup, data_points_num);
+    const enc_init_params_s& params = setup->enc_init_params;
+    Secret_Sharing secret_sharing(params);
+    MemoryPoolHandle pool = MemoryPoolHandle::New();
+    Ciphertext x_final_CT(pool);
+
+    // the cleartext terms Rec_CT receives: p * b - t and p * (-1)^b
+    vector<vector<double>> cleartext_vecs, cleartext_for_cipher_vecs;
+    for (int i = 0; i < inputs->x_int_vec.size(); i++)
+    {
+        vector<double> b_vec = utility::x_gen_int(0, 1, inputs->x_int_vec[i].size());
+        vector<double> t_vec = utility::x_gen_int(0, params.prime_minus_1, inputs->x_int_vec[i].size());
+        vector<double> cleartext_vec, cleartext_for_cipher_vec;
+        for (int j = 0; j < b_vec.size(); j++)
+        {
+            cleartext_vec.push_back(params.prime * b_vec[j] - t_vec[j]);
+            cleartext_for_cipher_vec.push_back(params.prime * ((b_vec[j] == 1) ? -1.0 : 1.0));
+        }
+        cleartext_vecs.push_back(cleartext_vec);
+        cleartext_for_cipher_vecs.push_back(cleartext_for_cipher_vec);
+    }
+
+    for (auto _ : state)
+    {
+        for (int i = 0; i < inputs->ct_x_int.size(); i++)
+        {
+            secret_sharing.Rec_CT(cleartext_vecs[i], cleartext_for_cipher_vecs[i], inputs->ct_x_int[i], inputs->ct_x_frac[i], x_final_CT, setup->seal, pool);
+        }
+    }
+
+    state.SetItemsProcessed(state.iterations() * data_points_num);
+}
+
+static void BM_serialize_fhe(benchmark::State& state, string params_file, int data_points_num)
+{
+    auto setup = GetSetup(params_file);
+    auto inputs = MakeBatchedInputs(setup, data_points_num);
+    long long bytes = 0;
+
+    for (auto _ : state)
+    {
+        for (const Ciphertext& ct : inputs->ct_x_frac)
+        {
+            std::string ser_str = utility::serialize_fhe(ct);
+            bytes += ser_str.size();
+            benchmark::DoNotOptimize(ser_str.data());
+        }
+    }
+
+    state.SetItemsProcessed(state.iterations() * inputs->ct_x_frac.size());
+    state.SetBytesProcessed(bytes);
+}
+
+static void BM_deserialize_fhe(benchmark::State& state, string params_file, int data_points_num)
+{
+    auto setup = GetSetup(params_file);
+    auto inputs = MakeBatchedInputs(setup, data_points_num);
+    vector<std::string> ser_vec;
+    long long bytes = 0;
+    Ciphertext ct;
+
+    for (const Ciphertext& ser_ct : inputs->ct_x_frac)
+    {
+        ser_vec.push_back(utility::serialize_fhe(ser_ct));
+    }
+
+    for (auto _ : state)
+    {
+        for (const std::string& ser_str : ser_vec)
+        {
+            utility::deserialize_fhe(ser_str, ct, setup->seal->context_ptr);
+            bytes += ser_str.size();
+        }
+    }
+
+    state.SetItemsProcessed(state.iterations() * ser_vec.size());
+    state.SetBytesProcessed(bytes);
+}
+
+// -----------------------------------------------------------------------------
+// Registration and main
+// -----------------------------------------------------------------------------
+
+typedef void (*bench_func)(benchmark::State&, string, int);
+
+static vector<string> ListParamsFiles(const string& params_dir)
+{
+    vector<string> files;
+    DIR* dir = opendir(params_dir.c_str());
+    if (dir == nullptr)
+    {
+        throw std::runtime_error("Error: Unable to open directory " + params_dir);
+    }
+
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != nullptr)
+    {
+        if (entry->d_name[0] != '.')
+        {
+            files.push_back(params_dir + "/" + entry->d_name);
+        }
+    }
+    closedir(dir);
+
+    std::sort(files.begin(), files.end());
+    return files;
+}
+
+static void RegisterAll(const vector<string>& params_files, const vector<int>& sizes)
+{
+    const std::pair<const char*, bench_func> kernels[] =
+    {
+        {"gen_keys", BM_gen_keys},
+        {"Derive_b_t", BM_Derive_b_t},
+        {"gen_share", BM_gen_share},
+        {"compact_mac_batched_optimized", BM_compact_mac_batched_optimized},
+        {"accumulateHE_batched_y", BM_accumulateHE_batched_y},
+        {"verifyHE_batched_y_tag", BM_verifyHE_batched_y_tag},
+        {"Rec_CT", BM_Rec_CT},
+        {"serialize_fhe", BM_serialize_fhe},
+        {"deserialize_fhe", BM_deserialize_fhe},
+    };
+
+    for (const auto& kernel : kernels)
+    {
+        for (const string& params_file : params_files)
+        {
+            string params_name = params_file.substr(params_file.find_last_of('/') + 1);
+            for (int data_points_num : sizes)
+            {
+                string name = string(kernel.first) + "/" + params_name + "/" + std::to_string(data_points_num);
+                benchmark::RegisterBenchmark(name.c_str(), kernel.second, params_file, data_points_num)->Unit(benchmark::kMicrosecond);
+            }
+        }
+    }
+}
+
+void printHelp(void)
+{
+    std::cout <<
+            "--params_dir=<dir>                   Directory of encryption params files to sweep. Default is ../tests_enc_params\n"
+            "--sizes=<n1,n2,...>                  Data sizes to sweep. Default is 16,4096,98304\n"
+            "Any --benchmark_* option is passed to Google Benchmark. Without --benchmark_out the results are written\n"
+            "as JSON to /tmp/out/protocol_bench.json\n";
+    exit(1);
+}
+
+int main(int argc, char* argv[])
+{
+    string params_dir = "../tests_enc_params";
+    vector<int> sizes = {16, 4096, 98304};
+    bool has_out = false;
+
+    // our own options are taken out before Google Benchmark parses the rest
+    vector<char*> bench_argv;
+    bench_argv.push_back(argv[0]);
+    for (int i = 1; i < argc; i++)
+    {
+        string arg(argv[i]);
+        if (arg.rfind("--params_dir=", 0) == 0)
+        {
+            params_dir = arg.substr(string("--params_dir=").size());
+        }
+        else if (arg.rfind("--sizes=", 0) == 0)
+        {
+            sizes.clear();
+            std::istringstream iss(arg.substr(string("--sizes=").size()));
+            string size;
+            while (getline(iss, size, ','))
+            {
+                sizes.push_back(std::stoi(size));
+            }
+        }
+        else if (arg == "--help" || arg == "-h")
+        {
+            printHelp();
+        }
+        else
+        {
+            has_out |= (arg.rfind("--benchmark_out=", 0) == 0);
+            bench_argv.push_back(argv[i]);
+        }
+    }
+
+    string out_arg = "--benchmark_out=/tmp/out/protocol_bench.json";
+    string out_format_arg = "--benchmark_out_format=json";
+    if (!has_out)
+    {
+        mkdir("/tmp/out", S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
+        bench_argv.push_back(&out_arg[0]);
+        bench_argv.push_back(&out_format_arg[0]);
+    }
+
+    RegisterAll(ListParamsFiles(params_dir), sizes);
+
+    int bench_argc = bench_argv.size();
+    benchmark::Initialize(&bench_argc, bench_argv.data());
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+
+    return 0;
+}
@@ -6,32 +6,45 @@ using namespace utility;
 Secret_Sharing::Secret_Sharing(enc_init_params_s enc_init_params)
 {
     _enc_init_params = enc_init_params;
+    _mod_arith = &Mod_Arith::For(enc_init_params.prime);
 }
 
 // Recombine shares into one FHE ciphertext
-const Ciphertext& Secret_Sharing::Rec_CT(
+void Secret_Sharing::Rec_CT(
     const vector<double>& cleartext_vec,
     const vector<double>& cleartext_for_cipher_vec,
-    Ciphertext& x_int_FHE,
-    Ciphertext& x_frac_FHE,
-    const shared_ptr<seal_struct> context)
+    const Ciphertext& x_int_FHE,
+    const Ciphertext& x_frac_FHE,
+    Ciphertext& x_final_CT,
+    const shared_ptr<seal_struct>& context,
+    MemoryPoolHandle pool,
+    bool defer_rescale)
 {
-    Plaintext encoded_cleartext_vec, encoded_cleartext_for_cipher_vec;
+    Plaintext encoded_cleartext_vec(pool), encoded_cleartext_for_cipher_vec(pool);
+    Ciphertext x_int_scaled(pool);
 
-    context->encoder_ptr->encode(cleartext_vec, _enc_init_params.scale, encoded_cleartext_vec);
-    context->encoder_ptr->encode(cleartext_for_cipher_vec, _enc_init_params.scale, encoded_cleartext_for_cipher_vec);
+    // x_int * p * (-1)^b is at scale^2, so x_frac is lifted to scale^2 by a plaintext of ones and the cleartext term is
+    // encoded directly at scale^2. Both plaintexts are zero after the data points, so the slots after them are zero
+    // in the result, also when a slot packed x_frac holds x_int there. One rescale at the end, or none when deferred
+    double scale_square = _enc_init_params.scale * _enc_init_params.scale;
+    Plaintext encoded_ones(pool);
+    vector<double> ones_vec(cleartext_vec.size(), 1);
 
-    context->evaluator_ptr->add_plain_inplace(x_frac_FHE, encoded_cleartext_vec);
-    context->evaluator_ptr->multiply_plain_inplace(x_int_FHE, encoded_cleartext_for_cipher_vec);
+    context->encoder_ptr->encode(cleartext_for_cipher_vec, x_int_FHE.parms_id(), _enc_init_params.scale, encoded_cleartext_for_cipher_vec, pool);
+    context->evaluator_ptr->multiply_plain(x_int_FHE, encoded_cleartext_for_cipher_vec, x_final_CT, pool);
 
-    context->evaluator_ptr->rescale_to_next_inplace(x_int_FHE);
-    context->evaluator_ptr->mod_switch_to_next_inplace(x_frac_FHE);
+    context->encoder_ptr->encode(ones_vec, x_frac_FHE.parms_id(), _enc_init_params.scale, encoded_ones, pool);
+    context->evaluator_ptr->multiply_plain(x_frac_FHE, encoded_ones, x_int_scaled, pool);
+    context->evaluator_ptr->add_inplace(x_final_CT, x_int_scaled);
 
-    x_int_FHE.scale() = _enc_init_params.scale;
+    context->encoder_ptr->encode(cleartext_vec, x_final_CT.parms_id(), scale_square, encoded_cleartext_vec, pool);
+    context->evaluator_ptr->add_plain_inplace(x_final_CT, encoded_cleartext_vec, pool);
 
-    context->evaluator_ptr->add_inplace(x_frac_FHE, x_int_FHE);
-
-    return x_frac_FHE;
+    if (!defer_rescale)
+    {
+        context->evaluator_ptr->rescale_to_next_inplace(x_final_CT, pool);
+        x_final_CT.scale() = _enc_init_params.scale;
+    }
 }
 
 // Helper: generate initial b and t from derived key bytes
@@ -60,6 +73,16 @@ void gen_b_t_init_values(ullong *b_init, ullong *t_init, int prime_bit_num, unsi
 
 // Derive b and t using SHARE_MAC_KEYS (HKDF version)
 sharePT_struct Secret_Sharing::Derive_b_t(SHARE_MAC_KEYS *keys, int prime_bits_to_bytes)
+{
+    Key_Window window(*keys, keys->keys_iter);
+    sharePT_struct shared_struct = Derive_b_t(window, prime_bits_to_bytes);
+    keys->keys_iter = window.position();
+
+    return shared_struct;
+}
+
+// Derive b and t from a key window
+sharePT_struct Secret_Sharing::Derive_b_t(Key_Window& window, int prime_bits_to_bytes)
 {
     ullong t1 = 0;
     int b1 = 0;
@@ -67,17 +90,17 @@ sharePT_struct Secret_Sharing::Derive_b_t(SHARE_MAC_KEYS *keys, int prime_bits_t
     // Derive t from bytes
     for(int i = 0; i < prime_bits_to_bytes; i++)
     {
-        t1 |= ((ullong)keys->get_next_byte() << (8 * i));
+        t1 |= ((ullong)window.get_next_byte() << (8 * i));
     }
 
     // Derive b as one bit
-    b1 = keys->get_next_byte() & 0x1;
+    b1 = window.get_next_byte() & 0x1;
 
     // Populate struct
     sharePT_struct shared_struct;
     shared_struct.x_int = 0.0;  // placeholder
     shared_struct.x_frac = 0.0; // placeholder
-    shared_struct.t = t1 % _enc_init_params.prime;
+    shared_struct.t = Mod_Arith::Mod(*_mod_arith, t1);
     shared_struct.b = b1;
 
     return shared_struct;
@@ -100,8 +123,8 @@ sharePT_struct Secret_Sharing::Derive_b_t(CryptoPP::HMAC<CryptoPP::SHA256> hmac,
     gen_b_t_init_values(&b_init, &t_init, prime_bit_num, (unsigned char*)derived_key.c_str());
 
     // Extract b and t from b_init and t_init
-    int b = b_init / _enc_init_params.prime;
-    llong t = t_init % _enc_init_params.prime;
+    int b = Mod_Arith::DivMod(*_mod_arith, b_init).quot;
+    llong t = Mod_Arith::Mod(*_mod_arith, t_init);
 
     // Populate struct
     sharePT_struct shared_struct;
@@ -118,8 +141,9 @@ sharePT_struct Secret_Sharing::gen_share(ullong x, SHARE_MAC_KEYS *secret_share_
 {
     sharePT_struct shared_struct = Derive_b_t(secret_share_keys, prime_bits_to_bytes);
 
-    int x_int = ((x + shared_struct.t) / _enc_init_params.prime + shared_struct.b) % 2;
-    ullong x_frac = ((x + shared_struct.t) % _enc_init_params.prime);
+    mod_divmod_s x_t = Mod_Arith::DivMod(*_mod_arith, x + shared_struct.t);
+    int x_int = (x_t.quot + shared_struct.b) % 2;
+    ullong x_frac = x_t.rem;
 
     shared_struct.x_int = (double)x_int;
     shared_struct.x_frac = (double)x_frac;
@@ -137,29 +161,32 @@ nanoseconds Secret_Sharing::Share(
     ullong x;
     nanoseconds share_time{0};
 
-    for (ullong i = 0; i < num_of_secrets; i++)
-    {
-        x = secret_num_vec[i];
+    Mod_Arith::Dispatch(*_mod_arith, [&](auto arith) {
+        for (ullong i = 0; i < num_of_secrets; i++)
+        {
+            x = secret_num_vec[i];
 
-        // Time start
-        auto start_share = utility::timer_start();
+            // Time start
+            auto start_share = utility::timer_start();
 
-        // Derive share
-        sharePT_struct shared_struct = Derive_b_t(hmac, i);
+            // Derive share
+            sharePT_struct shared_struct = Derive_b_t(hmac, i);
 
-        int x_int = ((x + shared_struct.t) / _enc_init_params.prime + shared_struct.b) % 2;
-        ullong x_frac = ((x + shared_struct.t) % _enc_init_params.prime);
+            mod_divmod_s x_t = arith.DivMod(x + shared_struct.t);
+            int x_int = (x_t.quot + shared_struct.b) % 2;
+            ullong x_frac = x_t.rem;
 
-        shared_struct.x_int = (double)x_int;
-        shared_struct.x_frac = (double)x_frac;
+            shared_struct.x_int = (double)x_int;
+            shared_struct.x_frac = (double)x_frac;
 
-        // Time end
-        share_time += utility::timer_end(start_share);
+            // Time end
+            share_time += utility::timer_end(start_share);
 
-        // Write share to output stream
-        os->write(reinterpret_cast<const char*>(&shared_struct.x_int), sizeof(double));
-        os->write(reinterpret_cast<const char*>(&shared_struct.x_frac), sizeof(double));
-    }
+            // Write share to output stream
+            os->write(reinterpret_cast<const char*>(&shared_struct.x_int), sizeof(double));
+            os->write(reinterpret_cast<const char*>(&shared_struct.x_frac), sizeof(double));
+        }
+    });
 
     return share_time;
 }
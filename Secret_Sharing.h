@@ -60,6 +60,7 @@ struct seal_struct {
 	shared_ptr<SecretKey> sk_ptr;           // Secret key
 
     shared_ptr<RelinKeys> relink_ptr;       // Relinearization keys
+    shared_ptr<GaloisKeys> galois_ptr;      // Galois keys, only created for slot packing and MAC aggregation rotations
 	int poly_modulus_degree;                // Polynomial modulus degree
 	vector<int> bit_sizes;                  // Modulus sizes
 	double scale;                           // CKKS scale
@@ -74,14 +75,16 @@ struct seal_struct {
 class Secret_Sharing {
 private:
     enc_init_params_s _enc_init_params;
+    const mod_arith_s* _mod_arith; // reduction by the prime, resolved once from the encryption params
     std::vector<byte> _keys;
 
 public:
     // Constructor
 	Secret_Sharing(enc_init_params_s _enc_inite_params);
 
-    // Secret sharing using HKDF keys
+    // Secret sharing using HKDF keys, from the current keys_iter or from a window
     sharePT_struct Derive_b_t(SHARE_MAC_KEYS *keys, int prime_bits_to_bytes);
+    sharePT_struct Derive_b_t(Key_Window& window, int prime_bits_to_bytes);
 
     // Secret sharing using HMAC-based derivation
     sharePT_struct Derive_b_t(CryptoPP::HMAC<CryptoPP::SHA256> hmac, int index);
@@ -93,6 +96,9 @@ public:
     sharePT_struct gen_share(ullong x, SHARE_MAC_KEYS *secret_share_keys, int prime_bits_to_bytes);
 
     // Recombine shares into FHE ciphertexts
-    const Ciphertext& Rec_CT(const vector<double>& cleartext_vec, const vector<double>& cleartext_for_cipher_vec, Ciphertext& x_int_FHE, Ciphertext& x_frac_FHE, const shared_ptr<seal_struct> context);
+    // x_int_FHE and x_frac_FHE are left untouched, the result is written into x_final_CT
+    // with defer_rescale the result stays at the input level with scale^2, and is rescaled by whoever consumes it
+    void Rec_CT(const vector<double>& cleartext_vec, const vector<double>& cleartext_for_cipher_vec, const Ciphertext& x_int_FHE, const Ciphertext& x_frac_FHE,
+        Ciphertext& x_final_CT, const shared_ptr<seal_struct>& context, MemoryPoolHandle pool = MemoryManager::GetPool(), bool defer_rescale = false);
 
 };
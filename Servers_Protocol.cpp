@@ -19,6 +19,20 @@ shared_ptr<seal_struct> Servers_Protocol::gen_seal_params(
     vector<seal::Modulus> coeff_modulus,
     double scale
 )
+{
+    shared_ptr<seal_struct> seal = gen_seal_context(poly_modulus_degree, coeff_modulus, scale);
+    gen_seal_keys(seal);
+
+    // Return fully initialized seal_struct
+    return seal;
+}
+
+// Create the SEALContext, Evaluator and Encoder only
+shared_ptr<seal_struct> Servers_Protocol::gen_seal_context(
+    int poly_modulus_degree,
+    vector<seal::Modulus> coeff_modulus,
+    double scale
+)
 {
     // Set up SEAL encryption parameters
     EncryptionParameters parms(scheme_type::ckks);
@@ -35,24 +49,67 @@ shared_ptr<seal_struct> Servers_Protocol::gen_seal_params(
     // Create core SEAL components
     seal.evaluator_ptr = make_shared<Evaluator>(seal.context_ptr);
     seal.encoder_ptr = make_shared<CKKSEncoder>(seal.context_ptr);
-    seal.keygen_ptr = make_shared<KeyGenerator>(seal.context_ptr);
+
+    return make_shared<seal_struct>(seal);
+}
+
+// Generate a fresh key set for the context
+void Servers_Protocol::gen_seal_keys(shared_ptr<seal_struct> seal)
+{
+    seal->keygen_ptr = make_shared<KeyGenerator>(seal->context_ptr);
 
     // Generate PublicKey and SecretKey
     seal::PublicKey pk;
-    seal.keygen_ptr->create_public_key(pk);
-    SecretKey sk = seal.keygen_ptr->secret_key();
+    seal->keygen_ptr->create_public_key(pk);
+    SecretKey sk = seal->keygen_ptr->secret_key();
 
     // Initialize Encryptor, Decryptor, and store keys
-    seal.encryptor_ptr = make_shared<Encryptor>(seal.context_ptr, pk);
-    seal.decryptor_ptr = make_shared<Decryptor>(seal.context_ptr, sk);
-    seal.pk_ptr = make_shared<seal::PublicKey>(pk);
-    seal.sk_ptr = make_shared<SecretKey>(sk);
+    seal->encryptor_ptr = make_shared<Encryptor>(seal->context_ptr, pk);
+    seal->decryptor_ptr = make_shared<Decryptor>(seal->context_ptr, sk);
+    seal->pk_ptr = make_shared<seal::PublicKey>(pk);
+    seal->sk_ptr = make_shared<SecretKey>(sk);
 
     // Generate and store RelinKeys for relinearization
     RelinKeys relin_keys;
-    seal.keygen_ptr->create_relin_keys(relin_keys);
-    seal.relink_ptr = make_shared<RelinKeys>(relin_keys);
+    seal->keygen_ptr->create_relin_keys(relin_keys);
+    seal->relink_ptr = make_shared<RelinKeys>(relin_keys);
+}
 
-    // Return fully initialized seal_struct
-    return make_shared<seal_struct>(seal);
+// Key generator, Decryptor and RelinKeys follow the loaded secret key
+void Servers_Protocol::set_secret_key(shared_ptr<seal_struct> seal, const SecretKey& sk, const RelinKeys* relin_keys)
+{
+    seal->sk_ptr = make_shared<SecretKey>(sk);
+    seal->keygen_ptr = make_shared<KeyGenerator>(seal->context_ptr, sk);
+    seal->decryptor_ptr = make_shared<Decryptor>(seal->context_ptr, sk);
+
+    if (relin_keys != nullptr)
+    {
+        seal->relink_ptr = make_shared<RelinKeys>(*relin_keys);
+    }
+    else
+    {
+        RelinKeys new_relin_keys;
+        seal->keygen_ptr->create_relin_keys(new_relin_keys);
+        seal->relink_ptr = make_shared<RelinKeys>(new_relin_keys);
+    }
+}
+
+// Encryptor follows the loaded public key
+void Servers_Protocol::set_public_key(shared_ptr<seal_struct> seal, const seal::PublicKey& pk)
+{
+    seal->pk_ptr = make_shared<seal::PublicKey>(pk);
+    seal->encryptor_ptr = make_shared<Encryptor>(seal->context_ptr, pk);
+}
+
+// Number of data points carried by the ciphertext at ct_index
+int Servers_Protocol::ct_data_points(int ct_index, int data_points_num, int max_ct_entries)
+{
+    int total_before_curr_ct = ct_index * max_ct_entries;
+    return std::min(data_points_num - total_before_curr_ct, max_ct_entries);
+}
+
+// Whether the ciphertext with the given amount of data points is sent slot packed
+bool Servers_Protocol::is_slot_packed(bool slot_packing, int ct_num_of_data_points, int max_ct_entries)
+{
+    return slot_packing && (ct_num_of_data_points <= max_ct_entries / 2);
 }
@@ -66,4 +66,30 @@ public:
         vector<seal::Modulus> coeff_modulus,   // Precomputed coefficient modulus vector
         double scale                           // Scaling factor for CKKS encoding
     );
+
+    // Create only the encryption context, evaluator and encoder, without any keys
+    // Used when the keys are loaded afterwards, so no keys are generated just to be replaced
+    shared_ptr<seal_struct> gen_seal_context(
+        int poly_modulus_degree,               // Polynomial modulus degree (degree of poly ring)
+        vector<seal::Modulus> coeff_modulus,   // Precomputed coefficient modulus vector
+        double scale                           // Scaling factor for CKKS encoding
+    );
+
+    // Generate a new secret key, public key and relinearization keys for a context
+    void gen_seal_keys(shared_ptr<seal_struct> seal);
+
+    // Use a loaded secret key: key generator, decryptor and relinearization keys
+    // The relinearization keys are generated from the secret key unless loaded ones are given
+    void set_secret_key(shared_ptr<seal_struct> seal, const SecretKey& sk, const RelinKeys* relin_keys = nullptr);
+
+    // Use a loaded public key for encryption
+    void set_public_key(shared_ptr<seal_struct> seal, const seal::PublicKey& pk);
+
+    // Number of data points carried by the ciphertext at ct_index
+    // all ciphertexts are full except possibly the last one
+    int ct_data_points(int ct_index, int data_points_num, int max_ct_entries);
+
+    // Slot packing: a ciphertext carrying at most half of the slots holds x_int and x_frac side by side
+    // ([x_int | x_frac]), and its MAC tag vectors are paired the same way
+    bool is_slot_packed(bool slot_packing, int ct_num_of_data_points, int max_ct_entries);
 };
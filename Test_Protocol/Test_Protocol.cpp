@@ -6,20 +6,40 @@
 #include <aws/s3/model/PutObjectRequest.h>
 #include <iomanip>
 #include <cryptopp/osrng.h>
+#include <atomic>
+#include <mutex>
+#include <random>
+#include <thread>
 
 using namespace Aws;
 
 
 std::ostream& operator<<(std::ostream& out, const TP_performance_metrics& tpPerformanceMetrics) {
-    return out << tpPerformanceMetrics.encode/1000 <<","<< tpPerformanceMetrics.encrypt/1000 <<","<< tpPerformanceMetrics.serialize/1000<<
+    out << tpPerformanceMetrics.encode/1000 <<","<< tpPerformanceMetrics.encrypt/1000 <<","<< tpPerformanceMetrics.serialize/1000<<
     ","<< tpPerformanceMetrics.store/1000 <<","<< tpPerformanceMetrics.load/1000 << ","<< tpPerformanceMetrics.deserialize/1000 <<
     "," <<tpPerformanceMetrics.hmac/1000 <<"," <<tpPerformanceMetrics.verify/1000 <<
     ","<<tpPerformanceMetrics.encode_no_mac/1000 <<","<< tpPerformanceMetrics.encrypt_no_mac/1000 <<","<< tpPerformanceMetrics.serialize_no_mac/1000<<
     ","<< tpPerformanceMetrics.store_no_mac/1000 <<","<< tpPerformanceMetrics.load_no_mac/1000<< ","<< tpPerformanceMetrics.deserialize_no_mac/1000<<
-    ","<< tpPerformanceMetrics.hkdf/1000<< ","<< tpPerformanceMetrics.decode_no_mac/1000<<","<< tpPerformanceMetrics.decrypt_no_mac/1000;}
+    ","<< tpPerformanceMetrics.hkdf/1000<< ","<< tpPerformanceMetrics.decode_no_mac/1000<<","<< tpPerformanceMetrics.decrypt_no_mac/1000;
+
+    if (Perf_Counters::IsEnabled())
+    {
+        out << "," << Perf_Counters::Format(tpPerformanceMetrics.encrypt_perf, tpPerformanceMetrics.perf_ct_count)
+            << "," << Perf_Counters::Format(tpPerformanceMetrics.verify_perf, tpPerformanceMetrics.perf_ct_count);
+    }
+
+    return out;
+}
 
 std::string TP_performance_metrics::getHeader(){
-    return "encode, encrypt, serialize, store, load, deserialize, hmac, verify, encode_no_mac, encrypt_no_mac, serialize_no_mac, store_no_mac, load_no_mac, deserialize_no_mac, hkdf, decode_no_mac, decrypt_no_mac";
+    std::string header = "encode, encrypt, serialize, store, load, deserialize, hmac, verify, encode_no_mac, encrypt_no_mac, serialize_no_mac, store_no_mac, load_no_mac, deserialize_no_mac, hkdf, decode_no_mac, decrypt_no_mac";
+
+    if (Perf_Counters::IsEnabled())
+    {
+        header += "," + Perf_Counters::getHeader("encode and encrypt") + "," + Perf_Counters::getHeader("verify");
+    }
+
+    return header;
 }
 
 Test_Protocol::Test_Protocol(string enc_init_params_file)
@@ -73,8 +93,7 @@ void Test_Protocol::test_storage_batched_sim()
 
         for (int j = 0; j < num_of_repetitions; j++)
         {
-            SDKOptions options;
-            Aws::InitAPI(options);
+            Aws_API_Guard aws_api;
             {
                 S3Utility s3_utility(awsparams::region);
 
@@ -198,8 +217,7 @@ void Test_Protocol::test_storage_unbatched(ullong input_size, shared_ptr<seal_st
 
     //std::cout << "3 - serialized" << endl;
 
-    SDKOptions options;
-    Aws::InitAPI(options);
+    Aws_API_Guard aws_api;
     {
         S3Utility s3_utility(awsparams::region);
 
@@ -349,7 +367,6 @@ void Test_Protocol::test_storage_unbatched(ullong input_size, shared_ptr<seal_st
 
         delete buf;
         delete buf2;
-        Aws::ShutdownAPI(options);
     //cout << "after delete " <<  endl;
 
 }
@@ -455,8 +472,7 @@ void Test_Protocol::hmac_on_FHE(ullong input_size, shared_ptr<seal_struct> seal,
 
     //std::cout << "3 - serialized" << endl;
 
-    SDKOptions options;
-    Aws::InitAPI(options);
+    Aws_API_Guard aws_api;
     {
         S3Utility s3_utility(awsparams::region);
 
@@ -544,11 +560,10 @@ void Test_Protocol::hmac_on_FHE(ullong input_size, shared_ptr<seal_struct> seal,
         }
     }
     delete buf;
-    Aws::ShutdownAPI(options);
 }
 
 
-int Test_Protocol::test_compact_HE_mac_optimized(ullong input_size){
+int Test_Protocol::test_compact_HE_mac_optimized(ullong input_size, TP_performance_metrics& performanceMetrics){
 
     vector<vector<double>> x_int_vec, x_frac_vec;
     int N_agg = ceil((input_size+0.0)/_enc_init_params.max_ct_entries);
@@ -577,15 +592,15 @@ int Test_Protocol::test_compact_HE_mac_optimized(ullong input_size){
         Batched_Key_Generator kmac(_enc_init_params.prime);
         vector<double> a_int = utility::x_gen_int(0, 1, len_vec); //generating random bit vec
         vector<double> a_frac = utility::x_gen_int(0,  _enc_init_params.prime_minus_1, len_vec);
-        kmac.a_int = a_int;
-        kmac.a_frac = a_frac;
+        kmac.assign(kmac.a_int, a_int);
+        kmac.assign(kmac.a_frac, a_frac);
 
         if(j==0){ //other values than a int, a frac are only necessary for number of slot count
-            kmac.b = utility::x_gen_int(0, _enc_init_params.prime_minus_1, len_vec);//utility::x_gen_int(0, _enc_init_params.prime_minus_1, 1)[0];
-            kmac.c_alpha = utility::x_gen_int(0, _enc_init_params.prime_minus_1, len_vec);
-            kmac.c_beta = utility::x_gen_int(0, _enc_init_params.prime_minus_1, len_vec);
-            kmac.d_alpha=utility::x_gen_int(0, 1, len_vec); //generating random bit vec
-            kmac.d_beta=utility::x_gen_int(0, 1, len_vec); //generating random bit vec
+            kmac.assign(kmac.b, utility::x_gen_int(0, _enc_init_params.prime_minus_1, len_vec));//utility::x_gen_int(0, _enc_init_params.prime_minus_1, 1)[0];
+            kmac.assign(kmac.c_alpha, utility::x_gen_int(0, _enc_init_params.prime_minus_1, len_vec));
+            kmac.assign(kmac.c_beta, utility::x_gen_int(0, _enc_init_params.prime_minus_1, len_vec));
+            kmac.assign(kmac.d_alpha, utility::x_gen_int(0, 1, len_vec)); //generating random bit vec
+            kmac.assign(kmac.d_beta, utility::x_gen_int(0, 1, len_vec)); //generating random bit vec
         }
 
         kmac_vec.push_back(kmac);
@@ -659,18 +674,32 @@ int Test_Protocol::test_compact_HE_mac_optimized(ullong input_size){
     seal_struct->encoder_ptr->encode(beta_int_vec, _enc_init_params.scale, pt_beta_int);
     seal_struct->encryptor_ptr->encrypt(pt_beta_int, ct_beta_int);
 
+    //zero the timers and counters of the previous run
+    nanoseconds encode_time(0), encrypt_time(0), verify_time(0);
+    performanceMetrics.encrypt_perf = perf_sample_s();
+    performanceMetrics.verify_perf = perf_sample_s();
+    performanceMetrics.perf_ct_count = 2 * N_agg;
+
     Ciphertext batched_y_ct;
     for(int j=0; j<N_agg; j++){
         Plaintext pt_x_int_const, pt_x_frac_const;
         Ciphertext ct_x_int_const, ct_x_frac_const;
 
+        Perf_Span encrypt_perf_span(&performanceMetrics.encrypt_perf);
+        high_resolution_clock::time_point start_encode = utility::timer_start();
         seal_struct->encoder_ptr->encode(x_int_vec[j], _enc_init_params.scale, pt_x_int_const);
-        seal_struct->encryptor_ptr->encrypt(pt_x_int_const, ct_x_int_const);
-
         seal_struct->encoder_ptr->encode(x_frac_vec[j], _enc_init_params.scale, pt_x_frac_const);
+        encode_time += utility::timer_end(start_encode);
+
+        high_resolution_clock::time_point start_encrypt = utility::timer_start();
+        seal_struct->encryptor_ptr->encrypt(pt_x_int_const, ct_x_int_const);
         seal_struct->encryptor_ptr->encrypt(pt_x_frac_const, ct_x_frac_const);
+        encrypt_time += utility::timer_end(start_encrypt);
+        encrypt_perf_span.End();
 
         //verify by DS
+        Perf_Span verify_perf_span(&performanceMetrics.verify_perf);
+        high_resolution_clock::time_point start_verify = utility::timer_start();
         if(j==0){
             batched_y_ct = verifyHE_batched_y(seal_struct, kmac_vec[j], ct_x_int_const, ct_x_frac_const);
         }
@@ -679,28 +708,39 @@ int Test_Protocol::test_compact_HE_mac_optimized(ullong input_size){
             seal_struct->evaluator_ptr->mod_switch_to_inplace(batched_y_ct, batched_y_ct_temp.parms_id());
             seal_struct->evaluator_ptr->add_inplace(batched_y_ct, batched_y_ct_temp);
         }
+        verify_time += utility::timer_end(start_verify);
+        verify_perf_span.End();
 
     }
+
+    Perf_Span verify_tag_perf_span(&performanceMetrics.verify_perf);
+    high_resolution_clock::time_point start_verify_tag = utility::timer_start();
     Ciphertext batched_y_tag_ct = verifyHE_batched_y_tag(seal_struct, len_vec, kmac_vec[0], ct_t_r, ct_alpha_int, ct_beta_int);
 
     Ciphertext diff_ct;
     vector<Ciphertext>(diffCt_shared);
     seal_struct->evaluator_ptr->sub(batched_y_ct, batched_y_tag_ct, diff_ct);
     diffCt_shared.push_back(diff_ct);
+    verify_time += utility::timer_end(start_verify_tag);
+    verify_tag_perf_span.End();
+
+    performanceMetrics.encode = encode_time.count();
+    performanceMetrics.encrypt = encrypt_time.count();
+    performanceMetrics.verify = verify_time.count();
 
-    return test_correctness::is_MAC_HE_valid(seal_struct,  make_shared<vector<Ciphertext>>(diffCt_shared), input_size, _enc_init_params.max_ct_entries, "MAC batched scheme", true);
+    return test_correctness::is_MAC_HE_valid(seal_struct, diffCt_shared, input_size, _enc_init_params.max_ct_entries, "MAC batched scheme", true);
 
 }
 
 
-Ciphertext Test_Protocol::verifyHE_batched_y(const shared_ptr<seal_struct> seal_struct , Batched_Key_Generator kmac, Ciphertext ct_x_int, Ciphertext ct_x_frac){
+Ciphertext Test_Protocol::verifyHE_batched_y(const shared_ptr<seal_struct> seal_struct , const Batched_Key_Generator& kmac, Ciphertext ct_x_int, Ciphertext ct_x_frac){
 
     MAC mac(_enc_init_params);
     Ciphertext ct_result;
     Plaintext pt_a_int, pt_a_frac;
 
-	seal_struct->encoder_ptr->encode(kmac.a_int, _enc_init_params.scale, pt_a_int);
-	seal_struct->encoder_ptr->encode(kmac.a_frac, _enc_init_params.scale, pt_a_frac);
+	seal_struct->encoder_ptr->encode(kmac.a_int.encode_view(), _enc_init_params.scale, pt_a_int);
+	seal_struct->encoder_ptr->encode(kmac.a_frac.encode_view(), _enc_init_params.scale, pt_a_frac);
 
 	mac.mult_ct_pt_inplace(seal_struct, ct_x_int, pt_a_int);
 	mac.mult_ct_pt_inplace(seal_struct, ct_x_frac, pt_a_frac);
@@ -711,7 +751,7 @@ Ciphertext Test_Protocol::verifyHE_batched_y(const shared_ptr<seal_struct> seal_
 }
 
 
-Ciphertext Test_Protocol::verifyHE_batched_y_tag(const shared_ptr<seal_struct> seal_struct , int len_vec, Batched_Key_Generator kmac, Ciphertext ct_tr, Ciphertext ct_alpha_int, Ciphertext ct_beta_int){
+Ciphertext Test_Protocol::verifyHE_batched_y_tag(const shared_ptr<seal_struct> seal_struct , int len_vec, const Batched_Key_Generator& kmac, Ciphertext ct_tr, Ciphertext ct_alpha_int, Ciphertext ct_beta_int){
 
     MAC mac(_enc_init_params);
     double p_square = _enc_init_params.prime * _enc_init_params.prime;
@@ -727,7 +767,7 @@ Ciphertext Test_Protocol::verifyHE_batched_y_tag(const shared_ptr<seal_struct> s
 			cleartext_calc[i] += p_triple - kmac.c_alpha[i] * p_square; // (-1)^d_alpha*(-d_alpha)*p^3-c_alpha*p^2
 		}
 		else {//d=0
-			cleartext_calc[i] +=  - kmac.c_alpha[i]* p_square ;//if d=0: -c_alpha*p^2
+			cleartext_calc[i] -= kmac.c_alpha[i] * p_square ;//if d=0: -c_alpha*p^2
 		}
 
 		if (kmac.d_beta[i] == 1) {
@@ -735,7 +775,7 @@ Ciphertext Test_Protocol::verifyHE_batched_y_tag(const shared_ptr<seal_struct> s
 			cleartext_calc[i] += p_square - kmac.c_beta[i] * _enc_init_params.prime ; // (-1)^d_beta*(-d_beta)*p^2-c_beta*p
 		}
 		else {//d=0
-			cleartext_calc[i] +=  - kmac.c_beta[i] * _enc_init_params.prime ;//if d=0: -c_beta*p
+			cleartext_calc[i] -= (double)kmac.c_beta[i] * _enc_init_params.prime ;//if d=0: -c_beta*p
 		}
 
 		cleartext_calc[i] -= kmac.b[i];
@@ -844,64 +884,290 @@ void Test_Protocol::test_crypto_sink_hmac(TP_performance_metrics& performanceMet
     //cout << "hmac len : "<<encoded.size()<< " data: " << encoded << endl;
 }
 
+bool Test_Protocol::test_hkdf_range(){
+
+    byte key_tag[KEY_SIZE_BYTES];
+    for (int i = 0; i < KEY_SIZE_BYTES; i++)
+    {
+        key_tag[i] = (byte)(i * 7 + 3);
+    }
+
+    int block_len = CryptoPP::HKDF<SHA512>().MaxDerivedKeyLength();
+    bool passed = true;
+
+    // without full blocks, with full blocks only, and with a remainder derived from the last full block
+    for (int key_len : {block_len / 3, 2 * block_len, 3 * block_len + block_len / 5})
+    {
+        SHARE_MAC_KEYS full_keys(key_len);
+        full_keys.gen_keys(key_tag, KEY_SIZE_BYTES, constants::MAC_DERIVE_KEY);
+
+        // the Data Owner and the Destination Server derive the same keys, also the ones of a remainder block
+        SHARE_MAC_KEYS other_keys(key_len);
+        other_keys.gen_keys(key_tag, KEY_SIZE_BYTES, constants::MAC_DERIVE_KEY);
+        if (full_keys.keys != other_keys.keys)
+        {
+            cout << "Two derivations of " << key_len << " bytes differ" << endl;
+            passed = false;
+        }
+
+        // offset and size pairs, most start and end mid block
+        vector<std::pair<int, int>> ranges = {
+            {0, key_len},
+            {0, 1},
+            {key_len - 1, 1},
+            {block_len / 2, 10},
+            {block_len / 2, block_len},
+            {block_len - 5, 10},
+            {key_len / 2 + 3, key_len / 4},
+            {key_len - block_len / 2 - 7, block_len / 2 + 7},
+        };
+
+        for (const auto& range : ranges)
+        {
+            int offset = std::max(0, std::min(range.first, key_len - 1));
+            int size = std::min(range.second, key_len - offset);
+
+            SHARE_MAC_KEYS range_keys(key_len);
+            range_keys.gen_keys_range(key_tag, KEY_SIZE_BYTES, constants::MAC_DERIVE_KEY, offset, size);
+
+            if (!std::equal(full_keys.keys.begin() + offset, full_keys.keys.begin() + offset + size, range_keys.keys.begin() + offset))
+            {
+                cout << "HKDF range of " << size << " bytes at " << offset << " of " << key_len << " differs from the full derivation" << endl;
+                passed = false;
+            }
+        }
+    }
+
+    cout << "HKDF range check - " << (passed ? "PASSED!" : "FAILED") << endl;
+    return passed;
+}
+
+bool Test_Protocol::test_aggregate_mac(shared_ptr<seal_struct> seal){
+
+    // a forged value, its square is well above the per value epsilon of 1
+    const double forged = 2;
+    int slot_count = seal->encoder_ptr->slot_count();
+    MAC mac(_enc_init_params);
+
+    seal->galois_ptr = make_shared<GaloisKeys>();
+    seal->keygen_ptr->create_galois_keys(MAC::aggregateRotationSteps(slot_count), *seal->galois_ptr);
+
+    // two diff ciphertexts of small honest errors, squared like the Destination Server squares them, then aggregated
+    auto aggregate = [&](const vector<double>& first_diff, const vector<double>& second_diff) {
+        vector<Ciphertext> diffs;
+        for (const vector<double>* diff_vec : {&first_diff, &second_diff})
+        {
+            Plaintext pt;
+            Ciphertext ct;
+            seal->encoder_ptr->encode(*diff_vec, _enc_init_params.scale, pt);
+            seal->encryptor_ptr->encrypt(pt, ct);
+            seal->evaluator_ptr->square_inplace(ct);
+            seal->evaluator_ptr->relinearize_inplace(ct, *seal->relink_ptr);
+            seal->evaluator_ptr->rescale_to_next_inplace(ct);
+            ct.scale() = _enc_init_params.scale;
+            diffs.push_back(std::move(ct));
+        }
+
+        Ciphertext aggregated;
+        mac.aggregateHE_diffs(seal, diffs, aggregated);
+        return aggregated;
+    };
+
+    // honest diffs at their bound, in every slot of both ciphertexts
+    vector<double> honest(slot_count, constants::MAC_HONEST_DIFF_BOUND);
+    ullong values = 2 * (ullong)slot_count;
+
+    // one slot flipped, and a pair of opposite forged slots in one ciphertext, which a signed sum would cancel
+    vector<double> flipped = honest;
+    flipped[slot_count / 3] = forged;
+    vector<double> paired = honest;
+    paired[1] = forged;
+    paired[2] = -forged;
+
+    bool passed = test_correctness::is_aggregated_MAC_HE_valid(seal, aggregate(honest, honest), values, "honest");
+    passed &= !test_correctness::is_aggregated_MAC_HE_valid(seal, aggregate(honest, flipped), values, "one slot flipped");
+    passed &= !test_correctness::is_aggregated_MAC_HE_valid(seal, aggregate(paired, honest), values, "paired opposite slots");
+
+    // the largest transfer, a block of 16M data points in the 8192 slots of the smallest shipped poly degree
+    const ullong smallest_slot_count = 8192;
+    ullong largest_values = (constants::NUM_DATAPOINTS_IN_BLOCK + smallest_slot_count - 1) / smallest_slot_count * smallest_slot_count;
+    if (!test_correctness::can_aggregate_MAC(largest_values))
+    {
+        cout << "The honest bound of " << largest_values << " aggregated values reaches a forged value's square" << endl;
+        passed = false;
+    }
+
+    cout << "Aggregated MAC forgery check - " << (passed ? "PASSED!" : "FAILED") << endl;
+    return passed;
+}
+
+bool Test_Protocol::test_mod_arith(){
+
+    std::mt19937_64 rng(12345);
+    bool passed = true;
+
+    // the primes with a ModArith specialization, and one that takes the runtime reduction
+    for (ullong prime : {constants::prime, 2999ULL, 16411ULL, 248231ULL, 524309ULL, 65537ULL})
+    {
+        vector<ullong> values = {0, 1, prime - 1, prime, prime + 1, prime * prime - 1, ~0ULL - 1, ~0ULL};
+        for (int i = 0; i < 1000; i++)
+        {
+            values.push_back(rng());
+            values.push_back(rng() >> 11); // doubles hold them exactly
+        }
+
+        const mod_arith_s& runtime = Mod_Arith::For(prime);
+
+        Mod_Arith::Dispatch(runtime, [&](auto arith) {
+            for (ullong x : values)
+            {
+                mod_divmod_s dv = arith.DivMod(x);
+                mod_divmod_s runtime_dv = runtime.DivMod(x);
+                double x_double = (double)x;
+                double mod_double = arith.ModDouble(x_double);
+
+                if (dv.quot != x / prime || dv.rem != x % prime || runtime_dv.quot != dv.quot || runtime_dv.rem != dv.rem)
+                {
+                    cout << "DivMod of " << x << " by " << prime << " gives " << dv.quot << ", " << dv.rem
+                         << " instead of " << x / prime << ", " << x % prime << endl;
+                    passed = false;
+                }
+
+                if (mod_double != fmod(x_double, prime) || runtime.ModDouble(x_double) != mod_double)
+                {
+                    cout << "ModDouble of " << x_double << " by " << prime << " gives " << mod_double
+                         << " instead of " << fmod(x_double, prime) << endl;
+                    passed = false;
+                }
+            }
+        });
+    }
+
+    cout << "Mod arithmetic check - " << (passed ? "PASSED!" : "FAILED") << endl;
+    return passed;
+}
+
 /////////////////////////////////////////////////////
 
 
-int test_correctness::is_correct_secret_sharing(shared_ptr<vector<Ciphertext>> x_final_CT, shared_ptr<seal_struct> seal, const vector<double>& x_origin,
-                                     int input_size, int max_ct_entries)
+void test_correctness::check_result_s::Merge(const check_result_s& other)
 {
-    int fhe_ctxt_number = ceil((input_size + 0.0) / max_ct_entries); //number of FHE  ciphertexts, derived automatically from user input
+    checked += other.checked;
+    incorrect += other.incorrect;
+    max_abs_error = std::max(max_abs_error, other.max_abs_error);
+    sum_abs_error += other.sum_abs_error;
+}
 
-    vector<vector<double>> main_final_x;
+// Decrypts and decodes the first ct_count ciphertexts on a pool of threads. Each thread takes the next ciphertext,
+// and compares it as soon as it is decoded, so memory doesn't grow with the data size.
+// abs_error(index, value) returns the absolute error of the decoded value of data point index
+template <typename Abs_Error_Func>
+static test_correctness::check_result_s CheckDecrypted(const vector<Ciphertext>& cts, int ct_count, shared_ptr<seal_struct> seal, int input_size,
+                                                      int max_ct_entries, double threshold, Abs_Error_Func abs_error)
+{
+    test_correctness::check_result_s result;
+    std::atomic<int> next_ct{0};
+    std::atomic<int> reported{0};
+    std::mutex result_mutex;
 
-    cout << "Checking secret share correctness" << endl;
-	//decrypt and decode final output
-	for (int i = 0; i < fhe_ctxt_number; i++)
-	{
-		Plaintext plain;
-		vector<double> final_x;
-		seal->decryptor_ptr->decrypt(x_final_CT.get()->at(i), plain);
-		seal->encoder_ptr->decode(plain, final_x);
-		main_final_x.push_back(final_x);
-	}
-	//check if output equals input
-	int counter_incorrect =0;
-	int threshold = 1;
-	for (int i = 0; (i < fhe_ctxt_number); i++)
-	{
-        for (int j = 0; j < max_ct_entries && ((j + i * max_ct_entries) < input_size) && (counter_incorrect < constants::max_reported_incorrect_items); j++)
-		{
-		    double orig_val = x_origin[j + i * max_ct_entries];
-		    double calc_val = main_final_x[i][j];
+    if (ct_count > (int)cts.size())
+    {
+        cout << "Expected " << ct_count << " ciphertexts, got " << cts.size() << endl;
+        ct_count = cts.size();
+        result.incorrect++;
+    }
 
-            if (abs(orig_val - calc_val) > threshold){
-                cout << "incorrect " << endl;
-				counter_incorrect++; //in case of final digit affects intire num
-				cout << "CT index is: " << i << " datapoint index " << j << " origin is " << orig_val << " result is " << calc_val << endl;
-			}
+    auto worker = [&]() {
+        test_correctness::check_result_s local;
+        Plaintext plain;
+        vector<double> decoded;
 
-		}
-	}
+        for (int i = next_ct++; i < ct_count; i = next_ct++)
+        {
+            seal->decryptor_ptr->decrypt(cts[i], plain);
+            seal->encoder_ptr->decode(plain, decoded);
+
+            for (int j = 0; (j < max_ct_entries) && ((j + i * max_ct_entries) < input_size); j++)
+            {
+                double error = abs_error(j + i * max_ct_entries, decoded[j]);
+                local.checked++;
+                local.sum_abs_error += error;
+                local.max_abs_error = std::max(local.max_abs_error, error);
+
+                // NaN counts as incorrect as well
+                if (!(error < threshold))
+                {
+                    local.incorrect++;
+                    if (reported++ < constants::max_reported_incorrect_items)
+                    {
+                        std::lock_guard<std::mutex> lock(result_mutex);
+                        cout.precision(14);
+                        cout << "incorrect at CT index " << i << " datapoint index " << j << " result is " << decoded[j] << " error is " << error << endl;
+                    }
+                }
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(result_mutex);
+        result.Merge(local);
+    };
 
-	if (counter_incorrect > 0)
+    int num_threads = std::max(1, std::min((int)std::thread::hardware_concurrency(), ct_count));
+    vector<std::thread> threads;
+    for (int t = 1; t < num_threads; t++)
     {
-        cout << "Secret share incorrect count: " << counter_incorrect << endl;
-        if (counter_incorrect >= constants::max_reported_incorrect_items)
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+
+    return result;
+}
+
+static void PrintCheckResult(const test_correctness::check_result_s& result, const string& check_name)
+{
+    cout << check_name << " max abs error: " << result.max_abs_error << " mean abs error: " << result.MeanAbsError() << endl;
+
+    if (result.incorrect > 0)
+    {
+        cout << check_name << " incorrect count: " << result.incorrect << " of " << result.checked << endl;
+        if (result.incorrect > (ullong)constants::max_reported_incorrect_items)
         {
-            cout << "Note that incorrect amounts larger than " << constants::max_reported_incorrect_items << " will not be reported" << endl;
+            cout << "Note that only the first " << constants::max_reported_incorrect_items << " incorrect items are reported" << endl;
         }
     }
-    else
+}
+
+int test_correctness::is_correct_secret_sharing(const vector<Ciphertext>& x_final_CT, shared_ptr<seal_struct> seal, const vector<double>& x_origin,
+                                     int input_size, int max_ct_entries, check_result_s* result)
+{
+    int fhe_ctxt_number = ceil((input_size + 0.0) / max_ct_entries); //number of FHE  ciphertexts, derived automatically from user input
+    double threshold = 1;
+
+    cout << "Checking secret share correctness" << endl;
+    check_result_s check = CheckDecrypted(x_final_CT, fhe_ctxt_number, seal, input_size, max_ct_entries, threshold,
+                                          [&](int index, double value) { return std::abs(x_origin[index] - value); });
+
+    PrintCheckResult(check, "Secret share");
+    if (check.incorrect == 0)
     {
         cout << "Secret share check for " << input_size << " inputs - PASSED!" << endl;
     }
 
-	return 1;
+    if (result != nullptr)
+    {
+        *result = check;
+    }
+
+	return (check.incorrect == 0);
 }
 
 
 
-bool test_correctness::is_MAC_HE_valid(shared_ptr<seal_struct> seal_struct, shared_ptr<vector<Ciphertext>> diffCt, int input_size, int max_ct_entries, string mac_type, bool compactMac)
+bool test_correctness::is_MAC_HE_valid(shared_ptr<seal_struct> seal_struct, const vector<Ciphertext>& diffCt, int input_size, int max_ct_entries, string mac_type, bool compactMac, check_result_s* result)
 {
 
     int fhe_ctxt_number = ceil((input_size + 0.0) / max_ct_entries); //number of FHE  ciphertexts, derived automatically from user input
@@ -909,48 +1175,68 @@ bool test_correctness::is_MAC_HE_valid(shared_ptr<seal_struct> seal_struct, shar
         fhe_ctxt_number =1;
     }
 
-    bool correct = true;
-    int EPSILON = 1;
-    int counter_incorrect = 0;
+    double EPSILON = constants::MAC_EPSILON;
 
     cout << "Checking " << mac_type << " MAC correctness" << endl;
-    //decrypt and decode output for comparison on cleartext
-    for (int i = 0; i < fhe_ctxt_number; i++)
-	{
-        Plaintext pt_diff;
-        vector<double> diff_vec;
-        seal_struct->decryptor_ptr->decrypt(diffCt.get()->at(i), pt_diff);
-        seal_struct->encoder_ptr->decode(pt_diff, diff_vec);
-
+    //decrypt and decode output for comparison on cleartext, the difference is expected to be 0
+    check_result_s check = CheckDecrypted(diffCt, fhe_ctxt_number, seal_struct, input_size, max_ct_entries, EPSILON,
+                                          [](int index, double value) { return std::abs(value); });
 
-        for (int j = 0; (j < max_ct_entries) && ((j + i * max_ct_entries) < input_size) && (counter_incorrect < constants::max_reported_incorrect_items);  j++) {
-            bool equal = (abs(diff_vec[j]) < EPSILON);
-            //cout <<"diff_vec[j]: "<<diff_vec[j]<<endl;
-            if (equal != true)
-            {
-                cout.precision(14);
-                std::cout << " ERROR at cipher: "<<i <<" index "<< j << " diff is: " << diff_vec[j] << endl;
-                correct = false;
-                counter_incorrect+=1;
-            }
-        }
-	}
-
-    if (counter_incorrect > 0)
+    PrintCheckResult(check, "MAC");
+    if (check.incorrect == 0)
     {
-        cout << "MAC incorrect count: " << counter_incorrect << endl;
-        if (counter_incorrect >= constants::max_reported_incorrect_items)
-        {
-            cout << "Note that incorrect amounts larger than " << constants::max_reported_incorrect_items << " will not be reported" << endl;
-        }
+        cout << "MAC check for " << input_size << " inputs - PASSED!" << endl;
     }
-    else
+
+    if (result != nullptr)
     {
-        cout << "MAC check for " << input_size << " inputs - PASSED!" << endl;
+        *result = check;
     }
 
+    return (check.incorrect == 0);
+}
 
-    return correct;
+
+double test_correctness::aggregated_MAC_honest_bound(ullong values)
+{
+    return values * constants::MAC_HONEST_DIFF_BOUND * constants::MAC_HONEST_DIFF_BOUND;
+}
+
+double test_correctness::aggregated_MAC_tolerance(ullong values)
+{
+    return (aggregated_MAC_honest_bound(values) + constants::MAC_EPSILON * constants::MAC_EPSILON) / 2;
+}
+
+bool test_correctness::can_aggregate_MAC(ullong values)
+{
+    return aggregated_MAC_honest_bound(values) < constants::MAC_EPSILON * constants::MAC_EPSILON;
+}
+
+bool test_correctness::is_aggregated_MAC_HE_valid(shared_ptr<seal_struct> seal_struct, const Ciphertext& aggregatedCt, ullong values, string mac_type)
+{
+    // the squared diffs are nonnegative, so the sum of a transfer with a value at or above the per value epsilon is at
+    // least its square. The honest values add at most their bound each, which the tolerance leaves room for
+    double tolerance = aggregated_MAC_tolerance(values);
+    Plaintext pt_aggregated;
+    vector<double> aggregated_vec;
+
+    cout << "Checking " << mac_type << " aggregated MAC correctness" << endl;
+    seal_struct->decryptor_ptr->decrypt(aggregatedCt, pt_aggregated);
+    seal_struct->encoder_ptr->decode(pt_aggregated, aggregated_vec);
+
+    cout.precision(14);
+    cout << "Aggregated MAC diff of " << values << " values: " << aggregated_vec[0] << " honest bound: " << aggregated_MAC_honest_bound(values)
+         << " tolerance: " << tolerance << endl;
+
+    // NaN counts as incorrect as well
+    if (!(std::abs(aggregated_vec[0]) < tolerance))
+    {
+        cout << "Aggregated MAC check FAILED" << endl;
+        return false;
+    }
+
+    cout << "Aggregated MAC check - PASSED!" << endl;
+    return true;
 }
 
 
@@ -959,7 +1245,7 @@ bool test_correctness::is_MAC_PT_valid(vector<double> diff_vec, int input_size,
 
     int fhe_ctxt_number = ceil((input_size + 0.0) / max_ct_entries); //number of FHE  ciphertexts, derived automatically from user input
     bool correct = true;
-    int EPSILON = 1;
+    double EPSILON = constants::MAC_EPSILON;
     int counter_incorrect = 0;
 
     cout << "Checking " << mac_type << " MAC correctness" << endl;
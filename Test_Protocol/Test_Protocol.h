@@ -5,6 +5,7 @@
 #include "../Servers_Protocol.h"
 #include "../Utility.h"
 #include "../Constants.h"
+#include "../Perf_Counters.h"
 
 #include <stdlib.h>
 #include <stdarg.h>
@@ -46,6 +47,11 @@ public:
 
     long long hkdf = 0; // Key derivation timer
 
+    // Hardware counters (with --perf_counters) of the MAC test, per encrypted ciphertext
+    perf_sample_s encrypt_perf;
+    perf_sample_s verify_perf;
+    long long perf_ct_count = 0;
+
     // Returns header string for performance report
     static std::string getHeader();
 };
@@ -75,6 +81,16 @@ public:
     // Test CryptoSink + HMAC output correctness and performance
     void test_crypto_sink_hmac(TP_performance_metrics& performanceMetrics);
 
+    // Test that keys derived for byte ranges match the same bytes of a full derivation
+    bool test_hkdf_range();
+
+    // Test that the aggregated MAC check passes honest diffs and rejects a forged slot, also when forged slots have opposite signs.
+    // Creates the Galois keys of the aggregation on the given seal
+    bool test_aggregate_mac(shared_ptr<seal_struct> seal);
+
+    // Test the division by every prime Mod_Arith has a specialization for, and by a runtime prime, against / % and fmod
+    bool test_mod_arith();
+
     // Simulated storage test — batched
     void test_storage_batched_sim();
 
@@ -85,32 +101,59 @@ public:
     void hmac_on_FHE(ullong input_size, shared_ptr<seal_struct> seal, TP_performance_metrics& performanceMetrics);
 
     // Test compact batched MAC verification (optimized version)
-    int test_compact_HE_mac_optimized(ullong input_size);
+    int test_compact_HE_mac_optimized(ullong input_size, TP_performance_metrics& performanceMetrics);
 
     // Local copy of batched MAC verification (ciphertext version) — used for testing only
-    Ciphertext verifyHE_batched_y(const shared_ptr<seal_struct> seal_struct, Batched_Key_Generator kmac, Ciphertext ct_x_int, Ciphertext ct_x_frac);
+    Ciphertext verifyHE_batched_y(const shared_ptr<seal_struct> seal_struct, const Batched_Key_Generator& kmac, Ciphertext ct_x_int, Ciphertext ct_x_frac);
 
     // Local copy of batched MAC verification with tag — used for testing only
-    Ciphertext verifyHE_batched_y_tag(const shared_ptr<seal_struct> seal_struct, int len_vec, Batched_Key_Generator kmac, Ciphertext ct_tr, Ciphertext ct_alpha_int, Ciphertext ct_beta_int);
+    Ciphertext verifyHE_batched_y_tag(const shared_ptr<seal_struct> seal_struct, int len_vec, const Batched_Key_Generator& kmac, Ciphertext ct_tr, Ciphertext ct_alpha_int, Ciphertext ct_beta_int);
 };
 
 // Namespace for testing correctness of protocol (unit tests)
 namespace test_correctness
 {
+    // Outcome of comparing decrypted values, accumulated over all the checked ciphertexts
+    struct check_result_s
+    {
+        ullong checked = 0;        // values compared
+        ullong incorrect = 0;      // values whose absolute error is above the threshold
+        double max_abs_error = 0;
+        double sum_abs_error = 0;
+
+        double MeanAbsError() const { return (checked > 0) ? sum_abs_error / checked : 0; }
+        void Merge(const check_result_s& other);
+    };
+
     // Check whether secret sharing result matches original vector (batched test)
-    int is_correct_secret_sharing(shared_ptr<vector<Ciphertext>> x_final_CT,
+    // The ciphertexts are decrypted, decoded and compared on a thread per core, one ciphertext at a time
+    int is_correct_secret_sharing(const vector<Ciphertext>& x_final_CT,
                                   shared_ptr<seal_struct> seal,
                                   const vector<double>& x_origin,
                                   int input_size,
-                                  int max_ct_entries);
+                                  int max_ct_entries,
+                                  check_result_s* result = nullptr);
 
-    // Check whether encrypted MAC output is valid (HE version)
+    // Check whether encrypted MAC output is valid (HE version), decrypted the same way
     bool is_MAC_HE_valid(shared_ptr<seal_struct> seal_struct,
-                         shared_ptr<vector<Ciphertext>> diffCt,
+                         const vector<Ciphertext>& diffCt,
                          int input_size,
                          int max_ct_entries,
                          string mac_type,
-                         bool compactMac);
+                         bool compactMac,
+                         check_result_s* result = nullptr);
+
+    // The bound of the sum of values squared honest MAC diffs, and the tolerance of the aggregated check: halfway between
+    // that bound and the square of a single forged value's diff, so it is only usable while the bound stays below it
+    double aggregated_MAC_honest_bound(ullong values);
+    double aggregated_MAC_tolerance(ullong values);
+    bool can_aggregate_MAC(ullong values);
+
+    // Check the aggregated squared MAC diff: its first slot, the sum of values squared diffs, must be below the tolerance
+    bool is_aggregated_MAC_HE_valid(shared_ptr<seal_struct> seal_struct,
+                                    const Ciphertext& aggregatedCt,
+                                    ullong values,
+                                    string mac_type);
 
     // Check whether plaintext MAC output is valid
     bool is_MAC_PT_valid(vector<double> diff_vec,
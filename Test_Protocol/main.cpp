@@ -15,6 +15,7 @@ void printHelp(void)
             "--enc_param_file <filename>  Read encryption params from a local file instead of defaults\n"
             "--no_test_mode               Do not validate output\n"
             "--no_mac                     Do not generate message authentication\n"
+            "--perf_counters              Report IPC and cache/branch misses per ciphertext of the encryption and MAC verification\n"
             "--help                       Display this help message\n";
     exit(1);
 
@@ -32,13 +33,14 @@ int main(int argc, char* argv[])
     bool with_mac = true;
     string params_file = "";
 
-    const char* const short_opts = "i:m:e:nh";
+    const char* const short_opts = "i:m:e:nPh";
     const option long_opts [] =
     {
             {"input", required_argument, nullptr, 'i'},
             {"repeat", required_argument, nullptr, 'm'},
             {"enc_param_file", required_argument, nullptr, 'e'},
             {"no_mac", no_argument, nullptr, 'n'},
+            {"perf_counters", no_argument, nullptr, 'P'},
             {"help", no_argument, nullptr, 'h'},
     };
 
@@ -66,6 +68,10 @@ int main(int argc, char* argv[])
             with_mac = false;
             break;
 
+        case 'P':
+            Perf_Counters::Enable();
+            break;
+
         case 'h':
         case '?':
         default:
@@ -84,10 +90,15 @@ int main(int argc, char* argv[])
 
     shared_ptr<seal_struct> seal = test_protocol.set_seal_struct();
 
+    // the cleartext checks don't depend on the input size
+    test_protocol.test_hkdf_range();
+    test_protocol.test_aggregate_mac(seal);
+    test_protocol.test_mod_arith();
+
     for (int i=0; i<repeat_times; i++){
 
         //test correctness of entire MAC. Note - to run this provide params file.
-        test_protocol.test_compact_HE_mac_optimized(input_size);
+        test_protocol.test_compact_HE_mac_optimized(input_size, performanceMetrics);
 
         /*other optional tests below
         test_protocol.test_hkdf(performanceMetrics);
@@ -0,0 +1,231 @@
+#include "Tracer.h"
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+std::atomic<bool> Tracer::_enabled(false);
+std::mutex Tracer::_buffers_mutex;
+vector<std::shared_ptr<Tracer::thread_buffer_s>> Tracer::_buffers;
+const high_resolution_clock::time_point Tracer::_origin = high_resolution_clock::now();
+
+// Owned by its thread. The global list keeps the buffer of an exited thread until its spans are exported
+struct Tracer::thread_owner_s
+{
+    string thread_name;
+    std::shared_ptr<thread_buffer_s> buffer;
+
+    ~thread_owner_s()
+    {
+        if (buffer)
+        {
+            ReleaseBuffer(buffer.get());
+        }
+    }
+};
+
+Tracer::thread_owner_s& Tracer::Owner()
+{
+    thread_local thread_owner_s owner;
+    return owner;
+}
+
+Tracer::thread_buffer_s* Tracer::ThreadBuffer()
+{
+    thread_owner_s& owner = Owner();
+
+    if (!owner.buffer)
+    {
+        auto new_buffer = std::make_shared<thread_buffer_s>();
+        new_buffer->tid = (int)syscall(SYS_gettid);
+        new_buffer->thread_name = owner.thread_name.empty() ? "thread " + std::to_string(new_buffer->tid) : owner.thread_name;
+        new_buffer->events.resize(RING_SIZE);
+
+        std::lock_guard<std::mutex> lock(_buffers_mutex);
+        _buffers.push_back(new_buffer);
+        owner.buffer = new_buffer;
+    }
+
+    return owner.buffer.get();
+}
+
+// the thread exited, a buffer without spans is dropped right away
+void Tracer::ReleaseBuffer(thread_buffer_s* buffer)
+{
+    std::lock_guard<std::mutex> buffers_lock(_buffers_mutex);
+    std::lock_guard<std::mutex> lock(buffer->mutex);
+
+    buffer->exited = true;
+    if (IsEmpty(*buffer))
+    {
+        _buffers.erase(std::remove_if(_buffers.begin(), _buffers.end(),
+                                      [&](const std::shared_ptr<thread_buffer_s>& other) { return other.get() == buffer; }),
+                       _buffers.end());
+    }
+}
+
+void Tracer::Record(const char* name, high_resolution_clock::time_point start, long long dur_ns)
+{
+    if (!IsEnabled())
+    {
+        return;
+    }
+
+    thread_buffer_s* buffer = ThreadBuffer();
+    std::lock_guard<std::mutex> lock(buffer->mutex);
+
+    trace_event_s& event = buffer->events[buffer->next];
+    event.name = name;
+    event.start_ns = duration_cast<nanoseconds>(start - _origin).count();
+    event.dur_ns = dur_ns;
+
+    if (++buffer->next == RING_SIZE)
+    {
+        buffer->next = 0;
+        buffer->wrapped = true;
+    }
+}
+
+void Tracer::SetThreadName(const string& name)
+{
+    thread_owner_s& owner = Owner();
+    owner.thread_name = name;
+
+    if (owner.buffer)
+    {
+        std::lock_guard<std::mutex> lock(owner.buffer->mutex);
+        owner.buffer->thread_name = name;
+    }
+}
+
+// complete ("X") events with microsecond timestamps, plus a thread_name metadata event per thread
+bool Tracer::WriteChromeTrace(const string& fileName, bool calling_thread_only)
+{
+    // a thread that recorded no span has no buffer, and its trace has no events
+    thread_buffer_s* own_buffer = calling_thread_only ? Owner().buffer.get() : nullptr;
+
+    std::ofstream out_file(fileName);
+    if (!out_file.is_open())
+    {
+        return false;
+    }
+
+    int pid = getpid();
+    bool first = true;
+    out_file << "{\"traceEvents\":[";
+
+    std::lock_guard<std::mutex> buffers_lock(_buffers_mutex);
+    for (auto it = _buffers.begin(); it != _buffers.end();)
+    {
+        thread_buffer_s* buffer = it->get();
+        if (calling_thread_only && (buffer != own_buffer))
+        {
+            ++it;
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(buffer->mutex);
+
+        out_file << (first ? "\n" : ",\n") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" << pid << ",\"tid\":" << buffer->tid
+                 << ",\"args\":{\"name\":\"" << buffer->thread_name << "\"}}";
+        first = false;
+
+        // oldest event first
+        size_t count = buffer->wrapped ? RING_SIZE : buffer->next;
+        size_t start = buffer->wrapped ? buffer->next : 0;
+        for (size_t i = 0; i < count; i++)
+        {
+            const trace_event_s& event = buffer->events[(start + i) % RING_SIZE];
+            out_file << ",\n{\"name\":\"" << event.name << "\",\"ph\":\"X\",\"pid\":" << pid << ",\"tid\":" << buffer->tid
+                     << ",\"ts\":" << event.start_ns / 1000.0 << ",\"dur\":" << event.dur_ns / 1000.0 << "}";
+        }
+
+        buffer->next = 0;
+        buffer->wrapped = false;
+
+        // the spans of an exited thread are exported, its buffer isn't needed anymore
+        bool exited = buffer->exited;
+        lock.unlock();
+        it = exited ? _buffers.erase(it) : it + 1;
+    }
+
+    out_file << "\n],\"displayTimeUnit\":\"ms\"}\n";
+    out_file.close();
+
+    return true;
+}
+
+void Tracer::Clear()
+{
+    std::lock_guard<std::mutex> buffers_lock(_buffers_mutex);
+    _buffers.erase(std::remove_if(_buffers.begin(), _buffers.end(),
+                                  [](const std::shared_ptr<thread_buffer_s>& buffer) {
+                                      std::lock_guard<std::mutex> lock(buffer->mutex);
+                                      buffer->next = 0;
+                                      buffer->wrapped = false;
+                                      return buffer->exited;
+                                  }),
+                   _buffers.end());
+}
+
+string Tracer::RunFileName(const string& fileName, const string& run)
+{
+    size_t ext = fileName.rfind(".json");
+    if (ext == string::npos)
+    {
+        return fileName + "_" + run + ".json";
+    }
+
+    return fileName.substr(0, ext) + "_" + run + ".json";
+}
+
+static void ReportRun(const string& run_file_name, bool written)
+{
+    if (written)
+    {
+        std::cout << "Trace written to " << run_file_name << std::endl;
+    }
+    else
+    {
+        std::cout << "Unable to open file " << run_file_name << std::endl;
+    }
+}
+
+void Tracer::WriteRun(const string& fileName, int run)
+{
+    string run_file_name = RunFileName(fileName, run);
+    ReportRun(run_file_name, WriteChromeTrace(run_file_name));
+}
+
+void Tracer::WriteThreadRun(const string& fileName, const string& run)
+{
+    string run_file_name = RunFileName(fileName, run);
+    ReportRun(run_file_name, WriteChromeTrace(run_file_name, true));
+}
+
+long long Trace_Span::End()
+{
+    if (_ended)
+    {
+        return 0;
+    }
+    _ended = true;
+
+    long long dur_ns = duration_cast<nanoseconds>(high_resolution_clock::now() - _start).count();
+
+    if (_total != nullptr)
+    {
+        *_total += dur_ns;
+    }
+    if (_atomic_total != nullptr)
+    {
+        _atomic_total->fetch_add(dur_ns, std::memory_order_relaxed);
+    }
+    if (_name != nullptr)
+    {
+        Tracer::Record(_name, _start, dur_ns);
+    }
+
+    return dur_ns;
+}
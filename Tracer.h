@@ -0,0 +1,107 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+using std::string;
+using std::vector;
+using namespace std::chrono;
+
+// a completed span, times are in nanoseconds since the tracer's origin
+struct trace_event_s
+{
+    const char* name;
+    long long start_ns;
+    long long dur_ns;
+};
+
+// Tracer - collects completed spans in per-thread ring buffers and exports them as a Chrome trace JSON,
+// which can be opened in chrome://tracing or ui.perfetto.dev.
+// When tracing is disabled recording is a single relaxed load, so spans can stay in the hot paths.
+class Tracer
+{
+private:
+    // each thread only appends to its own buffer, the mutex is only contended while exporting
+    struct thread_buffer_s
+    {
+        int tid;
+        string thread_name;
+        vector<trace_event_s> events;
+        size_t next = 0;
+        bool wrapped = false;
+        bool exited = false;   // the buffer is dropped once its spans are exported
+        std::mutex mutex;
+    };
+
+    // the calling thread's name and buffer, the buffer is only created by the first recorded span
+    struct thread_owner_s;
+
+    static std::atomic<bool> _enabled;
+    static std::mutex _buffers_mutex;
+    static vector<std::shared_ptr<thread_buffer_s>> _buffers;
+    static const high_resolution_clock::time_point _origin;
+
+    static thread_owner_s& Owner();
+    static thread_buffer_s* ThreadBuffer();
+    static void ReleaseBuffer(thread_buffer_s* buffer);
+    static bool IsEmpty(const thread_buffer_s& buffer) { return (buffer.next == 0) && !buffer.wrapped; }
+
+public:
+    // events kept per thread, older events are overwritten
+    static const size_t RING_SIZE = 1 << 16;
+
+    static void Enable(bool enable) { _enabled.store(enable, std::memory_order_relaxed); }
+    static bool IsEnabled() { return _enabled.load(std::memory_order_relaxed); }
+
+    // add a completed span to the calling thread's buffer
+    static void Record(const char* name, high_resolution_clock::time_point start, long long dur_ns);
+
+    // name the calling thread in the exported trace, without taking a buffer while tracing is disabled
+    static void SetThreadName(const string& name);
+
+    // write the buffered spans as Chrome trace JSON and clear their buffers, returns false if the file can't be opened.
+    // With calling_thread_only the spans of other threads, e.g. of concurrent connections, are left in their buffers
+    static bool WriteChromeTrace(const string& fileName, bool calling_thread_only = false);
+
+    // drop all buffered spans
+    static void Clear();
+
+    // file name for one run: trace.json -> trace_<run>.json
+    static string RunFileName(const string& fileName, const string& run);
+    static string RunFileName(const string& fileName, int run) { return RunFileName(fileName, std::to_string(run)); }
+
+    // write the spans of one run and report where they went
+    static void WriteRun(const string& fileName, int run);
+
+    // write only the calling thread's spans, for runs served concurrently on their own threads
+    static void WriteThreadRun(const string& fileName, const string& run);
+};
+
+// Trace_Span - RAII timer for one stage.
+// On End() or destruction the duration is added to the given metrics total and, if tracing is enabled
+// and the span is named, recorded in the tracer. Unnamed spans only accumulate, for per item loops.
+class Trace_Span
+{
+private:
+    const char* _name;
+    high_resolution_clock::time_point _start;
+    long long* _total = nullptr;
+    std::atomic<long long>* _atomic_total = nullptr;
+    bool _ended = false;
+
+public:
+    Trace_Span(const char* name) : _name(name), _start(high_resolution_clock::now()) {}
+    Trace_Span(const char* name, long long* total) : _name(name), _start(high_resolution_clock::now()), _total(total) {}
+    Trace_Span(const char* name, std::atomic<long long>* total) : _name(name), _start(high_resolution_clock::now()), _atomic_total(total) {}
+    ~Trace_Span() { End(); }
+
+    Trace_Span(const Trace_Span&) = delete;
+    Trace_Span& operator=(const Trace_Span&) = delete;
+
+    // end the span before the end of its scope, returns the duration in nanoseconds
+    long long End();
+};
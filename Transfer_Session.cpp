@@ -0,0 +1,425 @@
+#include "Transfer_Session.h"
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <sstream>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <cryptopp/osrng.h>
+#include <cryptopp/sha.h>
+
+static const uint32_t SESSION_VERSION = 5;
+static const uint32_t MAX_BLOCK_RANGES = 4096;
+static const size_t MAGIC_SIZE = 4;
+static const char HELLO_MAGIC[4] = {'S', 'H', 'L', 'O'};
+static const char ACCEPT_MAGIC[4] = {'S', 'A', 'C', 'P'};
+static const char ACK_MAGIC[4] = {'S', 'A', 'C', 'K'};
+
+static const size_t HELLO_MESSAGE_SIZE = MAGIC_SIZE + sizeof(uint32_t) + 2 * sizeof(ullong) + 5 * sizeof(uint32_t); // followed by the block ranges and the dataset name
+static const size_t BLOCK_RANGE_SIZE = 2 * sizeof(uint32_t);
+static const size_t ACCEPT_MESSAGE_SIZE = MAGIC_SIZE + sizeof(uint32_t) + sizeof(ullong) + 4 * sizeof(uint32_t);
+static const size_t ACK_MESSAGE_SIZE = MAGIC_SIZE + sizeof(uint32_t);
+
+// appends the fields of a message one after the other, without padding
+class Message_Writer
+{
+private:
+    char* _pos;
+
+public:
+    explicit Message_Writer(char* buffer) : _pos(buffer) {}
+
+    template <typename T>
+    void Put(const T& value)
+    {
+        memcpy(_pos, &value, sizeof(T));
+        _pos += sizeof(T);
+    }
+
+    void PutBytes(const char* data, size_t size)
+    {
+        memcpy(_pos, data, size);
+        _pos += size;
+    }
+};
+
+class Message_Reader
+{
+private:
+    const char* _pos;
+
+public:
+    explicit Message_Reader(const char* buffer) : _pos(buffer) {}
+
+    template <typename T>
+    T Get()
+    {
+        T value;
+        memcpy(&value, _pos, sizeof(T));
+        _pos += sizeof(T);
+        return value;
+    }
+
+    const char* Skip(size_t size)
+    {
+        const char* start = _pos;
+        _pos += size;
+        return start;
+    }
+};
+
+// the magic and the version that start every message
+static bool CheckHeader(Message_Reader& reader, const char magic[4], const char* message_name)
+{
+    if (memcmp(reader.Skip(MAGIC_SIZE), magic, MAGIC_SIZE) != 0)
+    {
+        std::cerr << "Expected a session " << message_name << ", the peer runs an older protocol" << std::endl;
+        return false;
+    }
+
+    uint32_t version = reader.Get<uint32_t>();
+    if (version != SESSION_VERSION)
+    {
+        std::cerr << "Session " << message_name << " has version " << version << ", expected " << SESSION_VERSION << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+ullong Transfer_Session::NewSessionId()
+{
+    CryptoPP::AutoSeededRandomPool rng;
+    return ((ullong)time(nullptr) << 32) | rng.GenerateWord32();
+}
+
+bool Transfer_Session::SendHello(int the_socket, const session_hello_s& hello)
+{
+    if (hello.blocks.size() > MAX_BLOCK_RANGES)
+    {
+        std::cerr << "At most " << MAX_BLOCK_RANGES << " block ranges can be requested" << std::endl;
+        return false;
+    }
+
+    if (hello.dataset.size() > MAX_DATASET_NAME_LENGTH)
+    {
+        std::cerr << "Dataset names are at most " << MAX_DATASET_NAME_LENGTH << " characters" << std::endl;
+        return false;
+    }
+
+    std::vector<char> message(HELLO_MESSAGE_SIZE + hello.blocks.size() * BLOCK_RANGE_SIZE + hello.dataset.size());
+    Message_Writer writer(message.data());
+    writer.PutBytes(HELLO_MAGIC, MAGIC_SIZE);
+    writer.Put(SESSION_VERSION);
+    writer.Put(hello.session_id);
+    writer.Put(hello.resume_from);
+    writer.Put(hello.data_points_num);
+    writer.Put(hello.mode);
+    writer.Put(hello.params_hash);
+    writer.Put((uint32_t)hello.blocks.size());
+    writer.Put((uint32_t)hello.dataset.size());
+
+    for (const block_range_s& range : hello.blocks)
+    {
+        writer.Put(range.first);
+        writer.Put(range.count);
+    }
+    writer.PutBytes(hello.dataset.data(), hello.dataset.size());
+
+    return SendAll(the_socket, message.data(), message.size());
+}
+
+bool Transfer_Session::ReceiveHello(int the_socket, session_hello_s& hello)
+{
+    char message[HELLO_MESSAGE_SIZE];
+    if (!ReceiveAll(the_socket, message, sizeof(message)))
+    {
+        return false;
+    }
+
+    Message_Reader reader(message);
+    if (!CheckHeader(reader, HELLO_MAGIC, "hello"))
+    {
+        return false;
+    }
+
+    hello.session_id = reader.Get<ullong>();
+    hello.resume_from = reader.Get<uint32_t>();
+    hello.data_points_num = reader.Get<uint32_t>();
+    hello.mode = reader.Get<uint32_t>();
+    hello.params_hash = reader.Get<ullong>();
+    uint32_t num_of_ranges = reader.Get<uint32_t>();
+    uint32_t dataset_length = reader.Get<uint32_t>();
+
+    if (num_of_ranges > MAX_BLOCK_RANGES)
+    {
+        std::cerr << "Session hello requests " << num_of_ranges << " block ranges, at most " << MAX_BLOCK_RANGES << " are served" << std::endl;
+        return false;
+    }
+
+    if (dataset_length > (uint32_t)MAX_DATASET_NAME_LENGTH)
+    {
+        std::cerr << "Session hello has a dataset name of " << dataset_length << " characters, at most " << MAX_DATASET_NAME_LENGTH << " are allowed" << std::endl;
+        return false;
+    }
+
+    std::vector<char> ranges_and_name(num_of_ranges * BLOCK_RANGE_SIZE + dataset_length);
+    if (!ReceiveAll(the_socket, ranges_and_name.data(), ranges_and_name.size()))
+    {
+        return false;
+    }
+
+    Message_Reader ranges_reader(ranges_and_name.data());
+    hello.blocks.resize(num_of_ranges);
+    for (block_range_s& range : hello.blocks)
+    {
+        range.first = ranges_reader.Get<uint32_t>();
+        range.count = ranges_reader.Get<uint32_t>();
+    }
+    hello.dataset.assign(ranges_reader.Skip(dataset_length), dataset_length);
+
+    return true;
+}
+
+bool Transfer_Session::SendAccept(int the_socket, const session_accept_s& accept)
+{
+    char message[ACCEPT_MESSAGE_SIZE];
+    Message_Writer writer(message);
+    writer.PutBytes(ACCEPT_MAGIC, MAGIC_SIZE);
+    writer.Put(SESSION_VERSION);
+    writer.Put(accept.status);
+    writer.Put(accept.mode);
+    writer.Put(accept.session_id);
+    writer.Put(accept.start_index);
+    writer.Put(accept.num_of_ct);
+
+    return SendAll(the_socket, message, sizeof(message));
+}
+
+bool Transfer_Session::ReceiveAccept(int the_socket, session_accept_s& accept)
+{
+    char message[ACCEPT_MESSAGE_SIZE];
+    if (!ReceiveAll(the_socket, message, sizeof(message)))
+    {
+        return false;
+    }
+
+    Message_Reader reader(message);
+    if (!CheckHeader(reader, ACCEPT_MAGIC, "accept"))
+    {
+        return false;
+    }
+
+    accept.status = reader.Get<uint32_t>();
+    accept.mode = reader.Get<uint32_t>();
+    accept.session_id = reader.Get<ullong>();
+    accept.start_index = reader.Get<uint32_t>();
+    accept.num_of_ct = reader.Get<uint32_t>();
+
+    return true;
+}
+
+bool Transfer_Session::SendAck(int the_socket, uint32_t verified)
+{
+    char message[ACK_MESSAGE_SIZE];
+    Message_Writer writer(message);
+    writer.PutBytes(ACK_MAGIC, MAGIC_SIZE);
+    writer.Put(verified);
+
+    return SendAll(the_socket, message, sizeof(message));
+}
+
+bool Transfer_Session::ReceiveAcks(int the_socket, uint32_t& verified, bool wait, int timeout_seconds)
+{
+    if (wait)
+    {
+        struct pollfd poll_fd = {the_socket, POLLIN, 0};
+        int ready = poll(&poll_fd, 1, timeout_seconds * 1000);
+        if (ready <= 0)
+        {
+            return (ready == 0) || (errno == EINTR);
+        }
+    }
+
+    while (true)
+    {
+        // only take an acknowledgement once all of it arrived, the sender never waits for a partial one
+        char message[ACK_MESSAGE_SIZE];
+        ssize_t available = recv(the_socket, message, sizeof(message), MSG_PEEK | MSG_DONTWAIT);
+        if (available == 0)
+        {
+            return false;
+        }
+        if (available < 0)
+        {
+            return (errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR);
+        }
+        if (available < (ssize_t)sizeof(message))
+        {
+            return true;
+        }
+
+        if (!ReceiveAll(the_socket, message, sizeof(message)))
+        {
+            return false;
+        }
+
+        Message_Reader reader(message);
+        if (memcmp(reader.Skip(MAGIC_SIZE), ACK_MAGIC, MAGIC_SIZE) != 0)
+        {
+            std::cerr << "Unexpected message instead of a session acknowledgement" << std::endl;
+            return false;
+        }
+        verified = reader.Get<uint32_t>();
+    }
+}
+
+const char* Transfer_Session::StatusText(uint32_t status)
+{
+    switch (status)
+    {
+    case SESSION_ACCEPTED:
+        return "accepted";
+    case SESSION_UNKNOWN_DATASET:
+        return "the dataset isn't served";
+    case SESSION_SIZE_MISMATCH:
+        return "the input size doesn't match the dataset";
+    case SESSION_MODE_MISMATCH:
+        return "slot packing doesn't match the dataset";
+    case SESSION_PARAMS_MISMATCH:
+        return "the encryption params don't match the dataset";
+    case SESSION_INVALID_BLOCKS:
+        return "the selected blocks can't be served";
+    default:
+        return "unknown status";
+    }
+}
+
+ullong Transfer_Session::ParamsHash(const utility::enc_init_params_s& enc_init_params)
+{
+    CryptoPP::SHA256 hash;
+    CryptoPP::byte digest[CryptoPP::SHA256::DIGESTSIZE];
+    hash.Update((const CryptoPP::byte*)&enc_init_params.prime, sizeof(enc_init_params.prime));
+    hash.Update((const CryptoPP::byte*)&enc_init_params.polyDegree, sizeof(enc_init_params.polyDegree));
+    hash.Update((const CryptoPP::byte*)&enc_init_params.max_ct_entries, sizeof(enc_init_params.max_ct_entries));
+    hash.Update((const CryptoPP::byte*)&enc_init_params.scale, sizeof(enc_init_params.scale));
+    hash.Update((const CryptoPP::byte*)enc_init_params.bit_sizes.data(), enc_init_params.bit_sizes.size() * sizeof(int));
+    hash.Final(digest);
+
+    ullong params_hash;
+    memcpy(&params_hash, digest, sizeof(params_hash));
+    return params_hash;
+}
+
+bool Transfer_Session::ParseBlocks(const std::string& text, std::vector<block_range_s>& blocks)
+{
+    std::stringstream list(text);
+    std::string item;
+
+    blocks.clear();
+    while (std::getline(list, item, ','))
+    {
+        unsigned long first, last;
+        char* end;
+
+        first = strtoul(item.c_str(), &end, 10);
+        last = first;
+        if (*end == '-')
+        {
+            last = strtoul(end + 1, &end, 10);
+        }
+
+        if (item.empty() || !isdigit(item[0]) || *end != '\0' || last < first)
+        {
+            return false;
+        }
+
+        block_range_s range;
+        range.first = first;
+        range.count = last - first + 1;
+        blocks.push_back(range);
+    }
+
+    return !blocks.empty();
+}
+
+bool Transfer_Session::SelectedBlocks(const std::vector<block_range_s>& blocks, uint32_t num_of_blocks, std::vector<int>& selected)
+{
+    selected.clear();
+
+    if (blocks.empty())
+    {
+        for (uint32_t i = 0; i < num_of_blocks; i++)
+        {
+            selected.push_back(i);
+        }
+        return true;
+    }
+
+    for (const block_range_s& range : blocks)
+    {
+        // 64 bit, so a huge count can't wrap around
+        ullong end = (ullong)range.first + range.count;
+        if (range.count == 0 || end > num_of_blocks || (!selected.empty() && range.first <= (uint32_t)selected.back()))
+        {
+            return false;
+        }
+
+        for (uint32_t i = range.first; i < end; i++)
+        {
+            selected.push_back(i);
+        }
+    }
+
+    return true;
+}
+
+bool Transfer_Session::SendAll(int the_socket, const char* data, size_t size)
+{
+    size_t sent = 0;
+    int sent_times = 0;
+
+    while (sent < size)
+    {
+        // MSG_NOSIGNAL, a closed peer is reported as an error instead of a SIGPIPE
+        ssize_t n = send(the_socket, data + sent, size - sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n < 0)
+        {
+            return false;
+        }
+        if (n == 0 && ++sent_times == MAX_SOCKET_SEND_RETRIES)
+        {
+            return false;
+        }
+        sent += n;
+    }
+
+    return true;
+}
+
+bool Transfer_Session::ReceiveAll(int the_socket, char* data, size_t size)
+{
+    size_t received = 0;
+
+    while (received < size)
+    {
+        ssize_t n = read(the_socket, data + received, size - received);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            return false;
+        }
+        received += n;
+    }
+
+    return true;
+}
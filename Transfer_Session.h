@@ -0,0 +1,96 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include "Utility.h"
+
+// consecutive ciphertext blocks: the data points first * max_ct_entries up to (first + count) * max_ct_entries
+struct block_range_s
+{
+    uint32_t first = 0;
+    uint32_t count = 0;
+};
+
+// the transfer mode of a request, the Aux encodes and the Destination Server decodes the ciphertexts the same way
+enum session_mode_flags
+{
+    SESSION_MODE_BATCHED = 1,
+    SESSION_MODE_SLOT_PACKING = 2,
+};
+
+// why the Aux accepted or rejected a hello
+enum session_status
+{
+    SESSION_ACCEPTED = 0,
+    SESSION_UNKNOWN_DATASET,
+    SESSION_SIZE_MISMATCH,
+    SESSION_MODE_MISMATCH,
+    SESSION_PARAMS_MISMATCH,
+    SESSION_INVALID_BLOCKS,
+};
+
+// first message of every connection, sent by the Destination Server
+struct session_hello_s
+{
+    ullong session_id = 0;
+    uint32_t resume_from = 0;           // first ciphertext set of the transfer the Destination Server still needs, 0 for a new session
+    uint32_t data_points_num = 0;       // size of the dataset, the Aux sizes the transfer from it
+    uint32_t mode = 0;                  // session_mode_flags, the Aux only matches the slot packing
+    ullong params_hash = 0;             // ParamsHash of the Destination Server's encryption params
+    std::vector<block_range_s> blocks;  // blocks to transfer, in ascending order. Empty for all of them
+    std::string dataset;                // dataset to transfer, empty for the Aux's default dataset
+};
+
+// the Aux's reply to a hello
+struct session_accept_s
+{
+    uint32_t status = SESSION_ACCEPTED; // the fields below mode are only set when the session is accepted
+    uint32_t mode = 0;                  // session_mode_flags the dataset is served with, the Destination Server verifies with its MAC scheme
+    ullong session_id = 0;
+    uint32_t start_index = 0; // first ciphertext set the Aux sends, 0 when it doesn't know the session
+    uint32_t num_of_ct = 0;   // ciphertext sets of the whole transfer, one per selected block
+};
+
+// Transfer_Session - the resumable session of one transfer between the Aux and the Destination Server.
+// The Destination Server opens every connection with a hello carrying its session id, the dataset with its size, mode and
+// encryption params, and the first ciphertext set it still needs. The Aux checks the request against the dataset it serves
+// and replies with the set it starts from, or with the reason it rejects the request. While receiving, the Destination Server acknowledges
+// the number of ciphertext sets verified so far, counted from set 0, so after a dropped connection both sides agree on
+// where to resume. A transfer can select ciphertext blocks, its sets are then the selected blocks in ascending order.
+// All messages start with a magic and a version, and are sent in host byte order like the ciphertext size headers.
+class Transfer_Session
+{
+public:
+    // a random id whose high bits are the creation time, so older sessions have smaller ids
+    static ullong NewSessionId();
+
+    static bool SendHello(int the_socket, const session_hello_s& hello);
+    static bool ReceiveHello(int the_socket, session_hello_s& hello);
+    static bool SendAccept(int the_socket, const session_accept_s& accept);
+    static bool ReceiveAccept(int the_socket, session_accept_s& accept);
+
+    // number of ciphertext sets verified, counted from set 0
+    static bool SendAck(int the_socket, uint32_t verified);
+
+    // reads the acknowledgements that already arrived, or waits up to timeout_seconds for one when wait is set.
+    // Keeps the latest count in verified, returns false once the connection is closed or failed
+    static bool ReceiveAcks(int the_socket, uint32_t& verified, bool wait, int timeout_seconds);
+
+    // what a rejection status means, for the logs of both sides
+    static const char* StatusText(uint32_t status);
+
+    // a hash of the encryption params that change the encoded ciphertexts, both sides of a transfer must use the same
+    static ullong ParamsHash(const utility::enc_init_params_s& enc_init_params);
+
+    // parse a block list like 0-3,7,10-12 (inclusive), returns false if it is malformed
+    static bool ParseBlocks(const std::string& text, std::vector<block_range_s>& blocks);
+
+    // the selected block indices in ascending order, all of them for an empty selection.
+    // Returns false if a block is out of range or the ranges aren't ascending and disjoint
+    static bool SelectedBlocks(const std::vector<block_range_s>& blocks, uint32_t num_of_blocks, std::vector<int>& selected);
+
+    // send or receive exactly size bytes, returns false if the connection failed or was closed
+    static bool SendAll(int the_socket, const char* data, size_t size);
+    static bool ReceiveAll(int the_socket, char* data, size_t size);
+};
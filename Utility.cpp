@@ -1,16 +1,67 @@
 #include "Utility.h"
 #include <sstream>
+#include <cstring>
 #include <aws/s3/model/GetObjectRequest.h>
+#include <aws/s3/model/HeadObjectRequest.h>
 #include <aws/s3/model/PutObjectRequest.h>
 
 using namespace Aws;
 
-// Constructor for S3Utility. Initializes the S3 client with given AWS region.
+std::mutex Aws_API_Guard::_mutex;
+int Aws_API_Guard::_refcount = 0;
+Aws::SDKOptions Aws_API_Guard::_options;
+
+// the shared S3 clients, one per region, released before the AWS API is shut down
+static std::mutex s3_clients_mutex;
+static std::map<std::string, std::shared_ptr<Aws::S3::S3Client>> s3_clients;
+static unsigned s3_max_connections = 25;
+
+// objects read in chunks are consumed this many bytes at a time
+static const std::size_t LOAD_CHUNK_SIZE = 1 << 20;
+
+Aws_API_Guard::Aws_API_Guard() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_refcount++ == 0) {
+        Aws::InitAPI(_options);
+    }
+}
+
+Aws_API_Guard::~Aws_API_Guard() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (--_refcount == 0) {
+        {
+            std::lock_guard<std::mutex> clients_lock(s3_clients_mutex);
+            s3_clients.clear();
+        }
+        Aws::ShutdownAPI(_options);
+    }
+}
+
+void utility::SetS3MaxConnections(unsigned max_connections) {
+    std::lock_guard<std::mutex> lock(s3_clients_mutex);
+    s3_max_connections = max_connections;
+}
+
+std::shared_ptr<Aws::S3::S3Client> utility::GetS3Client(const Aws::String& region) {
+    std::lock_guard<std::mutex> lock(s3_clients_mutex);
+
+    std::shared_ptr<Aws::S3::S3Client>& client = s3_clients[std::string(region.c_str())];
+    if (!client) {
+        Aws::Client::ClientConfiguration config;
+        if (!region.empty()) {
+            config.region = region;
+        }
+        config.maxConnections = s3_max_connections;
+        config.enableTcpKeepAlive = true;
+        client = std::make_shared<Aws::S3::S3Client>(config);
+    }
+
+    return client;
+}
+
+// Constructor for S3Utility. Uses the shared S3 client of the given AWS region.
 S3Utility::S3Utility(const Aws::String& region) {
-    Aws::Client::ClientConfiguration config;
-    config.region = region;
-    Aws::S3::S3Client s3_client(config);
-    m_s3_client = s3_client;
+    m_s3_client = utility::GetS3Client(region);
 }
 
 // Loads an object from an S3 bucket into a buffer.
@@ -20,7 +71,7 @@ const bool S3Utility::load_from_bucket(const Aws::String& objectKey, const Aws::
     object_request.SetBucket(fromBucket);
     object_request.SetKey(objectKey);
 
-    Aws::S3::Model::GetObjectOutcome get_object_outcome = m_s3_client.GetObject(object_request);
+    Aws::S3::Model::GetObjectOutcome get_object_outcome = m_s3_client->GetObject(object_request);
 
     if (get_object_outcome.IsSuccess()) {
         Aws::IOStream& out = get_object_outcome.GetResultWithOwnership().GetBody();
@@ -43,7 +94,7 @@ const bool S3Utility::save_to_bucket(const Aws::String& object_key, const Aws::S
     std::shared_ptr<Aws::IOStream> input_data = Aws::MakeShared<Aws::StringStream>("SampleAllocationTag", buffer, std::ios_base::in | std::ios_base::binary);
     request.SetBody(input_data);
 
-    Aws::S3::Model::PutObjectOutcome outcome = m_s3_client.PutObject(request);
+    Aws::S3::Model::PutObjectOutcome outcome = m_s3_client->PutObject(request);
 
     if (outcome.IsSuccess()) {
         std::cout << "Added object '" << object_key << "' to bucket '" << to_bucket << "'." << std::endl;
@@ -55,20 +106,220 @@ const bool S3Utility::save_to_bucket(const Aws::String& object_key, const Aws::S
     return true;
 }
 
-// Loads encryption parameters from an S3 bucket.
-bool utility::GetEncryptionParamsFromBucket(const Aws::String& objectKey, const Aws::String& fromBucket, const Aws::String& region, EncryptionParameters& parms) {
+// Reads an object from an S3 bucket chunk by chunk, so the caller never needs a buffer of the whole object.
+const bool S3Utility::load_chunks_from_bucket(const Aws::String& objectKey, const Aws::String& fromBucket, std::size_t size, const std::function<void(const char*, std::size_t)>& consume) {
+
+    Aws::S3::Model::GetObjectRequest object_request;
+    object_request.SetBucket(fromBucket);
+    object_request.SetKey(objectKey);
+
+    Aws::S3::Model::GetObjectOutcome get_object_outcome = m_s3_client->GetObject(object_request);
+
+    if (!get_object_outcome.IsSuccess()) {
+        auto err = get_object_outcome.GetError();
+        std::cout << "Error: GetObject: " << err.GetExceptionName() << ": " << err.GetMessage() << std::endl;
+        return false;
+    }
+
+    Aws::IOStream& body = get_object_outcome.GetResultWithOwnership().GetBody();
+    std::vector<char> chunk(std::min(size, LOAD_CHUNK_SIZE));
+    std::size_t remaining = size;
+
+    while (remaining > 0) {
+        body.read(chunk.data(), std::min(chunk.size(), remaining));
+        std::streamsize read_size = body.gcount();
+        if (read_size <= 0) {
+            break;
+        }
+        consume(chunk.data(), read_size);
+        remaining -= read_size;
+    }
+
+    return true;
+}
+
+// Loads a byte range of an object from an S3 bucket into a buffer.
+const bool S3Utility::load_range_from_bucket(const Aws::String& objectKey, const Aws::String& fromBucket, std::size_t offset, std::size_t size, char* buffer) {
+
+    if (size == 0) {
+        return true;
+    }
+
+    Aws::S3::Model::GetObjectRequest object_request;
+    object_request.SetBucket(fromBucket);
+    object_request.SetKey(objectKey);
+
+    // HTTP ranges are inclusive
+    object_request.SetRange(("bytes=" + std::to_string(offset) + "-" + std::to_string(offset + size - 1)).c_str());
+
+    Aws::S3::Model::GetObjectOutcome get_object_outcome = m_s3_client->GetObject(object_request);
+
+    if (get_object_outcome.IsSuccess()) {
+        Aws::IOStream& out = get_object_outcome.GetResultWithOwnership().GetBody();
+        out.read(buffer, size);
+        if ((std::size_t)out.gcount() != size) {
+            std::cout << "Error: GetObject: " << objectKey << " holds " << out.gcount() << " of the " << size << " bytes at " << offset << std::endl;
+            return false;
+        }
+        return true;
+    } else {
+        auto err = get_object_outcome.GetError();
+        std::cout << "Error: GetObject: " << err.GetExceptionName() << ": " << err.GetMessage() << std::endl;
+        return false;
+    }
+}
+
+// Reads the size of an object in an S3 bucket from its metadata.
+const bool S3Utility::object_size(const Aws::String& objectKey, const Aws::String& fromBucket, std::size_t& size) {
+
+    Aws::S3::Model::HeadObjectRequest object_request;
+    object_request.SetBucket(fromBucket);
+    object_request.SetKey(objectKey);
+
+    Aws::S3::Model::HeadObjectOutcome head_object_outcome = m_s3_client->HeadObject(object_request);
+
+    if (head_object_outcome.IsSuccess()) {
+        size = head_object_outcome.GetResult().GetContentLength();
+        return true;
+    } else {
+        auto err = head_object_outcome.GetError();
+        std::cout << "Error: HeadObject: " << err.GetExceptionName() << ": " << err.GetMessage() << std::endl;
+        return false;
+    }
+}
+
+// Loads an object saved to the local storage into a buffer.
+const bool Local_Storage::load_from_bucket(const Aws::String& objectKey, const Aws::String& fromBucket, int size, char* buffer) {
 
-    Aws::Client::ClientConfiguration config;
-    if (!region.empty()) {
-        config.region = region;
+    std::string object_name = std::string(fromBucket.c_str()) + "/" + objectKey.c_str();
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    auto it = m_objects.find(object_name);
+    if (it == m_objects.end()) {
+        std::cout << "Error: Local storage has no object '" << object_name << "'" << std::endl;
+        return false;
+    }
+
+    std::memcpy(buffer, it->second.data(), std::min((std::size_t)size, it->second.size()));
+    return true;
+}
+
+// Saves a buffer as an object in the local storage.
+const bool Local_Storage::save_to_bucket(const Aws::String& object_key, const Aws::String& to_bucket, std::string buffer) {
+
+    std::string object_name = std::string(to_bucket.c_str()) + "/" + object_key.c_str();
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    m_objects[object_name] = std::move(buffer);
+    return true;
+}
+
+// Passes an object saved to the local storage to consume, at most size bytes.
+const bool Local_Storage::load_chunks_from_bucket(const Aws::String& objectKey, const Aws::String& fromBucket, std::size_t size, const std::function<void(const char*, std::size_t)>& consume) {
+
+    std::string object_name = std::string(fromBucket.c_str()) + "/" + objectKey.c_str();
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    auto it = m_objects.find(object_name);
+    if (it == m_objects.end()) {
+        std::cout << "Error: Local storage has no object '" << object_name << "'" << std::endl;
+        return false;
+    }
+
+    consume(it->second.data(), std::min(size, it->second.size()));
+    return true;
+}
+
+// Copies size bytes of an object saved to the local storage, starting at offset, into a buffer.
+const bool Local_Storage::load_range_from_bucket(const Aws::String& objectKey, const Aws::String& fromBucket, std::size_t offset, std::size_t size, char* buffer) {
+
+    std::string object_name = std::string(fromBucket.c_str()) + "/" + objectKey.c_str();
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    auto it = m_objects.find(object_name);
+    if (it == m_objects.end()) {
+        std::cout << "Error: Local storage has no object '" << object_name << "'" << std::endl;
+        return false;
+    }
+
+    if ((offset > it->second.size()) || (size > it->second.size() - offset)) {
+        std::cout << "Error: Local storage object '" << object_name << "' holds " << it->second.size() << " bytes, not " << size << " at " << offset << std::endl;
+        return false;
+    }
+
+    std::memcpy(buffer, it->second.data() + offset, size);
+    return true;
+}
+
+// The size of an object saved to the local storage.
+const bool Local_Storage::object_size(const Aws::String& objectKey, const Aws::String& fromBucket, std::size_t& size) {
+
+    std::string object_name = std::string(fromBucket.c_str()) + "/" + objectKey.c_str();
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    auto it = m_objects.find(object_name);
+    if (it == m_objects.end()) {
+        std::cout << "Error: Local storage has no object '" << object_name << "'" << std::endl;
+        return false;
     }
 
-    Aws::S3::S3Client s3_client(config);
+    size = it->second.size();
+    return true;
+}
+
+void Fixed_Width_Reader::Consume(const char* data, std::size_t size) {
+
+    // complete the field the previous chunk ended in
+    if (!_partial_field.empty()) {
+        std::size_t missing = std::min(_width - _partial_field.size(), size);
+        _partial_field.append(data, missing);
+        data += missing;
+        size -= missing;
+
+        if (_partial_field.size() < (std::size_t)_width) {
+            return;
+        }
+        if (_count < _values.size()) {
+            _values[_count++] = ParseField(_partial_field.data(), _width);
+        }
+        _partial_field.clear();
+    }
+
+    while ((size >= (std::size_t)_width) && (_count < _values.size())) {
+        _values[_count++] = ParseField(data, _width);
+        data += _width;
+        size -= _width;
+    }
+
+    if (size < (std::size_t)_width) {
+        _partial_field.assign(data, size);
+    }
+}
+
+ullong Fixed_Width_Reader::ParseField(const char* field, int width) {
+    ullong value = 0;
+
+    for (int i = 0; i < width; i++) {
+        unsigned digit = (unsigned char)field[i] - '0';
+        if (digit > 9) {
+            break;
+        }
+        value = value * 10 + digit;
+    }
+
+    return value;
+}
+
+// Loads encryption parameters from an S3 bucket.
+bool utility::GetEncryptionParamsFromBucket(const Aws::String& objectKey, const Aws::String& fromBucket, const Aws::String& region, EncryptionParameters& parms) {
+
+    Aws_API_Guard aws_api;
+    std::shared_ptr<Aws::S3::S3Client> s3_client = utility::GetS3Client(region);
     Aws::S3::Model::GetObjectRequest object_request;
     object_request.SetBucket(fromBucket);
     object_request.SetKey(objectKey);
 
-    Aws::S3::Model::GetObjectOutcome get_object_outcome = s3_client.GetObject(object_request);
+    Aws::S3::Model::GetObjectOutcome get_object_outcome = s3_client->GetObject(object_request);
 
     if (get_object_outcome.IsSuccess()) {
         Aws::IOStream& out = get_object_outcome.GetResultWithOwnership().GetBody();
@@ -86,17 +337,13 @@ bool utility::GetEncryptionParamsFromBucket(const Aws::String& objectKey, const
 // Loads public key from an S3 bucket into SEAL PublicKey object.
 bool utility::GetPublicKeyFromBucket(const Aws::String& objectKey, const Aws::String& fromBucket, const Aws::String& region, SEALContext context_ptr, seal::PublicKey& pk_fhe) {
 
-    Aws::Client::ClientConfiguration config;
-    if (!region.empty()) {
-        config.region = region;
-    }
-
-    Aws::S3::S3Client s3_client(config);
+    Aws_API_Guard aws_api;
+    std::shared_ptr<Aws::S3::S3Client> s3_client = utility::GetS3Client(region);
     Aws::S3::Model::GetObjectRequest object_request;
     object_request.SetBucket(fromBucket);
     object_request.SetKey(objectKey);
 
-    Aws::S3::Model::GetObjectOutcome get_object_outcome = s3_client.GetObject(object_request);
+    Aws::S3::Model::GetObjectOutcome get_object_outcome = s3_client->GetObject(object_request);
 
     if (get_object_outcome.IsSuccess()) {
         Aws::IOStream& out = get_object_outcome.GetResultWithOwnership().GetBody();
@@ -114,17 +361,13 @@ bool utility::GetPublicKeyFromBucket(const Aws::String& objectKey, const Aws::St
 // Loads secret key from an S3 bucket into SEAL SecretKey object.
 bool utility::GetSecretKeyFromBucket(const Aws::String& objectKey, const Aws::String& fromBucket, const Aws::String& region, SEALContext context_ptr, SecretKey& sk_fhe) {
 
-    Aws::Client::ClientConfiguration config;
-    if (!region.empty()) {
-        config.region = region;
-    }
-
-    Aws::S3::S3Client s3_client(config);
+    Aws_API_Guard aws_api;
+    std::shared_ptr<Aws::S3::S3Client> s3_client = utility::GetS3Client(region);
     Aws::S3::Model::GetObjectRequest object_request;
     object_request.SetBucket(fromBucket);
     object_request.SetKey(objectKey);
 
-    Aws::S3::Model::GetObjectOutcome get_object_outcome = s3_client.GetObject(object_request);
+    Aws::S3::Model::GetObjectOutcome get_object_outcome = s3_client->GetObject(object_request);
 
     if (get_object_outcome.IsSuccess()) {
         Aws::IOStream& out = get_object_outcome.GetResultWithOwnership().GetBody();
@@ -140,16 +383,15 @@ bool utility::GetSecretKeyFromBucket(const Aws::String& objectKey, const Aws::St
 }
 
 // Serializes SEAL Ciphertext into string.
-std::string utility::serialize_fhe(Ciphertext ct_input) {
+std::string utility::serialize_fhe(const Ciphertext& ct_input) {
     std::ostringstream os(std::ios::binary);
     ct_input.save(os);
     return os.str();
 }
 
 // Deserializes SEAL Ciphertext from string.
-void utility::deserialize_fhe(std::string str, Ciphertext& ct_output, SEALContext& context) {
-    std::istringstream is(str, std::ios::in | std::ios::binary);
-    std::streamoff loaded = ct_output.load(context, is);
+void utility::deserialize_fhe(const std::string& str, Ciphertext& ct_output, SEALContext& context) {
+    std::streamoff loaded = ct_output.load(context, (const seal_byte*)str.data(), str.size());
 }
 
 // Deserializes SEAL Ciphertext from char array.
@@ -289,3 +531,26 @@ void utility::InitEncParams(enc_init_params_s* enc_init_params, string fileName)
         std::cout << std::endl;
     }
 }
+
+// Runs func on the given storage. Without one, on the shared S3 client of the region.
+void utility::WithStorage(const std::shared_ptr<Data_Storage>& storage, const Aws::String& region, const std::function<void(Data_Storage&)>& func) {
+
+    if (storage) {
+        func(*storage);
+        return;
+    }
+
+    Aws_API_Guard aws_api;
+    S3Utility s3Utility(region);
+    func(s3Utility);
+}
+
+// Prefixes the object name with the dataset, the objects of the default dataset keep their names.
+std::string utility::DatasetObjectName(const std::string& dataset, const std::string& object_name) {
+
+    if (dataset.empty()) {
+        return object_name;
+    }
+
+    return dataset + "/" + object_name;
+}
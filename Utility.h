@@ -4,10 +4,14 @@
 #include <fstream>
 #include <sys/stat.h>
 #include <cmath>
+#include <map>
+#include <mutex>
+#include <functional>
 #include "seal/seal.h"
 #include <aws/core/Aws.h>
 #include <aws/s3/S3Client.h>
 #include "Constants.h"
+#include "Tracer.h"
 
 // CryptoPP includes
 #include "cryptopp/cryptlib.h"
@@ -27,24 +31,122 @@ using std::vector;
 using std::string;
 using std::tuple;
 
+// Aws_API_Guard - keeps the AWS API initialized while any guard exists. The first guard initializes it and the
+// last one shuts it down, after releasing the shared S3 clients, so nested and concurrent users don't shut it down
+// under each other. A process holding a guard for its lifetime keeps its S3 connections open between transfers.
+class Aws_API_Guard
+{
+private:
+    static std::mutex _mutex;
+    static int _refcount;
+    static Aws::SDKOptions _options;
+
+public:
+    Aws_API_Guard();
+    ~Aws_API_Guard();
+
+    Aws_API_Guard(const Aws_API_Guard&) = delete;
+    Aws_API_Guard& operator=(const Aws_API_Guard&) = delete;
+};
+
+// Data_Storage - the object store the Data Owner writes to and the servers read from
+class Data_Storage
+{
+public:
+    virtual ~Data_Storage() {};
+
+    // Load object into buffer
+    virtual const bool load_from_bucket(const Aws::String& objectKey, const Aws::String& fromBucket, int size, char* buffer) = 0;
+
+    // Save buffer content as an object
+    virtual const bool save_to_bucket(const Aws::String& object_key, const Aws::String& to_bucket, std::string buffer) = 0;
+
+    // Load at most size bytes of an object in chunks, without buffering all of it. consume gets the chunks in order
+    virtual const bool load_chunks_from_bucket(const Aws::String& objectKey, const Aws::String& fromBucket, std::size_t size, const std::function<void(const char*, std::size_t)>& consume) = 0;
+
+    // Load size bytes of an object starting at offset into buffer, fails when the object ends before them
+    virtual const bool load_range_from_bucket(const Aws::String& objectKey, const Aws::String& fromBucket, std::size_t offset, std::size_t size, char* buffer) = 0;
+
+    // The size of an object in bytes, without loading it
+    virtual const bool object_size(const Aws::String& objectKey, const Aws::String& fromBucket, std::size_t& size) = 0;
+};
+
 // S3Utility class for AWS S3 bucket interactions
-class S3Utility
+class S3Utility : public Data_Storage
 {
 private:
-    Aws::S3::S3Client m_s3_client;
+    std::shared_ptr<Aws::S3::S3Client> m_s3_client;
 
 public:
-    // Constructor: initialize S3 client with given region
+    // Constructor: use the shared S3 client of the given region
     S3Utility(const Aws::String& region);
 
     // Destructor
     ~S3Utility() {};
 
     // Load object from S3 bucket into buffer
-    const bool load_from_bucket(const Aws::String& objectKey, const Aws::String& fromBucket, int size, char* buffer);
+    const bool load_from_bucket(const Aws::String& objectKey, const Aws::String& fromBucket, int size, char* buffer) override;
 
     // Save buffer content to S3 bucket
-    const bool save_to_bucket(const Aws::String& object_key, const Aws::String& to_bucket, std::string buffer);
+    const bool save_to_bucket(const Aws::String& object_key, const Aws::String& to_bucket, std::string buffer) override;
+
+    // Read the object body from the S3 response stream in chunks
+    const bool load_chunks_from_bucket(const Aws::String& objectKey, const Aws::String& fromBucket, std::size_t size, const std::function<void(const char*, std::size_t)>& consume) override;
+
+    // Ranged GetObject, only the requested bytes leave the bucket
+    const bool load_range_from_bucket(const Aws::String& objectKey, const Aws::String& fromBucket, std::size_t offset, std::size_t size, char* buffer) override;
+
+    // HeadObject, the Content-Length of the object
+    const bool object_size(const Aws::String& objectKey, const Aws::String& fromBucket, std::size_t& size) override;
+};
+
+// Local_Storage - in memory stand-in for the S3 bucket, so all parties can run in one process
+class Local_Storage : public Data_Storage
+{
+private:
+    std::map<std::string, std::string> m_objects;
+    std::mutex m_mutex;
+
+public:
+    ~Local_Storage() {};
+
+    // Load object into buffer, at most size bytes
+    const bool load_from_bucket(const Aws::String& objectKey, const Aws::String& fromBucket, int size, char* buffer) override;
+
+    // Save buffer content as an object
+    const bool save_to_bucket(const Aws::String& object_key, const Aws::String& to_bucket, std::string buffer) override;
+
+    // The object is already in memory, consume gets it as one chunk
+    const bool load_chunks_from_bucket(const Aws::String& objectKey, const Aws::String& fromBucket, std::size_t size, const std::function<void(const char*, std::size_t)>& consume) override;
+
+    // Copy a slice of the object into buffer
+    const bool load_range_from_bucket(const Aws::String& objectKey, const Aws::String& fromBucket, std::size_t offset, std::size_t size, char* buffer) override;
+
+    // The size of the object in memory
+    const bool object_size(const Aws::String& objectKey, const Aws::String& fromBucket, std::size_t& size) override;
+};
+
+// Fixed_Width_Reader - parses zero padded decimal fields of a fixed width, as the Data Owner saves the secret inputs,
+// from chunks of any size. A field split between two chunks is completed with the next chunk.
+class Fixed_Width_Reader
+{
+private:
+    int _width;
+    vector<double>& _values;
+    std::size_t _count = 0;
+    std::string _partial_field;
+
+public:
+    // values must be sized to the expected number of fields, extra fields are ignored
+    Fixed_Width_Reader(int width, vector<double>& values) : _width(width), _values(values) {}
+
+    void Consume(const char* data, std::size_t size);
+
+    // number of complete fields parsed so far
+    std::size_t Count() const { return _count; }
+
+    // value of the leading decimal digits of a field, as atof would read it
+    static ullong ParseField(const char* field, int width);
 };
 
 namespace utility
@@ -79,6 +181,13 @@ namespace utility
         }
     };
 
+    // Maximum number of pooled connections of each S3 client, only affects clients created afterwards
+    void SetS3MaxConnections(unsigned max_connections);
+
+    // The shared, thread safe S3 client of the region (the SDK default region if empty), created on first use.
+    // Requests on it reuse its keep-alive connections. Only valid while an Aws_API_Guard exists
+    std::shared_ptr<Aws::S3::S3Client> GetS3Client(const Aws::String& region);
+
     // Retrieve encryption parameters from S3 bucket
     bool GetEncryptionParamsFromBucket(
         const Aws::String& objectKey,
@@ -120,14 +229,20 @@ namespace utility
     nanoseconds timer_end(high_resolution_clock::time_point start);
 
     // Serialize a SEAL ciphertext to string
-    std::string serialize_fhe(Ciphertext ct_input);
+    std::string serialize_fhe(const Ciphertext& ct_input);
 
     // Deserialize a SEAL ciphertext from string
-    void deserialize_fhe(std::string str, Ciphertext& ct_output, SEALContext& context);
+    void deserialize_fhe(const std::string& str, Ciphertext& ct_output, SEALContext& context);
 
     // Deserialize a SEAL ciphertext from raw char buffer
     void deserialize_fhe(const char* str, std::size_t size, Ciphertext& ct_output, SEALContext& context);
 
     // Initialize encryption parameters from a file
     void InitEncParams(enc_init_params_s* enc_init_params, string fileName);
+
+    // Run func on the given storage, or on an S3 client for the region if no storage is given
+    void WithStorage(const std::shared_ptr<Data_Storage>& storage, const Aws::String& region, const std::function<void(Data_Storage&)>& func);
+
+    // The bucket object name of a dataset: <dataset>/<object name>, or the object name itself for the default dataset
+    std::string DatasetObjectName(const std::string& dataset, const std::string& object_name);
 }